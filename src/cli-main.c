@@ -1,5 +1,8 @@
 #include "interpreter.h"
+#include "server.h"
+#include "statement.h"
 #include "storage.h"
+#include "util/parallel.h"
 #include "util/str.h"
 
 #include <fcntl.h>
@@ -8,6 +11,47 @@
 
 #include <string.h>
 
+#define CSV_BATCH_LINES 65536
+#define CSV_MORSEL_LINES 4096
+
+typedef struct CsvBatch {
+    const char *delim;
+    size_t count;
+    char *lines[CSV_BATCH_LINES];
+    StrList *values[CSV_BATCH_LINES];
+} CsvBatch;
+
+// read up to CSV_BATCH_LINES lines into [lines], returning how many were read
+static size_t csv_batch_read(FILE *file, char **lines)
+{
+    size_t count = 0;
+
+    while (count < CSV_BATCH_LINES) {
+        char *line = NULL;
+        size_t len = 0;
+        ssize_t nread = getline(&line, &len, file);
+        if (nread == -1) {
+            free(line);
+            break;
+        }
+
+        if (nread > 0)
+            line[nread-1] = 0;
+        lines[count++] = line;
+    }
+
+    return count;
+}
+
+static void csv_split_morsel(void *arg, size_t morsel)
+{
+    CsvBatch *batch = arg;
+    size_t end = (morsel + 1) * CSV_MORSEL_LINES < batch->count ? (morsel + 1) * CSV_MORSEL_LINES : batch->count;
+
+    for (size_t i = morsel * CSV_MORSEL_LINES; i < end; i++)
+        batch->values[i] = strlist_from_split_quoted(batch->lines[i], batch->delim);
+}
+
 // read in a csv file containing a table into the db.
 // the file has to be in a pretty specific format; the first line
 // must contain the column names and the second line must specify their types
@@ -18,6 +62,7 @@ BazaResult csv_read(const char *table_name, const char *path, const char *csv_de
         return RESULT_FILE_NOT_FOUND;
 
     BazaResult result = RESULT_OK;
+    CsvBatch *batch = NULL;
 
     char *line = NULL; 
     size_t len = 0;
@@ -49,36 +94,51 @@ BazaResult csv_read(const char *table_name, const char *path, const char *csv_de
         .create_types = types,
     };
 
-    QueryResponse resp = interpret_query(&query);
+    QueryResponse resp = interpret_query(&query, stdout);
     if (resp.result != RESULT_OK) {
         result = resp.result;
         goto bail;
     }
 
-    // iterate over the remaining lines issuing an insert query for each one
-    while ((nread = getline(&line, &len, file)) != -1) {
-        if (nread > 0)
-            line[nread-1] = 0;
+    // the remaining lines are split into values by the thread pool a batch at a time,
+    // then an insert query is issued for each one, in order
+    batch = malloc(sizeof(CsvBatch));
+    if (!batch) {
+        result = RESULT_ALLOC;
+        goto bail;
+    }
+    batch->delim = csv_delim;
 
-        StrList *values = strlist_from_split_quoted(line, csv_delim);
+    while ((batch->count = csv_batch_read(file, batch->lines))) {
+        parallel_for((batch->count + CSV_MORSEL_LINES - 1) / CSV_MORSEL_LINES, csv_split_morsel, batch);
 
-        query = (Query) {
-            .type = QUERY_INSERT,
-            .table_name = tn_copy,
-            .insert_values = values,
-        };
+        for (size_t i = 0; i < batch->count; i++) {
+            query = (Query) {
+                .type = QUERY_INSERT,
+                .table_name = tn_copy,
+                .insert_values = batch->values[i],
+            };
 
-        QueryResponse resp = interpret_query(&query);
+            // after a failure the rest of the batch is only freed
+            if (result == RESULT_OK)
+                result = interpret_query(&query, stdout).result;
 
-        strlist_free(values);
+            strlist_free(batch->values[i]);
+            free(batch->lines[i]);
+        }
 
-        if (resp.result != RESULT_OK) {
-            result = resp.result;
+        if (result != RESULT_OK)
             goto bail;
-        }
     }
 
+    // low cardinality string columns are cheaper to store and filter as dictionaries
+    TableResult tabres = db_table_get(tn_copy);
+    result = tabres.result;
+    if (result == RESULT_OK)
+        result = table_dict_encode_auto(tabres.meta.id);
+
 bail:
+    free(batch);
     free(line);
     free(tn_copy);
     strlist_free(columns); 
@@ -125,16 +185,18 @@ StrList *fs_read_queries(const char *path)
 
 void do_query(const char *q)
 {
-    QueryParseResult res = query_parse(q);
+    StatementResult res = statement_parse(q);
     printf("SQL INPUT: '%s'\n", q);
 
     if (res.result != RESULT_OK) {
-        printf("%s: %s", result_str(res.result), res.error_msg);
-    } else {
-        query_print(res.query);
+        printf("%s: %s\n\n\n", result_str(res.result),
+               res.result == RESULT_ERR_SQL_PARSE ? res.error_msg : "");
+        return;
     }
 
-    QueryResponse resp = interpret_query(res.query);
+    query_print(statement_query(res.statement));
+
+    QueryResponse resp = statement_execute(res.statement, NULL, 0, stdout);
     if (resp.result != RESULT_OK) {
         printf("INTERP ERR: %s\n", result_str(resp.result));
     } else {
@@ -143,15 +205,58 @@ void do_query(const char *q)
 
     fputs("\n\n", stdout);
 
-    query_free(res.query);
+    statement_release(res.statement);
 }
 
-int main()
+static int usage(const char *argv0)
 {
+    fprintf(stderr,
+            "usage: %s                 run the statements of ./queries.sql\n"
+            "       %s --serve [--host HOST] [--port PORT] [--socket PATH]\n"
+            "                          serve clients over TCP (on "SERVER_DEFAULT_HOST":"SERVER_DEFAULT_PORT
+            " unless only a socket is given) and/or a Unix socket\n",
+            argv0, argv0);
+    return 2;
+}
+
+int main(int argc, char **argv)
+{
+    bool serve = false;
+    ServerConfig config = { 0 };
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--serve"))
+            serve = true;
+        else if (!strcmp(argv[i], "--host") && i + 1 < argc)
+            config.host = argv[++i];
+        else if (!strcmp(argv[i], "--port") && i + 1 < argc)
+            config.port = argv[++i];
+        else if (!strcmp(argv[i], "--socket") && i + 1 < argc)
+            config.socket_path = argv[++i];
+        else
+            return usage(argv[0]);
+    }
+
+    if (!serve && (config.host || config.port || config.socket_path))
+        return usage(argv[0]);
+    if (serve && !config.port && !config.socket_path)
+        config.port = SERVER_DEFAULT_PORT;
+
+    // before storage_init starts any threads
+    if (serve)
+        server_signals_block();
+
     storage_init();
 
+    // tables saved with SAVE or CHECKPOINT were already loaded by storage_init
     #define READ_CSV_FILE(name) do { \
+        if (db_table_get(name).result == RESULT_OK) { \
+            puts("LOAD CSV "name": skipped, already in the database"); \
+            break; \
+        } \
         BazaResult tres = csv_read(name, "./tables/"name".baza.csv", ","); \
+        if (tres == RESULT_OK) \
+            tres = db_commit(); \
         printf("LOAD CSV "name": %s\n", result_str(tres)); \
         if (tres != RESULT_OK) \
             return 1; } while (0) \
@@ -159,6 +264,15 @@ int main()
     READ_CSV_FILE("Studenci");
     READ_CSV_FILE("PodstawyProgramowania");
 
+    if (serve) {
+        BazaResult sres = server_run(&config);
+        if (sres != RESULT_OK)
+            printf("SERVE: %s\n", result_str(sres));
+
+        storage_deinit();
+        return sres == RESULT_OK ? 0 : 1;
+    }
+
     StrList *queries = fs_read_queries("./queries.sql");
 
     StrList *q = queries;
@@ -1,8 +1,12 @@
 #include "interpreter.h"
+#include "statement.h"
 #include "storage.h"
 #include "parser.h"
+#include "planner.h"
 
 #include "util/intlist.h"
+#include "util/parallel.h"
+#include "util/selection.h"
 #include "util/result.h"
 #include "util/str.h"
 
@@ -12,231 +16,196 @@
 
 #include <fcntl.h>
 
-bool filter_func_equals(BaseType type, const void *left, const void *right)
-{
-    switch (type) {
-        case BTYPE_INT32: {
-            return (*(const int32_t*)left) == (*(const int32_t*)right);
-        } break;
-        case BTYPE_INT64: {
-            return (*(const int64_t*)left) == (*(const int64_t*)right);
-        } break;
-        case BTYPE_STRING: {
-            return !strcmp(*(char**)left, right);
-        } break;
-        case BTYPE_INVALID:
-            return false;
-    }
-    return false;
+/// Narrow the rows found through an index down to [within] (all rows if NULL)
+static TableFindResult plan_within(TableFindResult tfres, const Selection *within)
+{
+    if (tfres.res != RESULT_OK || !within)
+        return tfres;
+
+    Selection *rows = selection_and(tfres.matches, within);
+    selection_free(tfres.matches);
+    if (!rows)
+        return (TableFindResult){ .res = RESULT_ALLOC };
+
+    return (TableFindResult){ .res = RESULT_OK, .matches = rows };
 }
 
-bool filter_func_greater(BaseType type, const void *left, const void *right)
+typedef struct FilterInterpResult {
+    BazaResult res;
+    Selection *rows;
+} FilterInterpResult;
+
+static FilterInterpResult plan_eval(TableMeta table, const PlanNode *node, const Selection *within);
+
+// find the rows of [within] (all rows if NULL) passing the predicate [node], through
+// an index or by scanning as planned
+static FilterInterpResult plan_eval_predicate(TableMeta table, const PlanNode *node,
+                                              const Selection *within)
 {
-    switch (type) {
-        case BTYPE_INT32: {
-            return (*(const int32_t*)left) > (*(const int32_t*)right);
-        } break;
-        case BTYPE_INT64: {
-            return (*(const int64_t*)left) > (*(const int64_t*)right);
-        } break;
-        case BTYPE_STRING: {
-            return strcmp(*(char**)left, right) > 0;
-        } break;
-        case BTYPE_INVALID:
-            return false;
+    TableFindResult tfres = { .res = RESULT_INDEX_NOT_FOUND };
+
+    if (node->access == PLAN_HASH_INDEX || node->access == PLAN_BTREE_INDEX) {
+        tfres = node->op == FILTER_EQUAL
+            ? table_lookup_equal(table.id, node->column.id, node->value)
+            : table_lookup_range(table.id, node->column.id, node->range);
+        tfres = plan_within(tfres, within);
     }
-    return false;
-}
 
-bool filter_func_greater_equal(BaseType type, const void *left, const void *right)
-{
-    return filter_func_equals(type, left, right) || filter_func_greater(type, left, right);
+    // the index is gone if the table was modified since the snapshot was taken
+    if (tfres.res == RESULT_INDEX_NOT_FOUND) {
+        tfres = node->op == FILTER_NONE
+            ? table_find_range(table.id, node->column.id, node->range, within)
+            : table_find(table.id, node->column.id, node->op, node->value, within);
+    }
+
+    if (tfres.res != RESULT_OK)
+        return (FilterInterpResult){ .res = tfres.res };
+
+    return (FilterInterpResult){ .res = RESULT_OK, .rows = tfres.matches };
 }
 
-bool filter_func_lesser(BaseType type, const void *left, const void *right)
+// every child of an AND only looks at the rows the ones before it let through, and
+// once no rows are left the rest are not evaluated at all
+static FilterInterpResult plan_eval_and(TableMeta table, const PlanNode *node,
+                                        const Selection *within)
 {
-    switch (type) {
-        case BTYPE_INT32: {
-            return (*(const int32_t*)left) < (*(const int32_t*)right);
-        } break;
-        case BTYPE_INT64: {
-            return (*(const int64_t*)left) < (*(const int64_t*)right);
-        } break;
-        case BTYPE_STRING: {
-            return strcmp(*(char**)left, right) < 0;
-        } break;
-        case BTYPE_INVALID:
-            return false;
+    Selection *rows = NULL;
+    for (const PlanNode *child = node->children; child; child = child->next) {
+        FilterInterpResult part = plan_eval(table, child, rows ? rows : within);
+
+        selection_free(rows);
+        if (part.res != RESULT_OK)
+            return part;
+
+        rows = part.rows;
+        if (selection_count(rows) == 0)
+            break;
     }
-    return false;
-}
 
-bool filter_func_lesser_equal(BaseType type, const void *left, const void *right)
-{
-    return filter_func_equals(type, left, right) || filter_func_lesser(type, left, right);
+    return (FilterInterpResult){ .res = RESULT_OK, .rows = rows };
 }
 
-bool filter_func_like(BaseType type, const void *left, const void *right)
+// every child of an OR only looks at the rows none of the ones before it matched,
+// and once no rows are left the rest are not evaluated at all
+static FilterInterpResult plan_eval_or(TableMeta table, const PlanNode *node,
+                                       const Selection *within)
 {
-    switch (type) {
-        case BTYPE_INT32: {
-            return (*(const int32_t*)left) == (*(const int32_t*)right);
-        } break;
-        case BTYPE_INT64: {
-            return (*(const int64_t*)left) == (*(const int64_t*)right);
-        } break;
-        case BTYPE_STRING: {
-            const char *str = *(const char**)left;
-            const char *pattern = right;
-
+    Selection *rows = NULL;
+    Selection *rest = NULL; // the rows left to match, unless that is still [within]
+    BazaResult res = RESULT_OK;
 
-            while (*str && *pattern) {
-                // %: zero or more characters
-                if (*pattern == '%') {
-                    pattern++;
-                    
-                    // pattern ending with a %, since we are already here
-                    // this must match
-                    if (!*pattern)
-                        return true;
+    for (const PlanNode *child = node->children; child; child = child->next) {
+        const Selection *candidates = rest ? rest : within;
 
-                    while (*str && *str != *pattern)
-                        str++;
-
-                    // no match
-                    if (!*str)
-                        return false;
-                }
+        FilterInterpResult part = plan_eval(table, child, candidates);
+        if (part.res != RESULT_OK) {
+            res = part.res;
+            break;
+        }
 
-                // _: exactly one character
-                if (*pattern == '_') {
-                    pattern++;
-                    if (!pattern)
-                        return true;
-                    str++;
-                    continue;
+        if (child->next) {
+            Selection *live = NULL;
+            if (!candidates) {
+                TableFindResult tfres = table_rows_live(table.id);
+                if (tfres.res != RESULT_OK) {
+                    selection_free(part.rows);
+                    res = tfres.res;
+                    break;
                 }
+                candidates = live = tfres.matches;
+            }
 
-                if (*str != *pattern)
-                    return false;
-            
-                str++;
-                pattern++;
+            Selection *left = selection_andnot(candidates, part.rows);
+            selection_free(live);
+            selection_free(rest);
+            rest = left;
+            if (!rest) {
+                selection_free(part.rows);
+                res = RESULT_ALLOC;
+                break;
             }
+        }
 
-            // one of the strings ends prematurely
-            if (*str + *pattern > 0 && *pattern != '%')
-                return false;
+        if (rows) {
+            Selection *merged = selection_or(rows, part.rows);
+            selection_free(rows);
+            selection_free(part.rows);
+            rows = merged;
+            if (!rows) {
+                res = RESULT_ALLOC;
+                break;
+            }
+        } else {
+            rows = part.rows;
+        }
 
-            return true;
-        } break;
-        case BTYPE_INVALID:
-            return false;
+        if (rest && selection_count(rest) == 0)
+            break;
     }
-    return false;
-}
-
-findfunc_t *filter_func_table[] = {
-    [FILTER_EQUAL] = filter_func_equals,
-    [FILTER_GREATER] = filter_func_greater,
-    [FILTER_GREATER_EQUAL] = filter_func_greater_equal,
-    [FILTER_LESSER] = filter_func_lesser,
-    [FILTER_LESSER_EQUAL] = filter_func_lesser_equal,
-    [FILTER_LIKE] = filter_func_like,
-};
 
+    selection_free(rest);
+    if (res != RESULT_OK) {
+        selection_free(rows);
+        return (FilterInterpResult){ .res = res };
+    }
 
-typedef struct FilterInterpResult {
-    BazaResult res;
-    IntList *rows;
-} FilterInterpResult;
+    return (FilterInterpResult){ .res = RESULT_OK, .rows = rows };
+}
 
-// interpret a list of filters performing the appropriate set operations and return
-// the final list of rows which passed the filters
-FilterInterpResult filter_interpret(TableMeta table, Filter *filter_list)
+static FilterInterpResult plan_eval_not(TableMeta table, const PlanNode *node,
+                                        const Selection *within)
 {
-    Filter *filter = filter_list;
-
-    IntList *rowset = NULL;
-    FilterRelation rel = FILTER_REL_NONE;
-    
-    while (filter) {
-        ColumnResult colres = table_column_get(table.id, filter->column);
-        if (colres.result != RESULT_OK) {
-            return (FilterInterpResult) {
-                .res = RESULT_COLUMN_NOT_FOUND,
-            };
-        }
-        ColumnMeta column = colres.meta;
+    Selection *live = NULL;
+    if (!within) {
+        TableFindResult tfres = table_rows_live(table.id);
+        if (tfres.res != RESULT_OK)
+            return (FilterInterpResult){ .res = tfres.res };
+        within = live = tfres.matches;
+    }
 
-        // Convert to appropriate type and get the matching columns
-        TableFindResult tfres;
-        switch (column.type) {
-            case BTYPE_INT32:
-            case BTYPE_INT64: {
-                IntConvResult icres = str_to_int(filter->value);
-                if (icres.result != RESULT_OK) {
-                    intlist_free(rowset);
+    FilterInterpResult part = plan_eval(table, node->children, within);
+    if (part.res == RESULT_OK) {
+        Selection *rows = selection_andnot(within, part.rows);
+        selection_free(part.rows);
+        part = rows ? (FilterInterpResult){ .res = RESULT_OK, .rows = rows }
+                    : (FilterInterpResult){ .res = RESULT_ALLOC };
+    }
 
-                    return (FilterInterpResult) {
-                        .res = RESULT_FILTER_VALUE_TYPE,
-                    };
-                }
+    selection_free(live);
 
-                tfres = table_find(table.id, column.id, filter_func_table[filter->op], &icres.value);
-            } break;
-            case BTYPE_STRING:
-                tfres = table_find(table.id, column.id, filter_func_table[filter->op], filter->value);
-                break;
-            case BTYPE_INVALID:
-                return (FilterInterpResult) {
-                    .res = RESULT_SERVER_ERROR,
-                };
-        }
+    return part;
+}
 
-        if (tfres.res != RESULT_OK) {
-            intlist_free(rowset);
+// evaluate [node] over the rows of [within] (all live rows if NULL), returning the
+// ones which pass it: always a subset of [within]
+static FilterInterpResult plan_eval(TableMeta table, const PlanNode *node, const Selection *within)
+{
+    switch (node->kind) {
+        case FILTER_PREDICATE:
+            return plan_eval_predicate(table, node, within);
+        case FILTER_AND:
+            return plan_eval_and(table, node, within);
+        case FILTER_OR:
+            return plan_eval_or(table, node, within);
+        case FILTER_NOT:
+            return plan_eval_not(table, node, within);
+    }
 
-            return (FilterInterpResult) {
-                .res = tfres.res,
-            };
-        }
-        
-        // the lookup was successful, check if we have any relations with previous queries to deal with
-        if (rel != FILTER_REL_NONE) {
-            IntList *new = NULL;
-
-            if (rel == FILTER_REL_AND) {
-                new = intlist_intersection(rowset, tfres.matches);
-            } else if (rel == FILTER_REL_OR) {
-                new = intlist_union(rowset, tfres.matches);
-            } 
-
-            if (!new) {
-                intlist_free(rowset);
-                intlist_free(tfres.matches);
-
-                return (FilterInterpResult) {
-                    .res = RESULT_SERVER_ERROR,
-                };
-            }
+    return (FilterInterpResult){ .res = RESULT_SERVER_ERROR };
+}
 
-            intlist_free(rowset); // we no longer need the previous iteration's set
-            intlist_free(tfres.matches); // ..nor do we need current iteration's set, since we are allocing new
-            rowset = new;
-        } else {
-            // .. this is the first filter, just set the rowset
-            rowset = tfres.matches;
-        }
+// plan the evaluation of a tree of filters (see planner.h) and follow the plan,
+// returning the final set of rows which passed them
+FilterInterpResult filter_interpret(TableMeta table, const Filter *filter)
+{
+    PlanResult pres = plan_filter(table, filter);
+    if (pres.res != RESULT_OK)
+        return (FilterInterpResult){ .res = pres.res };
 
-        rel = filter->next_relation;
-        filter = filter->next;
-    }
+    FilterInterpResult fres = plan_eval(table, pres.plan->root, NULL);
+    plan_free(pres.plan);
 
-    return (FilterInterpResult) {
-        .res = RESULT_OK,
-        .rows = rowset,
-    };
+    return fres;
 }
 
 // check if all the values successfuly convert to their designated types
@@ -246,14 +215,18 @@ BazaResult validate_value_types(ColumnMetaList *columns, StrList *values)
     StrList *value = values;
 
     while (col) {
+        // a value for every column, no more and no less
+        if (!value || !value->str)
+            return RESULT_INVALID_QUERY;
+
         switch (col->meta->type) {
             case BTYPE_INT32: {
-                IntConvResult ires = str_to_int(value->str);
+                IntConvResult ires = str_to_int(value->str, INT32_MIN, INT32_MAX);
                 if (ires.result != RESULT_OK)
                     return ires.result;
             } break;
             case BTYPE_INT64: {
-                IntConvResult ires = str_to_int(value->str);
+                IntConvResult ires = str_to_int(value->str, INT64_MIN, INT64_MAX);
                 if (ires.result != RESULT_OK)
                     return ires.result;
             } break;
@@ -266,11 +239,187 @@ BazaResult validate_value_types(ColumnMetaList *columns, StrList *values)
         value = value->next;
     }
 
+    if (value && value->str)
+        return RESULT_INVALID_QUERY;
+
     return RESULT_OK;
 }
 
+// the rows of a SELECT in the order requested by ORDER BY, see select_order
+typedef struct SelectOrder {
+    uint64_t *rows;
+    size_t count;
+    bool walk; // [rows] are all the rows of the table, the unselected ones are skipped
+} SelectOrder;
+
+// Sort the rows in [selection] by the ORDER BY keys of [query] into [order]
+static BazaResult select_sort(const Query *query, TableMeta table, const Selection *selection,
+                              SelectOrder *order)
+{
+    size_t key_count = 0;
+    for (const SortKey *key = query->select_order; key; key = key->next)
+        key_count++;
+
+    *order = (SelectOrder) { .count = selection_count(selection) };
+    TableSortKey *keys = malloc(key_count * sizeof(TableSortKey));
+    order->rows = malloc((order->count ? order->count : 1) * sizeof(uint64_t));
+    if (!keys || !order->rows) {
+        free(keys);
+        free(order->rows);
+        return RESULT_ALLOC;
+    }
+
+    size_t nth = 0;
+    for (const SortKey *key = query->select_order; key; key = key->next) {
+        ColumnResult colres = table_column_get(table.id, key->column);
+        if (colres.result != RESULT_OK) {
+            free(keys);
+            free(order->rows);
+            return colres.result;
+        }
+        keys[nth++] = (TableSortKey) { .column = colres.meta.id, .direction = key->direction };
+    }
+
+    SelectionIter it = selection_iter(selection);
+    uint64_t row;
+    for (nth = 0; selection_next(&it, &row); nth++)
+        order->rows[nth] = row;
+
+    BazaResult res = table_sort(table.id, keys, key_count, order->rows, order->count);
+    free(keys);
+    if (res != RESULT_OK)
+        free(order->rows);
+
+    return res;
+}
+
+// Put the rows in [selection] in the order of the ORDER BY of [query], walking an
+// ordered index or sorting them, whichever the planner expects to be cheaper
+static BazaResult select_order(const Query *query, TableMeta table, const Selection *selection,
+                               SelectOrder *order)
+{
+    const SortKey *key = query->select_order;
+
+    if (plan_order(table, key, selection_count(selection)) == PLAN_ORDER_BTREE_INDEX) {
+        ColumnResult colres = table_column_get(table.id, key->column);
+        TableOrderResult tores = colres.result == RESULT_OK
+                               ? table_lookup_ordered(table.id, colres.meta.id, key->direction)
+                               : (TableOrderResult) { .res = colres.result };
+        if (tores.res == RESULT_OK) {
+            *order = (SelectOrder) { .rows = tores.rows, .count = tores.count, .walk = true };
+            return RESULT_OK;
+        }
+        // the index is not visible to a snapshot taken before it was built
+    }
+
+    return select_sort(query, table, selection, order);
+}
+
+// the result rows of a SELECT are formatted in morsels of this many rows by the worker
+// pool, each into a buffer of its own, and written out in row order. Rows are taken
+// a batch of SELECT_BATCH_MORSELS morsels per thread at a time, bounding the buffers.
+#define SELECT_MORSEL_ROWS 4096
+#define SELECT_BATCH_MORSELS 4
+
+typedef struct SelectPrinter {
+    TableCursor *cursor;
+    FILE *out;
+    uint64_t *rows; // of the current batch
+    size_t count;
+    size_t capacity;
+    char **buffers; // per morsel, NULL if it could not be formatted
+    size_t *sizes;
+} SelectPrinter;
+
+static bool select_printer_init(SelectPrinter *printer, TableCursor *cursor, FILE *out)
+{
+    size_t morsels = parallel_threads() * SELECT_BATCH_MORSELS;
+
+    *printer = (SelectPrinter) {
+        .cursor = cursor,
+        .out = out,
+        .rows = malloc(morsels * SELECT_MORSEL_ROWS * sizeof(uint64_t)),
+        .count = 0,
+        .capacity = morsels * SELECT_MORSEL_ROWS,
+        .buffers = malloc(morsels * sizeof(char*)),
+        .sizes = malloc(morsels * sizeof(size_t)),
+    };
+
+    return printer->rows && printer->buffers && printer->sizes;
+}
+
+static void select_printer_deinit(SelectPrinter *printer)
+{
+    free(printer->rows);
+    free(printer->buffers);
+    free(printer->sizes);
+}
+
+// print the rows [start, end) of the current batch to [out]
+static void select_print_rows(SelectPrinter *printer, size_t start, size_t end, FILE *out)
+{
+    if (end > printer->count)
+        end = printer->count;
+
+    for (size_t i = start; i < end; i++) {
+        table_cursor_row_print(printer->cursor, printer->rows[i], out);
+        fputc('\n', out);
+    }
+}
+
+static void select_print_morsel(void *arg, size_t morsel)
+{
+    SelectPrinter *printer = arg;
+
+    printer->buffers[morsel] = NULL;
+    FILE *out = open_memstream(&printer->buffers[morsel], &printer->sizes[morsel]);
+    if (!out)
+        return;
+
+    select_print_rows(printer, morsel * SELECT_MORSEL_ROWS, (morsel + 1) * SELECT_MORSEL_ROWS, out);
+
+    if (fclose(out) != 0) {
+        free(printer->buffers[morsel]);
+        printer->buffers[morsel] = NULL;
+    }
+}
+
+// print the rows of the current batch, in order
+static void select_printer_flush(SelectPrinter *printer)
+{
+    size_t morsels = (printer->count + SELECT_MORSEL_ROWS - 1) / SELECT_MORSEL_ROWS;
+
+    // small results are not worth handing out
+    if (morsels < 2 || parallel_threads() < 2) {
+        select_print_rows(printer, 0, printer->count, printer->out);
+        printer->count = 0;
+        return;
+    }
+
+    parallel_for(morsels, select_print_morsel, printer);
+
+    for (size_t i = 0; i < morsels; i++) {
+        if (printer->buffers[i]) {
+            fwrite(printer->buffers[i], 1, printer->sizes[i], printer->out);
+            free(printer->buffers[i]);
+        } else {
+            // out of memory, print the morsel directly
+            select_print_rows(printer, i * SELECT_MORSEL_ROWS, (i + 1) * SELECT_MORSEL_ROWS, printer->out);
+        }
+    }
+
+    printer->count = 0;
+}
+
+static void select_printer_push(SelectPrinter *printer, uint64_t row)
+{
+    printer->rows[printer->count++] = row;
+    if (printer->count == printer->capacity)
+        select_printer_flush(printer);
+}
+
 QueryResponse interpret_select_filter(const Query *query, TableMeta table,
-                                      ColumnMetaList *columns)
+                                      ColumnMetaList *columns, FILE *out)
 {
     FilterInterpResult fres = filter_interpret(table, query->select_filters);
 
@@ -279,24 +428,55 @@ QueryResponse interpret_select_filter(const Query *query, TableMeta table,
         return (QueryResponse) { .result = fres.res };
     }
 
-    IntList *column_ids = intlist_empty();
-    ColumnMetaList *col = columns;
-    while (col) {
-        intlist_push(column_ids, col->meta->id);
-        col = col->next;
+    SelectOrder order = { 0 };
+    if (query->select_order) {
+        BazaResult ores = select_order(query, table, fres.rows, &order);
+        if (ores != RESULT_OK) {
+            selection_free(fres.rows);
+            columnlist_free(columns);
+            return (QueryResponse) { .result = ores };
+        }
     }
 
-    IntList *row = fres.rows;
-    while (row && row->value != INTLIST_NULL) {
-        // TODO: fetch data into bintable
-        table_row_print(table.id, column_ids, row->value);
-        puts("");
+    TableCursorResult cres = table_cursor_open(table.id, columns, TABLE_LOCK_READ);
+    if (cres.res != RESULT_OK) {
+        free(order.rows);
+        selection_free(fres.rows);
+        columnlist_free(columns);
+        return (QueryResponse) { .result = cres.res };
+    }
+    TableCursor *cursor = cres.cursor;
+
+    SelectPrinter printer;
+    if (!select_printer_init(&printer, cursor, out)) {
+        select_printer_deinit(&printer);
+        table_cursor_close(cursor);
+        free(order.rows);
+        selection_free(fres.rows);
+        columnlist_free(columns);
+        return (QueryResponse) { .result = RESULT_ALLOC };
+    }
 
-        row = row->next;
+    if (query->select_order) {
+        // an index walk passes every row, only the ones that passed the filters are printed
+        for (size_t i = 0; i < order.count; i++) {
+            if (!order.walk || selection_contains(fres.rows, order.rows[i]))
+                select_printer_push(&printer, order.rows[i]);
+        }
+    } else {
+        SelectionIter it = selection_iter(fres.rows);
+        uint64_t row;
+        while (selection_next(&it, &row)) {
+            // TODO: fetch data into bintable
+            select_printer_push(&printer, row);
+        }
     }
 
-    intlist_free(fres.rows);
-    intlist_free(column_ids);
+    select_printer_flush(&printer);
+    select_printer_deinit(&printer);
+    table_cursor_close(cursor);
+    free(order.rows);
+    selection_free(fres.rows);
     columnlist_free(columns);
 
     // TODO: return data
@@ -307,13 +487,53 @@ QueryResponse interpret_select_filter(const Query *query, TableMeta table,
 }
 
 QueryResponse interpret_select_all(const Query *query, TableMeta table,
-                                   ColumnMetaList *columns)
+                                   ColumnMetaList *columns, FILE *out)
 {
-    for (uint64_t row = 0; row < table.row_count; row++) {
-        table_row_print(table.id, NULL, row);
-        puts("");
+    TableCursorResult cres = table_cursor_open(table.id, NULL, TABLE_LOCK_READ);
+    if (cres.res != RESULT_OK) {
+        columnlist_free(columns);
+        return (QueryResponse) { .result = cres.res };
     }
+    TableCursor *cursor = cres.cursor;
 
+    SelectPrinter printer;
+    if (!select_printer_init(&printer, cursor, out)) {
+        select_printer_deinit(&printer);
+        table_cursor_close(cursor);
+        columnlist_free(columns);
+        return (QueryResponse) { .result = RESULT_ALLOC };
+    }
+
+    TableFindResult live = table_rows_live(table.id);
+    SelectOrder order = { 0 };
+    BazaResult res = live.res;
+    if (res == RESULT_OK && query->select_order)
+        res = select_order(query, table, live.matches, &order);
+
+    if (res != RESULT_OK) {
+        selection_free(live.matches);
+        select_printer_deinit(&printer);
+        table_cursor_close(cursor);
+        columnlist_free(columns);
+        return (QueryResponse) { .result = res };
+    }
+
+    if (query->select_order) {
+        // every live row is selected, an index walk included
+        for (size_t i = 0; i < order.count; i++)
+            select_printer_push(&printer, order.rows[i]);
+    } else {
+        SelectionIter it = selection_iter(live.matches);
+        uint64_t row;
+        while (selection_next(&it, &row))
+            select_printer_push(&printer, row);
+    }
+
+    select_printer_flush(&printer);
+    select_printer_deinit(&printer);
+    table_cursor_close(cursor);
+    free(order.rows);
+    selection_free(live.matches);
     columnlist_free(columns);
 
     // TODO: return data
@@ -323,7 +543,7 @@ QueryResponse interpret_select_all(const Query *query, TableMeta table,
     };
 }
 
-QueryResponse interpret_select(const Query *query)
+QueryResponse interpret_select(const Query *query, FILE *out)
 {
     TableResult tabres = db_table_get(query->table_name);
     if (tabres.result != RESULT_OK) {
@@ -342,9 +562,9 @@ QueryResponse interpret_select(const Query *query)
     }
 
     if (query->select_filters) {
-        return interpret_select_filter(query, table, columns);
+        return interpret_select_filter(query, table, columns, out);
     } else {
-        return interpret_select_all(query, table, columns);
+        return interpret_select_all(query, table, columns, out);
     }
 }
 
@@ -393,49 +613,88 @@ QueryResponse interpret_create(const Query *query)
 
     intlist_free(type_list);
 
+    // switch the columns declared with DICT to dictionary encoding
+    StrList *dict_column = query->create_dict_columns;
+    while (dict_column && dict_column->str) {
+        ColumnResult colres = table_column_get(table.id, dict_column->str);
+        BazaResult res = colres.result;
+        if (res == RESULT_OK)
+            res = table_column_dict_encode(table.id, colres.meta.id);
+
+        if (res != RESULT_OK) {
+            return (QueryResponse) {
+                .result = res,
+            };
+        }
+
+        dict_column = dict_column->next;
+    }
+
     return (QueryResponse) {
         .result = RESULT_OK,
         .data = NULL,
     };
 }
 
-// insert values into [colums] at [row]
-BazaResult insert_values(const Query *query, TableMeta table, 
-                         ColumnMetaList *columns, StrList *values, uint64_t row,
-                         bool replace)
+QueryResponse interpret_create_index(const Query *query)
+{
+    TableResult tabres = db_table_get(query->table_name);
+    if (tabres.result != RESULT_OK) {
+        return (QueryResponse) {
+            .result = tabres.result,
+        };
+    }
+    TableMeta table = tabres.meta;
+
+    ColumnResult colres = table_column_get(table.id, query->index_column);
+    if (colres.result != RESULT_OK) {
+        return (QueryResponse) {
+            .result = colres.result,
+        };
+    }
+
+    IndexKind kind = indexkind_from_str(query->index_kind);
+    if (kind == INDEX_INVALID) {
+        return (QueryResponse) {
+            .result = RESULT_INVALID_QUERY,
+        };
+    }
+
+    return (QueryResponse) {
+        .result = table_index_new(table.id, colres.meta.id, query->index_name, kind),
+    };
+}
+
+// insert values into the columns of [cursor] at [row]
+BazaResult insert_values(TableCursor *cursor, StrList *values, uint64_t row)
 {
-    ColumnMetaList *col = columns;
     StrList *value = values;
 
-    while (col) {
-        switch (col->meta->type) {
+    for (size_t i = 0; i < cursor->column_count; i++) {
+        switch (cursor->columns[i].meta.type) {
             case BTYPE_INT32: {
-                IntConvResult ires = str_to_int(value->str);
+                IntConvResult ires = str_to_int(value->str, INT32_MIN, INT32_MAX);
                 if (ires.result != RESULT_OK)
                     return ires.result;
 
-                uint32_t *slot = table_column_get_row(table.id, col->meta->id, row);
-                *slot = ires.value;
+                uint32_t v = ires.value;
+                ENSURE(table_cursor_set(cursor, i, row, &v));
             } break;
             case BTYPE_INT64: {
-                IntConvResult ires = str_to_int(value->str);
+                IntConvResult ires = str_to_int(value->str, INT64_MIN, INT64_MAX);
                 if (ires.result != RESULT_OK)
                     return ires.result;
 
-                uint64_t *slot = table_column_get_row(table.id, col->meta->id, row);
-                *slot = ires.value;
-
+                uint64_t v = ires.value;
+                ENSURE(table_cursor_set(cursor, i, row, &v));
             } break;
             case BTYPE_STRING:  {
-                char **slot = table_column_get_row(table.id, col->meta->id, row);
-                if (replace)
-                    free(*slot);
-                *slot = strdup(value->str);
+                // the backend makes its own copy and frees the previous value
+                ENSURE(table_cursor_set(cursor, i, row, &value->str));
             } break;
             default: {} // NOP - shouldn't happen
         }
 
-        col = col->next;
         value = value->next;
     }
 
@@ -466,16 +725,23 @@ QueryResponse interpret_insert(const Query *query)
     BazaResult res = validate_value_types(columns, query->insert_values);
 
     if (res != RESULT_OK) {
+        columnlist_free(columns);
         return (QueryResponse) {
             .result = res,
         };
     }
 
-    table_row_add(table.id);
-    res = insert_values(query, table, columns, 
-                        query->insert_values, table.row_count, false);
-
+    TableCursorResult cres = table_cursor_open(table.id, columns, TABLE_LOCK_WRITE);
     columnlist_free(columns);
+    if (cres.res != RESULT_OK)
+        return (QueryResponse) { .result = cres.res };
+
+    uint64_t row;
+    res = table_cursor_row_add(cres.cursor, &row);
+    if (res == RESULT_OK)
+        res = insert_values(cres.cursor, query->insert_values, row);
+
+    table_cursor_close(cres.cursor);
 
     if (res != RESULT_OK) {
         return (QueryResponse) {
@@ -488,48 +754,45 @@ QueryResponse interpret_insert(const Query *query)
     };
 }
 
-QueryResponse interpret_delete_filtered(const Query *query, TableMeta table)
+// delete all the rows in [rows], then give the table a chance to compact itself
+QueryResponse delete_rows(TableMeta table, Selection *rows)
 {
-    FilterInterpResult fres = filter_interpret(table, query->delete_filters);
-    if (fres.res != RESULT_OK)
-        return (QueryResponse) { .result = fres.res };
-
-    IntList *filter_rows = fres.rows;
-
-    uint64_t delete_count = 0;
-    IntList *row = filter_rows;
-    while (row && row->value != INTLIST_NULL) {
-        BazaResult res = table_row_delete(table.id, row->value - delete_count);
+    // deleted rows keep their ids until compaction, so no adjustment is needed
+    SelectionIter it = selection_iter(rows);
+    uint64_t row;
+    while (selection_next(&it, &row)) {
+        BazaResult res = table_row_delete(table.id, row);
         if (res != RESULT_OK) {
+            selection_free(rows);
             return (QueryResponse) {
                 .result = res,
             };
         }
-        delete_count++;
-        row = row->next;
     }
 
-    intlist_free(filter_rows);
+    selection_free(rows);
 
     return (QueryResponse) {
-        .result = RESULT_OK,
+        .result = table_compact(table.id, false),
     };
 }
 
+QueryResponse interpret_delete_filtered(const Query *query, TableMeta table)
+{
+    FilterInterpResult fres = filter_interpret(table, query->delete_filters);
+    if (fres.res != RESULT_OK)
+        return (QueryResponse) { .result = fres.res };
+
+    return delete_rows(table, fres.rows);
+}
+
 QueryResponse interpret_delete_all(const Query *query, TableMeta table)
 {
-    for (uint64_t row = 0; row < table.row_count; row++) {
-        BazaResult res = table_row_delete(table.id, 0);
-        if (res != RESULT_OK) {
-            return (QueryResponse) {
-                .result = res,
-            };
-        }
-    }
+    TableFindResult live = table_rows_live(table.id);
+    if (live.res != RESULT_OK)
+        return (QueryResponse) { .result = live.res };
 
-    return (QueryResponse) {
-        .result = RESULT_OK,
-    };
+    return delete_rows(table, live.matches);
 }
 
 QueryResponse interpret_delete(const Query *query)
@@ -548,61 +811,76 @@ QueryResponse interpret_delete(const Query *query)
     return interpret_delete_all(query, table);
 }
 
-QueryResponse interpret_update_filtered(const Query *query, TableMeta table, ColumnMetaList *columns)
+QueryResponse interpret_update_filtered(const Query *query, TableMeta table, TableCursor *cursor)
 {
     FilterInterpResult fres = filter_interpret(table, query->update_filters);
     if (fres.res != RESULT_OK)
         return (QueryResponse) { .result = fres.res };
-    IntList *filter_rows = fres.rows;
-
-    BazaResult validate_res = validate_value_types(columns, query->update_values);
-    if (validate_res != RESULT_OK) {
-        return (QueryResponse) {
-            .result = RESULT_VALUE_TYPE, 
-        };
-    }
+    Selection *filter_rows = fres.rows;
 
-    IntList *row = filter_rows;
-    while (row && row->value != INTLIST_NULL) {
-        BazaResult res = insert_values(query, table, columns, query->update_values, row->value, true);
+    SelectionIter it = selection_iter(filter_rows);
+    uint64_t row;
+    while (selection_next(&it, &row)) {
+        BazaResult res = insert_values(cursor, query->update_values, row);
         if (res != RESULT_OK) {
+            selection_free(filter_rows);
             return (QueryResponse) {
                 .result = res,
             };
         }
-        row = row->next;
     }
 
-    intlist_free(filter_rows);
+    selection_free(filter_rows);
     
     return (QueryResponse) {
         .result = RESULT_OK,
     };
 }
 
-QueryResponse interpret_update_all(const Query *query, TableMeta table, ColumnMetaList *columns)
+QueryResponse interpret_update_all(const Query *query, TableMeta table, TableCursor *cursor)
 {
-    BazaResult validate_res = validate_value_types(columns, query->update_values);
-    if (validate_res != RESULT_OK) {
-        return (QueryResponse) {
-            .result = RESULT_VALUE_TYPE, 
-        };
-    }
-
-    for (uint64_t row = 0; row < table.row_count; row++) {
-        BazaResult res = insert_values(query, table, columns, query->update_values, row, true);
+    TableFindResult live = table_rows_live(table.id);
+    if (live.res != RESULT_OK)
+        return (QueryResponse) { .result = live.res };
+
+    SelectionIter it = selection_iter(live.matches);
+    uint64_t row;
+    while (selection_next(&it, &row)) {
+        BazaResult res = insert_values(cursor, query->update_values, row);
         if (res != RESULT_OK) {
+            selection_free(live.matches);
             return (QueryResponse) {
                 .result = res,
             };
         }
     }
 
+    selection_free(live.matches);
+
     return (QueryResponse) {
         .result = RESULT_OK,
     };
 }
 
+// the columns set by an UPDATE, in the order of its values (table_column_get_list
+// keeps the order of the table). NULL if one of them does not exist.
+static ColumnMetaList *update_column_list(TableID_t table, StrList *names)
+{
+    ColumnMetaList *columns = columnlist_empty();
+
+    for (StrList *name = names; columns && name && name->str; name = name->next) {
+        ColumnResult colres = table_column_get(table, name->str);
+        if (colres.result != RESULT_OK) {
+            columnlist_free(columns);
+            return NULL;
+        }
+
+        columnlist_push(columns, colres.meta);
+    }
+
+    return columns;
+}
+
 QueryResponse interpret_update(const Query *query)
 {
     TableResult tabres = db_table_get(query->table_name);
@@ -614,31 +892,180 @@ QueryResponse interpret_update(const Query *query)
     TableMeta table = tabres.meta;
 
     // fetch column meta
-    ColumnMetaList *columns = table_column_get_list(table.id, query->update_columns);
+    ColumnMetaList *columns = update_column_list(table.id, query->update_columns);
     if (!columns) {
         return (QueryResponse) {
             .result = RESULT_COLUMN_NOT_FOUND,
         };
     }
 
+    BazaResult validate_res = validate_value_types(columns, query->update_values);
+    if (validate_res != RESULT_OK) {
+        columnlist_free(columns);
+        return (QueryResponse) {
+            .result = RESULT_VALUE_TYPE, 
+        };
+    }
+
+    TableCursorResult cres = table_cursor_open(table.id, columns, TABLE_LOCK_WRITE);
+    columnlist_free(columns);
+    if (cres.res != RESULT_OK)
+        return (QueryResponse) { .result = cres.res };
+
     QueryResponse resp;
 
     if (query->update_filters) {
-        resp = interpret_update_filtered(query, table, columns);
+        resp = interpret_update_filtered(query, table, cres.cursor);
     } else {
-        resp = interpret_update_all(query, table, columns);
+        resp = interpret_update_all(query, table, cres.cursor);
     }
 
-    columnlist_free(columns);
+    table_cursor_close(cres.cursor);
 
     return resp;
 }
 
-QueryResponse interpret_query(const Query *query)
+QueryResponse interpret_vacuum(const Query *query)
 {
+    TableResult tabres = db_table_get(query->table_name);
+    if (tabres.result != RESULT_OK) {
+        return (QueryResponse) {
+            .result = tabres.result,
+        };
+    }
+
+    return (QueryResponse) {
+        .result = table_compact(tabres.meta.id, true),
+    };
+}
+
+QueryResponse interpret_analyze(const Query *query)
+{
+    TableResult tabres = db_table_get(query->table_name);
+    if (tabres.result != RESULT_OK) {
+        return (QueryResponse) {
+            .result = tabres.result,
+        };
+    }
+
+    return (QueryResponse) {
+        .result = table_analyze(tabres.meta.id, true),
+    };
+}
+
+QueryResponse interpret_save(const Query *query)
+{
+    TableResult tabres = db_table_get(query->table_name);
+    if (tabres.result != RESULT_OK) {
+        return (QueryResponse) {
+            .result = tabres.result,
+        };
+    }
+
+    return (QueryResponse) {
+        .result = table_save(tabres.meta.id),
+    };
+}
+
+QueryResponse interpret_checkpoint(void)
+{
+    return (QueryResponse) {
+        .result = db_checkpoint(),
+    };
+}
+
+QueryResponse interpret_prepare(const Query *query)
+{
+    StatementResult sres = statement_prepare(query->prepare_sql);
+    if (sres.result != RESULT_OK) {
+        return (QueryResponse) {
+            .result = sres.result,
+        };
+    }
+
+    BazaResult res = statement_register(query->statement_name, sres.statement);
+    statement_release(sres.statement);
+
+    return (QueryResponse) {
+        .result = res,
+    };
+}
+
+QueryResponse interpret_execute(const Query *query, FILE *out)
+{
+    Statement *statement = statement_lookup(query->statement_name);
+    if (!statement) {
+        return (QueryResponse) {
+            .result = RESULT_STATEMENT_NOT_FOUND,
+        };
+    }
+
+    size_t count = 0;
+    for (StrList *param = query->execute_params; param && param->str; param = param->next)
+        count++;
+
+    const char **params = malloc(count * sizeof(char*));
+    if (count && !params) {
+        statement_release(statement);
+        return (QueryResponse) { .result = RESULT_ALLOC };
+    }
+
+    StrList *param = query->execute_params;
+    for (size_t i = 0; i < count; i++, param = param->next)
+        params[i] = param->str;
+
+    QueryResponse resp = statement_execute(statement, params, count, out);
+
+    free(params);
+    statement_release(statement);
+
+    return resp;
+}
+
+QueryResponse interpret_deallocate(const Query *query)
+{
+    return (QueryResponse) {
+        .result = statement_unregister(query->statement_name),
+    };
+}
+
+// print the plan of a SELECT, DELETE or UPDATE to [out] instead of running it
+QueryResponse interpret_explain(const Query *query, FILE *out)
+{
+    TableResult tabres = db_table_get(query->table_name);
+    if (tabres.result != RESULT_OK) {
+        return (QueryResponse) {
+            .result = tabres.result,
+        };
+    }
+
+    const Filter *filter = query->type == QUERY_SELECT ? query->select_filters
+                         : query->type == QUERY_DELETE ? query->delete_filters
+                         : query->update_filters;
+
+    PlanResult pres = plan_filter(tabres.meta, filter);
+    if (pres.res != RESULT_OK)
+        return (QueryResponse) { .result = pres.res };
+
+    if (query->type == QUERY_SELECT)
+        pres.plan->order = plan_order(tabres.meta, query->select_order, pres.plan->rows);
+
+    plan_print(pres.plan, out);
+    plan_free(pres.plan);
+
+    return (QueryResponse) {
+        .result = RESULT_OK,
+    };
+}
+
+static QueryResponse interpret_statement(const Query *query, FILE *out)
+{
+    if (query->explain)
+        return interpret_explain(query, out);
+
     switch (query->type) {
         case QUERY_SELECT:
-            return interpret_select(query);
+            return interpret_select(query, out);
         case QUERY_CREATE:
             return interpret_create(query);
         case QUERY_INSERT:
@@ -647,11 +1074,101 @@ QueryResponse interpret_query(const Query *query)
             return interpret_delete(query);
         case QUERY_UPDATE:
             return interpret_update(query);
+        case QUERY_CREATE_INDEX:
+            return interpret_create_index(query);
+        case QUERY_VACUUM:
+            return interpret_vacuum(query);
+        case QUERY_ANALYZE:
+            return interpret_analyze(query);
+        case QUERY_SAVE:
+            return interpret_save(query);
+        case QUERY_CHECKPOINT:
+            return interpret_checkpoint();
+        case QUERY_PREPARE:
+            return interpret_prepare(query);
+        case QUERY_EXECUTE:
+            return interpret_execute(query, out);
+        case QUERY_DEALLOCATE:
+            return interpret_deallocate(query);
     }
     FATAL("UNIMPLEMENTED");
 }
 
+/// The lock a statement holds on its table from its start until it is committed,
+/// so that the row IDs it works with stay valid and the write-ahead log keeps the
+/// order of the changes. Returns false for statements which do not need one.
+/// Readers take a snapshot of their table instead whenever they can.
+static bool interpret_lock_mode(const Query *query, TableLockMode *mode)
+{
+    // planning only reads the table
+    if (query->explain) {
+        *mode = TABLE_LOCK_READ;
+        return true;
+    }
+
+    switch (query->type) {
+        case QUERY_SELECT:
+            *mode = TABLE_LOCK_READ;
+            return true;
+        case QUERY_INSERT:
+        case QUERY_DELETE:
+        case QUERY_UPDATE:
+        case QUERY_CREATE_INDEX:
+        case QUERY_VACUUM:
+        case QUERY_ANALYZE:
+        case QUERY_SAVE:
+            *mode = TABLE_LOCK_WRITE;
+            return true;
+        case QUERY_CREATE:     // creating a table locks the catalog
+        case QUERY_CHECKPOINT: // locks every table itself
+        case QUERY_PREPARE:    // checks the table without holding on to it
+        case QUERY_EXECUTE:    // runs the prepared statement as a statement of its own
+        case QUERY_DEALLOCATE:
+            break;
+    }
+
+    return false;
+}
+
+QueryResponse interpret_query(const Query *query, FILE *out)
+{
+    TableLockMode mode;
+    TableResult table = { .result = RESULT_TABLE_NOT_FOUND };
+    bool snapshot = false;
+
+    if (interpret_lock_mode(query, &mode)
+        && (table = db_table_get(query->table_name)).result == RESULT_OK) {
+        // a snapshot does not hold writers up for as long as the statement runs
+        if (mode == TABLE_LOCK_READ && table_snapshot_begin(table.meta.id) == RESULT_OK)
+            snapshot = true;
+        else
+            table_lock(table.meta.id, mode);
+    }
+
+    QueryResponse response = interpret_statement(query, out);
+
+    // the statistics of the columns a statement changed enough are refreshed
+    // before anybody gets to plan with them
+    if (table.result == RESULT_OK && mode == TABLE_LOCK_WRITE && response.result == RESULT_OK)
+        response.result = table_analyze(table.meta.id, false);
+
+    // every statement is its own transaction in the write-ahead log
+    BazaResult res = db_commit();
+    if (response.result == RESULT_OK && res != RESULT_OK)
+        response.result = res;
+
+    if (snapshot)
+        table_snapshot_end();
+    else if (table.result == RESULT_OK)
+        table_unlock(table.meta.id);
+
+    return response;
+}
+
 #ifdef BAZATEST_INTERPRETER
+#include <dirent.h>
+#include <unistd.h>
+
 void do_query(const char *q)
 {
     QueryParseResult res = query_parse(q);
@@ -663,7 +1180,7 @@ void do_query(const char *q)
         query_print(res.query);
     }
 
-    QueryResponse resp = interpret_query(res.query);
+    QueryResponse resp = interpret_query(res.query, stdout);
     if (resp.result != RESULT_OK) {
         printf("INTERP ERR: %s\n", result_str(resp.result));
     }
@@ -671,8 +1188,28 @@ void do_query(const char *q)
     query_free(res.query);
 }
 
+// remove the temporary directory [dir], the current one, and the data directory in it
+static void remove_test_dir(const char *dir)
+{
+    DIR *data = opendir("tables");
+    for (struct dirent *entry; data && (entry = readdir(data)); )
+        if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, ".."))
+            unlinkat(dirfd(data), entry->d_name, 0);
+    if (data)
+        closedir(data);
+
+    if (rmdir("tables") != 0 || chdir("/") != 0 || rmdir(dir) != 0)
+        FATAL("failed to remove %s: %m", dir);
+}
+
 int main()
 {
+    // storage_init loads the tables and replays the log of the data directory under
+    // the current one, a fresh one keeps the output the same from run to run
+    char dir[] = "/tmp/bazatest-XXXXXX";
+    if (!mkdtemp(dir) || chdir(dir) != 0)
+        FATAL("failed to create a temporary directory: %m");
+
     storage_init();
 
     const char *queries[] = {
@@ -690,6 +1227,36 @@ int main()
         "INSERT INTO testing VALUES (hello, 50, lastone)",
 
         "SELECT * FROM testing WHERE two = 50",
+
+        // integers have to be whole numbers in range, in statements and parameters alike:
+        // the next three fail with VALUE_TYPE, then the WHERE with FILTER_VALUE_TYPE
+        "INSERT INTO testing VALUES (x, 12abc, y)",
+        "INSERT INTO testing VALUES (x, 99999999999, y)",
+        "UPDATE testing SET two = 7x WHERE one = hi",
+        "SELECT * FROM testing WHERE two = 5O",
+
+        // the values of an UPDATE go to the columns in the order they are set in
+        "UPDATE testing SET three = sets, two = 21 WHERE one = hi",
+        "SELECT * FROM testing WHERE one = hi",
+
+        "PREPARE ins AS INSERT INTO testing VALUES (?, ?, ?)",
+        "EXECUTE ins (x, one, y)",
+        "EXECUTE ins (x, 12abc, y)",
+        "EXECUTE ins (x, 99999999999, y)",
+        "EXECUTE ins (prepared, 60, row)",
+        "SELECT * FROM testing WHERE two >= 60",
+
+        // a quoted ? is a value like any other, only the unquoted one is a parameter
+        "PREPARE quoted AS INSERT INTO testing VALUES (\"?\", ?, two)",
+        "EXECUTE quoted (70)",
+        "SELECT * FROM testing WHERE one = \"?\"",
+
+        // ORDER BY walks the index when most rows are selected, and sorts a few selected ones
+        "CREATE INDEX testing_two ON testing (two) USING btree",
+        "EXPLAIN SELECT * FROM testing ORDER BY two DESC",
+        "SELECT * FROM testing ORDER BY two DESC",
+        "EXPLAIN SELECT * FROM testing WHERE one = hello ORDER BY two DESC",
+        "SELECT * FROM testing WHERE one = hello ORDER BY two DESC",
     };
 
     for (int i = 0; i < sizeof(queries)/sizeof(queries[0]); i++) {
@@ -699,6 +1266,8 @@ int main()
 
     storage_deinit();
 
+    remove_test_dir(dir);
+
     return 0;
 }
 #endif
@@ -13,6 +13,8 @@ typedef struct QueryRespose {
     void *data;
 } QueryResponse;
 
-QueryResponse interpret_query(const Query *query);
+/// Run [query] as a statement of its own, committing it. The rows a SELECT returns
+/// are written to [out].
+QueryResponse interpret_query(const Query *query, FILE *out);
 
 #endif /* _INTERPRETER_H */
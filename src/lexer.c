@@ -0,0 +1,174 @@
+#include "lexer.h"
+
+#include <string.h>
+
+/// What a byte can be, outside of a string
+typedef enum CharClass {
+    CHAR_WORD,  // part of a word, the default (this includes UTF-8)
+    CHAR_SPACE,
+    CHAR_QUOTE,
+    CHAR_SINGLE, // a token by itself: ( ) ,
+    CHAR_OPERATOR,
+    CHAR_END,   // NUL and ';'
+} CharClass;
+
+static const unsigned char CHAR_CLASS[256] = {
+    [0] = CHAR_END,
+    [';'] = CHAR_END,
+    [' '] = CHAR_SPACE,
+    ['\t'] = CHAR_SPACE,
+    ['\n'] = CHAR_SPACE,
+    ['\r'] = CHAR_SPACE,
+    ['"'] = CHAR_QUOTE,
+    ['('] = CHAR_SINGLE,
+    [')'] = CHAR_SINGLE,
+    [','] = CHAR_SINGLE,
+    ['='] = CHAR_OPERATOR,
+    ['<'] = CHAR_OPERATOR,
+    ['>'] = CHAR_OPERATOR,
+    ['!'] = CHAR_OPERATOR,
+};
+
+typedef struct KeywordEntry {
+    const char *word;
+    unsigned char length;
+    Keyword keyword;
+} KeywordEntry;
+
+#define KEYWORD_HASH_SIZE 64
+
+/// The hash of a word that might be a keyword. The factors were picked to map every
+/// keyword to a slot of its own, so a lookup is one hash and one compare: the table
+/// below has to be regenerated whenever a keyword is added.
+static inline unsigned keyword_hash(const char *word, size_t length)
+{
+    return (((unsigned char)word[0] | 0x20) * 18
+            + ((unsigned char)word[length - 1] | 0x20) * 11
+            + length) & (KEYWORD_HASH_SIZE - 1);
+}
+
+#define KW(str, kw) { str, sizeof(str) - 1, kw }
+
+static const KeywordEntry KEYWORDS[KEYWORD_HASH_SIZE] = {
+    [1] = KW("vacuum", KEYWORD_VACUUM),
+    [3] = KW("values", KEYWORD_VALUES),
+    [4] = KW("table", KEYWORD_TABLE),
+    [5] = KW("as", KEYWORD_AS),
+    [8] = KW("dict", KEYWORD_DICT),
+    [10] = KW("on", KEYWORD_ON),
+    [13] = KW("desc", KEYWORD_DESC),
+    [15] = KW("index", KEYWORD_INDEX),
+    [19] = KW("create", KEYWORD_CREATE),
+    [21] = KW("set", KEYWORD_SET),
+    [22] = KW("asc", KEYWORD_ASC),
+    [23] = KW("update", KEYWORD_UPDATE),
+    [24] = KW("select", KEYWORD_SELECT),
+    [25] = KW("by", KEYWORD_BY),
+    [27] = KW("explain", KEYWORD_EXPLAIN),
+    [31] = KW("from", KEYWORD_FROM),
+    [33] = KW("and", KEYWORD_AND),
+    [36] = KW("insert", KEYWORD_INSERT),
+    [37] = KW("delete", KEYWORD_DELETE),
+    [41] = KW("deallocate", KEYWORD_DEALLOCATE),
+    [43] = KW("into", KEYWORD_INTO),
+    [44] = KW("using", KEYWORD_USING),
+    [48] = KW("analyze", KEYWORD_ANALYZE),
+    [49] = KW("save", KEYWORD_SAVE),
+    [51] = KW("like", KEYWORD_LIKE),
+    [54] = KW("or", KEYWORD_OR),
+    [56] = KW("execute", KEYWORD_EXECUTE),
+    [57] = KW("order", KEYWORD_ORDER),
+    [58] = KW("where", KEYWORD_WHERE),
+    [59] = KW("not", KEYWORD_NOT),
+    [60] = KW("checkpoint", KEYWORD_CHECKPOINT),
+    [62] = KW("prepare", KEYWORD_PREPARE),
+};
+
+#undef KW
+
+Keyword keyword_lookup(const char *word, size_t length)
+{
+    if (length == 0)
+        return KEYWORD_NONE;
+
+    const KeywordEntry *entry = &KEYWORDS[keyword_hash(word, length)];
+    if (entry->length != length)
+        return KEYWORD_NONE;
+
+    // keywords are all letters, so folding the case is a matter of one bit
+    for (size_t i = 0; i < length; i++) {
+        if (((unsigned char)word[i] | 0x20) != (unsigned char)entry->word[i])
+            return KEYWORD_NONE;
+    }
+
+    return entry->keyword;
+}
+
+void lexer_init(Lexer *lexer, const char *text)
+{
+    lexer->pos = text;
+    lexer_advance(lexer);
+}
+
+void lexer_advance(Lexer *lexer)
+{
+    const unsigned char *c = (const unsigned char *)lexer->pos;
+
+    while (CHAR_CLASS[*c] == CHAR_SPACE)
+        c++;
+
+    Token token = {
+        .keyword = KEYWORD_NONE,
+        .start = (const char *)c,
+        .length = 1,
+    };
+
+    switch ((CharClass)CHAR_CLASS[*c]) {
+        case CHAR_END:
+            // stay put, so that the end is all that is left
+            token.kind = TOKEN_END;
+            token.length = 0;
+            break;
+        case CHAR_QUOTE: {
+            const unsigned char *close = (const unsigned char *)strchr((const char *)c + 1, '"');
+            if (!close) {
+                token.kind = TOKEN_INVALID;
+                token.length = strlen((const char *)c);
+                c += token.length;
+                break;
+            }
+            token.kind = TOKEN_STRING;
+            token.start = (const char *)c + 1;
+            token.length = close - c - 1;
+            c = close + 1;
+        } break;
+        case CHAR_SINGLE:
+            token.kind = *c == '(' ? TOKEN_LPAREN : *c == ')' ? TOKEN_RPAREN : TOKEN_COMMA;
+            c++;
+            break;
+        case CHAR_OPERATOR:
+            token.kind = TOKEN_OPERATOR;
+            if (c[1] == '=' && *c != '=')
+                token.length = 2;
+            else if (*c == '!')
+                token.kind = TOKEN_INVALID;
+            c += token.length;
+            break;
+        case CHAR_SPACE:
+        case CHAR_WORD:
+            token.kind = TOKEN_WORD;
+            while (CHAR_CLASS[*c] == CHAR_WORD)
+                c++;
+            token.length = c - (const unsigned char *)token.start;
+            token.keyword = keyword_lookup(token.start, token.length);
+            break;
+    }
+
+    lexer->pos = (const char *)c;
+    lexer->token = token;
+}
+
+bool token_is(const Token *token, const char *str)
+{
+    return !strncmp(token->start, str, token->length) && !str[token->length];
+}
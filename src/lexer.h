@@ -0,0 +1,83 @@
+// SQL lexer - splits the text of a statement into tokens for the parser, in a
+// single pass and without allocating: a token is a slice of the original text.
+#ifndef _LEXER_H
+#define _LEXER_H
+
+#include "util/includes.h"
+
+typedef enum TokenKind {
+    TOKEN_END,      // the end of the statement: the end of the text or a ';'
+    TOKEN_WORD,     // keywords, names, numbers and unquoted values
+    TOKEN_STRING,   // a "quoted" value, the slice leaves the quotes out
+    TOKEN_LPAREN,
+    TOKEN_RPAREN,
+    TOKEN_COMMA,
+    TOKEN_OPERATOR, // = != < <= > >=
+    TOKEN_INVALID,  // a string missing its closing quote, a lone '!'
+} TokenKind;
+
+/// Keywords are told apart from other words by the lexer. Whether a word is used
+/// as a keyword is up to the parser, so keywords still work as names and values.
+typedef enum Keyword {
+    KEYWORD_NONE,
+    KEYWORD_SELECT,
+    KEYWORD_FROM,
+    KEYWORD_WHERE,
+    KEYWORD_AND,
+    KEYWORD_OR,
+    KEYWORD_NOT,
+    KEYWORD_ORDER,
+    KEYWORD_BY,
+    KEYWORD_ASC,
+    KEYWORD_DESC,
+    KEYWORD_LIKE,
+    KEYWORD_CREATE,
+    KEYWORD_TABLE,
+    KEYWORD_INDEX,
+    KEYWORD_ON,
+    KEYWORD_USING,
+    KEYWORD_DICT,
+    KEYWORD_INSERT,
+    KEYWORD_INTO,
+    KEYWORD_VALUES,
+    KEYWORD_DELETE,
+    KEYWORD_UPDATE,
+    KEYWORD_SET,
+    KEYWORD_VACUUM,
+    KEYWORD_SAVE,
+    KEYWORD_CHECKPOINT,
+    KEYWORD_PREPARE,
+    KEYWORD_AS,
+    KEYWORD_EXECUTE,
+    KEYWORD_DEALLOCATE,
+    KEYWORD_EXPLAIN,
+    KEYWORD_ANALYZE,
+} Keyword;
+
+typedef struct Token {
+    TokenKind kind;
+    Keyword keyword;   // of a TOKEN_WORD (case-insensitive), KEYWORD_NONE otherwise
+    const char *start; // in the text, not NUL terminated
+    size_t length;
+} Token;
+
+/// Reads the tokens of a statement one at a time. [token] is the current one;
+/// the text has to outlive the lexer and every token taken from it.
+typedef struct Lexer {
+    const char *pos; // just after [token]
+    Token token;
+} Lexer;
+
+/// Start lexing [text], reading its first token
+void lexer_init(Lexer *lexer, const char *text);
+
+/// Move on to the next token. The end of the statement is returned for good.
+void lexer_advance(Lexer *lexer);
+
+/// Does [token] have the text [str] (exactly)
+bool token_is(const Token *token, const char *str);
+
+/// Look up the keyword spelled by [length] bytes at [word], KEYWORD_NONE if it is none
+Keyword keyword_lookup(const char *word, size_t length);
+
+#endif /* _LEXER_H */
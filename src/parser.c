@@ -1,5 +1,7 @@
 #include "parser.h"
+#include "lexer.h"
 
+#include "util/arena.h"
 #include "util/result.h"
 #include "util/defs.h"
 #include "util/str.h"
@@ -8,122 +10,94 @@
 #include <string.h>
 #include <stdlib.h>
 
-/// Checks if [tok]->str matches [keyword] and if so skips to the next token.
+// The parsing functions walk the tokens of a Lexer, returning a QueryParseResult:
+// they fill in the query as they go, so whatever they did manage to parse is
+// freed with it in case of an error. Only the text of the tokens the query keeps
+// is ever copied, into the arena of the query.
+
+/// Most statements fit in the first block of their arena
+#define QUERY_ARENA_BLOCK 1024
+
+#define PARSE_ERROR(error) (QueryParseResult) { \
+    .result = RESULT_ERR_SQL_PARSE, \
+    .error_msg = error \
+}
+
+#define PARSE_ALLOC_ERROR (QueryParseResult) { .result = RESULT_ALLOC }
+
+/// An error at [token], which might be an unterminated string instead
+#define PARSE_ERROR_AT(token, error) PARSE_ERROR( \
+    (token)->kind == TOKEN_INVALID && (token)->start[0] == '"' \
+        ? "a string is missing its closing quote" : (error))
+
+/// Checks if the current token of [lex] is [keyword] and if so skips to the next token.
 /// must be called from within a function returning QueryParseResult
-#define EXPECT_KEYWORD(tok, keyword, error) do { \
-    if (!tok || !str_ieq(tok->str, keyword)) { \
-        return (QueryParseResult) { \
-            .result = RESULT_ERR_SQL_PARSE, \
-            .error_msg = error \
-        }; \
-    } \
-    tok = tok->next; \
+#define EXPECT_KEYWORD(lex, kw, error) do { \
+    if ((lex)->token.kind != TOKEN_WORD || (lex)->token.keyword != kw) \
+        return PARSE_ERROR(error); \
+    lexer_advance(lex); \
 } while(0)
 
-/// Checks if [tok] exists and if so assigns [value] to [variable], otherwise
-/// returning an error with [error] as the message.
+/// Checks if the current token of [lex] is of [token_kind] and if so skips to the next token.
 /// must be called from within a function returning QueryParseResult
-#define EXPECT_VARIABLE(tok, variable, value, error) do { \
-    if (!tok) { \
-        return (QueryParseResult) { \
-            .result = RESULT_ERR_SQL_PARSE, \
-            .error_msg = error \
-        }; \
-    } \
-    variable = value; \
-    tok = tok->next; \
+#define EXPECT_TOKEN(lex, token_kind, error) do { \
+    if ((lex)->token.kind != token_kind) \
+        return PARSE_ERROR(error); \
+    lexer_advance(lex); \
 } while(0)
 
-/// Checks if [tok] exists, returning an error if it doesn't.
+/// Checks if the current token of [lex] is a word or a string and if so assigns a copy
+/// of its text (in [arena]) to [variable], otherwise returning an error with [error]
+/// as the message.
 /// must be called from within a function returning QueryParseResult
-#define EXPECT_TOKEN(tok, error) do { \
-    if (!tok) { \
-        return (QueryParseResult) { \
-            .result = RESULT_ERR_SQL_PARSE, \
-            .error_msg = error \
-        }; \
-    } \
+#define EXPECT_TEXT(lex, arena, variable, error) do { \
+    if (!token_is_text(&(lex)->token)) \
+        return PARSE_ERROR_AT(&(lex)->token, error); \
+    if (!(variable = token_dup(arena, &(lex)->token))) \
+        return PARSE_ALLOC_ERROR; \
+    lexer_advance(lex); \
 } while(0)
 
-typedef struct ListParseResult {
-    BazaResult res;
-    union {
-        const char *error_msg;
-        struct {
-            StrList *list;
-            StrList *outer_last;  // the last element of the list as understood by the caller
-        };
-    };
-} ListParseResult;
-
-#define LIST_DELIMITER ","
-
-/// Extract an SQL list from tokens starting at [start].
-/// If [delim] is not NULL, it is assumed to contain at least two chars,
-/// signifying the start and end delimiter. For instance:
-/// brack_delim should = "()" for a list like "(1, 2, 3)"
-/// Invalid lists:
-///  1,2,3)  (IFF delim is _not_ NULL of course)
-/// Extra commas are ignored for now but might throw some sort of an error
-/// in a later revision
-ListParseResult extract_sql_list(StrList *start, const char *delim)
-{
-    StrList *final;
-    StrList *cur = start;
-
-    if (delim) {
-        if (start->str[0] != delim[0]) {
-            return (ListParseResult) {
-                .res = RESULT_ERR_SQL_PARSE,
-                .error_msg = "Expected a list "
-                             "to start with a valid delimiter"
-            };
-        }
-
-        bool bail = false;
-        if (start->str[start->strlen-1] == delim[1]) {
-            start->str[start->strlen-1] = 0;
-            bail = true;
-        }
-
-        // seek the start string one char to step over the opening delimiter
-        final = strlist_from_split(start->str + 1, LIST_DELIMITER);
-
-        cur = cur->next;
-
-        if (bail)
-            goto bail;
-    } else {
-        final = strlist_empty();
-    }
-
-    for (;;) {
-        bool last;
-
-        // TODO: sort of unclean and maybe redundant to check the strlen?
-        if (delim) {
-            last = cur->strlen > 0 && cur->str[cur->strlen-1] == delim[1];
-            if (last) {
-                cur->str[cur->strlen-1] = 0;
-            }
-        } else {
-            last = !(cur->strlen > 0 && cur->str[cur->strlen-1] == ',');
-        }
+/// Names and values: words, or anything at all in quotes
+static inline bool token_is_text(const Token *token)
+{
+    return token->kind == TOKEN_WORD || token->kind == TOKEN_STRING;
+}
 
-        StrList *sub_splt = strlist_from_split(cur->str, ",");
-        final = strlist_merge(final, sub_splt);
-        cur = cur->next;
+static inline char *token_dup(Arena *arena, const Token *token)
+{
+    return arena_strndup(arena, token->start, token->length);
+}
 
-        if (last)
-            break;
-    }
+/// A value standing for a parameter of a prepared statement: ? without quotes
+static inline bool token_is_placeholder(const Token *token)
+{
+    return token->kind == TOKEN_WORD && token_is(token, "?");
+}
 
-bail:
-    return (ListParseResult) {
-        .res = RESULT_OK,
-        .list = final,
-        .outer_last = cur,
+/// Append a copy of the text of [token] to [*list], [*tail] being its last element
+/// (NULL while the list is empty). The list is never walked. The nodes are
+/// allocated in [arena], so the list must not be given to strlist_free.
+static bool list_append(Arena *arena, StrList **list, StrList **tail, const Token *token)
+{
+    StrList *node = arena_alloc(arena, sizeof(StrList));
+    if (!node)
+        return false;
+
+    *node = (StrList) {
+        .str = token_dup(arena, token),
+        .strlen = token->length,
+        .placeholder = token_is_placeholder(token),
     };
+    if (!node->str)
+        return false;
+
+    if (*tail)
+        (*tail)->next = node;
+    else
+        *list = node;
+    *tail = node;
+    return true;
 }
 
 const char *querytype_str(QueryType type)
@@ -134,6 +108,14 @@ const char *querytype_str(QueryType type)
         case QUERY_INSERT: return "INSERT";
         case QUERY_DELETE: return "DELETE";
         case QUERY_UPDATE: return "UPDATE";
+        case QUERY_CREATE_INDEX: return "CREATE INDEX";
+        case QUERY_VACUUM: return "VACUUM";
+        case QUERY_ANALYZE: return "ANALYZE";
+        case QUERY_SAVE: return "SAVE";
+        case QUERY_CHECKPOINT: return "CHECKPOINT";
+        case QUERY_PREPARE: return "PREPARE";
+        case QUERY_EXECUTE: return "EXECUTE";
+        case QUERY_DEALLOCATE: return "DEALLOCATE";
     }
     return NULL;
 }
@@ -182,162 +164,71 @@ FilterOp filterop_from_str(const char *str)
     return FILTER_INVALID;
 }
 
-#define STRFILTERREL_AND "and"
-#define STRFILTERREL_OR  "or"
-
-const char *filterrel_to_str(FilterRelation rel)
+static void filter_print_nested(const Filter *filter, bool nested)
 {
-    switch (rel) {
-        case FILTER_REL_INVALID: return "!invalid filter relation!";
-        case FILTER_REL_NONE: return "none";
-        case FILTER_REL_AND: return STRFILTERREL_AND;
-        case FILTER_REL_OR: return STRFILTERREL_OR;
+    switch (filter->kind) {
+        case FILTER_PREDICATE:
+            printf("%s %s '%s'", filter->column, filterop_to_str(filter->op), filter->value);
+            break;
+        case FILTER_NOT:
+            fputs("NOT ", stdout);
+            filter_print_nested(filter->children, true);
+            break;
+        case FILTER_AND:
+        case FILTER_OR:
+            if (nested)
+                putchar('(');
+            for (const Filter *child = filter->children; child; child = child->next) {
+                if (child != filter->children)
+                    fputs(filter->kind == FILTER_AND ? " AND " : " OR ", stdout);
+                filter_print_nested(child, true);
+            }
+            if (nested)
+                putchar(')');
+            break;
     }
-    return NULL;
-}
-
-FilterRelation filterrel_from_str(const char *str)
-{
-    if (str_ieq(str, STRFILTERREL_AND))
-        return FILTER_REL_AND;
-    else if (str_ieq(str, STRFILTERREL_OR))
-        return FILTER_REL_OR;
-    return FILTER_REL_INVALID;
 }
 
-void filter_print(Filter *filter)
+void filter_print(const Filter *filter)
 {
-    printf("Filter { column: '%s' op: '%s' value: '%s' next_rel: '%s' }", filter->column,
-           filterop_to_str(filter->op), filter->value, filterrel_to_str(filter->next_relation));
+    filter_print_nested(filter, false);
 }
 
-Filter *filter_empty()
+static Filter *filter_new(Arena *arena, FilterKind kind)
 {
-    Filter *filter = malloc(sizeof(Filter));
+    Filter *filter = arena_alloc(arena, sizeof(Filter));
     if (!filter)
         return NULL;
 
     *filter = (Filter) {
+        .kind = kind,
+        .op = FILTER_NONE,
         .value = NULL,
+        .placeholder = false,
+        .column = NULL,
+        .children = NULL,
         .next = NULL,
-        .op = FILTER_NONE,
-        .next_relation = FILTER_REL_NONE,
     };
 
     return filter;
 }
 
-void filter_free(Filter *filter)
-{
-    Filter *cur = filter, *nxt;
-    while (cur) {
-        nxt = cur->next;
-        if (cur->value)
-            free(cur->value);
-        if (cur->column)
-            free(cur->column);
-        free(cur);
-        cur = nxt;
-    }
-}
-
-typedef struct FilterParseResult {
-    BazaResult res;
-    union {
-        const char *err_msg;
-        struct {
-            Filter *filters;
-            StrList *last_tok;
-        };
-    };
-} FilterParseResult;
-
-FilterParseResult parse_filters(StrList *tok)
+/// Add [child] to the children of [parent] (an AND or an OR), after [*tail], its last
+/// child so far. A [child] of the same kind hands its own children over instead.
+static void filter_adopt(Filter *parent, Filter **tail, Filter *child)
 {
-    Filter *filters = filter_empty();
-    Filter *cur = filters;
-
-    if (!tok) {
-        return (FilterParseResult) { 
-            .res = RESULT_ERR_SQL_PARSE, 
-            .err_msg = "expected a filter after WHERE"
-        };
+    Filter *first = child, *last = child;
+    if (child->kind == parent->kind) {
+        first = child->children;
+        for (last = first; last->next; last = last->next)
+            ;
     }
 
-    for (;;) {
-        // WHERE <column> <filterop> <value> [FILTER_REL..]
-        //       ^      ^
-        
-        // we know this token exists because we checked either before 
-        // the loop or at the end of last iter.
-        cur->column = strdup(tok->str);
-        tok = tok->next;
-
-        // WHERE <column> <filterop> <value> [FILTER_REL..]
-        //                ^        ^
-
-        FilterOp op = filterop_from_str(tok->str);
-        if (op == FILTER_INVALID) {
-            filter_free(filters);
-
-            return (FilterParseResult) { 
-                .res = RESULT_ERR_SQL_PARSE, 
-                .err_msg = "invalid operator in a filter (where clause)"
-            };
-        }
-        cur->op = op;
-        tok = tok->next;
-
-        // WHERE <column> <filterop> <value> [FILTER_REL..]
-        //                           ^     ^
-
-        if (!tok) {
-            filter_free(filters);
-
-            return (FilterParseResult) { 
-                .res = RESULT_ERR_SQL_PARSE, 
-                .err_msg = "expected a value after an operator in a filter (where clause)"
-            };
-        }
-
-        cur->value = strdup(tok->str);
-        tok = tok->next;
-
-        if (!tok) {
-            // .. then we are done
-            return (FilterParseResult) { 
-                .res = RESULT_OK, 
-                .filters = filters,
-                .last_tok = tok,
-            };
-        }
-
-        // .. else we expect an 'AND' or an 'OR'
-        FilterRelation rel = filterrel_from_str(tok->str);
-        if (rel == FILTER_REL_INVALID)  {
-            // We still return OK because a WHERE clause can be followed 
-            // by other things like 'GROUP BY' etc.
-            return (FilterParseResult) { 
-                .res = RESULT_OK, 
-                .filters = filters,
-                .last_tok = tok,
-            };
-        }
-
-        cur->next_relation = rel;
-        tok = tok->next;
-
-        if (!tok) {
-            return (FilterParseResult) { 
-                .res = RESULT_ERR_SQL_PARSE, 
-                .err_msg = "expected another filter condition following 'AND' or 'OR'",
-            };
-        }
-
-        // we expect another filter following this one
-        cur->next = filter_empty();
-        cur = cur->next;
-    }
+    if (*tail)
+        (*tail)->next = first;
+    else
+        parent->children = first;
+    *tail = last;
 }
 
 #define SORT_ASCENDING_STR "ASC"
@@ -362,29 +253,26 @@ const char *sortdirection_to_str(SortDirection direction)
     }
 }
 
-void query_print(Query *query)
+void query_print(const Query *query)
 {
     printf("Query {\n"
            "  type: %s\n"
            "  table_name: %s\n",
            querytype_str(query->type),
            query->table_name);
+    if (query->explain)
+        puts("  explain: true");
 
     switch(query->type) {
         case QUERY_SELECT:
             fputs("  columns: ", stdout);
             strlist_print(query->select_columns);
-            Filter *fcur = query->select_filters;
             fputs("\n  filters: ", stdout);
-            while (fcur) {
-                fputs("\n   ", stdout);
-                filter_print(fcur);
-                fcur = fcur->next;
-            }
-            if (query->select_sort_column) {
-                printf("\n  order by: %s (%s)", 
-                       query->select_sort_column, 
-                       sortdirection_to_str(query->select_sort_direction));
+            if (query->select_filters)
+                filter_print(query->select_filters);
+            for (const SortKey *key = query->select_order; key; key = key->next) {
+                printf(key == query->select_order ? "\n  order by: %s (%s)" : ", %s (%s)",
+                       key->column, sortdirection_to_str(key->direction));
             }
             break;
         case QUERY_CREATE:
@@ -393,20 +281,20 @@ void query_print(Query *query)
             putchar('\n');
             fputs("  column types: ", stdout);
             strlist_print(query->create_types);
+            if (query->create_dict_columns) {
+                fputs("\n  dictionary encoded: ", stdout);
+                strlist_print(query->create_dict_columns);
+            }
             break;
         case QUERY_INSERT:
             fputs("  values: ", stdout);
             strlist_print(query->insert_values);
             break;
-        case QUERY_DELETE: {
-            Filter *fcur = query->delete_filters;
+        case QUERY_DELETE:
             fputs("  filters: ", stdout);
-            while (fcur) {
-                fputs("\n   ", stdout);
-                filter_print(fcur);
-                fcur = fcur->next;
-            }
-        } break;
+            if (query->delete_filters)
+                filter_print(query->delete_filters);
+            break;
         case QUERY_UPDATE: {
             fputs("  column names: ", stdout);
             strlist_print(query->update_columns);
@@ -414,27 +302,57 @@ void query_print(Query *query)
             fputs("  column values: ", stdout);
             strlist_print(query->update_values);
             if (query->update_filters) {
-                Filter *fcur = query->update_filters;
                 fputs("\n  filters: ", stdout);
-                while (fcur) {
-                    fputs("\n   ", stdout);
-                    filter_print(fcur);
-                    fcur = fcur->next;
-                }
+                filter_print(query->update_filters);
             }
         } break;
+        case QUERY_CREATE_INDEX:
+            printf("  index name: %s\n"
+                   "  column: %s\n"
+                   "  kind: %s",
+                   query->index_name,
+                   query->index_column,
+                   query->index_kind ? query->index_kind : "default");
+            break;
+        case QUERY_PREPARE:
+            printf("  name: %s\n"
+                   "  statement: %s",
+                   query->statement_name,
+                   query->prepare_sql);
+            break;
+        case QUERY_EXECUTE:
+            printf("  name: %s\n", query->statement_name);
+            fputs("  parameters: ", stdout);
+            strlist_print(query->execute_params);
+            break;
+        case QUERY_DEALLOCATE:
+            printf("  name: %s", query->statement_name);
+            break;
+        case QUERY_VACUUM:
+        case QUERY_ANALYZE:
+        case QUERY_SAVE:
+        case QUERY_CHECKPOINT:
+            break;
     }
     puts("\n}");
 }
 
-Query *query_new()
+/// An empty query, allocated in an arena of its own
+static Query *query_new()
 {
-    Query *query = malloc(sizeof(Query));
-    if (!query)
+    Arena *arena = arena_new(QUERY_ARENA_BLOCK);
+    if (!arena)
+        return NULL;
+
+    Query *query = arena_alloc(arena, sizeof(Query));
+    if (!query) {
+        arena_free(arena);
         return NULL;
-    
+    }
+
     *query = (Query) {
         .table_name = NULL,
+        .arena = arena,
     };
 
     return query;
@@ -442,121 +360,191 @@ Query *query_new()
 
 void query_free(Query *query)
 {
-    free(query->table_name);
+    // the query itself is in the arena too
+    arena_free(query->arena);
+}
 
-    switch(query->type) {
-        case QUERY_SELECT:
-            if (query->select_columns)
-                strlist_free(query->select_columns);
-            if (query->select_filters)
-                filter_free(query->select_filters);
-            if (query->select_sort_column)
-                free(query->select_sort_column);
-            break;
-        case QUERY_CREATE:
-            if (query->create_columns)
-                strlist_free(query->create_columns);
-            if (query->create_types)
-                strlist_free(query->create_types);
-            break;
-        case QUERY_INSERT:
-            if (query->insert_values)
-                strlist_free(query->insert_values);
-            break;
-        case QUERY_DELETE:
-            if (query->delete_filters)
-                filter_free(query->delete_filters);
+/// Parse a list of names or values: ( item, ... ). [*list] is left NULL for an empty one.
+static QueryParseResult parse_list(Lexer *lex, Arena *arena, StrList **list, const char *error)
+{
+    StrList *tail = NULL;
+
+    // ( item, ... )
+    // ^^
+    EXPECT_TOKEN(lex, TOKEN_LPAREN, error);
+
+    if (lex->token.kind == TOKEN_RPAREN) {
+        lexer_advance(lex);
+        return (QueryParseResult) { .result = RESULT_OK };
+    }
+
+    for (;;) {
+        // ( item, ... )
+        //   ^   ^
+        if (!token_is_text(&lex->token))
+            return PARSE_ERROR_AT(&lex->token, "expected a name or a value in a list");
+        if (!list_append(arena, list, &tail, &lex->token))
+            return PARSE_ALLOC_ERROR;
+        lexer_advance(lex);
+
+        if (lex->token.kind != TOKEN_COMMA)
             break;
-        case QUERY_UPDATE:
-            if (query->update_values)
-                strlist_free(query->update_values);
-            if (query->update_columns)
-                strlist_free(query->update_columns);
-            if (query->update_filters)
-                filter_free(query->update_filters);
-            break; 
+        lexer_advance(lex);
     }
 
-    free(query);
+    // ( item, ... )
+    //             ^
+    EXPECT_TOKEN(lex, TOKEN_RPAREN, "expected a ',' or a ')' after an element of a list");
+
+    return (QueryParseResult) { .result = RESULT_OK };
 }
 
-/// Try to parse a 'WHERE' clause. Returns NULL if the token stream
-/// doesn't contain a valid WHERE
-Filter *try_parse_where(StrList **split)
+static FilterOp filterop_from_token(const Token *token)
 {
-    StrList *tok = *split;
+    if (token->kind == TOKEN_WORD)
+        return token->keyword == KEYWORD_LIKE ? FILTER_LIKE : FILTER_INVALID;
+    if (token->kind != TOKEN_OPERATOR)
+        return FILTER_INVALID;
+
+    bool or_equal = token->length == 2;
+    switch (token->start[0]) {
+        case '=': return FILTER_EQUAL;
+        case '!': return FILTER_NOT_EQUAL;
+        case '>': return or_equal ? FILTER_GREATER_EQUAL : FILTER_GREATER;
+        case '<': return or_equal ? FILTER_LESSER_EQUAL : FILTER_LESSER;
+    }
+    return FILTER_INVALID;
+}
 
-    //  WHERE <filters> 
-    //  ^   ^
+/// How deep parentheses and NOTs can nest in a WHERE clause
+#define FILTER_MAX_DEPTH 64
 
-    if (!tok || !str_ieq(tok->str, "WHERE")) {
-        // not a valid WHERE
-        return NULL;
-    } 
-    tok = tok->next;
+/// Parse a single condition: <column> <filterop> <value>
+static QueryParseResult parse_predicate(Lexer *lex, Arena *arena, Filter **filter)
+{
+    Filter *predicate = filter_new(arena, FILTER_PREDICATE);
+    if (!predicate)
+        return PARSE_ALLOC_ERROR;
+    *filter = predicate;
+
+    // <column> <filterop> <value>
+    // ^      ^
+    EXPECT_TEXT(lex, arena, predicate->column, "expected a column name in a filter (where clause)");
+
+    // <column> <filterop> <value>
+    //          ^        ^
+    predicate->op = filterop_from_token(&lex->token);
+    if (predicate->op == FILTER_INVALID)
+        return PARSE_ERROR("invalid operator in a filter (where clause)");
+    lexer_advance(lex);
+
+    // <column> <filterop> <value>
+    //                     ^     ^
+    predicate->placeholder = token_is_placeholder(&lex->token);
+    EXPECT_TEXT(lex, arena, predicate->value, "expected a value after an operator in a filter (where clause)");
+
+    return (QueryParseResult) { .result = RESULT_OK };
+}
 
-    //  WHERE <filters> 
-    //        ^       ^
+static QueryParseResult parse_filter_chain(Lexer *lex, Arena *arena, Filter **filter, int depth, FilterKind kind);
+
+/// Parse a condition, a negated one or a parenthesized group of them
+static QueryParseResult parse_filter_operand(Lexer *lex, Arena *arena, Filter **filter, int depth)
+{
+    if (depth > FILTER_MAX_DEPTH)
+        return PARSE_ERROR("conditions nested too deeply in a filter (where clause)");
+
+    // NOT <operand>
+    if (lex->token.kind == TOKEN_WORD && lex->token.keyword == KEYWORD_NOT) {
+        lexer_advance(lex);
 
-    // TODO: this filter parsing is _very_ primitive. We should honor parenthesis 
-    // and build a tree from this in the future.
+        Filter *not = filter_new(arena, FILTER_NOT);
+        if (!not)
+            return PARSE_ALLOC_ERROR;
+        *filter = not;
 
-    FilterParseResult fpr = parse_filters(tok);
-    if (fpr.res != RESULT_OK) {
-        // TODO remove this silly unwrap
-        FATAL("filter parse error: %s", fpr.err_msg);
+        return parse_filter_operand(lex, arena, &not->children, depth + 1);
     }
 
-    *split = fpr.last_tok;
-    return fpr.filters;
-}
+    // ( <conditions> )
+    if (lex->token.kind == TOKEN_LPAREN) {
+        lexer_advance(lex);
 
-typedef struct OrderParseResult {
-    BazaResult result;
-    SortDirection direction;
-    char *column;
-} OrderParseResult;
+        QueryParseResult res = parse_filter_chain(lex, arena, filter, depth + 1, FILTER_OR);
+        if (res.result != RESULT_OK)
+            return res;
 
-OrderParseResult try_parse_order(StrList **split)
+        EXPECT_TOKEN(lex, TOKEN_RPAREN, "expected a ')' closing a group of conditions in a filter (where clause)");
+        return (QueryParseResult) { .result = RESULT_OK };
+    }
+
+    return parse_predicate(lex, arena, filter);
+}
+
+/// Parse operands joined by ORs, or by ANDs if [kind] is FILTER_AND. AND binds
+/// tighter than OR, so the operands of an OR are chains of ANDs.
+static QueryParseResult parse_filter_chain(Lexer *lex, Arena *arena, Filter **filter, int depth, FilterKind kind)
 {
-    StrList *tok = *split;
+    Keyword keyword = kind == FILTER_OR ? KEYWORD_OR : KEYWORD_AND;
+    Filter *parent = NULL, *tail = NULL;
 
-    OrderParseResult ret = (OrderParseResult) {
-        .direction = SORT_INVALID,
-        .column = NULL,
-        .result = RESULT_ERR_SQL_PARSE
-    };
+    for (;;) {
+        Filter *operand = NULL;
+        QueryParseResult res = kind == FILTER_OR
+            ? parse_filter_chain(lex, arena, &operand, depth, FILTER_AND)
+            : parse_filter_operand(lex, arena, &operand, depth);
+        if (res.result != RESULT_OK)
+            return res;
+
+        bool more = lex->token.kind == TOKEN_WORD && lex->token.keyword == keyword;
+
+        // a single operand is not wrapped
+        if (!parent && !more) {
+            *filter = operand;
+            return res;
+        }
 
-    //  ORDER BY <column> <direction>
-    //  ^      ^
-    if (!tok || !str_ieq(tok->str, "ORDER"))
-        return ret;
-    tok = tok->next;
-
-    if (!tok || !str_ieq(tok->str, "BY"))
-        return ret;
-    tok = tok->next;
-
-    //  ORDER BY <column> <direction>
-    //           ^      ^
-    if (!tok)
-        return ret;
-    ret.column = strdup(tok->str);
-    tok = tok->next;
-
-    //  ORDER BY <column> <direction>
-    //                    ^         ^
-    if (!tok) {
-        free(ret.column);
-        return ret;
+        if (!parent) {
+            if (!(parent = filter_new(arena, kind)))
+                return PARSE_ALLOC_ERROR;
+            *filter = parent;
+        }
+        filter_adopt(parent, &tail, operand);
+
+        // anything else is left to the caller, a WHERE clause
+        // can be followed by 'ORDER BY' etc.
+        if (!more)
+            return res;
+        lexer_advance(lex);
     }
-    
-    ret.direction = sortdirection_from_str(tok->str);
-    tok = tok->next;
-    
-    *split = tok;
-    ret.result = RESULT_OK;
-    return ret;
+}
+
+/// Parse an optional 'WHERE' clause into [*filters]
+static QueryParseResult parse_where(Lexer *lex, Arena *arena, Filter **filters)
+{
+    //  WHERE <filters>
+    //  ^   ^
+    if (lex->token.kind != TOKEN_WORD || lex->token.keyword != KEYWORD_WHERE)
+        return (QueryParseResult) { .result = RESULT_OK };
+    if (*filters)
+        return PARSE_ERROR("more than one WHERE clause");
+    lexer_advance(lex);
+
+    //  WHERE <filters>
+    //        ^       ^
+    return parse_filter_chain(lex, arena, filters, 0, FILTER_OR);
+}
+
+/// Checks that nothing follows the end of the statement
+static QueryParseResult parse_end(Lexer *lex, Query *query)
+{
+    if (lex->token.kind != TOKEN_END)
+        return PARSE_ERROR_AT(&lex->token, "unexpected text after the end of the statement");
+
+    return (QueryParseResult) {
+        .result = RESULT_OK,
+        .query = query,
+    };
 }
 
 /// Parse a "SELECT" query
@@ -564,74 +552,135 @@ OrderParseResult try_parse_order(StrList **split)
 ///    SELECT * FROM table;
 ///    SELECT * FROM table WHERE name = 'Bob';
 ///    SELECT name, age FROM table WHERE name = 'Bob';
-QueryParseResult query_parse_select(Query *query, StrList *split)
+///    SELECT name, age FROM table ORDER BY age DESC;
+///    SELECT name, age FROM table ORDER BY age DESC, name;
+static QueryParseResult query_parse_select(Query *query, Lexer *lex)
 {
     query->type = QUERY_SELECT;
     query->select_columns = NULL;
     query->select_filters = NULL;
-    query->select_sort_column = NULL;
-
-    StrList *tok = split;
-    EXPECT_TOKEN(tok, "Empty SELECT clause, no column names provided");
+    query->select_order = NULL;
 
     // SELECT <columns> FROM <table>
     //        ^       ^
-    if (!strcmp(tok->str, "*")) {
+    if (lex->token.kind == TOKEN_WORD && token_is(&lex->token, "*")) {
         query->select_columns = NULL;
-        tok = tok->next;
+        lexer_advance(lex);
     } else {
-        ListParseResult lpr = extract_sql_list(tok, NULL);
-
-        if (lpr.res == RESULT_OK) {
-            query->select_columns = lpr.list;
-        } else {
-            return (QueryParseResult) {
-                .result = RESULT_ERR_SQL_PARSE,
-                .error_msg = lpr.error_msg,
-            };
+        StrList *tail = NULL;
+        for (;;) {
+            if (!token_is_text(&lex->token))
+                return PARSE_ERROR_AT(&lex->token, "Empty SELECT clause, no column names provided");
+            if (!list_append(query->arena, &query->select_columns, &tail, &lex->token))
+                return PARSE_ALLOC_ERROR;
+            lexer_advance(lex);
+
+            if (lex->token.kind != TOKEN_COMMA)
+                break;
+            lexer_advance(lex);
         }
-
-        tok = lpr.outer_last;
     }
 
     // SELECT <columns> FROM <table>
     //                  ^  ^
-    EXPECT_KEYWORD(tok, "from", "expected FROM after a column list");
-    
+    EXPECT_KEYWORD(lex, KEYWORD_FROM, "expected FROM after a column list");
+
     // SELECT <columns> FROM <table>
     //                       ^     ^
+    EXPECT_TEXT(lex, query->arena, query->table_name, "expected a table name after FROM in a SELECT");
 
-    EXPECT_VARIABLE(tok, query->table_name, strdup(tok->str), "expected a table name after FROM in a SELECT");
-
-
-    // [Optional] scan for WHERE and ORDER BY (might appear in any order)
+    // [Optional] WHERE and ORDER BY (might appear in any order)
     // SELECT (...) WHERE/ORDER BY
     //              ^            ^
-    while (tok) {
-        Filter *filters = try_parse_where(&tok);
-        // TODO: check for duplicate matches?
-        if (filters)
-            query->select_filters = filters;
-
-        OrderParseResult opres = try_parse_order(&tok);
-        if (opres.result == RESULT_OK) {
-            if (opres.direction == SORT_INVALID) {
-                free(opres.column);
-                return (QueryParseResult) {
-                    .result = RESULT_ERR_SQL_PARSE,
-                    .error_msg = "invalid sort direction, must be one of (ASC/DESC)",
-                };
-            }
+    while (lex->token.kind == TOKEN_WORD) {
+        if (lex->token.keyword == KEYWORD_WHERE) {
+            QueryParseResult res = parse_where(lex, query->arena, &query->select_filters);
+            if (res.result != RESULT_OK)
+                return res;
+        } else if (lex->token.keyword == KEYWORD_ORDER) {
+            if (query->select_order)
+                return PARSE_ERROR("more than one ORDER BY clause");
+            lexer_advance(lex);
+
+            //  ORDER BY <column> [direction], ...
+            //        ^^
+            EXPECT_KEYWORD(lex, KEYWORD_BY, "expected BY after ORDER");
+
+            SortKey **link = &query->select_order;
+            for (;;) {
+                SortKey *key = arena_alloc(query->arena, sizeof(SortKey));
+                if (!key)
+                    return PARSE_ALLOC_ERROR;
+                *key = (SortKey) { .direction = SORT_ASCENDING, .next = NULL };
+                *link = key;
+                link = &key->next;
+
+                //  ORDER BY <column> [direction], ...
+                //           ^      ^
+                EXPECT_TEXT(lex, query->arena, key->column, "expected a column name after ORDER BY");
+
+                //  ORDER BY <column> [direction], ...
+                //                    ^         ^
+                if (lex->token.kind == TOKEN_WORD && lex->token.keyword == KEYWORD_DESC) {
+                    key->direction = SORT_DESCENDING;
+                    lexer_advance(lex);
+                } else if (lex->token.kind == TOKEN_WORD && lex->token.keyword == KEYWORD_ASC) {
+                    lexer_advance(lex);
+                }
 
-            query->select_sort_column = opres.column;
-            query->select_sort_direction = opres.direction;
+                //  ORDER BY <column> [direction], ...
+                //                               ^
+                if (lex->token.kind != TOKEN_COMMA)
+                    break;
+                lexer_advance(lex);
+            }
+        } else {
+            break;
         }
     }
 
-    return (QueryParseResult) {
-        .result = RESULT_OK,
-        .query = query,
-    };
+    return parse_end(lex, query);
+}
+
+/// Examples of valid CREATE INDEX queries:
+/// CREATE INDEX idx_name ON TableName (column)
+/// CREATE INDEX idx_name ON TableName ( column )
+/// CREATE INDEX idx_name ON TableName (column) USING btree
+static QueryParseResult query_parse_create_index(Query *query, Lexer *lex)
+{
+    query->type = QUERY_CREATE_INDEX;
+    query->index_name = NULL;
+    query->index_column = NULL;
+    query->index_kind = NULL;
+
+    // CREATE INDEX idx_name ON TableName (column)
+    //              ^      ^
+    EXPECT_TEXT(lex, query->arena, query->index_name, "expected an index name after INDEX");
+
+    // CREATE INDEX idx_name ON TableName (column)
+    //                       ^^
+    EXPECT_KEYWORD(lex, KEYWORD_ON, "expected ON after the index name");
+
+    // CREATE INDEX idx_name ON TableName (column)
+    //                          ^       ^
+    EXPECT_TEXT(lex, query->arena, query->table_name, "expected a table name after ON");
+
+    // CREATE INDEX idx_name ON TableName (column)
+    //                                    ^      ^
+    const char *error = "an index must be created over exactly one column";
+    EXPECT_TOKEN(lex, TOKEN_LPAREN, "expected a '(column)' after the table name");
+    EXPECT_TEXT(lex, query->arena, query->index_column, error);
+    EXPECT_TOKEN(lex, TOKEN_RPAREN, error);
+
+    // [Optional]
+    // CREATE INDEX idx_name ON TableName (column) USING kind
+    //                                             ^   ^
+    if (lex->token.kind == TOKEN_WORD && lex->token.keyword == KEYWORD_USING) {
+        lexer_advance(lex);
+        EXPECT_TEXT(lex, query->arena, query->index_kind, "expected an index kind after USING");
+    }
+
+    return parse_end(lex, query);
 }
 
 /// Examples of valid CREATE queries:
@@ -640,94 +689,76 @@ QueryParseResult query_parse_select(Query *query, StrList *split)
 ///     FavoriteNumber int64
 /// )
 ///
-/// CREATE TABLE TableName 
+/// CREATE TABLE TableName
 /// (
-///     Name string,
+///     Name string DICT,
 ///     FavoriteNumber int64
 /// )
-QueryParseResult query_parse_create(Query *query, StrList *split)
+static QueryParseResult query_parse_create(Query *query, Lexer *lex)
 {
+    if (lex->token.kind == TOKEN_WORD && lex->token.keyword == KEYWORD_INDEX) {
+        lexer_advance(lex);
+        return query_parse_create_index(query, lex);
+    }
+
     query->type = QUERY_CREATE;
     query->create_columns = NULL;
     query->create_types = NULL;
-
-    StrList *tok = split;
+    query->create_dict_columns = NULL;
 
     // CREATE TABLE TableName (
     //        ^   ^
-    EXPECT_KEYWORD(tok, "table", "expected TABLE after CREATE");
+    EXPECT_KEYWORD(lex, KEYWORD_TABLE, "expected TABLE after CREATE");
 
     // CREATE TABLE TableName (
     //              ^       ^
-    // (...)
-    //    Column type{,}
-    // (...)
-    // )
-    //
-    EXPECT_VARIABLE(tok, query->table_name, strdup(tok->str), "expected a table name after TABLE");
-
-    // TODO: replace the following section by an extract_sql_list()?
+    EXPECT_TEXT(lex, query->arena, query->table_name, "expected a table name after TABLE");
 
     // CREATE TABLE TableName (
     //                        ^
-
-    // sure.. "(" is a keyword!
-    EXPECT_KEYWORD(tok, "(", "expected a '(' after the table name. Forgot a space?");
+    EXPECT_TOKEN(lex, TOKEN_LPAREN, "expected a '(' after the table name");
 
     // CREATE TABLE TableName (
     // (...)
-    //    Column type{,}
-    //    ^            ^
+    //    Column type [DICT]{,}
+    //    ^                   ^
     // (...)
     // )
-
-    query->create_columns = NULL;
-    query->create_types = NULL;
-
+    StrList *columns_tail = NULL, *types_tail = NULL, *dict_tail = NULL;
     for (;;) {
-        // 1) parse the column name
-        if (!tok) {
-            return (QueryParseResult) {
-                .result = RESULT_ERR_SQL_PARSE,
-                .error_msg = "inside of column definition section of a"
-                             "CREATE statement; expected a column name"
-            };
+        // 1) the column name
+        if (!token_is_text(&lex->token)) {
+            return PARSE_ERROR_AT(&lex->token,
+                                  "inside of column definition section of a "
+                                  "CREATE statement; expected a column name. "
+                                  "Perhaps you forgot to remove a comma from the "
+                                  "last Column-Type pair?");
         }
-
-        if (!query->create_columns)
-            query->create_columns = strlist_new(tok->str);
-        else
-            strlist_push(query->create_columns, tok->str);
-
-        tok = tok->next;
-
-        // 2) parse the type name
-        if (!tok) {
-            return (QueryParseResult) {
-                .result = RESULT_ERR_SQL_PARSE,
-                .error_msg = "inside of column definition section of a "
-                             "CREATE statement; expected a column name. "
-                             "Perhaps you forgot to remove a comma from the "
-                             "last Column-Type pair?"
-            };
+        Token name = lex->token;
+        if (!list_append(query->arena, &query->create_columns, &columns_tail, &name))
+            return PARSE_ALLOC_ERROR;
+        lexer_advance(lex);
+
+        // 2) the type name
+        if (!token_is_text(&lex->token)) {
+            return PARSE_ERROR_AT(&lex->token,
+                                  "inside of column definition section of a "
+                                  "CREATE statement; expected a type after the column name");
         }
-
-        bool has_comma = false;
-        if (tok->strlen > 0 && tok->str[tok->strlen-1] == ',') {
-            tok->str[tok->strlen-1] = 0;
-            has_comma = true;
+        if (!list_append(query->arena, &query->create_types, &types_tail, &lex->token))
+            return PARSE_ALLOC_ERROR;
+        lexer_advance(lex);
+
+        // 3) the optional DICT option (dictionary encoding)
+        if (lex->token.kind == TOKEN_WORD && lex->token.keyword == KEYWORD_DICT) {
+            if (!list_append(query->arena, &query->create_dict_columns, &dict_tail, &name))
+                return PARSE_ALLOC_ERROR;
+            lexer_advance(lex);
         }
 
-        if (!query->create_types)
-            query->create_types = strlist_new(tok->str);
-        else
-            strlist_push(query->create_types, tok->str);
-        
-        if (!has_comma) {
-            tok = tok->next;
+        if (lex->token.kind != TOKEN_COMMA)
             break;
-        }
-        tok = tok->next;
+        lexer_advance(lex);
     }
 
     // CREATE TABLE TableName (
@@ -736,171 +767,190 @@ QueryParseResult query_parse_create(Query *query, StrList *split)
     // (...)
     // )
     // ^
+    EXPECT_TOKEN(lex, TOKEN_RPAREN, "expected a ')' after the column definition section");
 
-    // sure.. ")" is a keyword!
-    EXPECT_KEYWORD(tok, ")", "expected a ')' after the column definition section");
-
-    return (QueryParseResult) {
-        .result = RESULT_OK,
-        .query = query,
-    };
+    return parse_end(lex, query);
 }
 
 /// Examples of valid INSERT queries:
 /// INSERT INTO table_name VALUES (5, "witam", 7)
 /// INSERT INTO table_name VALUES ( 5, "witam", 7 )
-QueryParseResult query_parse_insert(Query *query, StrList *split)
+static QueryParseResult query_parse_insert(Query *query, Lexer *lex)
 {
     query->type = QUERY_INSERT;
     query->insert_values = NULL;
 
-    StrList *tok = split;
-
     // INSERT INTO table_name VALUES (...)
     //        ^  ^
-    EXPECT_KEYWORD(tok, "into", "expected INTO after INSERT");
+    EXPECT_KEYWORD(lex, KEYWORD_INTO, "expected INTO after INSERT");
 
     // INSERT INTO table_name VALUES (...)
     //             ^        ^
-    EXPECT_VARIABLE(tok, query->table_name, strdup(tok->str), 
-                    "expected a table name after INTO in an INSERT statement");
+    EXPECT_TEXT(lex, query->arena, query->table_name, "expected a table name after INTO in an INSERT statement");
 
     // INSERT INTO table_name VALUES (...)
     //                        ^    ^
-    EXPECT_KEYWORD(tok, "values", "expected VALUES after the table name");
+    EXPECT_KEYWORD(lex, KEYWORD_VALUES, "expected VALUES after the table name");
 
     // INSERT INTO table_name VALUES (...)
     //                               ^   ^
-    ListParseResult lpr = extract_sql_list(tok, "()");
-    if (lpr.res == RESULT_OK) {
-        query->insert_values = lpr.list;
-    } else {
-        return (QueryParseResult) {
-            .result = RESULT_ERR_SQL_PARSE,
-            .error_msg = lpr.error_msg,
-        };
-    }
-
-    return (QueryParseResult) {
-        .result = RESULT_OK,
-        .query = query,
-    };
+    QueryParseResult res = parse_list(lex, query->arena, &query->insert_values,
+                                      "Expected a list of values after VALUES");
+    if (res.result != RESULT_OK)
+        return res;
+    if (!query->insert_values)
+        return PARSE_ERROR("expected at least one value in an INSERT statement");
+
+    return parse_end(lex, query);
 }
 
-QueryParseResult query_parse_delete(Query *query, StrList *split)
+static QueryParseResult query_parse_delete(Query *query, Lexer *lex)
 {
     query->type = QUERY_DELETE;
     query->delete_filters = NULL;
 
-    StrList *tok = split;
-
-    // DELETE FROM table WHERE conditions 
+    // DELETE FROM table WHERE conditions
     //        ^  ^
-    EXPECT_KEYWORD(tok, "from", "expected FROM after DELETE");
+    EXPECT_KEYWORD(lex, KEYWORD_FROM, "expected FROM after DELETE");
 
-    // DELETE FROM table WHERE conditions 
+    // DELETE FROM table WHERE conditions
     //             ^   ^
-    EXPECT_VARIABLE(tok, query->table_name, strdup(tok->str), "expected a table name after FROM in DELETE");
+    EXPECT_TEXT(lex, query->arena, query->table_name, "expected a table name after FROM in DELETE");
 
     // [Optional] (if no where clause is specified, this query deletes all rows)
-    // DELETE FROM table WHERE conditions 
+    // DELETE FROM table WHERE conditions
     //                   ^   ^
+    QueryParseResult res = parse_where(lex, query->arena, &query->delete_filters);
+    if (res.result != RESULT_OK)
+        return res;
 
-    Filter *filters = try_parse_where(&tok);
-    if (filters)
-        query->delete_filters = filters;
-
-    return (QueryParseResult) {
-        .result = RESULT_OK,
-        .query = query,
-    };
+    return parse_end(lex, query);
 }
 
-QueryParseResult query_parse_update(Query *query, StrList *split)
+static QueryParseResult query_parse_update(Query *query, Lexer *lex)
 {
     query->type = QUERY_UPDATE;
     query->update_filters = NULL;
     query->update_columns = NULL;
     query->update_values = NULL;
 
-    StrList *tok = split;
-
     // UPDATE table SET column = value, ... WHERE condition/filter
-    //        ^   ^ 
-    EXPECT_VARIABLE(tok, query->table_name, strdup(tok->str), "expected a table name UPDATE");
+    //        ^   ^
+    EXPECT_TEXT(lex, query->arena, query->table_name, "expected a table name UPDATE");
 
     // UPDATE table SET column = value, ... WHERE condition/filter
-    //              ^ ^ 
-    EXPECT_KEYWORD(tok, "set", "expected SET after table name in UPDATE");
-
-    StrList *columns = strlist_empty();
-    StrList *values = strlist_empty();
+    //              ^ ^
+    EXPECT_KEYWORD(lex, KEYWORD_SET, "expected SET after table name in UPDATE");
 
+    StrList *columns_tail = NULL, *values_tail = NULL;
     for (;;) {
         // SET column = value, ... WHERE condition/filter
-        //     ^    ^ 
-        if (!tok) {
-            strlist_free(columns);
-            strlist_free(values);
-
-            return (QueryParseResult) {
-                .result = RESULT_ERR_SQL_PARSE,
-                .error_msg = "expected a column name in a SET assignment",
-            };
-        }
+        //     ^    ^
+        if (!token_is_text(&lex->token))
+            return PARSE_ERROR_AT(&lex->token, "expected a column name in a SET assignment");
+        if (!list_append(query->arena, &query->update_columns, &columns_tail, &lex->token))
+            return PARSE_ALLOC_ERROR;
+        lexer_advance(lex);
 
-        strlist_push(columns, tok->str);
-        tok = tok->next;
+        // SET column = value, ... WHERE condition/filter
+        //            ^
+        if (lex->token.kind != TOKEN_OPERATOR || !token_is(&lex->token, "="))
+            return PARSE_ERROR("expected '=' after column name in a SET assignment");
+        lexer_advance(lex);
 
         // SET column = value, ... WHERE condition/filter
-        //            ^ 
+        //              ^   ^
+        if (!token_is_text(&lex->token))
+            return PARSE_ERROR_AT(&lex->token, "expected a value in a SET assignment");
+        if (!list_append(query->arena, &query->update_values, &values_tail, &lex->token))
+            return PARSE_ALLOC_ERROR;
+        lexer_advance(lex);
+
+        if (lex->token.kind != TOKEN_COMMA)
+            break;
+        lexer_advance(lex);
+    }
 
-        if (!tok || !str_ieq(tok->str, "=")) {
-            strlist_free(columns);
-            strlist_free(values);
+    // [Optional]
+    // UPDATE table SET column = value, ... WHERE condition/filter
+    //                                      ^   ^
+    QueryParseResult res = parse_where(lex, query->arena, &query->update_filters);
+    if (res.result != RESULT_OK)
+        return res;
 
-            return (QueryParseResult) {
-                .result = RESULT_ERR_SQL_PARSE,
-                .error_msg = "expected '=' after column name in a SET assignment",
-            };
-        }
+    return parse_end(lex, query);
+}
 
-        tok = tok->next;
+/// VACUUM table_name
+static QueryParseResult query_parse_vacuum(Query *query, Lexer *lex)
+{
+    query->type = QUERY_VACUUM;
 
-        // SET column = value, ... WHERE condition/filter
-        //              ^   ^ 
+    // VACUUM table_name
+    //        ^        ^
+    EXPECT_TEXT(lex, query->arena, query->table_name, "expected a table name after VACUUM");
 
-        if (!tok) {
-            strlist_free(columns);
-            strlist_free(values);
+    return parse_end(lex, query);
+}
 
-            return (QueryParseResult) {
-                .result = RESULT_ERR_SQL_PARSE,
-                .error_msg = "expected a column name in a SET assignment",
-            };
-        }
+/// ANALYZE table_name
+static QueryParseResult query_parse_analyze(Query *query, Lexer *lex)
+{
+    query->type = QUERY_ANALYZE;
 
-        strlist_push(values, tok->str);
+    // ANALYZE table_name
+    //         ^        ^
+    EXPECT_TEXT(lex, query->arena, query->table_name, "expected a table name after ANALYZE");
 
-        if (tok->strlen && tok->str[tok->strlen-1] != ',') {
-            // no comma, break
-            tok = tok->next;
-            break;
-        }
+    return parse_end(lex, query);
+}
 
-        tok = tok->next;
-    }
+/// SAVE table_name
+static QueryParseResult query_parse_save(Query *query, Lexer *lex)
+{
+    query->type = QUERY_SAVE;
 
-    query->update_columns = columns;
-    query->update_values = values;
+    // SAVE table_name
+    //      ^        ^
+    EXPECT_TEXT(lex, query->arena, query->table_name, "expected a table name after SAVE");
 
-    // [Optional]
-    // UPDATE table SET column = value, ... WHERE condition/filter
-    //                                      ^   ^ 
+    return parse_end(lex, query);
+}
 
-    Filter *filter = try_parse_where(&tok);
-    if (filter)
-        query->update_filters = filter;
+/// CHECKPOINT
+static QueryParseResult query_parse_checkpoint(Query *query, Lexer *lex)
+{
+    query->type = QUERY_CHECKPOINT;
+
+    return parse_end(lex, query);
+}
+
+/// PREPARE name AS statement
+/// The statement is kept as text, to be parsed by whoever prepares it
+static QueryParseResult query_parse_prepare(Query *query, Lexer *lex)
+{
+    query->type = QUERY_PREPARE;
+    query->statement_name = NULL;
+    query->prepare_sql = NULL;
+    query->execute_params = NULL;
+
+    // PREPARE name AS statement
+    //         ^  ^
+    EXPECT_TEXT(lex, query->arena, query->statement_name, "expected a statement name after PREPARE");
+
+    // PREPARE name AS statement
+    //              ^^
+    if (lex->token.kind != TOKEN_WORD || lex->token.keyword != KEYWORD_AS)
+        return PARSE_ERROR("expected AS after the statement name");
+
+    // PREPARE name AS statement
+    //                 ^       ^
+    // the rest of the text, as it was written
+    const char *body = lex->pos + strspn(lex->pos, " \t\n\r");
+    if (!*body)
+        return PARSE_ERROR("expected a statement after AS");
+    if (!(query->prepare_sql = arena_strdup(query->arena, body)))
+        return PARSE_ALLOC_ERROR;
 
     return (QueryParseResult) {
         .result = RESULT_OK,
@@ -908,7 +958,46 @@ QueryParseResult query_parse_update(Query *query, StrList *split)
     };
 }
 
-#define PARSE_SPLIT_STRING " \t\n"
+/// EXECUTE name
+/// EXECUTE name (value, ...)
+static QueryParseResult query_parse_execute(Query *query, Lexer *lex)
+{
+    query->type = QUERY_EXECUTE;
+    query->statement_name = NULL;
+    query->prepare_sql = NULL;
+    query->execute_params = NULL;
+
+    // EXECUTE name (value, ...)
+    //         ^  ^
+    EXPECT_TEXT(lex, query->arena, query->statement_name, "expected a statement name after EXECUTE");
+
+    // [Optional]
+    // EXECUTE name (value, ...)
+    //              ^          ^
+    if (lex->token.kind != TOKEN_END) {
+        QueryParseResult res = parse_list(lex, query->arena, &query->execute_params,
+                                          "Expected a list of values after the statement name");
+        if (res.result != RESULT_OK)
+            return res;
+    }
+
+    return parse_end(lex, query);
+}
+
+/// DEALLOCATE name
+static QueryParseResult query_parse_deallocate(Query *query, Lexer *lex)
+{
+    query->type = QUERY_DEALLOCATE;
+    query->statement_name = NULL;
+    query->prepare_sql = NULL;
+    query->execute_params = NULL;
+
+    // DEALLOCATE name
+    //            ^  ^
+    EXPECT_TEXT(lex, query->arena, query->statement_name, "expected a statement name after DEALLOCATE");
+
+    return parse_end(lex, query);
+}
 
 QueryParseResult query_parse(const char *query_string)
 {
@@ -916,39 +1005,49 @@ QueryParseResult query_parse(const char *query_string)
     if (!query)
         return (QueryParseResult) { .result = RESULT_ALLOC };
 
-    // split the string on whitespace (and newlines)
-    StrList *split = strlist_from_split_quoted(query_string, PARSE_SPLIT_STRING);
+    Lexer lex;
+    lexer_init(&lex, query_string);
 
     QueryParseResult parse_result;
-    char *verb = split->str;
-
-    if (str_ieq(verb, "select")) {
-        parse_result = query_parse_select(query, split->next);
-    } else if (str_ieq(verb, "create")) {
-        parse_result = query_parse_create(query, split->next);
-    } else if (str_ieq(verb, "insert")) {
-        parse_result = query_parse_insert(query, split->next);
-    } else if (str_ieq(verb, "delete")) {
-        parse_result = query_parse_delete(query, split->next);
-    } else if (str_ieq(verb, "update")) {
-        parse_result = query_parse_update(query, split->next);
-    } else {
-        parse_result = (QueryParseResult) {
-            .result = RESULT_ERR_SQL_PARSE,
-            .error_msg = "Unknown SQL command"
-        };
+    Keyword verb = lex.token.kind == TOKEN_WORD ? lex.token.keyword : KEYWORD_NONE;
+    lexer_advance(&lex);
+
+    // EXPLAIN SELECT|DELETE|UPDATE ...
+    //         ^
+    if (verb == KEYWORD_EXPLAIN) {
+        query->explain = true;
+        verb = lex.token.kind == TOKEN_WORD ? lex.token.keyword : KEYWORD_NONE;
+        lexer_advance(&lex);
+
+        if (verb != KEYWORD_SELECT && verb != KEYWORD_DELETE && verb != KEYWORD_UPDATE)
+            verb = KEYWORD_NONE;
+    }
+
+    switch (verb) {
+        case KEYWORD_SELECT: parse_result = query_parse_select(query, &lex); break;
+        case KEYWORD_CREATE: parse_result = query_parse_create(query, &lex); break;
+        case KEYWORD_INSERT: parse_result = query_parse_insert(query, &lex); break;
+        case KEYWORD_DELETE: parse_result = query_parse_delete(query, &lex); break;
+        case KEYWORD_UPDATE: parse_result = query_parse_update(query, &lex); break;
+        case KEYWORD_VACUUM: parse_result = query_parse_vacuum(query, &lex); break;
+        case KEYWORD_ANALYZE: parse_result = query_parse_analyze(query, &lex); break;
+        case KEYWORD_SAVE: parse_result = query_parse_save(query, &lex); break;
+        case KEYWORD_CHECKPOINT: parse_result = query_parse_checkpoint(query, &lex); break;
+        case KEYWORD_PREPARE: parse_result = query_parse_prepare(query, &lex); break;
+        case KEYWORD_EXECUTE: parse_result = query_parse_execute(query, &lex); break;
+        case KEYWORD_DEALLOCATE: parse_result = query_parse_deallocate(query, &lex); break;
+        default:
+            parse_result = query->explain ? PARSE_ERROR("expected SELECT, DELETE or UPDATE after EXPLAIN")
+                                          : PARSE_ERROR("Unknown SQL command");
+            break;
     }
 
     if (parse_result.result != RESULT_OK) {
-        // free the query since we are not returning it
+        // free the query since we are not returning it, along with
+        // anything that was parsed into its arena
         query_free(query);
     }
 
-    // the query_parse_<whatever> functions create their own copies
-    // of the strings that they require, so it is ok the free
-    // the entire thing
-    strlist_free(split);
-
     return parse_result;
 }
 
@@ -4,6 +4,7 @@
 #ifndef _PARSER_H
 #define _PARSER_H
 
+#include "util/arena.h"
 #include "util/str.h"
 #include "util/result.h"
 
@@ -13,6 +14,14 @@ typedef enum {
     QUERY_INSERT,
     QUERY_DELETE,
     QUERY_UPDATE,
+    QUERY_CREATE_INDEX,
+    QUERY_VACUUM,
+    QUERY_ANALYZE,
+    QUERY_SAVE,
+    QUERY_CHECKPOINT,
+    QUERY_PREPARE,
+    QUERY_EXECUTE,
+    QUERY_DEALLOCATE,
 } QueryType;
 
 const char *querytype_str(QueryType type);
@@ -32,25 +41,28 @@ typedef enum FilterOp {
 const char *filterop_to_str(FilterOp op);
 FilterOp filterop_from_str(const char *str);
 
-typedef enum FilterRelation {
-    FILTER_REL_INVALID,
-    FILTER_REL_NONE,
-    FILTER_REL_AND,
-    FILTER_REL_OR,
-} FilterRelation;
-
-const char *filterrel_to_str(FilterRelation relation);
-FilterRelation filterrel_from_str(const char *str);
+typedef enum FilterKind {
+    FILTER_PREDICATE, // [column] [op] [value]
+    FILTER_AND,       // all of [children]
+    FILTER_OR,        // any of [children]
+    FILTER_NOT,       // not its only child
+} FilterKind;
 
+/// A WHERE clause, as a tree of conditions. AND and OR take any number (at least
+/// two) of children, in the order they were written: nested ANDs (ORs) are merged
+/// into a single one, so the children of an AND are never ANDs themselves.
 typedef struct Filter {
+    FilterKind kind;
     FilterOp op;
     char *value;
+    bool placeholder; // [value] is an unquoted ?, a parameter of a prepared statement
     char *column;
-    FilterRelation next_relation;
-    struct Filter *next;
+    struct Filter *children;
+    struct Filter *next; // the next child of the same parent
 } Filter;
 
-void filter_print(Filter *filter);
+/// Print [filter] as an expression, with every nested AND and OR in parentheses
+void filter_print(const Filter *filter);
 
 typedef enum SortDirection {
     SORT_ASCENDING,
@@ -61,27 +73,37 @@ typedef enum SortDirection {
 SortDirection sortdirection_from_str(const char *str);
 const char *sortdirection_to_str(SortDirection direction);
 
+/// A key of ORDER BY. Rows equal in it are ordered by the next one.
+typedef struct SortKey {
+    char *column;
+    SortDirection direction;
+    struct SortKey *next;
+} SortKey;
+
 /// Internal server-side representation of a query.
-/// In order to avoid free-releated errors, we assume that
-/// the query struct owns all the memory/pointers in its body
-/// and is responsible for freeing them.
+/// A parsed query, its strings, lists and filters are all allocated
+/// in its arena and released together by query_free. Queries put
+/// together by hand have no arena and are freed by whoever made them.
 typedef struct Query {
     QueryType type; 
+    Arena *arena;
+    bool explain; // EXPLAIN: show the plan of a SELECT, DELETE or UPDATE instead of running it
     char *table_name;
     union {
         struct { // QUERY_SELECT
             Filter *select_filters;
             StrList *select_columns;
-            char *select_sort_column;
-            SortDirection select_sort_direction;
+            SortKey *select_order; // NULL without ORDER BY
         };
         struct { // QUERY_CREATE
             // names and types of columns, might be merged
             // into a single list in the future
             StrList *create_columns;
             StrList *create_types;
+            // columns declared with the DICT option, NULL if none were
+            StrList *create_dict_columns;
         };
-        struct { // QUERY_CREATE
+        struct { // QUERY_INSERT
             StrList *insert_values;
             // columns will be added in future versions where
             // we will support null values. Since we do not, all
@@ -96,10 +118,24 @@ typedef struct Query {
             StrList *update_columns;
             StrList *update_values;
         };
+        struct { // QUERY_CREATE_INDEX
+            char *index_name;
+            char *index_column;
+            char *index_kind; // NULL if no USING clause was given
+        };
+        struct { // QUERY_PREPARE, QUERY_EXECUTE, QUERY_DEALLOCATE
+            char *statement_name;
+            // PREPARE: the text of the statement, parsed when it is prepared
+            // (see statement.h), with a '?' in place of every parameter value
+            char *prepare_sql;
+            // EXECUTE: the values of the parameters, NULL if none were given
+            StrList *execute_params;
+        };
     };
 } Query;
 
-void query_print(Query *query);
+void query_print(const Query *query);
+/// Free a query returned by query_parse, all of it at once
 void query_free(Query *query);
 
 typedef struct {
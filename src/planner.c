@@ -0,0 +1,477 @@
+#include "planner.h"
+
+#include "util/str.h"
+
+#include <float.h>
+#include <string.h>
+
+// Costs are counted in string comparisons, roughly: the time it takes to check
+// the value of a row of a string column, through its pointer.
+#define COST_ROW_STR 1.0
+#define COST_ROW_INT 0.05      // the scan kernels compare blocks of rows at a time
+#define COST_ROW_DICT 0.1      // a lookup of the result for the code of the row
+#define COST_PROBE 0.5         // finding a single candidate row, on top of checking it
+#define COST_INDEX_LOOKUP 20.0
+#define COST_INDEX_ROW 0.5     // per match, collecting it
+#define COST_WORD 0.05         // per 64 rows, combining bitmaps
+#define COST_SORT_ROW 1.0      // per selected row, the radix passes and the ties of strings
+
+#define PLAN_ARENA_BLOCK 1024
+
+/// A selectivity this close to 0 (1) rules out (in) next to nothing
+#define PLAN_EPSILON 1e-9
+
+const char *planaccess_str(PlanAccess access)
+{
+    switch (access) {
+        case PLAN_SCAN: return "scan";
+        case PLAN_ZONE_SCAN: return "zone map scan";
+        case PLAN_HASH_INDEX: return "hash index";
+        case PLAN_BTREE_INDEX: return "btree index";
+    }
+
+    return "!invalid access!";
+}
+
+const char *planorder_str(PlanOrder order)
+{
+    switch (order) {
+        case PLAN_ORDER_NONE: return "none";
+        case PLAN_ORDER_SORT: return "sort";
+        case PLAN_ORDER_BTREE_INDEX: return "btree index";
+    }
+
+    return "!invalid order!";
+}
+
+static PlanNode *plan_node_new(Plan *plan, FilterKind kind)
+{
+    PlanNode *node = arena_alloc(plan->arena, sizeof(PlanNode));
+    if (node)
+        *node = (PlanNode) { .kind = kind, .index_cost = DBL_MAX };
+
+    return node;
+}
+
+/// The cost of evaluating [node] over [candidates] rows, the cheapest way
+static double plan_cost(const PlanNode *node, double candidates)
+{
+    double cost = node->full_cost;
+    if (candidates * node->probe_cost < cost)
+        cost = candidates * node->probe_cost;
+    if (node->index_cost < cost)
+        cost = node->index_cost;
+
+    return cost;
+}
+
+static bool filterop_is_lower_bound(FilterOp op)
+{
+    return op == FILTER_GREATER || op == FILTER_GREATER_EQUAL;
+}
+
+static bool filterop_is_upper_bound(FilterOp op)
+{
+    return op == FILTER_LESSER || op == FILTER_LESSER_EQUAL;
+}
+
+// a lower and an upper bound on the same column ANDed together (e.g. a >= 1 AND a < 5)
+// are a single range, checked in one pass
+static bool filter_is_range(const Filter *a, const Filter *b)
+{
+    return a->kind == FILTER_PREDICATE && b->kind == FILTER_PREDICATE
+        && !strcmp(a->column, b->column)
+        && ((filterop_is_lower_bound(a->op) && filterop_is_upper_bound(b->op))
+            || (filterop_is_upper_bound(a->op) && filterop_is_lower_bound(b->op)));
+}
+
+// convert the value of [filter] to the type of [column], storing integers in [intbuf].
+// On success [value] points to the converted value, as expected by table_find.
+static BazaResult plan_value(ColumnMeta column, const Filter *filter, uint64_t *intbuf,
+                             const void **value)
+{
+    switch (column.type) {
+        case BTYPE_INT32:
+        case BTYPE_INT64: {
+            IntConvResult icres = column.type == BTYPE_INT32
+                                  ? str_to_int(filter->value, INT32_MIN, INT32_MAX)
+                                  : str_to_int(filter->value, INT64_MIN, INT64_MAX);
+            if (icres.result != RESULT_OK)
+                return RESULT_FILTER_VALUE_TYPE;
+
+            *intbuf = icres.value;
+            *value = intbuf;
+        } break;
+        case BTYPE_STRING:
+            *value = filter->value;
+            break;
+        case BTYPE_INVALID:
+            return RESULT_SERVER_ERROR;
+    }
+
+    return RESULT_OK;
+}
+
+/// Add the comparison [op] [value] to the range of [node]
+static void plan_bound(PlanNode *node, FilterOp op, const void *value)
+{
+    if (filterop_is_lower_bound(op)) {
+        node->range.lower = value;
+        node->range.lower_inclusive = op == FILTER_GREATER_EQUAL;
+    } else {
+        node->range.upper = value;
+        node->range.upper_inclusive = op == FILTER_LESSER_EQUAL;
+    }
+}
+
+/// Plan the predicate [filter], merged with [bound] (the opposite bound on the same
+/// column) unless that is NULL
+static BazaResult plan_predicate(Plan *plan, const Filter *filter, const Filter *bound,
+                                 PlanNode **out)
+{
+    ColumnResult colres = table_column_get(plan->table.id, filter->column);
+    if (colres.result != RESULT_OK)
+        return RESULT_COLUMN_NOT_FOUND;
+
+    PlanNode *node = plan_node_new(plan, FILTER_PREDICATE);
+    if (!node)
+        return RESULT_ALLOC;
+
+    node->column = colres.meta;
+    node->filter = filter;
+    node->bound = bound;
+
+    const void *value;
+    BazaResult res = plan_value(node->column, filter, &node->ints[0], &value);
+    if (res != RESULT_OK)
+        return res;
+
+    // the other comparisons are ranges, so that a pair of bounds is no different from one
+    if (filterop_is_lower_bound(filter->op) || filterop_is_upper_bound(filter->op)) {
+        node->op = FILTER_NONE;
+        plan_bound(node, filter->op, value);
+    } else {
+        node->op = filter->op;
+        node->value = value;
+    }
+
+    if (bound) {
+        res = plan_value(node->column, bound, &node->ints[1], &value);
+        if (res != RESULT_OK)
+            return res;
+
+        plan_bound(node, bound->op, value);
+    }
+
+    ColumnEstimate *est = &node->estimate;
+    *est = node->op == FILTER_NONE
+        ? table_estimate_range(plan->table.id, node->column.id, node->range)
+        : table_estimate(plan->table.id, node->column.id, node->op, node->value);
+    if (est->res != RESULT_OK)
+        return est->res;
+
+    plan->live = est->rows;
+
+    double rows = est->rows;
+    node->selectivity = rows ? est->matches / rows : 0;
+    if (node->selectivity > 1)
+        node->selectivity = 1;
+
+    double row_cost = node->column.type != BTYPE_STRING ? COST_ROW_INT
+                    : est->distinct ? COST_ROW_DICT : COST_ROW_STR;
+    double scanned = est->chunks ? (double)(est->chunks - est->chunks_skipped) / est->chunks : 0;
+
+    node->full_cost = scanned * rows * row_cost + rows / 64 * COST_WORD;
+    node->probe_cost = COST_PROBE + row_cost;
+    if (est->index != INDEX_INVALID)
+        node->index_cost = COST_INDEX_LOOKUP + est->matches * COST_INDEX_ROW;
+
+    *out = node;
+
+    return RESULT_OK;
+}
+
+static BazaResult plan_node(Plan *plan, const Filter *filter, PlanNode **out);
+
+/// Plan the children of [filter] into [nodes], merging the bounds of ranges for an AND
+static BazaResult plan_children(Plan *plan, const Filter *filter, PlanNode **nodes, size_t *count)
+{
+    size_t total = 0;
+    for (const Filter *child = filter->children; child; child = child->next)
+        total++;
+
+    // children already planned as the other bound of a range
+    bool *merged = arena_alloc(plan->arena, total * sizeof(bool));
+    if (!merged)
+        return RESULT_ALLOC;
+    memset(merged, 0, total * sizeof(bool));
+
+    *count = 0;
+    size_t i = 0;
+    for (const Filter *child = filter->children; child; child = child->next, i++) {
+        if (merged[i])
+            continue;
+
+        const Filter *bound = NULL;
+        if (filter->kind == FILTER_AND) {
+            size_t j = i + 1;
+            for (bound = child->next; bound; bound = bound->next, j++) {
+                if (!merged[j] && filter_is_range(child, bound)) {
+                    merged[j] = true;
+                    break;
+                }
+            }
+        }
+
+        BazaResult res = bound ? plan_predicate(plan, child, bound, &nodes[*count])
+                               : plan_node(plan, child, &nodes[*count]);
+        if (res != RESULT_OK)
+            return res;
+
+        (*count)++;
+    }
+
+    return RESULT_OK;
+}
+
+// The children of an AND are evaluated one after the other, each over the rows the
+// ones before it let through, and those of an OR over the rows the ones before it
+// did not match. Either way, the sooner the rows are narrowed down the better,
+// so the order is picked greedily: next comes the child which costs the least
+// per share of the rows left it decides, over those rows.
+static BazaResult plan_compound(Plan *plan, const Filter *filter, PlanNode **out)
+{
+    bool and = filter->kind == FILTER_AND;
+
+    size_t total = 0;
+    for (const Filter *child = filter->children; child; child = child->next)
+        total++;
+
+    PlanNode **nodes = arena_alloc(plan->arena, total * sizeof(PlanNode*));
+    if (!nodes)
+        return RESULT_ALLOC;
+
+    size_t count;
+    BazaResult res = plan_children(plan, filter, nodes, &count);
+    if (res != RESULT_OK)
+        return res;
+
+    // e.g. a range made of the only two children
+    if (count == 1) {
+        *out = nodes[0];
+        return RESULT_OK;
+    }
+
+    PlanNode *node = plan_node_new(plan, filter->kind);
+    if (!node)
+        return RESULT_ALLOC;
+
+    double candidates = plan->live;
+    double left = 1; // share of the rows still undecided
+    PlanNode **tail = &node->children;
+
+    for (size_t i = 0; i < count; i++) {
+        size_t best = i;
+        double best_rank = DBL_MAX;
+        for (size_t j = i; j < count; j++) {
+            double decided = and ? 1 - nodes[j]->selectivity : nodes[j]->selectivity;
+            double rank = plan_cost(nodes[j], candidates) / (decided > PLAN_EPSILON ? decided : PLAN_EPSILON);
+            if (rank < best_rank) {
+                best_rank = rank;
+                best = j;
+            }
+        }
+
+        // keep the order of the rest, ties go to the one written first
+        PlanNode *next = nodes[best];
+        memmove(&nodes[i + 1], &nodes[i], (best - i) * sizeof(PlanNode*));
+        nodes[i] = next;
+
+        *tail = next;
+        tail = &next->next;
+
+        node->full_cost += plan_cost(next, candidates);
+        node->probe_cost += left * next->probe_cost;
+        if (!and) // rows matched so far are set aside, and added to the result
+            node->full_cost += 2 * plan->live / 64 * COST_WORD;
+
+        double share = and ? next->selectivity : 1 - next->selectivity;
+        candidates *= share;
+        left *= share;
+    }
+    *tail = NULL;
+
+    node->selectivity = and ? left : 1 - left;
+    *out = node;
+
+    return RESULT_OK;
+}
+
+static BazaResult plan_node(Plan *plan, const Filter *filter, PlanNode **out)
+{
+    switch (filter->kind) {
+        case FILTER_PREDICATE:
+            return plan_predicate(plan, filter, NULL, out);
+        case FILTER_AND:
+        case FILTER_OR:
+            return plan_compound(plan, filter, out);
+        case FILTER_NOT: {
+            PlanNode *node = plan_node_new(plan, FILTER_NOT);
+            if (!node)
+                return RESULT_ALLOC;
+
+            BazaResult res = plan_node(plan, filter->children, &node->children);
+            if (res != RESULT_OK)
+                return res;
+
+            // the matches of the child are taken out of the candidates
+            PlanNode *child = node->children;
+            node->selectivity = 1 - child->selectivity;
+            node->full_cost = plan_cost(child, plan->live) + 2 * plan->live / 64 * COST_WORD;
+            node->probe_cost = child->probe_cost;
+            *out = node;
+
+            return RESULT_OK;
+        }
+    }
+
+    return RESULT_SERVER_ERROR;
+}
+
+/// Settle how [node] is evaluated, now that the order of the nodes around it is
+/// known and with it the number of [candidates] it gets
+static void plan_settle(PlanNode *node, double candidates)
+{
+    node->rows = candidates;
+    node->cost = plan_cost(node, candidates);
+
+    switch (node->kind) {
+        case FILTER_PREDICATE:
+            if (node->index_cost <= node->cost)
+                node->access = node->estimate.index == INDEX_HASH ? PLAN_HASH_INDEX : PLAN_BTREE_INDEX;
+            else if (node->estimate.chunks_skipped)
+                node->access = PLAN_ZONE_SCAN;
+            else
+                node->access = PLAN_SCAN;
+            break;
+        case FILTER_AND:
+            for (PlanNode *child = node->children; child; child = child->next) {
+                plan_settle(child, candidates);
+                candidates *= child->selectivity;
+            }
+            break;
+        case FILTER_OR:
+            for (PlanNode *child = node->children; child; child = child->next) {
+                plan_settle(child, candidates);
+                candidates *= 1 - child->selectivity;
+            }
+            break;
+        case FILTER_NOT:
+            plan_settle(node->children, candidates);
+            break;
+    }
+}
+
+PlanResult plan_filter(TableMeta table, const Filter *filter)
+{
+    Arena *arena = arena_new(PLAN_ARENA_BLOCK);
+    Plan *plan = arena ? arena_alloc(arena, sizeof(Plan)) : NULL;
+    if (!plan) {
+        arena_free(arena);
+        return (PlanResult) { .res = RESULT_ALLOC };
+    }
+
+    // the deleted rows are only known once a predicate is estimated
+    *plan = (Plan) { .arena = arena, .table = table, .live = table.row_count };
+
+    if (filter) {
+        BazaResult res = plan_node(plan, filter, &plan->root);
+        if (res != RESULT_OK) {
+            arena_free(arena);
+            return (PlanResult) { .res = res };
+        }
+
+        plan_settle(plan->root, plan->live);
+        plan->rows = plan->live * plan->root->selectivity;
+        plan->cost = plan->root->cost;
+    } else {
+        plan->rows = plan->live;
+    }
+
+    return (PlanResult) { .res = RESULT_OK, .plan = plan };
+}
+
+void plan_free(Plan *plan)
+{
+    if (plan)
+        arena_free(plan->arena);
+}
+
+PlanOrder plan_order(TableMeta table, const SortKey *order, double rows)
+{
+    if (!order)
+        return PLAN_ORDER_NONE;
+
+    // an index only orders by a single column, unknown columns are left to the sort to report
+    ColumnResult colres = table_column_get(table.id, order->column);
+    if (order->next || colres.result != RESULT_OK)
+        return PLAN_ORDER_SORT;
+
+    ColumnEstimate est = table_estimate_range(table.id, colres.meta.id, (ValueRange) { 0 });
+    if (est.res != RESULT_OK || est.index != INDEX_BTREE)
+        return PLAN_ORDER_SORT;
+
+    // the walk collects every live row from the index, the sort only the selected ones
+    return est.rows * COST_INDEX_ROW <= rows * COST_SORT_ROW ? PLAN_ORDER_BTREE_INDEX : PLAN_ORDER_SORT;
+}
+
+static void plan_print_node(const PlanNode *node, int depth, FILE *out)
+{
+    fprintf(out, "%*s", 4 + 2 * depth, "");
+
+    switch (node->kind) {
+        case FILTER_PREDICATE: {
+            const Filter *filter = node->filter;
+            fprintf(out, "%s %s '%s'", filter->column, filterop_to_str(filter->op), filter->value);
+            if (node->bound)
+                fprintf(out, " AND %s %s '%s'", node->bound->column,
+                        filterop_to_str(node->bound->op), node->bound->value);
+
+            fprintf(out, ": %s", planaccess_str(node->access));
+            if (node->access == PLAN_ZONE_SCAN)
+                fprintf(out, " (skipping %zu of %zu chunks)", node->estimate.chunks_skipped,
+                        node->estimate.chunks);
+        } break;
+        case FILTER_AND: fputs("AND", out); break;
+        case FILTER_OR: fputs("OR", out); break;
+        case FILTER_NOT: fputs("NOT", out); break;
+    }
+
+    fprintf(out, " [rows: %.0f -> %.0f, cost: %.1f]\n",
+            node->rows, node->rows * node->selectivity, node->cost);
+
+    for (const PlanNode *child = node->children; child; child = child->next)
+        plan_print_node(child, depth + 1, out);
+}
+
+void plan_print(const Plan *plan, FILE *out)
+{
+    fprintf(out, "Plan {\n"
+                 "  table: %s\n"
+                 "  rows: %.0f of %lu\n"
+                 "  cost: %.1f\n"
+                 "  filter:",
+            plan->table.name, plan->rows, plan->live, plan->cost);
+
+    if (plan->root) {
+        fputc('\n', out);
+        plan_print_node(plan->root, 0, out);
+    } else {
+        fputs(" none\n", out);
+    }
+
+    if (plan->order != PLAN_ORDER_NONE)
+        fprintf(out, "  order: %s\n", planorder_str(plan->order));
+
+    fputs("}\n", out);
+}
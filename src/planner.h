@@ -0,0 +1,96 @@
+// Query planner - decides how the interpreter evaluates the WHERE clause of a
+// query, before it runs: which order the conditions of every AND and OR are
+// checked in, so that cheap and selective ones narrow the rows down for the
+// rest, and how every predicate finds its rows. The choices are made by cost,
+// from what the storage can estimate without looking at the rows (see
+// table_estimate), and kept in a Plan, which EXPLAIN prints.
+#ifndef _PLANNER_H
+#define _PLANNER_H
+
+#include "parser.h"
+#include "storage.h"
+
+#include "util/arena.h"
+
+typedef enum PlanAccess {
+    PLAN_SCAN,       // compare the rows of the column, only those among the candidates
+    PLAN_ZONE_SCAN,  // the same, with the zones expected to rule some chunks in or out
+    PLAN_HASH_INDEX, // look the matches up in an index, then keep the candidates among them
+    PLAN_BTREE_INDEX,
+} PlanAccess;
+
+const char *planaccess_str(PlanAccess access);
+
+/// A node of a plan, mirroring a node of the WHERE clause. A lower and an upper bound
+/// on the same column under the same AND are merged into a single range predicate.
+typedef struct PlanNode {
+    FilterKind kind;
+
+    // FILTER_PREDICATE only
+    ColumnMeta column;
+    FilterOp op;           // FILTER_EQUAL, FILTER_NOT_EQUAL, FILTER_LIKE, or FILTER_NONE for [range]
+    const void *value;     // converted to the type of [column], as table_find takes it
+    ValueRange range;      // the other comparisons, as table_find_range takes it
+    uint64_t ints[2];      // integer values point in here
+    ColumnEstimate estimate;
+    PlanAccess access;
+    const Filter *filter;  // what the node was planned from
+    const Filter *bound;   // the other bound merged into a range, NULL if none
+
+    // the children of AND and OR in the order they are to be evaluated in,
+    // the only child of NOT
+    struct PlanNode *children;
+    struct PlanNode *next;
+
+    // estimates, see planner.c for the units of cost
+    double selectivity; // share of the candidate rows passing the node
+    double full_cost;   // of evaluating the node over the whole table
+    double probe_cost;  // per candidate row, when there are few enough to visit one by one
+    double index_cost;  // of looking the matches up in an index
+    double rows;        // candidate rows the node is expected to be evaluated over
+    double cost;        // of evaluating it over those
+} PlanNode;
+
+/// How the rows selected for a SELECT are put in the order of its ORDER BY
+typedef enum PlanOrder {
+    PLAN_ORDER_NONE,        // no ORDER BY
+    PLAN_ORDER_SORT,        // sort the selected rows (see table_sort)
+    PLAN_ORDER_BTREE_INDEX, // walk every row of the table in index order, keeping the selected ones
+} PlanOrder;
+
+const char *planorder_str(PlanOrder order);
+
+/// How a statement finds the rows its WHERE clause selects. Everything in it is
+/// allocated in its arena, and the Filter it was planned from has to outlive it.
+typedef struct Plan {
+    Arena *arena;
+    TableMeta table;
+    PlanNode *root; // NULL without a WHERE clause: every live row is selected
+    uint64_t live;  // rows in the table, the deleted ones aside as far as they are known
+    double rows;    // expected to be selected
+    double cost;
+    PlanOrder order; // PLAN_ORDER_NONE unless set with plan_order, for EXPLAIN
+} Plan;
+
+typedef struct PlanResult {
+    BazaResult res;
+    Plan *plan;
+} PlanResult;
+
+/// Plan the evaluation of [filter] (NULL for none) over [table], with the table
+/// locked or a snapshot of it taken, like for running the plan. The values in the
+/// filter are converted to the types of their columns here, so unknown columns
+/// and values of the wrong type are reported by the planner.
+PlanResult plan_filter(TableMeta table, const Filter *filter);
+
+void plan_free(Plan *plan);
+
+/// Pick how [rows] rows selected from [table] are best put in the order of [order]
+/// (NULL for none). Walking an ordered index visits every row of the table, so it
+/// only pays off when the selection keeps most of them.
+PlanOrder plan_order(TableMeta table, const SortKey *order, double rows);
+
+/// Print [plan] to [out], with the estimates for every node
+void plan_print(const Plan *plan, FILE *out);
+
+#endif /* _PLANNER_H */
@@ -0,0 +1,479 @@
+#define _GNU_SOURCE // accept4
+#include "server.h"
+#include "statement.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <string.h>
+
+#define SERVER_MAX_EVENTS 64
+#define SERVER_FRAME_HEADER 4
+/// Read at most this much from a connection per event, so that one busy client
+/// cannot hold up the others (epoll is level-triggered, the rest is read next time)
+#define SERVER_READ_BUDGET (1 << 20)
+/// Requests are not run while a connection has this much output left to send,
+/// until its client reads it
+#define SERVER_OUTPUT_LIMIT (4 << 20)
+
+typedef enum ServerSource {
+    SOURCE_LISTENER,
+    SOURCE_CONNECTION,
+    SOURCE_SIGNALS,
+} ServerSource;
+
+/// What epoll reports an event for, in its data.ptr
+typedef struct ServerHandle {
+    ServerSource source;
+    int fd;
+} ServerHandle;
+
+typedef struct ServerBuffer {
+    byte *data;
+    size_t length;
+    size_t capacity;
+} ServerBuffer;
+
+typedef struct Connection {
+    ServerHandle handle;
+    ServerBuffer in;  // received requests not run yet, the last one possibly incomplete
+    ServerBuffer out; // responses, sent up to [sent]
+    size_t sent;
+    bool closing;     // the client shut its side down, close once everything was answered
+    uint32_t events;  // registered with epoll
+    struct Connection *prev, *next;
+} Connection;
+
+static struct {
+    int epoll;
+    ServerHandle listeners[2];
+    size_t listener_count;
+    ServerHandle signals;
+    const char *socket_path; // unlinked on shutdown
+    Connection *connections;
+} SERVER = { .epoll = -1 };
+
+void server_signals_block(void)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+}
+
+static bool server_buffer_append(ServerBuffer *buffer, const void *data, size_t length)
+{
+    if (buffer->length + length > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+        while (capacity < buffer->length + length)
+            capacity *= 2;
+
+        byte *grown = realloc(buffer->data, capacity);
+        if (!grown)
+            return false;
+
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+
+    return true;
+}
+
+static bool server_watch(ServerHandle *handle, uint32_t events)
+{
+    struct epoll_event event = { .events = events, .data.ptr = handle };
+    return epoll_ctl(SERVER.epoll, EPOLL_CTL_ADD, handle->fd, &event) == 0;
+}
+
+static BazaResult server_listen(int fd, const struct sockaddr *addr, socklen_t addrlen)
+{
+    if (bind(fd, addr, addrlen) != 0 || listen(fd, SOMAXCONN) != 0) {
+        close(fd);
+        return RESULT_SERVER_ERROR;
+    }
+
+    ServerHandle *listener = &SERVER.listeners[SERVER.listener_count];
+    *listener = (ServerHandle) { .source = SOURCE_LISTENER, .fd = fd };
+
+    if (!server_watch(listener, EPOLLIN)) {
+        close(fd);
+        return RESULT_SERVER_ERROR;
+    }
+
+    SERVER.listener_count++;
+    return RESULT_OK;
+}
+
+static BazaResult server_listen_tcp(const char *host, const char *port)
+{
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = AI_PASSIVE,
+    };
+    struct addrinfo *addrs;
+
+    if (getaddrinfo(host, port, &hints, &addrs) != 0)
+        return RESULT_SERVER_ERROR;
+
+    // the first address which can be bound
+    BazaResult result = RESULT_SERVER_ERROR;
+    for (struct addrinfo *addr = addrs; addr && result != RESULT_OK; addr = addr->ai_next) {
+        int fd = socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                        addr->ai_protocol);
+        if (fd < 0)
+            continue;
+
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+        result = server_listen(fd, addr->ai_addr, addr->ai_addrlen);
+    }
+
+    freeaddrinfo(addrs);
+
+    if (result == RESULT_OK)
+        printf("SERVE: listening on %s:%s\n", host, port);
+    return result;
+}
+
+static BazaResult server_listen_unix(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return RESULT_SERVER_ERROR;
+    strcpy(addr.sun_path, path);
+
+    // a socket left behind by a server which did not shut down cleanly
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return RESULT_SERVER_ERROR;
+
+    ENSURE(server_listen(fd, (struct sockaddr*)&addr, sizeof(addr)));
+
+    SERVER.socket_path = path;
+    printf("SERVE: listening on %s\n", path);
+    return RESULT_OK;
+}
+
+static void server_connection_close(Connection *conn)
+{
+    close(conn->handle.fd); // which removes it from the epoll set
+
+    if (conn->prev)
+        conn->prev->next = conn->next;
+    else
+        SERVER.connections = conn->next;
+    if (conn->next)
+        conn->next->prev = conn->prev;
+
+    free(conn->in.data);
+    free(conn->out.data);
+    free(conn);
+}
+
+static void server_accept(ServerHandle *listener)
+{
+    for (;;) {
+        int fd = accept4(listener->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == ECONNABORTED || errno == EINTR)
+                continue;
+            // EAGAIN once every pending connection was accepted. Anything else (e.g.
+            // out of file descriptors) leaves the rest for the next event.
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                fprintf(stderr, "SERVE: accept: %s\n", strerror(errno));
+            return;
+        }
+
+        Connection *conn = calloc(1, sizeof(Connection));
+        if (!conn) {
+            close(fd);
+            continue;
+        }
+
+        conn->handle = (ServerHandle) { .source = SOURCE_CONNECTION, .fd = fd };
+        conn->events = EPOLLIN;
+        if (!server_watch(&conn->handle, conn->events)) {
+            close(fd);
+            free(conn);
+            continue;
+        }
+
+        conn->next = SERVER.connections;
+        if (conn->next)
+            conn->next->prev = conn;
+        SERVER.connections = conn;
+    }
+}
+
+/// Read what the client sent, up to SERVER_READ_BUDGET. False if the connection failed.
+static bool server_connection_read(Connection *conn)
+{
+    byte chunk[65536];
+    size_t total = 0;
+
+    while (total < SERVER_READ_BUDGET) {
+        ssize_t nread = recv(conn->handle.fd, chunk, sizeof(chunk), 0);
+        if (nread == 0) {
+            conn->closing = true;
+            return true;
+        }
+        if (nread < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+
+        if (!server_buffer_append(&conn->in, chunk, nread))
+            return false;
+        total += nread;
+    }
+
+    return true;
+}
+
+/// Run the statement [sql] and queue its response. False if out of memory.
+static bool server_connection_run(Connection *conn, const char *sql)
+{
+    char *rows = NULL;
+    size_t rows_size = 0;
+    FILE *out = open_memstream(&rows, &rows_size);
+    if (!out)
+        return false;
+
+    BazaResult result;
+    const char *error = NULL;
+
+    StatementResult sres = statement_parse(sql);
+    if (sres.result != RESULT_OK) {
+        result = sres.result;
+        error = result == RESULT_ERR_SQL_PARSE ? sres.error_msg : result_str(result);
+    } else {
+        result = statement_execute(sres.statement, NULL, 0, out).result;
+        statement_release(sres.statement);
+        if (result != RESULT_OK)
+            error = result_str(result);
+    }
+
+    if (fclose(out) != 0) {
+        free(rows);
+        return false;
+    }
+
+    // an error replaces whatever rows were written before it
+    const char *body = error ? error : rows;
+    size_t body_size = error ? strlen(error) : rows_size;
+
+    uint32_t header[2] = {
+        htonl(sizeof(uint32_t) + body_size),
+        htonl(result),
+    };
+
+    bool ok = server_buffer_append(&conn->out, header, sizeof(header))
+              && server_buffer_append(&conn->out, body, body_size);
+
+    free(rows);
+    return ok;
+}
+
+/// Run the complete requests received so far, while the output is not piling up.
+/// False if the connection has to be dropped.
+static bool server_connection_process(Connection *conn)
+{
+    size_t offset = 0;
+    bool ok = true;
+
+    while (conn->out.length - conn->sent < SERVER_OUTPUT_LIMIT
+           && conn->in.length - offset >= SERVER_FRAME_HEADER) {
+        uint32_t length;
+        memcpy(&length, conn->in.data + offset, sizeof(length));
+        length = ntohl(length);
+
+        if (length > SERVER_MAX_REQUEST) {
+            ok = false;
+            break;
+        }
+        if (conn->in.length - offset - SERVER_FRAME_HEADER < length)
+            break;
+
+        char *sql = strndup((char*)conn->in.data + offset + SERVER_FRAME_HEADER, length);
+        if (!sql || !server_connection_run(conn, sql)) {
+            free(sql);
+            ok = false;
+            break;
+        }
+        free(sql);
+
+        offset += SERVER_FRAME_HEADER + length;
+    }
+
+    // keep the rest for later (the buffer might not even be allocated yet)
+    if (offset > 0) {
+        memmove(conn->in.data, conn->in.data + offset, conn->in.length - offset);
+        conn->in.length -= offset;
+    }
+
+    return ok;
+}
+
+/// Send as much of the output as the socket takes. False if the connection failed.
+static bool server_connection_flush(Connection *conn)
+{
+    while (conn->sent < conn->out.length) {
+        ssize_t nsent = send(conn->handle.fd, conn->out.data + conn->sent,
+                             conn->out.length - conn->sent, MSG_NOSIGNAL);
+        if (nsent < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+
+        conn->sent += nsent;
+    }
+
+    conn->out.length = 0;
+    conn->sent = 0;
+
+    return true;
+}
+
+static void server_connection_event(Connection *conn, uint32_t events)
+{
+    bool ok = !(events & EPOLLERR);
+
+    if (ok && (events & (EPOLLIN | EPOLLHUP)) && !conn->closing)
+        ok = server_connection_read(conn);
+
+    // keep going for as long as the responses fit in the socket
+    while (ok) {
+        size_t received = conn->in.length;
+        ok = server_connection_process(conn) && server_connection_flush(conn);
+        if (conn->out.length > 0 || conn->in.length == received)
+            break;
+    }
+
+    bool pending = conn->out.length > 0;
+
+    // once the client is done sending, whatever did not make a full request never will
+    if (!ok || (conn->closing && !pending)) {
+        server_connection_close(conn);
+        return;
+    }
+
+    // stop reading while the output backs up, waiting for the client to catch up
+    uint32_t wanted = 0;
+    if (!conn->closing && conn->out.length - conn->sent < SERVER_OUTPUT_LIMIT)
+        wanted |= EPOLLIN;
+    if (pending)
+        wanted |= EPOLLOUT;
+
+    if (wanted != conn->events) {
+        struct epoll_event event = { .events = wanted, .data.ptr = &conn->handle };
+        if (epoll_ctl(SERVER.epoll, EPOLL_CTL_MOD, conn->handle.fd, &event) != 0) {
+            server_connection_close(conn);
+            return;
+        }
+        conn->events = wanted;
+    }
+}
+
+static void server_shutdown(void)
+{
+    while (SERVER.connections)
+        server_connection_close(SERVER.connections);
+
+    for (size_t i = 0; i < SERVER.listener_count; i++)
+        close(SERVER.listeners[i].fd);
+    SERVER.listener_count = 0;
+
+    if (SERVER.socket_path)
+        unlink(SERVER.socket_path);
+    SERVER.socket_path = NULL;
+
+    if (SERVER.signals.fd >= 0)
+        close(SERVER.signals.fd);
+    close(SERVER.epoll);
+    SERVER.epoll = -1;
+}
+
+BazaResult server_run(const ServerConfig *config)
+{
+    BazaResult result = RESULT_OK;
+
+    SERVER.epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (SERVER.epoll < 0)
+        return RESULT_SERVER_ERROR;
+
+    // stop on the signals blocked by server_signals_block
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+
+    SERVER.signals = (ServerHandle) {
+        .source = SOURCE_SIGNALS,
+        .fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC),
+    };
+    if (SERVER.signals.fd < 0 || !server_watch(&SERVER.signals, EPOLLIN))
+        result = RESULT_SERVER_ERROR;
+
+    if (result == RESULT_OK && config->port)
+        result = server_listen_tcp(config->host ? config->host : SERVER_DEFAULT_HOST, config->port);
+    if (result == RESULT_OK && config->socket_path)
+        result = server_listen_unix(config->socket_path);
+
+    fflush(stdout);
+
+    bool running = result == RESULT_OK;
+    while (running) {
+        struct epoll_event events[SERVER_MAX_EVENTS];
+        int count = epoll_wait(SERVER.epoll, events, SERVER_MAX_EVENTS, -1);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            result = RESULT_SERVER_ERROR;
+            break;
+        }
+
+        for (int i = 0; i < count; i++) {
+            ServerHandle *handle = events[i].data.ptr;
+
+            switch (handle->source) {
+                case SOURCE_LISTENER:
+                    server_accept(handle);
+                    break;
+                case SOURCE_CONNECTION:
+                    // the handle is the first member of its connection
+                    server_connection_event((Connection*)handle, events[i].events);
+                    break;
+                case SOURCE_SIGNALS:
+                    running = false;
+                    break;
+            }
+        }
+    }
+
+    server_shutdown();
+
+    puts("SERVE: stopped");
+    return result;
+}
@@ -0,0 +1,38 @@
+// A long-lived server running the statements sent by its clients, over TCP
+// and/or a Unix socket. One thread multiplexes every connection with epoll,
+// with non-blocking sockets and buffers of their own; the statements themselves
+// are run one at a time on that thread, spreading their work over the thread
+// pool like they do in batch mode.
+//
+// The protocol is a stream of frames in both directions, each a 4 byte length
+// (big endian) followed by that many bytes:
+//  - a request is the text of a single statement, with no terminating ';'
+//  - the response to it (responses come in the order of the requests) starts
+//    with its BazaResult as 4 bytes (big endian), followed by the rows it
+//    returned, formatted as in batch mode, or by a description of the error
+#ifndef _SERVER_H
+#define _SERVER_H
+
+#include "util/defs.h"
+#include "util/result.h"
+
+#define SERVER_DEFAULT_HOST "127.0.0.1"
+#define SERVER_DEFAULT_PORT "5454"
+/// Requests longer than this close the connection
+#define SERVER_MAX_REQUEST (64 << 20)
+
+typedef struct ServerConfig {
+    const char *host;        // for TCP, SERVER_DEFAULT_HOST if NULL
+    const char *port;        // TCP is not served if NULL
+    const char *socket_path; // the Unix socket is not served if NULL
+} ServerConfig;
+
+/// Block the signals stopping the server (SIGINT and SIGTERM), so that server_run
+/// can wait for them with the connections. To be called before any other thread
+/// is started, as those inherit the signal mask.
+void server_signals_block(void);
+
+/// Serve the clients of every endpoint of [config] until SIGINT or SIGTERM
+BazaResult server_run(const ServerConfig *config);
+
+#endif /* _SERVER_H */
@@ -0,0 +1,466 @@
+#include "statement.h"
+#include "util/strmap.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#define STATEMENT_SPACE " \t\n" // as split by the parser
+
+typedef struct StatementParam {
+    char **value;      // where the bound value goes in the query
+    size_t *length;    // of the StrList node holding it, NULL for filters
+    char *placeholder; // the query's own string, put back after each run
+    BaseType type;
+} StatementParam;
+
+struct Statement {
+    Query *query;
+    size_t refs;              // atomic
+    pthread_mutex_t lock;     // held while values are bound to the parameters
+    StatementParam *params;
+    size_t param_count;
+    char *key;                // the normalized text, while in the cache
+    char *name;               // while in the registry
+    Statement *newer, *older; // order of use, in the cache
+};
+
+static struct {
+    pthread_mutex_t lock;
+    StrMap *statements;       // by key, created on first use
+    Statement *newest, *oldest;
+} CACHE = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static struct {
+    pthread_mutex_t lock;
+    StrMap *statements;       // by name, created on first use
+} REGISTRY = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static Statement *statement_new(Query *query)
+{
+    Statement *statement = malloc(sizeof(Statement));
+    if (!statement)
+        return NULL;
+
+    *statement = (Statement) {
+        .query = query,
+        .refs = 1,
+    };
+    pthread_mutex_init(&statement->lock, NULL);
+
+    return statement;
+}
+
+static void statement_free(Statement *statement)
+{
+    query_free(statement->query);
+    pthread_mutex_destroy(&statement->lock);
+    free(statement->params);
+    free(statement->key);
+    free(statement->name);
+    free(statement);
+}
+
+void statement_release(Statement *statement)
+{
+    if (__atomic_sub_fetch(&statement->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        statement_free(statement);
+}
+
+static Statement *statement_ref(Statement *statement)
+{
+    __atomic_add_fetch(&statement->refs, 1, __ATOMIC_RELAXED);
+    return statement;
+}
+
+const Query *statement_query(const Statement *statement)
+{
+    return statement->query;
+}
+
+size_t statement_param_count(const Statement *statement)
+{
+    return statement->param_count;
+}
+
+BaseType statement_param_type(const Statement *statement, size_t index)
+{
+    return index < statement->param_count ? statement->params[index].type : BTYPE_INVALID;
+}
+
+/// The cache key of [sql]: runs of whitespace outside of quotes become a single space,
+/// none is left at the ends. The parser splits the result into the same tokens.
+static char *statement_normalize(const char *sql)
+{
+    char *key = malloc(strlen(sql) + 1);
+    if (!key)
+        return NULL;
+
+    size_t length = 0;
+    bool quoted = false, space = false;
+
+    for (const char *c = sql; *c; c++) {
+        if (!quoted && strchr(STATEMENT_SPACE, *c)) {
+            space = length > 0;
+            continue;
+        }
+
+        if (space) {
+            key[length++] = ' ';
+            space = false;
+        }
+        if (*c == '"')
+            quoted = !quoted;
+
+        key[length++] = *c;
+    }
+    key[length] = 0;
+
+    return key;
+}
+
+/// Put [statement] at the newest end of the cache's order of use
+static void statement_cache_touch(Statement *statement)
+{
+    // unlink it, if it is linked at all
+    if (statement->newer)
+        statement->newer->older = statement->older;
+    else if (CACHE.newest == statement)
+        CACHE.newest = statement->older;
+    if (statement->older)
+        statement->older->newer = statement->newer;
+    else if (CACHE.oldest == statement)
+        CACHE.oldest = statement->newer;
+
+    statement->newer = NULL;
+    statement->older = CACHE.newest;
+    if (CACHE.newest)
+        CACHE.newest->newer = statement;
+    CACHE.newest = statement;
+    if (!CACHE.oldest)
+        CACHE.oldest = statement;
+}
+
+static void statement_cache_evict(void)
+{
+    Statement *oldest = CACHE.oldest;
+
+    strmap_remove(CACHE.statements, oldest->key);
+
+    CACHE.oldest = oldest->newer;
+    if (CACHE.oldest)
+        CACHE.oldest->older = NULL;
+    else
+        CACHE.newest = NULL;
+
+    statement_release(oldest);
+}
+
+StatementResult statement_parse(const char *sql)
+{
+    char *key = statement_normalize(sql);
+    if (!key)
+        return (StatementResult) { .result = RESULT_ALLOC };
+
+    uint64_t cached;
+    pthread_mutex_lock(&CACHE.lock);
+    if (CACHE.statements && strmap_get(CACHE.statements, key, &cached)) {
+        Statement *statement = statement_ref((Statement*)cached);
+        statement_cache_touch(statement);
+        pthread_mutex_unlock(&CACHE.lock);
+
+        free(key);
+        return (StatementResult) { .result = RESULT_OK, .statement = statement };
+    }
+    pthread_mutex_unlock(&CACHE.lock);
+
+    // parsed without holding the cache up
+    QueryParseResult pres = query_parse(sql);
+    if (pres.result != RESULT_OK) {
+        free(key);
+        return (StatementResult) { .result = pres.result, .error_msg = pres.error_msg };
+    }
+
+    Statement *statement = statement_new(pres.query);
+    if (!statement) {
+        query_free(pres.query);
+        free(key);
+        return (StatementResult) { .result = RESULT_ALLOC };
+    }
+
+    pthread_mutex_lock(&CACHE.lock);
+
+    if (!CACHE.statements)
+        CACHE.statements = strmap_new();
+
+    // another thread may have cached the same text in the meantime, keep theirs
+    if (CACHE.statements && !strmap_get(CACHE.statements, key, &cached)
+        && strmap_put(CACHE.statements, key, (uint64_t)statement) == RESULT_OK) {
+        statement->key = key;
+        key = NULL;
+        statement_cache_touch(statement_ref(statement));
+
+        if (CACHE.statements->count > STATEMENT_CACHE_CAPACITY)
+            statement_cache_evict();
+    }
+
+    pthread_mutex_unlock(&CACHE.lock);
+
+    // not cached, the statement is the caller's alone
+    free(key);
+
+    return (StatementResult) { .result = RESULT_OK, .statement = statement };
+}
+
+static BazaResult statement_param_add(Statement *statement, char **value, size_t *length, BaseType type)
+{
+    StatementParam *params = realloc(statement->params, (statement->param_count + 1) * sizeof(StatementParam));
+    if (!params)
+        return RESULT_ALLOC;
+
+    params[statement->param_count++] = (StatementParam) {
+        .value = value,
+        .length = length,
+        .placeholder = *value,
+        .type = type,
+    };
+    statement->params = params;
+
+    return RESULT_OK;
+}
+
+/// Check the columns of [filter] and take its placeholders, in the order of the text
+static BazaResult statement_prepare_filters(Statement *statement, TableMeta table, Filter *filter)
+{
+    if (!filter)
+        return RESULT_OK;
+
+    if (filter->kind != FILTER_PREDICATE) {
+        for (Filter *child = filter->children; child; child = child->next)
+            ENSURE(statement_prepare_filters(statement, table, child));
+        return RESULT_OK;
+    }
+
+    ColumnResult colres = table_column_get(table.id, filter->column);
+    if (colres.result != RESULT_OK)
+        return colres.result;
+
+    if (filter->placeholder)
+        ENSURE(statement_param_add(statement, &filter->value, NULL, colres.meta.type));
+
+    return RESULT_OK;
+}
+
+/// The values of an INSERT go into the columns of the table, in order
+static BazaResult statement_prepare_insert(Statement *statement, TableMeta table)
+{
+    ColumnMetaList *columns = table_column_get_list(table.id, NULL);
+    if (!columns)
+        return RESULT_COLUMN_NOT_FOUND;
+
+    BazaResult res = RESULT_OK;
+    ColumnMetaList *column = columns;
+    StrList *value = statement->query->insert_values;
+
+    for (; column && res == RESULT_OK; column = column->next, value = value->next) {
+        // a value for every column, no more and no less
+        if (!value || !value->str) {
+            res = RESULT_INVALID_QUERY;
+            break;
+        }
+
+        if (value->placeholder)
+            res = statement_param_add(statement, &value->str, &value->strlen, column->meta->type);
+    }
+
+    if (res == RESULT_OK && value && value->str)
+        res = RESULT_INVALID_QUERY;
+
+    columnlist_free(columns);
+    return res;
+}
+
+/// The values of an UPDATE go into the columns they are assigned to
+static BazaResult statement_prepare_update(Statement *statement, TableMeta table)
+{
+    StrList *column = statement->query->update_columns;
+    StrList *value = statement->query->update_values;
+
+    for (; column && column->str && value && value->str; column = column->next, value = value->next) {
+        ColumnResult colres = table_column_get(table.id, column->str);
+        if (colres.result != RESULT_OK)
+            return colres.result;
+
+        if (value->placeholder)
+            ENSURE(statement_param_add(statement, &value->str, &value->strlen, colres.meta.type));
+    }
+
+    return RESULT_OK;
+}
+
+/// Check what [statement] refers to and collect its parameters, in the order of its text
+static BazaResult statement_prepare_query(Statement *statement)
+{
+    Query *query = statement->query;
+
+    switch (query->type) {
+        case QUERY_SELECT:
+        case QUERY_INSERT:
+        case QUERY_DELETE:
+        case QUERY_UPDATE:
+            break;
+        case QUERY_PREPARE:
+        case QUERY_EXECUTE:
+        case QUERY_DEALLOCATE:
+            return RESULT_INVALID_QUERY;
+        default:
+            // nothing to bind, checked when run
+            return RESULT_OK;
+    }
+
+    TableResult tabres = db_table_get(query->table_name);
+    if (tabres.result != RESULT_OK)
+        return tabres.result;
+    TableMeta table = tabres.meta;
+
+    switch (query->type) {
+        case QUERY_SELECT: {
+            ColumnMetaList *columns = table_column_get_list(table.id, query->select_columns);
+            if (!columns)
+                return RESULT_COLUMN_NOT_FOUND;
+            columnlist_free(columns);
+
+            for (const SortKey *key = query->select_order; key; key = key->next)
+                ENSURE(table_column_get(table.id, key->column).result);
+
+            return statement_prepare_filters(statement, table, query->select_filters);
+        }
+        case QUERY_INSERT:
+            return statement_prepare_insert(statement, table);
+        case QUERY_DELETE:
+            return statement_prepare_filters(statement, table, query->delete_filters);
+        case QUERY_UPDATE:
+            ENSURE(statement_prepare_update(statement, table));
+            return statement_prepare_filters(statement, table, query->update_filters);
+        default:
+            return RESULT_OK;
+    }
+}
+
+StatementResult statement_prepare(const char *sql)
+{
+    QueryParseResult pres = query_parse(sql);
+    if (pres.result != RESULT_OK)
+        return (StatementResult) { .result = pres.result, .error_msg = pres.error_msg };
+
+    Statement *statement = statement_new(pres.query);
+    if (!statement) {
+        query_free(pres.query);
+        return (StatementResult) { .result = RESULT_ALLOC };
+    }
+
+    BazaResult res = statement_prepare_query(statement);
+    if (res != RESULT_OK) {
+        statement_release(statement);
+        return (StatementResult) { .result = res };
+    }
+
+    return (StatementResult) { .result = RESULT_OK, .statement = statement };
+}
+
+QueryResponse statement_execute(Statement *statement, const char *const *params,
+                                size_t count, FILE *out)
+{
+    if (count != statement->param_count)
+        return (QueryResponse) { .result = RESULT_INVALID_QUERY };
+
+    if (!count)
+        return interpret_query(statement->query, out);
+
+    for (size_t i = 0; i < count; i++) {
+        if (!params[i])
+            return (QueryResponse) { .result = RESULT_INVALID_QUERY };
+
+        IntConvResult ires = { .result = RESULT_OK };
+        if (statement->params[i].type == BTYPE_INT32)
+            ires = str_to_int(params[i], INT32_MIN, INT32_MAX);
+        else if (statement->params[i].type == BTYPE_INT64)
+            ires = str_to_int(params[i], INT64_MIN, INT64_MAX);
+
+        if (ires.result != RESULT_OK)
+            return (QueryResponse) { .result = ires.result };
+    }
+
+    // the values are bound in place, the placeholders put back afterwards
+    pthread_mutex_lock(&statement->lock);
+
+    for (size_t i = 0; i < count; i++) {
+        *statement->params[i].value = (char*)params[i];
+        if (statement->params[i].length)
+            *statement->params[i].length = strlen(params[i]);
+    }
+
+    QueryResponse response = interpret_query(statement->query, out);
+
+    for (size_t i = 0; i < count; i++) {
+        *statement->params[i].value = statement->params[i].placeholder;
+        if (statement->params[i].length)
+            *statement->params[i].length = strlen(statement->params[i].placeholder);
+    }
+
+    pthread_mutex_unlock(&statement->lock);
+
+    return response;
+}
+
+BazaResult statement_register(const char *name, Statement *statement)
+{
+    BazaResult res = RESULT_OK;
+    uint64_t existing;
+
+    pthread_mutex_lock(&REGISTRY.lock);
+
+    if (!REGISTRY.statements && !(REGISTRY.statements = strmap_new()))
+        res = RESULT_ALLOC;
+    else if (statement->name || strmap_get(REGISTRY.statements, name, &existing))
+        res = RESULT_DUPLICATE_STATEMENT;
+    else if (!(statement->name = strdup(name)))
+        res = RESULT_ALLOC;
+    else if ((res = strmap_put(REGISTRY.statements, statement->name, (uint64_t)statement)) == RESULT_OK)
+        statement_ref(statement);
+
+    pthread_mutex_unlock(&REGISTRY.lock);
+
+    return res;
+}
+
+Statement *statement_lookup(const char *name)
+{
+    Statement *statement = NULL;
+    uint64_t found;
+
+    pthread_mutex_lock(&REGISTRY.lock);
+    if (REGISTRY.statements && strmap_get(REGISTRY.statements, name, &found))
+        statement = statement_ref((Statement*)found);
+    pthread_mutex_unlock(&REGISTRY.lock);
+
+    return statement;
+}
+
+BazaResult statement_unregister(const char *name)
+{
+    Statement *statement = NULL;
+    uint64_t found;
+
+    pthread_mutex_lock(&REGISTRY.lock);
+    if (REGISTRY.statements && strmap_get(REGISTRY.statements, name, &found)) {
+        statement = (Statement*)found;
+        strmap_remove(REGISTRY.statements, name);
+    }
+    pthread_mutex_unlock(&REGISTRY.lock);
+
+    if (!statement)
+        return RESULT_STATEMENT_NOT_FOUND;
+
+    statement_release(statement);
+    return RESULT_OK;
+}
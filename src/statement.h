@@ -0,0 +1,64 @@
+// Statements parsed once and run any number of times: an LRU cache of parsed
+// queries keyed by their (normalized) text, and prepared statements, whose
+// values can be left out as '?' placeholders and bound every time they are run.
+// Both work on top of the parser and the interpreter, for the front ends (the
+// cli, the server) and for anyone using baza as a library.
+#ifndef _STATEMENT_H
+#define _STATEMENT_H
+
+#include "interpreter.h"
+#include "parser.h"
+#include "storage.h"
+
+/// Parsed statements kept by the cache, the least recently used ones are dropped first
+#define STATEMENT_CACHE_CAPACITY 256
+
+typedef struct Statement Statement;
+
+typedef struct StatementResult {
+    BazaResult result;
+    union {
+        Statement *statement;
+        const char *error_msg; // set when result is RESULT_ERR_SQL_PARSE
+    };
+} StatementResult;
+
+/// Parse [sql], or take it from the cache if the same text (up to whitespace outside
+/// of quotes) was parsed before. The statement stays valid until released, even if
+/// the cache drops it in the meantime. Placeholders are only understood in prepared
+/// statements, anywhere else '?' is an ordinary value.
+StatementResult statement_parse(const char *sql);
+
+/// Prepare [sql]: parse it and check the table and columns it refers to, once.
+/// Every value written as '?' becomes a parameter, typed by the column it goes
+/// into or is compared with. Prepared statements are not cached, each has a
+/// private copy of its query.
+StatementResult statement_prepare(const char *sql);
+
+/// The parsed query, with '?' in place of the parameters of a prepared statement
+const Query *statement_query(const Statement *statement);
+
+size_t statement_param_count(const Statement *statement);
+
+/// The type of the value the parameter [index] (counted from 0, in the order of
+/// the statement text) takes
+BaseType statement_param_type(const Statement *statement, size_t index);
+
+/// Run [statement] with the [count] values of [params] bound to its parameters, in
+/// order, writing the rows it returns to [out]. Fails with RESULT_INVALID_QUERY if
+/// [count] is not the number of parameters, and with RESULT_VALUE_TYPE if a value
+/// does not fit its type. Runs of the same prepared statement take turns.
+QueryResponse statement_execute(Statement *statement, const char *const *params,
+                                size_t count, FILE *out);
+
+/// Drop the caller's reference to [statement]
+void statement_release(Statement *statement);
+
+/// Prepared statements by name, for PREPARE, EXECUTE and DEALLOCATE. The names are
+/// shared by every client. The registry keeps its own reference to the statement.
+BazaResult statement_register(const char *name, Statement *statement);
+/// Returns a reference to the statement named [name], NULL if there is none
+Statement *statement_lookup(const char *name);
+BazaResult statement_unregister(const char *name);
+
+#endif /* _STATEMENT_H */
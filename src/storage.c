@@ -1,5 +1,7 @@
 #include "storage.h"
 #include "storage_internal.h"
+#include "storage_sort.h"
+#include "storage_wal.h"
 #include "util/result.h"
 
 #include <string.h>
@@ -75,13 +77,109 @@ BaseType basetype_from_str(const char *type)
     return BTYPE_INVALID;
 }
 
+/// The calling thread's snapshot, see table_snapshot_begin
+static _Thread_local TableSnapshot *SNAPSHOT = NULL;
+
+/// Start reading [tptr]: through the calling thread's snapshot of it if it has one,
+/// otherwise by read locking it. Returns the table to read, for table_read_end.
+static Table *table_read_begin(Table *tptr)
+{
+    if (SNAPSHOT && SNAPSHOT->table == tptr)
+        return &SNAPSHOT->view;
+
+    itable_lock(tptr, TABLE_LOCK_READ);
+
+    return tptr;
+}
+
+static void table_read_end(Table *read)
+{
+    if (!SNAPSHOT || read != &SNAPSHOT->view)
+        itable_unlock(read);
+}
+
+/// Snapshots have no indexes of their own. The live ones answer for them as long
+/// as nobody modified [tptr], whose lock the caller holds, since the snapshot was taken.
+static bool table_indexes_visible(Table *tptr)
+{
+    return !SNAPSHOT || SNAPSHOT->table != tptr || SNAPSHOT->modifications == tptr->modifications;
+}
+
+BazaResult table_snapshot_begin(TableID_t table)
+{
+    Table *tptr = idb_table_get_byid(table);
+    if (!tptr)
+        return RESULT_TABLE_NOT_FOUND;
+
+    if (SNAPSHOT)
+        FATAL("a thread can hold at most one snapshot, this is a bug");
+
+    itable_lock(tptr, TABLE_LOCK_READ);
+    SNAPSHOT = itable_snapshot_open(tptr);
+    itable_unlock(tptr);
+
+    return SNAPSHOT ? RESULT_OK : RESULT_ALLOC;
+}
+
+void table_snapshot_end(void)
+{
+    if (!SNAPSHOT)
+        return;
+
+    itable_snapshot_close(SNAPSHOT);
+    SNAPSHOT = NULL;
+}
+
 BazaResult table_column_new(TableID_t tid, BaseType type, const char *name)
 {
     Table *tptr = idb_table_get_byid(tid);
     if (!tptr)
         return RESULT_TABLE_NOT_FOUND;
 
-    return itable_column_new(tptr, type, name);
+    itable_lock(tptr, TABLE_LOCK_WRITE);
+    BazaResult res = itable_column_new(tptr, type, name);
+    itable_unlock(tptr);
+
+    return res;
+}
+
+BazaResult table_column_dict_encode(TableID_t tid, ColumnID_t cid)
+{
+    Table *tptr = idb_table_get_byid(tid);
+    if (!tptr)
+        return RESULT_TABLE_NOT_FOUND;
+
+    itable_lock(tptr, TABLE_LOCK_WRITE);
+
+    Column *column = itable_column_byid(tptr, cid);
+    BazaResult res = column ? itable_column_dict_encode(tptr, column, UINT32_MAX - 1) : RESULT_COLUMN_NOT_FOUND;
+
+    itable_unlock(tptr);
+
+    return res;
+}
+
+BazaResult table_dict_encode_auto(TableID_t tid)
+{
+    Table *tptr = idb_table_get_byid(tid);
+    if (!tptr)
+        return RESULT_TABLE_NOT_FOUND;
+
+    itable_lock(tptr, TABLE_LOCK_WRITE);
+
+    uint64_t live = tptr->meta.row_count - tptr->dead_count;
+    uint64_t max_values = live * BAZA_DICT_AUTO_MAX_PERCENT / 100;
+
+    BazaResult res = RESULT_OK;
+    for (size_t i = 0; res == RESULT_OK && i < tptr->column_count; i++) {
+        Column *column = &tptr->columns[i];
+        if (column->meta.type == BTYPE_STRING)
+            res = itable_column_dict_encode(tptr, column, max_values);
+    }
+
+    itable_unlock(tptr);
+
+    return res;
 }
 
 ColumnResult table_column_get(TableID_t tid, const char *column_name)
@@ -90,18 +188,16 @@ ColumnResult table_column_get(TableID_t tid, const char *column_name)
     if (!tptr)
         return (ColumnResult) { .result = RESULT_TABLE_NOT_FOUND };
 
-    Column *column = tptr->columns;
-    while (column) {
-        if (!strcmp(column->meta.name, column_name)) {
-            return (ColumnResult) {
-                .result = RESULT_OK,
-                .meta = column->meta,
-            };
-        }
-        column = column->next;
-    }
+    Table *read = table_read_begin(tptr);
 
-    return (ColumnResult) { .result = RESULT_COLUMN_NOT_FOUND };
+    Column *column = itable_column_find(read, column_name);
+    ColumnResult res = { .result = RESULT_COLUMN_NOT_FOUND };
+    if (column)
+        res = (ColumnResult) { .result = RESULT_OK, .meta = column->meta };
+
+    table_read_end(read);
+
+    return res;
 }
 
 ColumnMetaList *table_column_get_list(TableID_t tid, StrList *list)
@@ -113,22 +209,18 @@ ColumnMetaList *table_column_get_list(TableID_t tid, StrList *list)
         return NULL;
 
     ColumnMetaList *cmlst = columnlist_empty();
-    Column *column = tptr->columns;
 
-    if (!list) {
+    Table *read = table_read_begin(tptr);
+
+    for (size_t i = 0; i < read->column_count; i++) {
+        Column *column = &read->columns[i];
         // No columns specified, return all of them
-        while (column) {
+        if (!list || strlist_contains(list, column->meta.name))
             columnlist_push(cmlst, column->meta);
-            column = column->next;
-        }
-    } else {
-        while (column) {
-            if (strlist_contains(list, column->meta.name))
-                columnlist_push(cmlst, column->meta);
-            column = column->next;
-        }
     }
 
+    table_read_end(read);
+
     return cmlst;
 }
 
@@ -138,14 +230,32 @@ void *table_column_get_row(TableID_t tid, ColumnID_t cid, uint64_t nth)
     if (!tptr)
         return NULL;
 
-    if (nth > tptr->meta.row_count)
-        return NULL;
+    Table *read = table_read_begin(tptr);
+
+    void *row = NULL;
+    Column *column = itable_column_byid(read, cid);
+    if (column && nth < read->meta.row_count && !itable_row_is_deleted(read, nth))
+        row = icolumn_row_get(column, nth);
+
+    table_read_end(read);
+
+    return row;
+}
+
+BazaResult table_column_set_row(TableID_t tid, ColumnID_t cid, uint64_t nth, const void *value)
+{
+    Table *tptr = idb_table_get_byid(tid);
+    if (!tptr)
+        return RESULT_TABLE_NOT_FOUND;
+
+    itable_lock(tptr, TABLE_LOCK_WRITE);
 
     Column *column = itable_column_byid(tptr, cid);
-    if (!column)
-        return NULL;
+    BazaResult res = column ? itable_row_set(tptr, column, nth, value) : RESULT_COLUMN_NOT_FOUND;
+
+    itable_unlock(tptr);
 
-    return icolumn_row_get(column, nth);
+    return res;
 }
 
 BazaResult table_row_add(TableID_t table)
@@ -154,12 +264,11 @@ BazaResult table_row_add(TableID_t table)
     if (!tptr)
         return RESULT_TABLE_NOT_FOUND;
 
-    tptr->meta.row_count++;
+    itable_lock(tptr, TABLE_LOCK_WRITE);
+    BazaResult res = itable_row_add(tptr);
+    itable_unlock(tptr);
 
-    if (tptr->meta.row_count == tptr->row_capacity)
-        itable_realloc(tptr, tptr->row_capacity * 2);
-
-    return RESULT_OK;
+    return res;
 }
 
 /// Delete [row] in [table]
@@ -169,7 +278,104 @@ BazaResult table_row_delete(TableID_t table, uint64_t row)
     if (!tptr)
         return RESULT_TABLE_NOT_FOUND;
 
-    return itable_row_delete(tptr, row);
+    itable_lock(tptr, TABLE_LOCK_WRITE);
+    BazaResult res = itable_row_delete(tptr, row);
+    itable_unlock(tptr);
+
+    return res;
+}
+
+BazaResult table_compact(TableID_t table, bool force)
+{
+    Table *tptr = idb_table_get_byid(table);
+    if (!tptr)
+        return RESULT_TABLE_NOT_FOUND;
+
+    itable_lock(tptr, TABLE_LOCK_WRITE);
+
+    BazaResult res = RESULT_OK;
+    if (force || itable_should_compact(tptr))
+        res = itable_compact(tptr, force);
+
+    itable_unlock(tptr);
+
+    return res;
+}
+
+BazaResult table_analyze(TableID_t table, bool force)
+{
+    Table *tptr = idb_table_get_byid(table);
+    if (!tptr)
+        return RESULT_TABLE_NOT_FOUND;
+
+    itable_lock(tptr, TABLE_LOCK_WRITE);
+    BazaResult res = itable_analyze(tptr, force);
+    itable_unlock(tptr);
+
+    return res;
+}
+
+BazaResult table_save(TableID_t table)
+{
+    Table *tptr = idb_table_get_byid(table);
+    if (!tptr)
+        return RESULT_TABLE_NOT_FOUND;
+
+    itable_lock(tptr, TABLE_LOCK_WRITE);
+    BazaResult res = itable_save(tptr);
+    itable_unlock(tptr);
+
+    return res;
+}
+
+BazaResult db_checkpoint(void)
+{
+    return idb_checkpoint();
+}
+
+BazaResult db_commit(void)
+{
+    iwal_commit();
+
+    return RESULT_OK;
+}
+
+BazaResult table_lock(TableID_t table, TableLockMode mode)
+{
+    Table *tptr = idb_table_get_byid(table);
+    if (!tptr)
+        return RESULT_TABLE_NOT_FOUND;
+
+    itable_lock(tptr, mode);
+
+    return RESULT_OK;
+}
+
+BazaResult table_unlock(TableID_t table)
+{
+    Table *tptr = idb_table_get_byid(table);
+    if (!tptr)
+        return RESULT_TABLE_NOT_FOUND;
+
+    itable_unlock(tptr);
+
+    return RESULT_OK;
+}
+
+TableFindResult table_rows_live(TableID_t table)
+{
+    Table *tptr = idb_table_get_byid(table);
+    if (!tptr)
+        return (TableFindResult) { .res = RESULT_TABLE_NOT_FOUND };
+
+    Table *read = table_read_begin(tptr);
+    Selection *live = itable_live_rows(read);
+    table_read_end(read);
+
+    if (!live)
+        return (TableFindResult) { .res = RESULT_ALLOC };
+
+    return (TableFindResult) { .res = RESULT_OK, .matches = live };
 }
 
 BazaResult table_row_print(TableID_t table, IntList *ColumnIDs, uint64_t row)
@@ -178,21 +384,190 @@ BazaResult table_row_print(TableID_t table, IntList *ColumnIDs, uint64_t row)
     if (!tptr)
         return RESULT_TABLE_NOT_FOUND;
 
-    itable_row_print(tptr, ColumnIDs, row);
+    Table *read = table_read_begin(tptr);
+    itable_row_print(read, ColumnIDs, row);
+    table_read_end(read);
     
     return RESULT_OK;
 }
 
-TableFindResult table_find(TableID_t tid, ColumnID_t cid,
-                           findfunc_t func, void *value)
+TableFindResult table_find(TableID_t tid, ColumnID_t cid, FilterOp op, const void *value,
+                           const Selection *within)
 {
     Table *tptr = idb_table_get_byid(tid);
     if (!tptr)
-        return (TableFindResult) { .res = RESULT_ALLOC };
+        return (TableFindResult) { .res = RESULT_TABLE_NOT_FOUND };
+
+    Table *read = table_read_begin(tptr);
+
+    Column *cptr = itable_column_byid(read, cid);
+    TableFindResult res = { .res = RESULT_COLUMN_NOT_FOUND };
+    if (cptr)
+        res = itable_find(read, cptr, op, value, within);
+
+    table_read_end(read);
+
+    return res;
+}
+
+TableFindResult table_find_range(TableID_t tid, ColumnID_t cid, ValueRange range,
+                                 const Selection *within)
+{
+    Table *tptr = idb_table_get_byid(tid);
+    if (!tptr)
+        return (TableFindResult) { .res = RESULT_TABLE_NOT_FOUND };
+
+    Table *read = table_read_begin(tptr);
+
+    Column *cptr = itable_column_byid(read, cid);
+    TableFindResult res = { .res = RESULT_COLUMN_NOT_FOUND };
+    if (cptr)
+        res = itable_find_range(read, cptr, range, within);
+
+    table_read_end(read);
+
+    return res;
+}
+
+IndexKind indexkind_from_str(const char *str)
+{
+    if (!str || str_ieq(str, "hash"))
+        return INDEX_HASH;
+    else if (str_ieq(str, "btree"))
+        return INDEX_BTREE;
+
+    return INDEX_INVALID;
+}
+
+BazaResult table_index_new(TableID_t tid, ColumnID_t cid, const char *name, IndexKind kind)
+{
+    Table *tptr = idb_table_get_byid(tid);
+    if (!tptr)
+        return RESULT_TABLE_NOT_FOUND;
+
+    itable_lock(tptr, TABLE_LOCK_WRITE);
+
+    Column *cptr = itable_column_byid(tptr, cid);
+    BazaResult res = cptr ? itable_index_new(tptr, cptr, name, kind) : RESULT_COLUMN_NOT_FOUND;
+
+    itable_unlock(tptr);
+
+    return res;
+}
+
+TableFindResult table_lookup_equal(TableID_t tid, ColumnID_t cid, const void *value)
+{
+    Table *tptr = idb_table_get_byid(tid);
+    if (!tptr)
+        return (TableFindResult) { .res = RESULT_TABLE_NOT_FOUND };
+
+    itable_lock(tptr, TABLE_LOCK_READ);
+
+    Column *cptr = itable_column_byid(tptr, cid);
+    TableFindResult res = { .res = RESULT_COLUMN_NOT_FOUND };
+    if (!table_indexes_visible(tptr))
+        res.res = RESULT_INDEX_NOT_FOUND;
+    else if (cptr)
+        res = itable_lookup_equal(tptr, cptr, value);
+
+    itable_unlock(tptr);
+
+    return res;
+}
+
+TableFindResult table_lookup_range(TableID_t tid, ColumnID_t cid, ValueRange range)
+{
+    Table *tptr = idb_table_get_byid(tid);
+    if (!tptr)
+        return (TableFindResult) { .res = RESULT_TABLE_NOT_FOUND };
+
+    itable_lock(tptr, TABLE_LOCK_READ);
+
+    Column *cptr = itable_column_byid(tptr, cid);
+    TableFindResult res = { .res = RESULT_COLUMN_NOT_FOUND };
+    if (!table_indexes_visible(tptr))
+        res.res = RESULT_INDEX_NOT_FOUND;
+    else if (cptr)
+        res = itable_lookup_range(tptr, cptr, range);
+
+    itable_unlock(tptr);
+
+    return res;
+}
+
+// the zones and dictionaries of a snapshot are its own, the indexes belong to the live table
+static ColumnEstimate table_estimate_internal(TableID_t tid, ColumnID_t cid, FilterOp op,
+                                              const void *value, ValueRange range)
+{
+    Table *tptr = idb_table_get_byid(tid);
+    if (!tptr)
+        return (ColumnEstimate) { .res = RESULT_TABLE_NOT_FOUND };
+
+    Table *read = table_read_begin(tptr);
+
+    Column *cptr = itable_column_byid(read, cid);
+    ColumnEstimate est = { .res = RESULT_COLUMN_NOT_FOUND };
+    if (cptr)
+        est = itable_estimate(read, cptr, op, value, range);
+
+    table_read_end(read);
+
+    if (est.res != RESULT_OK)
+        return est;
+
+    itable_lock(tptr, TABLE_LOCK_READ);
+
+    cptr = itable_column_byid(tptr, cid);
+    if (cptr && table_indexes_visible(tptr))
+        itable_estimate_index(cptr, op, value, range, &est);
+
+    itable_unlock(tptr);
+
+    return est;
+}
+
+ColumnEstimate table_estimate(TableID_t tid, ColumnID_t cid, FilterOp op, const void *value)
+{
+    return table_estimate_internal(tid, cid, op, value, (ValueRange) { 0 });
+}
+
+ColumnEstimate table_estimate_range(TableID_t tid, ColumnID_t cid, ValueRange range)
+{
+    return table_estimate_internal(tid, cid, FILTER_NONE, NULL, range);
+}
+
+TableOrderResult table_lookup_ordered(TableID_t tid, ColumnID_t cid, SortDirection direction)
+{
+    Table *tptr = idb_table_get_byid(tid);
+    if (!tptr)
+        return (TableOrderResult) { .res = RESULT_TABLE_NOT_FOUND };
+
+    itable_lock(tptr, TABLE_LOCK_READ);
 
     Column *cptr = itable_column_byid(tptr, cid);
+    TableOrderResult res = { .res = RESULT_COLUMN_NOT_FOUND };
+    if (!table_indexes_visible(tptr))
+        res.res = RESULT_INDEX_NOT_FOUND;
+    else if (cptr)
+        res = itable_lookup_ordered(tptr, cptr, direction);
 
-    return itable_find(tptr, cptr, func, value);
+    itable_unlock(tptr);
+
+    return res;
+}
+
+BazaResult table_sort(TableID_t tid, const TableSortKey *keys, size_t key_count,
+                      uint64_t *rows, size_t count)
+{
+    Table *tptr = idb_table_get_byid(tid);
+    if (!tptr)
+        return RESULT_TABLE_NOT_FOUND;
+
+    Table *read = table_read_begin(tptr);
+    BazaResult res = isort_rows(read, keys, key_count, rows, count);
+    table_read_end(read);
+
+    return res;
 }
 
 TableResult db_table_get(const char *table_name)
@@ -205,9 +580,14 @@ TableResult db_table_get(const char *table_name)
         };
     }
 
+    // row_count changes with every insert
+    Table *read = table_read_begin(tptr);
+    TableMeta meta = read->meta;
+    table_read_end(read);
+
     return (TableResult) {
         .result = RESULT_OK,
-        .meta = tptr->meta,
+        .meta = meta,
     };
 }
 
@@ -217,4 +597,130 @@ TableResult db_table_new(const char *table_name)
 }
 
 
+/// Re-read the storage behind a cursor column, whose chunk array moves when chunks are added
+/// (and for dictionary encoded columns, when new values are added)
+static void cursor_column_refresh(CursorColumn *ccol)
+{
+    Column *column = ccol->column;
+
+    ccol->chunks = (byte**)column->chunks;
+    ccol->stride = icolumn_cell_size(column);
+    ccol->dict = column->dict ? column->dict->values : NULL;
+}
+
+TableCursorResult table_cursor_open(TableID_t tid, ColumnMetaList *columns, TableLockMode mode)
+{
+    Table *tptr = idb_table_get_byid(tid);
+    if (!tptr)
+        return (TableCursorResult) { .res = RESULT_TABLE_NOT_FOUND };
+
+    TableCursor *cursor = malloc(sizeof(TableCursor));
+    if (!cursor)
+        return (TableCursorResult) { .res = RESULT_ALLOC };
+
+    // held until table_cursor_close, read cursors of a thread with a snapshot read that instead
+    if (mode == TABLE_LOCK_READ)
+        tptr = table_read_begin(tptr);
+    else
+        itable_lock(tptr, mode);
+
+    *cursor = (TableCursor) {
+        .meta = tptr->meta,
+        .columns = malloc((tptr->column_count ? tptr->column_count : 1) * sizeof(CursorColumn)),
+        .column_count = 0,
+        .table = tptr,
+        .mode = mode,
+    };
+
+    if (!cursor->columns) {
+        table_cursor_close(cursor);
+        return (TableCursorResult) { .res = RESULT_ALLOC };
+    }
+
+    if (!columns) {
+        for (size_t i = 0; i < tptr->column_count; i++)
+            cursor->columns[cursor->column_count++].column = &tptr->columns[i];
+    } else {
+        for (ColumnMetaList *col = columns; col && col->meta; col = col->next) {
+            Column *column = itable_column_byid(tptr, col->meta->id);
+            if (!column || cursor->column_count == tptr->column_count) {
+                table_cursor_close(cursor);
+                return (TableCursorResult) { .res = RESULT_COLUMN_NOT_FOUND };
+            }
+            cursor->columns[cursor->column_count++].column = column;
+        }
+    }
+
+    for (size_t i = 0; i < cursor->column_count; i++) {
+        cursor->columns[i].meta = cursor->columns[i].column->meta;
+        cursor_column_refresh(&cursor->columns[i]);
+    }
+
+    return (TableCursorResult) { .res = RESULT_OK, .cursor = cursor };
+}
+
+void table_cursor_close(TableCursor *cursor)
+{
+    if (!cursor)
+        return;
+
+    if (cursor->mode == TABLE_LOCK_READ)
+        table_read_end(cursor->table);
+    else
+        itable_unlock(cursor->table);
+
+    free(cursor->columns);
+    free(cursor);
+}
+
+void *table_cursor_get(TableCursor *cursor, size_t nth, uint64_t row)
+{
+    CursorColumn *ccol = &cursor->columns[nth];
+
+    byte *cell = ccol->chunks[row >> BAZA_CHUNK_SHIFT] + (row & BAZA_CHUNK_MASK) * ccol->stride;
+
+    if (ccol->dict)
+        return &ccol->dict[*(DictCode_t*)cell];
+
+    return cell;
+}
+
+BazaResult table_cursor_set(TableCursor *cursor, size_t nth, uint64_t row, const void *value)
+{
+    CursorColumn *ccol = &cursor->columns[nth];
+
+    // a no-op for write cursors, catches writes through read cursors
+    itable_lock(cursor->table, TABLE_LOCK_WRITE);
+
+    BazaResult res = itable_row_set(cursor->table, ccol->column, row, value);
+    cursor_column_refresh(ccol);
+
+    itable_unlock(cursor->table);
+
+    return res;
+}
+
+BazaResult table_cursor_row_add(TableCursor *cursor, uint64_t *row)
+{
+    itable_lock(cursor->table, TABLE_LOCK_WRITE);
+
+    *row = cursor->table->meta.row_count;
+
+    BazaResult res = itable_row_add(cursor->table);
+
+    cursor->meta = cursor->table->meta;
+    for (size_t i = 0; i < cursor->column_count; i++)
+        cursor_column_refresh(&cursor->columns[i]);
+
+    itable_unlock(cursor->table);
+
+    return res;
+}
+
+void table_cursor_row_print(TableCursor *cursor, uint64_t row, FILE *out)
+{
+    for (size_t i = 0; i < cursor->column_count; i++)
+        icell_print(out, cursor->columns[i].meta.type, table_cursor_get(cursor, i, row));
+}
+
 // storage_init and storage_deinit are implemented in storage_internal
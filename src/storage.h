@@ -4,6 +4,7 @@
 #include "parser.h"
 #include "util/result.h"
 #include "util/intlist.h"
+#include "util/selection.h"
 #include "util/defs.h"
 #include "util/str.h"
 
@@ -15,14 +16,22 @@
 /// database as well as to fetch information about tables. Conceptually
 /// the db "object" is a singleton, so no handles/descriptors are necessary
 /// to call these functions. 
-/// (TODO: in multithreaded scenarios you may need to take a mutex to 
-/// perform certain operations)
 ///
 /// Table: a table as generally understood in the context of relational
 /// databases. Contains a list of columns.
 ///
 /// Column: a column as generally understood in the context of relational
 /// databases. Contains a list of rows.
+///
+/// Threads: every function here may be called from any thread. The catalog of
+/// tables has a lock of its own and every table has a reader-writer lock, which
+/// each table_* function takes for its duration: functions that only read the
+/// table (table_find, table_lookup_*, table_column_get_row, ...) share it, those
+/// that modify it (table_column_set_row, table_row_add, table_compact, ...) hold
+/// it exclusively. Anything spanning several calls, like row IDs returned by
+/// table_find or pointers returned by table_column_get_row, is only stable while
+/// the caller holds the table's lock itself, see table_lock, or reads the table
+/// through a snapshot, see table_snapshot_begin.
 
 typedef enum BaseType {
     BTYPE_INVALID,
@@ -38,13 +47,15 @@ void basetype_print(BaseType type, void *data);
 char *basetype_value_to_str(BaseType type, void *value);
 BaseType basetype_from_str(const char *type);
 
+/// Table ids are assigned in creation order, column ids are the column's position
+/// within its table (so they are only meaningful together with the table id).
 typedef uint64_t TableID_t;
 #define TABLE_ID_INVALID (-1)
 
 typedef struct TableMeta {
     TableID_t id;
     char *name;
-    uint64_t row_count;
+    uint64_t row_count; // including deleted rows which have not been compacted yet
 } TableMeta;
 
 typedef uint64_t ColumnID_t;
@@ -66,7 +77,8 @@ void columnlist_free(ColumnMetaList *list);
 void columnlist_push(ColumnMetaList *list, ColumnMeta value);
 void columnlist_print(ColumnMetaList *list);
 
-/// Initialize the entire backend
+/// Initialize the entire backend, loading every table saved in the data directory
+/// (which is created if it does not exist yet)
 void storage_init();
 
 /// Deinitialize the entire backend
@@ -98,6 +110,16 @@ typedef struct ColumnCreationResult {
 BazaResult table_column_new(TableID_t table, 
                             BaseType type, const char *name);
 
+/// Switch the string [column] to dictionary encoding: every distinct value is stored
+/// once and rows only hold small integer codes. Filters on such a column evaluate
+/// their predicate once per distinct value. Otherwise this is transparent to the
+/// rest of the storage API.
+BazaResult table_column_dict_encode(TableID_t table, ColumnID_t column);
+
+/// Dictionary encode the string columns of [table] which hold few distinct values
+/// compared to the number of rows. Meant to be called after bulk loads.
+BazaResult table_dict_encode_auto(TableID_t table);
+
 /// Returns the column meta of a given column, if it exists.
 ColumnResult table_column_get(TableID_t table, 
                               const char *column_name);
@@ -110,39 +132,239 @@ ColumnMetaList *table_column_get_list(TableID_t table, StrList *list);
 /// Deletes [column] from [table].
 BazaResult table_column_delete(TableID_t table, ColumnID_t column);
 
-/// Get the [nth] row from [column] in [table]. Returns NULL if out of range.
-/// Since even in a multithreaded context this is expected to be called only
-/// after acquiring a lock (and dropped afterwards), this pointer may also
-/// be used to modify the row contents (aka "exclusive raw mutable pointer" in rusty terms).
+/// Get the [nth] row from [column] in [table]. Returns NULL if out of range or deleted.
+/// The pointer is only valid until the table is modified (so, with other threads
+/// around, while the caller holds the table's lock) and must not be written
+/// through (dictionary encoded columns share it between rows), use table_column_set_row.
 /// It is up to the caller to interpret the return pointer type.
 /// The storage backend guarantees correct alignment.
 void *table_column_get_row(TableID_t table, ColumnID_t column, uint64_t nth);
 
-void *table_column_set_row(TableID_t table, ColumnID_t column, uint64_t nth, void *value);
+/// Set the [nth] row of [column] in [table] to [value]. [value] points to a value of the
+/// column's type, i.e. a char* for strings, which the backend copies. Unlike writing
+/// through table_column_get_row, this keeps any indexes on the column up to date.
+BazaResult table_column_set_row(TableID_t table, ColumnID_t column, uint64_t nth, const void *value);
 
-/// Make space for an additional row, incrementing the internal row_count of the table
+/// Make space for an additional row, incrementing the internal row_count of the table.
+/// The new row is zeroed (strings are NULL) until set with table_column_set_row.
 BazaResult table_row_add(TableID_t table);
 
-/// Delete [row] in [table]
+/// Delete [row] in [table]. The row is only marked as deleted: it is skipped by 
+/// table_find, table_rows_live and the index lookups, and row IDs stay stable 
+/// until the table is compacted with table_compact.
 BazaResult table_row_delete(TableID_t table, uint64_t row);
 
-/// Print a row to stdout
+/// Physically remove the deleted rows from [table], renumbering the remaining ones.
+/// Unless [force] is set, this only happens once enough of the table is dead for 
+/// the pass to pay off; forcing it also reclaims the space of overwritten strings.
+/// Row IDs obtained before the call are invalidated.
+BazaResult table_compact(TableID_t table, bool force);
+
+/// Collect statistics of the values in every column of [table] for table_estimate:
+/// how many distinct ones there are, the most common ones and a histogram of the
+/// rest, taken from a sample of the rows. They are not saved with the table. Unless
+/// [force] is set, only the columns analyzed before which have changed enough since
+/// are analyzed again.
+BazaResult table_analyze(TableID_t table, bool force);
+
+/// Write [table] to its file in the data directory, compacting it first. On the next
+/// start storage_init maps the file instead of the table having to be rebuilt.
+BazaResult table_save(TableID_t table);
+
+/// Save every table, as with table_save, then empty the write-ahead log
+BazaResult db_checkpoint(void);
+
+/// End a statement. Every change is logged to the write-ahead log in the data
+/// directory as it is made, and replayed by storage_init after a crash if the
+/// statement was committed. Whether the log is fsync'ed here depends on the
+/// BAZA_WAL_SYNC environment variable: "always", "group" (the default, like
+/// "always" but waiting up to BAZA_WAL_GROUP_MS milliseconds for the statements
+/// of other threads, to share one fsync with them) or "off". Under "always" and
+/// "group" the statement is on disk when this returns, under "off" a crash of
+/// the OS can lose any of the statements since the last checkpoint.
+BazaResult db_commit(void);
+
+typedef enum TableLockMode {
+    TABLE_LOCK_READ,  // shared with other readers, nobody can modify the table
+    TABLE_LOCK_WRITE, // exclusive
+} TableLockMode;
+
+/// Lock [table] for the calling thread until the matching table_unlock, so that row
+/// IDs and row pointers stay valid across several calls. Table locks are re-entrant:
+/// the table_* functions called while holding one do not take it again, as long as
+/// the lock held is enough for them (a read lock cannot be upgraded, modifying a
+/// table locked for reading is a bug). Hold at most one table's lock at a time, or
+/// lock tables in the order of their IDs, to avoid deadlocks.
+BazaResult table_lock(TableID_t table, TableLockMode mode);
+
+BazaResult table_unlock(TableID_t table);
+
+/// Take a snapshot of [table] for the calling thread: until table_snapshot_end,
+/// every function reading the table (including read cursors) sees it as it was
+/// at this point, without taking its lock, so that long readers neither block
+/// writers nor are blocked by them. Row IDs and row pointers stay valid for as
+/// long as the snapshot. Writers copy the chunks of rows a snapshot sees before
+/// changing them, and the storage they replace is freed once no snapshot needs it.
+/// The index lookups only answer while nobody has modified the table since the
+/// snapshot was taken, RESULT_INDEX_NOT_FOUND sends the caller to table_find after
+/// that. A thread has at most one snapshot, and the table's own writes are not
+/// visible through it.
+BazaResult table_snapshot_begin(TableID_t table);
+
+/// Release the calling thread's snapshot, after closing its cursors
+void table_snapshot_end(void);
+
+/// Print a row to stdout, nothing if it is out of range or deleted
 BazaResult table_row_print(TableID_t table, IntList *ColumnIDs, uint64_t row);
 
 // NOTE: it is the responsiblity of the caller to free [matches]
 typedef struct TableFindResult {
     BazaResult res;
-    IntList *matches;
+    Selection *matches;
 } TableFindResult;
 
-/// Args: 
-///    type: type of the column (and thus both of the values)
-///    left: value already present in the column 
-///    right: value supplied as the [value] arg in table_find
-typedef bool (findfunc_t)(BaseType type, const void *left, const void *right);
+// NOTE: it is the responsiblity of the caller to free [rows]
+typedef struct TableOrderResult {
+    BazaResult res;
+    uint64_t *rows;
+    size_t count;
+} TableOrderResult;
+
+/// Returns the set of row IDs whose [column] satisfies [op] [value], by scanning the
+/// column. [value] points to an int64_t for integer columns (int32 columns compare
+/// against its low 32 bits) and is a char* for string columns. LIKE on an integer
+/// column is the same as equality.
+/// Unless [within] is NULL, only the rows in it are examined and the result is a
+/// subset of it, e.g. to refine the rows matching the previous conditions of an AND.
+TableFindResult table_find(TableID_t table, ColumnID_t column, FilterOp op, const void *value,
+                           const Selection *within);
+
+/// A range of column values. Bounds use the same convention as the value in
+/// table_find, a NULL bound leaves that side of the range open.
+typedef struct ValueRange {
+    const void *lower;
+    bool lower_inclusive;
+    const void *upper;
+    bool upper_inclusive;
+} ValueRange;
+
+/// Returns the set of row IDs whose [column] lies within [range], by scanning the column.
+/// [within] limits the rows examined, as in table_find.
+TableFindResult table_find_range(TableID_t table, ColumnID_t column, ValueRange range,
+                                 const Selection *within);
+
+/// Returns the set of all rows in [table] which are not deleted
+TableFindResult table_rows_live(TableID_t table);
+
+typedef enum IndexKind {
+    INDEX_HASH,   // equality lookups only
+    INDEX_BTREE,  // ordered: equality, ranges and ordered scans
+    INDEX_INVALID,
+} IndexKind;
+
+/// Parse an index kind ("hash" or "btree"). NULL selects the default (hash).
+IndexKind indexkind_from_str(const char *str);
+
+/// What the storage can tell about the rows of a column satisfying a predicate
+/// without looking at them, for planning: judging by the zones of the column's
+/// chunks (see table_find), its statistics (see table_analyze), its dictionary and
+/// its indexes. Nothing is scanned
+/// (stale zones are not refreshed either), so it is cheap to ask before every statement.
+typedef struct ColumnEstimate {
+    BazaResult res;
+    uint64_t rows;         // live rows in the table
+    double matches;        // estimated live rows satisfying the predicate
+    size_t chunks;         // of the column
+    size_t chunks_skipped; // those whose zone rules the predicate in or out, so a scan skips them
+    uint64_t distinct;     // distinct values of a dictionary encoded column, 0 if not known
+    IndexKind index;       // that table_lookup_* would answer the predicate with, INDEX_INVALID if none
+} ColumnEstimate;
+
+/// Estimate the rows of [column] satisfying [op] [value], see table_find
+ColumnEstimate table_estimate(TableID_t table, ColumnID_t column, FilterOp op, const void *value);
+
+/// Estimate the rows of [column] within [range], see table_find_range
+ColumnEstimate table_estimate_range(TableID_t table, ColumnID_t column, ValueRange range);
+
+/// Create an index of [kind] called [name] over [column], used by the table_lookup_*
+/// functions. Once created, the index is maintained by every function modifying the table.
+/// A column can have at most one index of each kind.
+BazaResult table_index_new(TableID_t table, ColumnID_t column, const char *name, IndexKind kind);
+
+/// Returns the set of row IDs whose [column] equals [value] (same convention as in
+/// table_find) by consulting an index. If the column is not indexed, .res is
+/// RESULT_INDEX_NOT_FOUND and the caller is expected to fall back to table_find.
+TableFindResult table_lookup_equal(TableID_t table, ColumnID_t column, const void *value);
+
+/// Like table_lookup_equal, but for ranges (see table_find_range), which can only be
+/// answered by an ordered index. Matches are returned in ascending row order.
+TableFindResult table_lookup_range(TableID_t table, ColumnID_t column, ValueRange range);
+
+/// Returns every row ID in [table] ordered by the values in [column] through an 
+/// ordered index, or RESULT_INDEX_NOT_FOUND if there is none. Rows with equal
+/// values are in ascending order either way, as table_sort leaves them.
+TableOrderResult table_lookup_ordered(TableID_t table, ColumnID_t column, SortDirection direction);
+
+/// A key of table_sort
+typedef struct TableSortKey {
+    ColumnID_t column;
+    SortDirection direction;
+} TableSortKey;
+
+/// Sorts the [count] row IDs at [rows] in place by the values of the columns in
+/// [keys]: by the first one, rows equal in it by the second one and so on. Rows
+/// equal in all of them keep their order. NULL strings come before any other.
+BazaResult table_sort(TableID_t table, const TableSortKey *keys, size_t key_count,
+                      uint64_t *rows, size_t count);
+
+/// A column resolved by table_cursor_open. [chunks] points straight at the column's
+/// row chunks and is refreshed by the table_cursor_* functions whenever the storage
+/// moves; use table_cursor_get to interpret it.
+typedef struct CursorColumn {
+    ColumnMeta meta;
+    struct Column *column;
+    byte **chunks; // the column's chunks of rows
+    size_t stride; // bytes per row in a chunk
+    char **dict;   // if not NULL, [chunks] hold 32 bit codes into [dict] (dictionary encoding)
+} CursorColumn;
+
+/// A table together with a set of resolved columns, for loops touching many cells:
+/// the table and the columns are looked up once, when the cursor is opened. The
+/// cursor holds the table's lock in its mode until it is closed (read cursors of
+/// a thread with a snapshot of the table read that instead), and stays valid
+/// until the table is modified through anything but the cursor itself (e.g.
+/// table_compact, or a table_column_set_row on one of its columns).
+typedef struct TableCursor {
+    TableMeta meta;        // row_count is kept up to date by table_cursor_row_add
+    CursorColumn *columns; // in the order they were requested in
+    size_t column_count;
+    struct Table *table;
+    TableLockMode mode;
+} TableCursor;
+
+typedef struct TableCursorResult {
+    BazaResult res;
+    TableCursor *cursor;
+} TableCursorResult;
+
+/// Open a cursor over [columns] of [table]. NULL selects all of the table's columns.
+/// Only cursors opened with TABLE_LOCK_WRITE can modify the table.
+TableCursorResult table_cursor_open(TableID_t table, ColumnMetaList *columns, TableLockMode mode);
+
+void table_cursor_close(TableCursor *cursor);
+
+/// Get [row] of the [nth] column of [cursor], with the same convention as
+/// table_column_get_row. No bounds checks performed.
+void *table_cursor_get(TableCursor *cursor, size_t nth, uint64_t row);
+
+/// Set [row] of the [nth] column of [cursor], as in table_column_set_row
+BazaResult table_cursor_set(TableCursor *cursor, size_t nth, uint64_t row, const void *value);
+
+/// Append a zeroed row to the cursor's table and store its ID in [row]
+BazaResult table_cursor_row_add(TableCursor *cursor, uint64_t *row);
 
-/// Returns a list of row IDs for which [func] returns true.
-TableFindResult table_find(TableID_t table, ColumnID_t column,
-                           findfunc_t func, void *value);
+/// Print the cursor's columns of [row] to [out]. Like table_cursor_get this only reads
+/// the table, so the thread holding the cursor can hand rows to other threads to print.
+void table_cursor_row_print(TableCursor *cursor, uint64_t row, FILE *out);
 
 #endif /* STORAGE_H */
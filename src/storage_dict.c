@@ -0,0 +1,131 @@
+#include "storage_dict.h"
+#include "util/hash.h"
+
+#include <string.h>
+
+#define DICT_INITIAL_CAPACITY 16
+#define DICT_MAX_LOAD_PERCENT 70
+#define DICT_ARENA_BLOCK (16 * 1024)
+
+StringDict *idict_new(void)
+{
+    StringDict *dict = malloc(sizeof(StringDict));
+    if (!dict)
+        return NULL;
+
+    *dict = (StringDict) {
+        .values = malloc(DICT_INITIAL_CAPACITY * sizeof(char*)),
+        .hashes = malloc(DICT_INITIAL_CAPACITY * sizeof(uint64_t)),
+        .count = 1,
+        .capacity = DICT_INITIAL_CAPACITY,
+        .slots = calloc(DICT_INITIAL_CAPACITY * 2, sizeof(uint32_t)),
+        .slot_capacity = DICT_INITIAL_CAPACITY * 2,
+        .strings = arena_new(DICT_ARENA_BLOCK),
+    };
+
+    if (!dict->values || !dict->hashes || !dict->slots || !dict->strings) {
+        idict_free(dict);
+        return NULL;
+    }
+
+    dict->values[DICT_CODE_NULL] = NULL;
+    dict->hashes[DICT_CODE_NULL] = 0;
+
+    return dict;
+}
+
+void idict_free(StringDict *dict)
+{
+    if (!dict)
+        return;
+
+    free(dict->values);
+    free(dict->hashes);
+    free(dict->slots);
+    arena_free(dict->strings);
+    free(dict);
+}
+
+static BazaResult idict_grow_slots(StringDict *dict)
+{
+    size_t new_capacity = dict->slot_capacity * 2;
+    uint32_t *new_slots = calloc(new_capacity, sizeof(uint32_t));
+    if (!new_slots)
+        return RESULT_ALLOC;
+
+    // values are unique, so every code goes into the first free slot
+    size_t mask = new_capacity - 1;
+    for (DictCode_t code = 1; code < dict->count; code++) {
+        size_t i = dict->hashes[code] & mask;
+        while (new_slots[i] != DICT_CODE_NULL)
+            i = (i + 1) & mask;
+        new_slots[i] = code;
+    }
+
+    free(dict->slots);
+    dict->slots = new_slots;
+    dict->slot_capacity = new_capacity;
+
+    return RESULT_OK;
+}
+
+static BazaResult idict_grow_values(StringDict *dict)
+{
+    uint32_t new_capacity = dict->capacity * 2;
+
+    char **values = realloc(dict->values, new_capacity * sizeof(char*));
+    if (!values)
+        return RESULT_ALLOC;
+    dict->values = values;
+
+    uint64_t *hashes = realloc(dict->hashes, new_capacity * sizeof(uint64_t));
+    if (!hashes)
+        return RESULT_ALLOC;
+    dict->hashes = hashes;
+
+    dict->capacity = new_capacity;
+
+    return RESULT_OK;
+}
+
+DictCode_t idict_intern(StringDict *dict, const char *str)
+{
+    if (!str)
+        return DICT_CODE_NULL;
+
+    // keep room for one more code, so that probing always ends on an empty slot
+    if ((size_t)dict->count * 100 > dict->slot_capacity * DICT_MAX_LOAD_PERCENT
+        && idict_grow_slots(dict) != RESULT_OK)
+        return DICT_CODE_NONE;
+
+    uint64_t hash = hash_str(str);
+    size_t mask = dict->slot_capacity - 1;
+    size_t i = hash & mask;
+
+    for (;;) {
+        DictCode_t code = dict->slots[i];
+        if (code == DICT_CODE_NULL)
+            break;
+        if (dict->hashes[code] == hash && !strcmp(dict->values[code], str))
+            return code;
+        i = (i + 1) & mask;
+    }
+
+    // not found: [i] is the empty slot for the new code
+    if (dict->count == DICT_CODE_NONE)
+        return DICT_CODE_NONE;
+
+    if (dict->count == dict->capacity && idict_grow_values(dict) != RESULT_OK)
+        return DICT_CODE_NONE;
+
+    char *copy = arena_strdup(dict->strings, str);
+    if (!copy)
+        return DICT_CODE_NONE;
+
+    DictCode_t code = dict->count++;
+    dict->values[code] = copy;
+    dict->hashes[code] = hash;
+    dict->slots[i] = code;
+
+    return code;
+}
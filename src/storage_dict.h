@@ -0,0 +1,33 @@
+/// Dictionaries backing dictionary encoded string columns. Owned by the column
+/// they belong to, nothing outside of the storage backend should touch them.
+#ifndef _STORAGE_DICT_H
+#define _STORAGE_DICT_H
+
+#include "storage.h"
+#include "util/arena.h"
+
+/// The distinct values of a column, each stored once and identified by a small
+/// integer code. Codes are handed out in insertion order and never reused.
+typedef struct StringDict {
+    char **values;        // code -> string; values[DICT_CODE_NULL] is NULL
+    uint64_t *hashes;     // code -> hash of values[code]
+    uint32_t count;       // codes in use, including DICT_CODE_NULL
+    uint32_t capacity;    // of [values] and [hashes]
+    uint32_t *slots;      // open addressing table of codes, DICT_CODE_NULL marks an empty slot
+    size_t slot_capacity; // always a power of two
+    Arena *strings;       // backing storage of [values]
+} StringDict;
+
+typedef uint32_t DictCode_t;
+
+#define DICT_CODE_NULL 0
+#define DICT_CODE_NONE UINT32_MAX
+
+StringDict *idict_new(void);
+void idict_free(StringDict *dict);
+
+/// Return the code of [str], adding it to [dict] if it is not there yet.
+/// NULL maps to DICT_CODE_NULL. Returns DICT_CODE_NONE on allocation failure.
+DictCode_t idict_intern(StringDict *dict, const char *str);
+
+#endif
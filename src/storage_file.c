@@ -0,0 +1,461 @@
+#include "storage_file.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string.h>
+
+_Static_assert(sizeof(char*) == sizeof(uint64_t), "string cells are stored as 64 bit heap offsets");
+
+static uint64_t ifile_align(uint64_t offset, uint64_t align)
+{
+    return (offset + align - 1) / align * align;
+}
+
+char *ifile_path(const char *dir, const char *name, const char *ext)
+{
+    size_t len = strlen(dir) + strlen(name) + strlen(ext) + 2;
+
+    char *path = malloc(len);
+    if (path)
+        snprintf(path, len, "%s/%s%s", dir, name, ext);
+
+    return path;
+}
+
+bool ifile_is_table_file(const char *filename)
+{
+    size_t len = strlen(filename), ext_len = strlen(TABLE_FILE_EXT);
+
+    return len > ext_len && !strcmp(filename + len - ext_len, TABLE_FILE_EXT);
+}
+
+/// Size of a cell of [column] inside a table file
+static size_t ifile_cell_size(Column *column)
+{
+    if (column->meta.type == BTYPE_STRING && !column->dict)
+        return sizeof(uint64_t);
+
+    return icolumn_cell_size(column);
+}
+
+/// A table file being written. Strings get their place in the heap as they are
+/// referenced, and are written out in the same order once the heap is reached.
+typedef struct TableFileWriter {
+    FILE *file;
+    uint64_t pos;  // offset of the next byte written
+    uint64_t heap; // offset of the next string reserved in the heap
+    bool failed;
+} TableFileWriter;
+
+static void ifile_write(TableFileWriter *writer, const void *data, size_t size)
+{
+    if (size && fwrite(data, size, 1, writer->file) != 1)
+        writer->failed = true;
+
+    writer->pos += size;
+}
+
+/// Write zeroes up to [offset]
+static void ifile_pad(TableFileWriter *writer, uint64_t offset)
+{
+    static const byte zeroes[TABLE_FILE_ALIGN];
+
+    while (writer->pos < offset) {
+        uint64_t len = offset - writer->pos;
+        ifile_write(writer, zeroes, len < sizeof(zeroes) ? len : sizeof(zeroes));
+    }
+}
+
+/// Reserve room for [str] in the heap, returning its offset
+static uint64_t ifile_heap_reserve(TableFileWriter *writer, const char *str)
+{
+    if (!str)
+        return TABLE_FILE_NULL;
+
+    uint64_t offset = writer->heap;
+    writer->heap += strlen(str) + 1;
+
+    return offset;
+}
+
+static void ifile_heap_write(TableFileWriter *writer, const char *str)
+{
+    if (str)
+        ifile_write(writer, str, strlen(str) + 1);
+}
+
+/// Write the cells (and the dictionary) of [column] at the offsets from [desc]
+static void ifile_column_write(TableFileWriter *writer, Column *column, const TableFileColumn *desc, uint64_t rows)
+{
+    ifile_pad(writer, desc->cells);
+
+    if (column->meta.type == BTYPE_STRING && !column->dict) {
+        for (uint64_t row = 0; row < rows; row++) {
+            uint64_t offset = ifile_heap_reserve(writer, *(char**)icolumn_cell(column, row));
+            ifile_write(writer, &offset, sizeof(offset));
+        }
+    } else {
+        size_t cell_size = icolumn_cell_size(column);
+        for (size_t chunk = 0; chunk < BAZA_CHUNK_COUNT(rows); chunk++) {
+            uint64_t count = rows - (chunk << BAZA_CHUNK_SHIFT);
+            ifile_write(writer, column->chunks[chunk],
+                        (count < BAZA_CHUNK_ROWS ? count : BAZA_CHUNK_ROWS) * cell_size);
+        }
+    }
+
+    if (!column->dict)
+        return;
+
+    ifile_pad(writer, desc->dict);
+    for (DictCode_t code = 0; code < column->dict->count; code++) {
+        uint64_t offset = ifile_heap_reserve(writer, column->dict->values[code]);
+        ifile_write(writer, &offset, sizeof(offset));
+    }
+}
+
+/// Write the strings of [column], in the order ifile_column_write reserved them
+static void ifile_column_heap_write(TableFileWriter *writer, Column *column, uint64_t rows)
+{
+    if (column->dict) {
+        for (DictCode_t code = 0; code < column->dict->count; code++)
+            ifile_heap_write(writer, column->dict->values[code]);
+    } else if (column->meta.type == BTYPE_STRING) {
+        for (uint64_t row = 0; row < rows; row++)
+            ifile_heap_write(writer, *(char**)icolumn_cell(column, row));
+    }
+}
+
+/// Write [table] to the already opened [file]
+static BazaResult ifile_table_write(Table *table, FILE *file, uint64_t wal_lsn)
+{
+    uint64_t rows = table->meta.row_count;
+
+    TableFileColumn *descs = calloc(table->column_count ? table->column_count : 1, sizeof(TableFileColumn));
+    if (!descs)
+        return RESULT_ALLOC;
+
+    // lay the file out up to the heap
+    uint64_t offset = sizeof(TableFileHeader) + table->column_count * sizeof(TableFileColumn);
+    for (size_t i = 0; i < table->column_count; i++) {
+        Column *column = &table->columns[i];
+
+        descs[i].type = column->meta.type;
+        descs[i].cells = offset = ifile_align(offset, TABLE_FILE_ALIGN);
+        offset += rows * ifile_cell_size(column);
+
+        if (column->dict) {
+            descs[i].dict_count = column->dict->count;
+            descs[i].dict = offset = ifile_align(offset, sizeof(uint64_t));
+            offset += column->dict->count * sizeof(uint64_t);
+        }
+    }
+
+    TableFileWriter writer = { .file = file, .pos = 0, .heap = offset, .failed = false };
+
+    TableFileHeader header = {
+        .version = TABLE_FILE_VERSION,
+        .column_count = table->column_count,
+        .row_count = rows,
+        .name = ifile_heap_reserve(&writer, table->meta.name),
+        .wal_lsn = wal_lsn,
+    };
+    memcpy(header.magic, TABLE_FILE_MAGIC, sizeof(header.magic));
+
+    for (size_t i = 0; i < table->column_count; i++)
+        descs[i].name = ifile_heap_reserve(&writer, table->columns[i].meta.name);
+    for (size_t i = 0; i < table->column_count; i++) {
+        Column *column = &table->columns[i];
+        descs[i].hash_index = ifile_heap_reserve(&writer, column->hash_index ? column->hash_index->name : NULL);
+        descs[i].btree_index = ifile_heap_reserve(&writer, column->btree_index ? column->btree_index->name : NULL);
+    }
+
+    // the header is rewritten once the size of the heap is known
+    ifile_write(&writer, &header, sizeof(header));
+    ifile_write(&writer, descs, table->column_count * sizeof(TableFileColumn));
+
+    for (size_t i = 0; i < table->column_count; i++)
+        ifile_column_write(&writer, &table->columns[i], &descs[i], rows);
+
+    BazaResult res = RESULT_OK;
+    if (writer.pos != offset)
+        res = RESULT_SERVER_ERROR; // the layout and what was written disagree
+
+    ifile_heap_write(&writer, table->meta.name);
+    for (size_t i = 0; i < table->column_count; i++)
+        ifile_heap_write(&writer, table->columns[i].meta.name);
+    for (size_t i = 0; i < table->column_count; i++) {
+        Column *column = &table->columns[i];
+        ifile_heap_write(&writer, column->hash_index ? column->hash_index->name : NULL);
+        ifile_heap_write(&writer, column->btree_index ? column->btree_index->name : NULL);
+    }
+    for (size_t i = 0; i < table->column_count; i++)
+        ifile_column_heap_write(&writer, &table->columns[i], rows);
+
+    header.size = writer.pos;
+    if (writer.pos != writer.heap || fseek(file, 0, SEEK_SET) != 0)
+        res = RESULT_SERVER_ERROR;
+    else
+        ifile_write(&writer, &header, sizeof(header));
+
+    free(descs);
+
+    if (res == RESULT_OK && writer.failed)
+        res = RESULT_IO_ERROR;
+
+    return res;
+}
+
+void ifile_sync_dir(const char *path)
+{
+    char *dir = strdup(path);
+    if (!dir)
+        return;
+
+    char *slash = strrchr(dir, '/');
+    if (slash)
+        *slash = '\0';
+
+    int fd = open(slash ? dir : ".", O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+
+    free(dir);
+}
+
+BazaResult ifile_table_save(Table *table, const char *path, uint64_t wal_lsn)
+{
+    if (table->dead_count)
+        return RESULT_SERVER_ERROR;
+
+    size_t len = strlen(path) + sizeof(".tmp");
+    char *tmp_path = malloc(len);
+    if (!tmp_path)
+        return RESULT_ALLOC;
+    snprintf(tmp_path, len, "%s.tmp", path);
+
+    FILE *file = fopen(tmp_path, "wb");
+    if (!file) {
+        free(tmp_path);
+        return RESULT_IO_ERROR;
+    }
+
+    BazaResult res = ifile_table_write(table, file, wal_lsn);
+
+    // the new version must be on disk before it replaces the old one
+    if (res == RESULT_OK && (fflush(file) != 0 || fsync(fileno(file)) != 0))
+        res = RESULT_IO_ERROR;
+    if (fclose(file) != 0 && res == RESULT_OK)
+        res = RESULT_IO_ERROR;
+    if (res == RESULT_OK && rename(tmp_path, path) != 0)
+        res = RESULT_IO_ERROR;
+
+    if (res == RESULT_OK)
+        ifile_sync_dir(path);
+    else
+        unlink(tmp_path);
+
+    free(tmp_path);
+
+    return res;
+}
+
+/// The string at heap [offset] of the mapped file, NULL if out of bounds. Every
+/// string is terminated before the end of the file, its last byte is always a NUL.
+static char *ifile_string(byte *base, size_t size, uint64_t offset)
+{
+    if (offset >= size)
+        return NULL;
+
+    return (char*)base + offset;
+}
+
+/// Turn the heap offsets in [count] string cells into pointers into the mapping
+static BazaResult ifile_strings_patch(byte *cells, size_t count, byte *base, size_t size)
+{
+    for (size_t i = 0; i < count; i++) {
+        uint64_t offset;
+        memcpy(&offset, cells + i * sizeof(uint64_t), sizeof(offset));
+
+        char *str = NULL;
+        if (offset != TABLE_FILE_NULL && !(str = ifile_string(base, size, offset)))
+            return RESULT_INVALID_TABLE_FILE;
+
+        memcpy(cells + i * sizeof(char*), &str, sizeof(str));
+    }
+
+    return RESULT_OK;
+}
+
+/// Rebuild the dictionary of [column] described by [desc]
+static BazaResult ifile_dict_load(Column *column, byte *base, size_t size, const TableFileColumn *desc)
+{
+    if (desc->dict % sizeof(uint64_t) || desc->dict > size
+        || (size - desc->dict) / sizeof(uint64_t) < desc->dict_count)
+        return RESULT_INVALID_TABLE_FILE;
+
+    StringDict *dict = idict_new();
+    if (!dict)
+        return RESULT_ALLOC;
+
+    // codes are handed out in insertion order, so interning the values in
+    // code order gives every value its code from the file back
+    const uint64_t *values = (const uint64_t*)(base + desc->dict);
+    for (DictCode_t code = DICT_CODE_NULL + 1; code < desc->dict_count; code++) {
+        const char *value = ifile_string(base, size, values[code]);
+        DictCode_t interned = value ? idict_intern(dict, value) : DICT_CODE_NONE;
+
+        if (interned != code) {
+            idict_free(dict);
+            return value && interned == DICT_CODE_NONE ? RESULT_ALLOC : RESULT_INVALID_TABLE_FILE;
+        }
+    }
+
+    arena_free(column->strings);
+    column->strings = NULL;
+    column->dict = dict;
+
+    return RESULT_OK;
+}
+
+/// Add the column described by [desc] to [table], with its rows from the file
+static BazaResult ifile_column_load(Table *table, byte *base, size_t size, const TableFileColumn *desc, uint64_t rows)
+{
+    const char *name = ifile_string(base, size, desc->name);
+    if (!name || (desc->type != BTYPE_INT32 && desc->type != BTYPE_INT64 && desc->type != BTYPE_STRING))
+        return RESULT_INVALID_TABLE_FILE;
+
+    ENSURE(itable_column_new(table, desc->type, name));
+    Column *column = &table->columns[table->column_count - 1];
+
+    if (desc->dict_count) {
+        if (desc->type != BTYPE_STRING)
+            return RESULT_INVALID_TABLE_FILE;
+        ENSURE(ifile_dict_load(column, base, size, desc));
+    }
+
+    size_t cell_size = ifile_cell_size(column);
+    if (desc->cells % sizeof(uint64_t) || desc->cells > size || (size - desc->cells) / cell_size < rows)
+        return RESULT_INVALID_TABLE_FILE;
+
+    bool patch = column->meta.type == BTYPE_STRING && !column->dict;
+
+    for (size_t chunk = 0; chunk < BAZA_CHUNK_COUNT(rows); chunk++) {
+        uint64_t first = chunk << BAZA_CHUNK_SHIFT;
+        byte *cells = base + desc->cells + first * cell_size;
+
+        // full chunks are used in place, the last one is copied out of the mapping
+        // since it has to be able to take new rows
+        if (rows - first >= BAZA_CHUNK_ROWS) {
+            ENSURE(icolumn_chunk_map(column, cells));
+        } else {
+            ENSURE(icolumn_chunk_add(column, table->version));
+            memcpy(column->chunks[chunk], cells, (rows - first) * cell_size);
+        }
+
+        if (patch) {
+            uint64_t count = rows - first < BAZA_CHUNK_ROWS ? rows - first : BAZA_CHUNK_ROWS;
+            ENSURE(ifile_strings_patch(column->chunks[chunk], count, base, size));
+        }
+    }
+
+    return RESULT_OK;
+}
+
+/// Rebuild the index of [kind] over [column] whose name is at heap [offset], if any
+static BazaResult ifile_index_load(Table *table, Column *column, byte *base, size_t size,
+                                   uint64_t offset, IndexKind kind)
+{
+    if (offset == TABLE_FILE_NULL)
+        return RESULT_OK;
+
+    const char *name = ifile_string(base, size, offset);
+    if (!name)
+        return RESULT_INVALID_TABLE_FILE;
+
+    return itable_index_new(table, column, name, kind);
+}
+
+/// Build [table] from the file mapped at [base]
+static BazaResult ifile_table_build(byte *base, size_t size, TableID_t id, Table **table)
+{
+    const TableFileHeader *header = (const TableFileHeader*)base;
+
+    if (memcmp(header->magic, TABLE_FILE_MAGIC, sizeof(header->magic))
+        || header->version != TABLE_FILE_VERSION || header->size != size || base[size - 1] != '\0'
+        || (size - sizeof(TableFileHeader)) / sizeof(TableFileColumn) < header->column_count)
+        return RESULT_INVALID_TABLE_FILE;
+
+    const char *name = ifile_string(base, size, header->name);
+    if (!name)
+        return RESULT_INVALID_TABLE_FILE;
+
+    if (!(*table = itable_new(id, name)))
+        return RESULT_ALLOC;
+
+    const TableFileColumn *descs = (const TableFileColumn*)(base + sizeof(TableFileHeader));
+    for (uint32_t i = 0; i < header->column_count; i++)
+        ENSURE(ifile_column_load(*table, base, size, &descs[i], header->row_count));
+
+    size_t capacity = BAZA_CHUNK_COUNT(header->row_count) << BAZA_CHUNK_SHIFT;
+    if (capacity && !((*table)->deleted = calloc(TABLE_BITMAP_WORDS(capacity), sizeof(uint64_t))))
+        return RESULT_ALLOC;
+
+    (*table)->row_capacity = capacity;
+    (*table)->meta.row_count = header->row_count;
+    (*table)->wal_lsn = header->wal_lsn;
+
+    // the rows are all in place by now
+    for (uint32_t i = 0; i < header->column_count; i++) {
+        Column *column = &(*table)->columns[i];
+        ENSURE(ifile_index_load(*table, column, base, size, descs[i].hash_index, INDEX_HASH));
+        ENSURE(ifile_index_load(*table, column, base, size, descs[i].btree_index, INDEX_BTREE));
+    }
+
+    return RESULT_OK;
+}
+
+BazaResult ifile_table_load(const char *path, TableID_t id, Table **table)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return RESULT_FILE_NOT_FOUND;
+
+    struct stat statbuf;
+    if (fstat(fd, &statbuf) < 0) {
+        close(fd);
+        return RESULT_IO_ERROR;
+    }
+
+    size_t size = statbuf.st_size;
+    if (size < sizeof(TableFileHeader)) {
+        close(fd);
+        return RESULT_INVALID_TABLE_FILE;
+    }
+
+    // private and writable: string cells are patched in place and the rows can be
+    // modified like any others, without the changes ever reaching the file
+    byte *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return RESULT_IO_ERROR;
+
+    *table = NULL;
+    BazaResult res = ifile_table_build(base, size, id, table);
+    if (res != RESULT_OK) {
+        // the mapped chunks are not freed along with the table
+        if (*table)
+            itable_free(*table);
+        munmap(base, size);
+        return res;
+    }
+
+    (*table)->mapping = base;
+    (*table)->mapping_size = size;
+
+    return RESULT_OK;
+}
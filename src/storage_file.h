@@ -0,0 +1,67 @@
+/// The on-disk format of tables: one file per table, which is mapped into memory
+/// on startup so that loading a table costs O(schema) instead of O(data). Owned by
+/// storage_internal, nothing outside of the storage backend should touch it.
+#ifndef _STORAGE_FILE_H
+#define _STORAGE_FILE_H
+
+#include "storage_internal.h"
+
+/// Layout of a table file. All offsets are from the start of the file and all
+/// integers are in native byte order, the files are not meant to be portable.
+///
+///   TableFileHeader
+///   TableFileColumn[column_count]
+///   for every column, TABLE_FILE_ALIGN aligned:
+///     row_count cells, as stored in memory. Strings are 64 bit heap offsets
+///     (TABLE_FILE_NULL for NULL), dictionary encoded columns store their codes
+///     followed by the dictionary: dict_count heap offsets, in code order
+///   the string heap: NUL terminated table, column and index names and string values
+///
+/// Indexes are not stored, only their names: they are rebuilt when the file is loaded.
+#define TABLE_FILE_MAGIC "BAZATBL"
+#define TABLE_FILE_VERSION 3
+#define TABLE_FILE_EXT ".baza"
+#define TABLE_FILE_ALIGN 64
+#define TABLE_FILE_NULL UINT64_MAX
+
+typedef struct TableFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t column_count;
+    uint64_t row_count;
+    uint64_t name; // heap offset of the table's name
+    uint64_t size;    // of the whole file, to catch truncated files
+    uint64_t wal_lsn; // the file contains the changes of every log record before it
+} TableFileHeader;
+
+typedef struct TableFileColumn {
+    uint64_t name;       // heap offset
+    uint32_t type;       // BaseType
+    uint32_t dict_count; // codes in the dictionary (incl. DICT_CODE_NULL), 0 if not encoded
+    uint64_t cells;
+    uint64_t dict;
+    uint64_t hash_index;  // heap offset of the name of the column's hash index, TABLE_FILE_NULL if none
+    uint64_t btree_index; // the same for its ordered index
+} TableFileColumn;
+
+/// Return "[dir]/[name][ext]", to be freed by the caller
+char *ifile_path(const char *dir, const char *name, const char *ext);
+
+/// Whether [filename] names a table file
+bool ifile_is_table_file(const char *filename);
+
+/// Write [table], which must not have any deleted rows, to [path]. The file is
+/// written next to [path] first and renamed over it once complete. [wal_lsn] is
+/// the first LSN of the write-ahead log whose changes are not in [table].
+BazaResult ifile_table_save(Table *table, const char *path, uint64_t wal_lsn);
+
+/// Persist the rename of a file inside the directory of [path]
+void ifile_sync_dir(const char *path);
+
+/// Build the table with [id] from the table file at [path]. The file is mapped
+/// privately (copy-on-write), full chunks of rows point straight into the mapping
+/// and the table keeps it until it is freed. Only string cells are touched, to
+/// turn their heap offsets into pointers. The indexes are built from the rows.
+BazaResult ifile_table_load(const char *path, TableID_t id, Table **table);
+
+#endif
@@ -0,0 +1,680 @@
+#include "storage_index.h"
+#include "util/hash.h"
+#include "util/parallel.h"
+
+#include <string.h>
+
+IndexKey ikey_from_cell(BaseType type, const void *cell)
+{
+    switch (type) {
+        case BTYPE_INT32:
+            return (IndexKey) { .i = *(const int32_t*)cell };
+        case BTYPE_INT64:
+            return (IndexKey) { .i = *(const int64_t*)cell };
+        case BTYPE_STRING:
+            return (IndexKey) { .s = *(char *const*)cell };
+        case BTYPE_INVALID:
+            break;
+    }
+    return (IndexKey) { .i = 0 };
+}
+
+IndexKey ikey_from_value(BaseType type, const void *value)
+{
+    if (type == BTYPE_STRING)
+        return (IndexKey) { .s = value };
+
+    return ikey_from_cell(type, value);
+}
+
+uint64_t rowremap_apply(const RowRemap *remap, uint64_t row)
+{
+    uint64_t word = row / 64, bit = row % 64;
+    uint64_t below = remap->deleted[word] & ((1ULL << bit) - 1);
+    return row - remap->dead_before[word] - __builtin_popcountll(below);
+}
+
+static uint64_t ikey_hash(BaseType type, IndexKey key)
+{
+    if (type == BTYPE_STRING)
+        return hash_str(key.s);
+    return hash_u64(key.i);
+}
+
+static bool ikey_eq(BaseType type, IndexKey left, IndexKey right)
+{
+    if (type == BTYPE_STRING)
+        return !strcmp(left.s, right.s);
+    return left.i == right.i;
+}
+
+#define HASH_INDEX_INITIAL_CAPACITY 64
+#define HASH_INDEX_MAX_LOAD_PERCENT 70
+#define HASH_INDEX_INITIAL_ROWS 4
+
+HashIndex *ihash_new(const char *name, BaseType type)
+{
+    HashIndex *index = malloc(sizeof(HashIndex));
+    if (!index)
+        return NULL;
+
+    *index = (HashIndex) {
+        .name = strdup(name),
+        .type = type,
+        .slots = calloc(HASH_INDEX_INITIAL_CAPACITY, sizeof(HashIndexEntry)),
+        .capacity = HASH_INDEX_INITIAL_CAPACITY,
+        .used = 0,
+    };
+
+    if (!index->slots) {
+        free(index->name);
+        free(index);
+        return NULL;
+    }
+
+    return index;
+}
+
+void ihash_free(HashIndex *index)
+{
+    if (!index)
+        return;
+
+    for (size_t i = 0; i < index->capacity; i++) {
+        HashIndexEntry *slot = &index->slots[i];
+        if (!slot->rows)
+            continue;
+        if (index->type == BTYPE_STRING)
+            free((char*)slot->key.s);
+        free(slot->rows);
+    }
+
+    free(index->slots);
+    free(index->name);
+    free(index);
+}
+
+/// Find the slot holding [key], or the empty slot where it should be inserted
+static HashIndexEntry *ihash_probe(HashIndex *index, uint64_t hash, IndexKey key)
+{
+    size_t mask = index->capacity - 1;
+    size_t i = hash & mask;
+
+    for (;;) {
+        HashIndexEntry *slot = &index->slots[i];
+        if (!slot->rows)
+            return slot;
+        if (slot->hash == hash && ikey_eq(index->type, slot->key, key))
+            return slot;
+        i = (i + 1) & mask;
+    }
+}
+
+static BazaResult ihash_grow(HashIndex *index)
+{
+    size_t new_capacity = index->capacity * 2;
+    HashIndexEntry *new_slots = calloc(new_capacity, sizeof(HashIndexEntry));
+    if (!new_slots)
+        return RESULT_ALLOC;
+
+    size_t mask = new_capacity - 1;
+    for (size_t i = 0; i < index->capacity; i++) {
+        HashIndexEntry *slot = &index->slots[i];
+        if (!slot->rows)
+            continue;
+
+        // keys are unique, so we only need to find the first free slot
+        size_t j = slot->hash & mask;
+        while (new_slots[j].rows)
+            j = (j + 1) & mask;
+        new_slots[j] = *slot;
+    }
+
+    free(index->slots);
+    index->slots = new_slots;
+    index->capacity = new_capacity;
+
+    return RESULT_OK;
+}
+
+/// Binary search for the position of [row] (or where it would be inserted)
+static uint32_t ihash_row_position(const HashIndexEntry *entry, uint64_t row)
+{
+    uint32_t lo = 0, hi = entry->row_count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (entry->rows[mid] < row)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+BazaResult ihash_insert(HashIndex *index, IndexKey key, uint64_t row)
+{
+    if (index->type == BTYPE_STRING && !key.s)
+        return RESULT_OK;
+
+    if ((index->used + 1) * 100 > index->capacity * HASH_INDEX_MAX_LOAD_PERCENT)
+        ENSURE(ihash_grow(index));
+
+    uint64_t hash = ikey_hash(index->type, key);
+    HashIndexEntry *slot = ihash_probe(index, hash, key);
+
+    if (!slot->rows) {
+        slot->rows = malloc(HASH_INDEX_INITIAL_ROWS * sizeof(uint64_t));
+        if (!slot->rows)
+            return RESULT_ALLOC;
+
+        slot->hash = hash;
+        slot->key = index->type == BTYPE_STRING ? (IndexKey) { .s = strdup(key.s) } : key;
+        slot->row_count = 0;
+        slot->row_capacity = HASH_INDEX_INITIAL_ROWS;
+        index->used++;
+    }
+
+    if (slot->row_count == slot->row_capacity) {
+        uint64_t *rows = realloc(slot->rows, slot->row_capacity * 2 * sizeof(uint64_t));
+        if (!rows)
+            return RESULT_ALLOC;
+        slot->rows = rows;
+        slot->row_capacity *= 2;
+    }
+
+    // rows are almost always appended in ascending order, so check that first
+    if (!slot->row_count || slot->rows[slot->row_count-1] < row) {
+        slot->rows[slot->row_count++] = row;
+        return RESULT_OK;
+    }
+
+    uint32_t pos = ihash_row_position(slot, row);
+    if (slot->rows[pos] == row)
+        return RESULT_OK;
+
+    memmove(&slot->rows[pos+1], &slot->rows[pos], (slot->row_count - pos) * sizeof(uint64_t));
+    slot->rows[pos] = row;
+    slot->row_count++;
+
+    return RESULT_OK;
+}
+
+void ihash_remove(HashIndex *index, IndexKey key, uint64_t row)
+{
+    if (index->type == BTYPE_STRING && !key.s)
+        return;
+
+    HashIndexEntry *slot = ihash_probe(index, ikey_hash(index->type, key), key);
+    if (!slot->rows || !slot->row_count)
+        return;
+
+    uint32_t pos = ihash_row_position(slot, row);
+    if (pos == slot->row_count || slot->rows[pos] != row)
+        return;
+
+    memmove(&slot->rows[pos], &slot->rows[pos+1], (slot->row_count - pos - 1) * sizeof(uint64_t));
+    slot->row_count--;
+}
+
+const HashIndexEntry *ihash_lookup(HashIndex *index, IndexKey key)
+{
+    if (index->type == BTYPE_STRING && !key.s)
+        return NULL;
+
+    HashIndexEntry *slot = ihash_probe(index, ikey_hash(index->type, key), key);
+    if (!slot->rows || !slot->row_count)
+        return NULL;
+
+    return slot;
+}
+
+void ihash_remap_rows(HashIndex *index, const RowRemap *remap)
+{
+    // remapping is monotonic, so the row lists stay sorted
+    for (size_t i = 0; i < index->capacity; i++) {
+        HashIndexEntry *slot = &index->slots[i];
+        for (uint32_t r = 0; slot->rows && r < slot->row_count; r++)
+            slot->rows[r] = rowremap_apply(remap, slot->rows[r]);
+    }
+}
+
+int ikey_cmp(BaseType type, IndexKey left, IndexKey right)
+{
+    if (type == BTYPE_STRING)
+        return strcmp(left.s, right.s);
+    return (left.i > right.i) - (left.i < right.i);
+}
+
+/// Compare the (key, row) entries
+static int ibtree_cmp(BTreeIndex *index, IndexKey lkey, uint64_t lrow, IndexKey rkey, uint64_t rrow)
+{
+    int cmp = ikey_cmp(index->type, lkey, rkey);
+    if (cmp)
+        return cmp;
+    return (lrow > rrow) - (lrow < rrow);
+}
+
+static IndexKey ibtree_key_copy(BTreeIndex *index, IndexKey key)
+{
+    if (index->type == BTYPE_STRING)
+        return (IndexKey) { .s = strdup(key.s) };
+    return key;
+}
+
+static void ibtree_key_free(BTreeIndex *index, IndexKey key)
+{
+    if (index->type == BTYPE_STRING)
+        free((char*)key.s);
+}
+
+static BTreeNode *ibtree_node_new(bool leaf)
+{
+    BTreeNode *node = aligned_alloc(CACHE_LINE_SIZE, sizeof(BTreeNode));
+    if (!node)
+        return NULL;
+
+    memset(node, 0, sizeof(BTreeNode));
+    node->leaf = leaf;
+
+    return node;
+}
+
+static void ibtree_node_free(BTreeIndex *index, BTreeNode *node)
+{
+    for (uint32_t i = 0; i < node->count; i++)
+        ibtree_key_free(index, node->keys[i]);
+
+    if (!node->leaf) {
+        for (uint32_t i = 0; i <= node->count; i++)
+            ibtree_node_free(index, node->children[i]);
+    }
+
+    free(node);
+}
+
+BTreeIndex *ibtree_new(const char *name, BaseType type)
+{
+    BTreeIndex *index = malloc(sizeof(BTreeIndex));
+    if (!index)
+        return NULL;
+
+    *index = (BTreeIndex) {
+        .name = strdup(name),
+        .type = type,
+        .root = ibtree_node_new(true),
+    };
+
+    if (!index->root) {
+        free(index->name);
+        free(index);
+        return NULL;
+    }
+
+    return index;
+}
+
+void ibtree_free(BTreeIndex *index)
+{
+    if (!index)
+        return;
+
+    ibtree_node_free(index, index->root);
+    free(index->name);
+    free(index);
+}
+
+/// The number of entries in [node] that are <= (key, row), which in inner
+/// nodes is also the index of the child to descend into.
+static uint32_t ibtree_upper_bound(BTreeIndex *index, BTreeNode *node, IndexKey key, uint64_t row)
+{
+    uint32_t lo = 0, hi = node->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (ibtree_cmp(index, node->keys[mid], node->rows[mid], key, row) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+typedef struct BTreeSplit {
+    BazaResult res;
+    BTreeNode *right;  // NULL if the node did not split
+    IndexKey key;      // separator to be inserted into the parent
+    uint64_t row;
+} BTreeSplit;
+
+static BTreeSplit ibtree_insert_rec(BTreeIndex *index, BTreeNode *node, IndexKey key, uint64_t row)
+{
+    uint32_t pos = ibtree_upper_bound(index, node, key, row);
+    BTreeNode *right_child = NULL;
+
+    if (node->leaf) {
+        // entries are unique, don't insert the same one twice
+        if (pos > 0 && !ibtree_cmp(index, node->keys[pos-1], node->rows[pos-1], key, row))
+            return (BTreeSplit) { .res = RESULT_OK };
+
+        key = ibtree_key_copy(index, key);
+    } else {
+        BTreeSplit child = ibtree_insert_rec(index, node->children[pos], key, row);
+        if (child.res != RESULT_OK || !child.right)
+            return child;
+
+        key = child.key;
+        row = child.row;
+        right_child = child.right;
+    }
+
+    // gather the node's entries with the new one in place into a scratch 
+    // buffer one slot larger than a node, then redistribute if necessary
+    IndexKey keys[BTREE_FANOUT + 1];
+    uint64_t rows[BTREE_FANOUT + 1];
+    BTreeNode *children[BTREE_FANOUT + 2];
+    uint32_t n = node->count + 1;
+
+    memcpy(keys, node->keys, pos * sizeof(IndexKey));
+    memcpy(rows, node->rows, pos * sizeof(uint64_t));
+    keys[pos] = key;
+    rows[pos] = row;
+    memcpy(keys + pos + 1, node->keys + pos, (node->count - pos) * sizeof(IndexKey));
+    memcpy(rows + pos + 1, node->rows + pos, (node->count - pos) * sizeof(uint64_t));
+
+    if (!node->leaf) {
+        memcpy(children, node->children, (pos + 1) * sizeof(BTreeNode*));
+        children[pos + 1] = right_child;
+        memcpy(children + pos + 2, node->children + pos + 1, (node->count - pos) * sizeof(BTreeNode*));
+    }
+
+    if (n <= BTREE_FANOUT) {
+        memcpy(node->keys, keys, n * sizeof(IndexKey));
+        memcpy(node->rows, rows, n * sizeof(uint64_t));
+        if (!node->leaf)
+            memcpy(node->children, children, (n + 1) * sizeof(BTreeNode*));
+        node->count = n;
+        return (BTreeSplit) { .res = RESULT_OK };
+    }
+
+    BTreeNode *right = ibtree_node_new(node->leaf);
+    if (!right)
+        return (BTreeSplit) { .res = RESULT_ALLOC };
+
+    uint32_t mid = n / 2;
+
+    if (node->leaf) {
+        // leaves keep every entry, the separator is a copy of the right half's first one
+        node->count = mid;
+        right->count = n - mid;
+        memcpy(node->keys, keys, mid * sizeof(IndexKey));
+        memcpy(node->rows, rows, mid * sizeof(uint64_t));
+        memcpy(right->keys, keys + mid, right->count * sizeof(IndexKey));
+        memcpy(right->rows, rows + mid, right->count * sizeof(uint64_t));
+
+        right->next = node->next;
+        node->next = right;
+
+        return (BTreeSplit) {
+            .res = RESULT_OK,
+            .right = right,
+            .key = ibtree_key_copy(index, right->keys[0]),
+            .row = right->rows[0],
+        };
+    }
+
+    // inner nodes move the middle entry up into the parent
+    node->count = mid;
+    right->count = n - mid - 1;
+    memcpy(node->keys, keys, mid * sizeof(IndexKey));
+    memcpy(node->rows, rows, mid * sizeof(uint64_t));
+    memcpy(node->children, children, (mid + 1) * sizeof(BTreeNode*));
+    memcpy(right->keys, keys + mid + 1, right->count * sizeof(IndexKey));
+    memcpy(right->rows, rows + mid + 1, right->count * sizeof(uint64_t));
+    memcpy(right->children, children + mid + 1, (right->count + 1) * sizeof(BTreeNode*));
+
+    return (BTreeSplit) {
+        .res = RESULT_OK,
+        .right = right,
+        .key = keys[mid],
+        .row = rows[mid],
+    };
+}
+
+BazaResult ibtree_insert(BTreeIndex *index, IndexKey key, uint64_t row)
+{
+    if (index->type == BTYPE_STRING && !key.s)
+        return RESULT_OK;
+
+    BTreeSplit split = ibtree_insert_rec(index, index->root, key, row);
+    if (split.res != RESULT_OK || !split.right)
+        return split.res;
+
+    // the root split, grow the tree by one level
+    BTreeNode *root = ibtree_node_new(false);
+    if (!root)
+        return RESULT_ALLOC;
+
+    root->count = 1;
+    root->keys[0] = split.key;
+    root->rows[0] = split.row;
+    root->children[0] = index->root;
+    root->children[1] = split.right;
+    index->root = root;
+
+    return RESULT_OK;
+}
+
+static int ibtree_entry_cmp(const void *left, const void *right, void *index)
+{
+    const BTreeEntry *l = left, *r = right;
+    return ibtree_cmp(index, l->key, l->row, r->key, r->row);
+}
+
+BazaResult ibtree_build(BTreeIndex *index, BTreeEntry *entries, size_t count)
+{
+    if (!count)
+        return RESULT_OK;
+
+    if (!parallel_sort(entries, count, sizeof(BTreeEntry), ibtree_entry_cmp, index))
+        return RESULT_ALLOC;
+
+    // the nodes of the level being built, and the smallest entry below each of them
+    size_t width = (count + BTREE_FANOUT - 1) / BTREE_FANOUT;
+    BTreeNode **level = malloc(width * sizeof(BTreeNode*));
+    BTreeEntry *lows = malloc(width * sizeof(BTreeEntry));
+    if (!level || !lows) {
+        free(level);
+        free(lows);
+        return RESULT_ALLOC;
+    }
+
+    for (size_t i = 0; i < width; i++) {
+        BTreeNode *leaf = ibtree_node_new(true);
+        if (!leaf) {
+            while (i--)
+                ibtree_node_free(index, level[i]);
+            free(level);
+            free(lows);
+            return RESULT_ALLOC;
+        }
+
+        const BTreeEntry *first = entries + i * BTREE_FANOUT;
+        leaf->count = count - i * BTREE_FANOUT < BTREE_FANOUT ? count - i * BTREE_FANOUT : BTREE_FANOUT;
+        for (uint32_t j = 0; j < leaf->count; j++) {
+            leaf->keys[j] = ibtree_key_copy(index, first[j].key);
+            leaf->rows[j] = first[j].row;
+        }
+
+        if (i)
+            level[i - 1]->next = leaf;
+        level[i] = leaf;
+        lows[i] = *first;
+    }
+
+    // the children are spread evenly over the parents, so that none is left with
+    // a single one. Parents replace their children in [level] as they go.
+    while (width > 1) {
+        size_t parents = (width + BTREE_FANOUT) / (BTREE_FANOUT + 1);
+        size_t child = 0;
+
+        for (size_t p = 0; p < parents; p++) {
+            size_t children = width / parents + (p < width % parents);
+
+            BTreeNode *node = ibtree_node_new(false);
+            if (!node) {
+                // the parents built so far own the children before [child]
+                for (size_t i = 0; i < p; i++)
+                    ibtree_node_free(index, level[i]);
+                for (size_t i = child; i < width; i++)
+                    ibtree_node_free(index, level[i]);
+                free(level);
+                free(lows);
+                return RESULT_ALLOC;
+            }
+
+            node->count = children - 1;
+            node->children[0] = level[child];
+            for (size_t j = 1; j < children; j++) {
+                node->keys[j - 1] = ibtree_key_copy(index, lows[child + j].key);
+                node->rows[j - 1] = lows[child + j].row;
+                node->children[j] = level[child + j];
+            }
+
+            lows[p] = lows[child];
+            level[p] = node;
+            child += children;
+        }
+
+        width = parents;
+    }
+
+    ibtree_node_free(index, index->root);
+    index->root = level[0];
+
+    free(level);
+    free(lows);
+
+    return RESULT_OK;
+}
+
+void ibtree_remove(BTreeIndex *index, IndexKey key, uint64_t row)
+{
+    if (index->type == BTYPE_STRING && !key.s)
+        return;
+
+    BTreeNode *node = index->root;
+    while (!node->leaf)
+        node = node->children[ibtree_upper_bound(index, node, key, row)];
+
+    uint32_t pos = ibtree_upper_bound(index, node, key, row);
+    if (!pos || ibtree_cmp(index, node->keys[pos-1], node->rows[pos-1], key, row))
+        return;
+
+    pos--;
+    ibtree_key_free(index, node->keys[pos]);
+    memmove(&node->keys[pos], &node->keys[pos+1], (node->count - pos - 1) * sizeof(IndexKey));
+    memmove(&node->rows[pos], &node->rows[pos+1], (node->count - pos - 1) * sizeof(uint64_t));
+    node->count--;
+}
+
+static void ibtree_remap_rows_rec(BTreeNode *node, const RowRemap *remap)
+{
+    // separators may refer to rows that have since been deleted, those are
+    // mapped to the next surviving row which keeps them valid bounds
+    for (uint32_t i = 0; i < node->count; i++)
+        node->rows[i] = rowremap_apply(remap, node->rows[i]);
+
+    if (!node->leaf) {
+        for (uint32_t i = 0; i <= node->count; i++)
+            ibtree_remap_rows_rec(node->children[i], remap);
+    }
+}
+
+void ibtree_remap_rows(BTreeIndex *index, const RowRemap *remap)
+{
+    ibtree_remap_rows_rec(index->root, remap);
+}
+
+/// The leaf holding the first entry within [range], storing its position in [*pos]
+static BTreeNode *ibtree_seek(BTreeIndex *index, BTreeRange range, uint32_t *pos)
+{
+    // (key, 0) is the smallest entry with a given key and (key, UINT64_MAX) the largest
+    IndexKey lower_key = range.lower ? *range.lower : (IndexKey) { 0 };
+    uint64_t lower_row = range.lower_inclusive ? 0 : UINT64_MAX;
+
+    BTreeNode *node = index->root;
+    while (!node->leaf) {
+        uint32_t child = range.lower ? ibtree_upper_bound(index, node, lower_key, lower_row) : 0;
+        node = node->children[child];
+    }
+
+    uint32_t i = range.lower ? ibtree_upper_bound(index, node, lower_key, lower_row) : 0;
+
+    // upper_bound counts the entries <= the bound, but an inclusive bound 
+    // has to start at an entry equal to (key, 0) if there is one
+    if (range.lower && range.lower_inclusive && i > 0 
+        && !ibtree_cmp(index, node->keys[i-1], node->rows[i-1], lower_key, lower_row))
+        i--;
+
+    *pos = i;
+    return node;
+}
+
+/// Whether [key] lies past the upper bound of [range]
+static bool ibtree_past(BTreeIndex *index, BTreeRange range, IndexKey key)
+{
+    if (!range.upper)
+        return false;
+
+    int cmp = ikey_cmp(index->type, key, *range.upper);
+    return cmp > 0 || (cmp == 0 && !range.upper_inclusive);
+}
+
+int64_t ibtree_scan(BTreeIndex *index, BTreeRange range, uint64_t **rows, size_t *capacity)
+{
+    size_t count = 0;
+    uint32_t i;
+
+    for (BTreeNode *node = ibtree_seek(index, range, &i); node; node = node->next, i = 0) {
+        for (; i < node->count; i++) {
+            if (ibtree_past(index, range, node->keys[i]))
+                return count;
+
+            if (count == *capacity) {
+                size_t new_capacity = *capacity ? *capacity * 2 : 64;
+                uint64_t *grown = realloc(*rows, new_capacity * sizeof(uint64_t));
+                if (!grown)
+                    return -1;
+                *rows = grown;
+                *capacity = new_capacity;
+            }
+
+            (*rows)[count++] = node->rows[i];
+        }
+    }
+
+    return count;
+}
+
+size_t ibtree_count(BTreeIndex *index, BTreeRange range, size_t limit)
+{
+    size_t count = 0;
+    uint32_t i;
+
+    for (BTreeNode *node = ibtree_seek(index, range, &i); node; node = node->next, i = 0) {
+        if (!node->count)
+            continue;
+
+        // whole leaves at a time, up to the one holding the upper bound
+        if (ibtree_past(index, range, node->keys[node->count - 1])) {
+            for (; i < node->count && !ibtree_past(index, range, node->keys[i]); i++)
+                count++;
+            break;
+        }
+
+        count += node->count - i;
+        if (count >= limit)
+            return limit;
+    }
+
+    return count < limit ? count : limit;
+}
@@ -0,0 +1,138 @@
+/// Secondary indexes over single columns. These are owned and kept up to date
+/// by storage_internal, nothing outside of the storage backend should touch them.
+#ifndef _STORAGE_INDEX_H
+#define _STORAGE_INDEX_H
+
+#include "storage.h"
+
+/// A column value normalized for hashing and comparisons. Integers are
+/// sign-extended to 64 bits, strings are borrowed from wherever they live.
+typedef union IndexKey {
+    int64_t i;
+    const char *s;
+} IndexKey;
+
+/// Build a key from a raw cell, as returned by icolumn_row_get (char** for strings)
+IndexKey ikey_from_cell(BaseType type, const void *cell);
+
+/// Build a key from a lookup value, as passed to table_find (char* for strings)
+IndexKey ikey_from_value(BaseType type, const void *value);
+
+/// Compare two keys of [type] (strcmp-like). Strings must not be NULL.
+int ikey_cmp(BaseType type, IndexKey left, IndexKey right);
+
+/// Maps the ids of rows surviving a compaction to their new ids. A row moves
+/// down by the number of deleted rows before it, which is the count of deleted
+/// rows in the preceding bitmap words plus those below it in its own word.
+typedef struct RowRemap {
+    const uint64_t *deleted;     // the deletion bitmap from before the compaction
+    const uint64_t *dead_before; // number of deleted rows before each bitmap word
+} RowRemap;
+
+uint64_t rowremap_apply(const RowRemap *remap, uint64_t row);
+
+/// A single distinct value stored in the hash index together with all
+/// the rows that hold it, in ascending order.
+typedef struct HashIndexEntry {
+    uint64_t hash;
+    IndexKey key;       // strings are owned by the entry
+    uint64_t *rows;     // NULL marks an empty slot
+    uint32_t row_count;
+    uint32_t row_capacity;
+} HashIndexEntry;
+
+/// Open-addressing (linear probing) hash index mapping column values to rows.
+/// Slots are never vacated, a value that no longer occurs in the column simply
+/// keeps an entry with an empty row list until the index is rebuilt.
+typedef struct HashIndex {
+    char *name;
+    BaseType type;
+    HashIndexEntry *slots;
+    size_t capacity;    // always a power of two
+    size_t used;
+} HashIndex;
+
+HashIndex *ihash_new(const char *name, BaseType type);
+void ihash_free(HashIndex *index);
+
+/// Add [row] to the entry for [key]. NULL strings are not indexed.
+BazaResult ihash_insert(HashIndex *index, IndexKey key, uint64_t row);
+
+/// Remove [row] from the entry for [key], if present.
+void ihash_remove(HashIndex *index, IndexKey key, uint64_t row);
+
+/// Returns the entry for [key] or NULL if no row holds that value.
+const HashIndexEntry *ihash_lookup(HashIndex *index, IndexKey key);
+
+/// Renumber every row according to [remap], see itable_compact
+void ihash_remap_rows(HashIndex *index, const RowRemap *remap);
+
+#define CACHE_LINE_SIZE 64
+
+/// Keys per B+tree node. With 8 byte keys, the key array (which is all we touch
+/// while searching a node) spans exactly two cache lines.
+#define BTREE_FANOUT 16
+
+/// A B+tree node. Entries are (key, row) pairs, which makes them unique even
+/// when the column holds duplicates. In inner nodes, keys[i]/rows[i] is the 
+/// smallest entry reachable through children[i+1]; leaves are chained in
+/// ascending order through [next].
+typedef struct BTreeNode {
+    IndexKey keys[BTREE_FANOUT];
+    uint64_t rows[BTREE_FANOUT];
+    uint32_t count;
+    bool leaf;
+    union {
+        struct BTreeNode *children[BTREE_FANOUT + 1];
+        struct BTreeNode *next;
+    };
+} __attribute__((aligned(CACHE_LINE_SIZE))) BTreeNode;
+
+/// Ordered index over a column, answering range predicates and ordered scans.
+/// Removals do not rebalance the tree: leaves may become sparse (or empty) and
+/// are simply skipped over by scans until the index is rebuilt.
+typedef struct BTreeIndex {
+    char *name;
+    BaseType type;
+    BTreeNode *root;
+} BTreeIndex;
+
+BTreeIndex *ibtree_new(const char *name, BaseType type);
+void ibtree_free(BTreeIndex *index);
+
+/// Add the entry ([key], [row]). NULL strings are not indexed.
+BazaResult ibtree_insert(BTreeIndex *index, IndexKey key, uint64_t row);
+
+typedef struct BTreeEntry {
+    IndexKey key;
+    uint64_t row;
+} BTreeEntry;
+
+/// Fill the empty [index] with [count] entries (no NULL strings), much faster than
+/// inserting them one by one: they are sorted in place by the thread pool, then the
+/// tree is built a level at a time from the leaves up, with every node full but
+/// the last ones of each level. The keys are copied.
+BazaResult ibtree_build(BTreeIndex *index, BTreeEntry *entries, size_t count);
+
+/// Remove the entry ([key], [row]), if present.
+void ibtree_remove(BTreeIndex *index, IndexKey key, uint64_t row);
+
+/// Renumber every row according to [remap], see itable_compact
+void ibtree_remap_rows(BTreeIndex *index, const RowRemap *remap);
+
+/// Bounds of a range scan. A NULL bound is unbounded on that side.
+typedef struct BTreeRange {
+    const IndexKey *lower;
+    bool lower_inclusive;
+    const IndexKey *upper;
+    bool upper_inclusive;
+} BTreeRange;
+
+/// Append the rows of all entries within [range] to [rows] (growing it as needed)
+/// in key order. Returns the new row count or -1 on allocation failure.
+int64_t ibtree_scan(BTreeIndex *index, BTreeRange range, uint64_t **rows, size_t *capacity);
+
+/// Count the entries within [range], giving up at [limit]: only the leaves are read
+size_t ibtree_count(BTreeIndex *index, BTreeRange range, size_t limit);
+
+#endif /* _STORAGE_INDEX_H */
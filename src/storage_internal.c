@@ -1,115 +1,185 @@
 #include "storage_internal.h"
+#include "storage_file.h"
+#include "storage_scan.h"
+#include "storage_wal.h"
+#include "util/hash.h"
 #include "util/intlist.h"
+#include "util/parallel.h"
 #include "util/result.h"
 #include "util/str.h"
 
+#include <dirent.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include <string.h>
 
-Column *icolumn_new(const char *name, BaseType type)
+BazaResult icolumn_init(Column *column, ColumnID_t id, const char *name, BaseType type)
 {
-    Column *ret = malloc(sizeof(Column));
-    if (!ret)
-        return NULL;
+    *column = (Column) {
+        .meta.id = id,
+        .meta.name = strdup(name),
+        .meta.type = type,
+        .chunks = NULL,
+        .zones = NULL,
+        .born = NULL,
+        .chunk_count = 0,
+        .strings = NULL,
+        .strings_dead = 0,
+        .dict = NULL,
+        .hash_index = NULL,
+        .btree_index = NULL,
+        .stats = NULL,
+        .stats_changes = 0,
+    };
 
-    static uint64_t COLUMN_ID = 0;
-    
-    ret->meta.name = strdup(name);
-    ret->meta.type = type;
-    ret->meta.id = COLUMN_ID;
-    ret->data = NULL;
-    ret->next = NULL;
+    if (!column->meta.name)
+        return RESULT_ALLOC;
 
-    COLUMN_ID++;
+    if (type == BTYPE_STRING) {
+        column->strings = arena_new(BAZA_STRING_ARENA_BLOCK);
+        if (!column->strings) {
+            free(column->meta.name);
+            return RESULT_ALLOC;
+        }
+    }
 
-    return ret;
+    return RESULT_OK;
 }
 
 // A column is assumed to "own" all of its data, including the data that it points to.
-void icolumn_free(Column *column, uint64_t row_count)
+// Strings all live in the column's arena, so they are released together with it.
+void icolumn_deinit(Column *column)
 {
-    // free data structures requiring special care
-    switch (column->meta.type) {
-        // TODO: could be reduced to a generic thing maybe, basetype_isptr() or something
-        case BTYPE_STRING: {
-            char **string_data = column->data;
+    arena_free(column->strings);
+    idict_free(column->dict);
+    ihash_free(column->hash_index);
+    ibtree_free(column->btree_index);
+    istats_free(column->stats);
+    icolumn_chunks_trim(column, 0);
+    free(column->chunks);
+    free(column->zones);
+    free(column->born);
+    free(column->meta.name);
+}
 
-            for(size_t i = 0; i < row_count; i++) {
-                free(string_data[i]);
-            }
-        } break;
-        default: { /* typed stored literally - NOP */ }
-    }
+size_t icolumn_cell_size(Column *column)
+{
+    if (column->dict)
+        return sizeof(DictCode_t);
 
-    free(column->data);
-    free(column->meta.name);
-    free(column);
+    return basetype_size(column->meta.type);
 }
 
-BazaResult icolumn_realloc_data(Column *column, size_t capacity)
+/// Append [chunk], allocated at table version [born], to the chunks of [column]
+static BazaResult icolumn_chunk_push(Column *column, void *chunk, uint64_t born)
 {
-    size_t type_size = basetype_size(column->meta.type);
+    // only the array of chunk pointers moves, never the rows themselves
+    void **chunks = realloc(column->chunks, (column->chunk_count + 1) * sizeof(void*));
+    if (!chunks)
+        return RESULT_ALLOC;
+    column->chunks = chunks;
 
-    if (!column->data) {
-        // first allocation
-        column->data = malloc(type_size * capacity);
-        if (!column->data)
-            return RESULT_ALLOC;
-    } else {
-        // subsequent realloc
-        column->data = realloc(column->data, type_size * capacity);
-        if (!column->data)
-            return RESULT_ALLOC;
-    }
+    Zone *zones = realloc(column->zones, (column->chunk_count + 1) * sizeof(Zone));
+    if (!zones)
+        return RESULT_ALLOC;
+    column->zones = zones;
+
+    uint64_t *borns = realloc(column->born, (column->chunk_count + 1) * sizeof(uint64_t));
+    if (!borns)
+        return RESULT_ALLOC;
+    column->born = borns;
+
+    column->zones[column->chunk_count] = (Zone) { .empty = true, .stale = true };
+    column->born[column->chunk_count] = born;
+    column->chunks[column->chunk_count++] = chunk;
 
     return RESULT_OK;
 }
 
+BazaResult icolumn_chunk_add(Column *column, uint64_t born)
+{
+    // cells are zeroed as rows are added, a fresh chunk only reserves the space
+    // (so the pages of a mostly empty chunk are never touched)
+    void *chunk = malloc(BAZA_CHUNK_ROWS * icolumn_cell_size(column));
+    if (!chunk)
+        return RESULT_ALLOC;
+
+    BazaResult res = icolumn_chunk_push(column, chunk, born);
+    if (res != RESULT_OK)
+        free(chunk);
+
+    return res;
+}
+
+BazaResult icolumn_chunk_map(Column *column, void *chunk)
+{
+    if (column->chunk_count && column->born[column->chunk_count - 1] != CHUNK_BORN_MAPPED)
+        return RESULT_SERVER_ERROR;
+
+    return icolumn_chunk_push(column, chunk, CHUNK_BORN_MAPPED);
+}
+
+void icolumn_chunks_trim(Column *column, size_t count)
+{
+    while (column->chunk_count > count) {
+        column->chunk_count--;
+        if (column->born[column->chunk_count] != CHUNK_BORN_MAPPED)
+            free(column->chunks[column->chunk_count]);
+    }
+}
+
+void *icolumn_cell(Column *column, uint64_t index)
+{
+    byte *chunk = column->chunks[index >> BAZA_CHUNK_SHIFT];
+    return chunk + (index & BAZA_CHUNK_MASK) * icolumn_cell_size(column);
+}
+
+void icolumn_zones_invalidate(Column *column)
+{
+    for (size_t i = 0; i < column->chunk_count; i++)
+        column->zones[i].stale = true;
+}
+
 /// Get the value at [index] inside [column]
 void *icolumn_row_get(Column *column, size_t index)
 {
-    // ^^ TODO: generate this with a macro?
-    switch (column->meta.type) {
-        case BTYPE_INT32: {
-            uint32_t *u32data = column->data;
-            u32data += index;
-            return u32data;
-        } break;
-        case BTYPE_INT64: {
-            uint64_t *u64data = column->data;
-            u64data += index;
-            return u64data;
-        } break;
-        case BTYPE_STRING: {
-            char **strdata = column->data;
-            strdata += index;
-            return strdata;
-        } break;
-        default: {
-            return NULL;
-        } break;
-    }
+    void *cell = icolumn_cell(column, index);
+
+    if (column->dict)
+        return &column->dict->values[*(DictCode_t*)cell];
+
+    return cell;
 }
 
 /// Set the row [data] at [index]. No bounds checks performed
 void icolumn_row_set(Column *column, size_t index, const void *data)
 {
-    // TODO: generate this with a macro?
+    void *cell = icolumn_cell(column, index);
+    column->zones[index >> BAZA_CHUNK_SHIFT].stale = true;
+
     switch (column->meta.type) {
         case BTYPE_INT32: {
-            uint32_t *u32data = column->data;
-            u32data += index;
-            *u32data = *(uint32_t*)data;
+            *(uint32_t*)cell = *(uint32_t*)data;
         } break;
         case BTYPE_INT64: {
-            uint64_t *u64data = column->data;
-            u64data += index;
-            *u64data = *(uint64_t*)data;
+            *(uint64_t*)cell = *(uint64_t*)data;
         } break;
         case BTYPE_STRING: {
-            char **strdata = column->data;
-            strdata += index;
-            char *dup = strdup(*(char**)data);
-            *strdata = dup;
+            char *src = *(char**)data;
+
+            if (column->dict) {
+                DictCode_t *code = cell;
+                if ((*code = idict_intern(column->dict, src)) == DICT_CODE_NONE)
+                    FATAL("failed to store a string in column %s", column->meta.name);
+                break;
+            }
+
+            char **strdata = cell;
+            *strdata = NULL;
+            if (src && !(*strdata = arena_strdup(column->strings, src)))
+                FATAL("failed to store a string in column %s", column->meta.name);
         } break;
         case BTYPE_INVALID: {
             // nop: this shouldn't ever happen.
@@ -117,286 +187,2065 @@ void icolumn_row_set(Column *column, size_t index, const void *data)
     }
 }
 
-// Set the row [data] at [index]. No bounds checks performed
-// DIFFERENCE FROM 'icolumn_row_set': does not copy types that would usually
-// be copied to ensure ownership. I figured this the right abstraction layer
-// to split this at. This function should probably thus only be called from
-// other column_* functions, where we already "own" the pointer
-void icolumn_row_set_nocopy(Column *column, size_t index, const void *data)
+void icolumn_compact(Column *column, const uint64_t *deleted, size_t size)
 {
-    // TODO: generate this with a macro?
-    switch (column->meta.type) {
-        case BTYPE_INT32: {
-            uint32_t *u32data = column->data;
-            u32data += index;
-            *u32data = *(uint32_t*)data;
-        } break;
-        case BTYPE_INT64: {
-            uint64_t *u64data = column->data;
-            u64data += index;
-            *u64data = *(uint64_t*)data;
-        } break;
-        case BTYPE_STRING: {
-            char **strdata = column->data;
-            strdata += index;
-            *strdata = *(char**)data;
-        } break;
-        case BTYPE_INVALID: {
-            // nop: this shouldn't ever happen.
-        } break;
+    size_t type_size = icolumn_cell_size(column);
+    size_t write = 0;
+
+    for (size_t read = 0; read < size; read++) {
+        bool dead = deleted[read / 64] >> (read % 64) & 1;
+
+        if (dead) {
+            icolumn_string_release(column, read);
+            continue;
+        }
+
+        if (write != read)
+            memcpy(icolumn_cell(column, write), icolumn_cell(column, read), type_size);
+        write++;
     }
+
+    icolumn_zones_invalidate(column);
 }
 
-void icolumn_row_delete(Column *column, size_t index, size_t size)
+void icolumn_string_release(Column *column, uint64_t index)
 {
-    // TODO: generalize
-    if (column->meta.type == BTYPE_STRING) {
-        char *to_delete = *(char**)icolumn_row_get(column, index);
-        free(to_delete);
-    }
+    // dictionary values stay around for as long as the column does
+    if (column->meta.type != BTYPE_STRING || column->dict)
+        return;
+
+    const char *str = *(char**)icolumn_row_get(column, index);
+    if (str)
+        column->strings_dead += strlen(str) + 1;
+}
+
+/// Number of rows of [chunk] in use, out of the first [size] rows of the column
+static size_t ichunk_rows(size_t chunk, size_t size)
+{
+    size_t base = chunk << BAZA_CHUNK_SHIFT;
+    return size - base < BAZA_CHUNK_ROWS ? size - base : BAZA_CHUNK_ROWS;
+}
+
+/// Scans only hold their table's read lock, so concurrent scans refreshing the
+/// same stale zone take one of these, picked by the zone's address
+#define ZONE_LOCK_COUNT 64
+
+static pthread_mutex_t ZONE_LOCKS[ZONE_LOCK_COUNT] = {
+    [0 ... ZONE_LOCK_COUNT - 1] = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/// Return the zone of [chunk], holding [count] rows, recomputing it if stale
+static const Zone *icolumn_zone(Column *column, size_t chunk, size_t count)
+{
+    Zone *zone = &column->zones[chunk];
+    if (!__atomic_load_n(&zone->stale, __ATOMIC_ACQUIRE))
+        return zone;
+
+    pthread_mutex_t *lock = &ZONE_LOCKS[hash_u64((uintptr_t)zone) % ZONE_LOCK_COUNT];
+    pthread_mutex_lock(lock);
+
+    if (zone->stale) {
+        BaseType type = column->meta.type;
+        Zone fresh = { .empty = true, .stale = false };
+
+        for (size_t i = 0; i < count; i++) {
+            IndexKey key = ikey_from_cell(type, icolumn_row_get(column, (chunk << BAZA_CHUNK_SHIFT) + i));
+            if (type == BTYPE_STRING && !key.s)
+                continue;
+
+            if (fresh.empty) {
+                fresh.min = fresh.max = key;
+                fresh.empty = false;
+            } else if (ikey_cmp(type, key, fresh.min) < 0) {
+                fresh.min = key;
+            } else if (ikey_cmp(type, key, fresh.max) > 0) {
+                fresh.max = key;
+            }
+        }
 
-    for(; index < size-1; index++) {
-        void *next = icolumn_row_get(column, index + 1);
-        icolumn_row_set_nocopy(column, index, next);
+        // readers only look at the bounds once they see the zone is not stale
+        zone->min = fresh.min;
+        zone->max = fresh.max;
+        zone->empty = fresh.empty;
+        __atomic_store_n(&zone->stale, false, __ATOMIC_RELEASE);
     }
+
+    pthread_mutex_unlock(lock);
+
+    return zone;
 }
 
-/// Find all matching rows i.e. ones for which func(value, column[i]) returns true
-TableFindResult icolumn_find(Column *column, size_t size, findfunc_t func, void *value)
+/// How the rows of a chunk match a predicate, judging by the chunk's zone alone
+typedef enum ZoneMatch {
+    ZONE_MATCH_NONE,
+    ZONE_MATCH_SOME, // undecided, the rows have to be scanned
+    ZONE_MATCH_ALL,
+} ZoneMatch;
+
+static ZoneMatch izone_match_int(const Zone *zone, int64_t lo, int64_t hi)
 {
-    IntList *lst = intlist_empty();
-    if (!lst)
-        return (TableFindResult) { .res = RESULT_ALLOC };
+    if (zone->empty || zone->max.i < lo || zone->min.i > hi)
+        return ZONE_MATCH_NONE;
 
-    for(size_t i = 0; i < size; i++) {
-        void *ith = icolumn_row_get(column, i);
-        bool cmp = func(column->meta.type, ith, value);
-        if (cmp)
-            intlist_push(lst, i);
+    if (zone->min.i >= lo && zone->max.i <= hi)
+        return ZONE_MATCH_ALL;
+
+    return ZONE_MATCH_SOME;
+}
+
+/// Whether any string within [zone] can satisfy [op] [value]
+static bool izone_may_match_str(const Zone *zone, FilterOp op, const char *value)
+{
+    switch (op) {
+        case FILTER_EQUAL:
+            return strcmp(zone->min.s, value) <= 0 && strcmp(zone->max.s, value) >= 0;
+        case FILTER_GREATER:
+            return strcmp(zone->max.s, value) > 0;
+        case FILTER_GREATER_EQUAL:
+            return strcmp(zone->max.s, value) >= 0;
+        case FILTER_LESSER:
+            return strcmp(zone->min.s, value) < 0;
+        case FILTER_LESSER_EQUAL:
+            return strcmp(zone->min.s, value) <= 0;
+        default:
+            return true;
     }
+}
 
-    return (TableFindResult) { .res = RESULT_OK, .matches = lst };
+/// Set the first [count] bits of [words]
+static void iwords_fill(uint64_t *words, size_t count)
+{
+    memset(words, 0xff, count / SELECTION_WORD_BITS * sizeof(uint64_t));
+    if (count % SELECTION_WORD_BITS)
+        words[count / SELECTION_WORD_BITS] = (1ULL << (count % SELECTION_WORD_BITS)) - 1;
 }
 
+/// A predicate over string cells: [op] [value], ANDed with [op2] [value2] unless
+/// [op2] is FILTER_NONE. FILTER_NONE as [op] matches every (non NULL) string.
+typedef struct StrPredicate {
+    FilterOp op;
+    const char *value;
+    FilterOp op2;
+    const char *value2;
+} StrPredicate;
 
-/// Return an empty table with the [name] and row capacity of {BAZA_DEFAULT_CAPACITY}
-Table *itable_new(const char *name)
+static bool istr_predicate_eval(const StrPredicate *pred, const char *str)
 {
-    Table *new = malloc(sizeof(Table));
-    if (!new)
-        return NULL;
+    if (!str)
+        return false;
 
-    static uint64_t TABLE_ID = 0;
-    
-    *new = (Table) {
-        .meta.name = strdup(name),
-        .meta.row_count = 0,
-        .meta.id = TABLE_ID,
-        .row_capacity = BAZA_DEFAULT_ROW_CAPACITY,
-        .columns = NULL,
-        .next = NULL,
-    };
+    return (pred->op == FILTER_NONE || scan_str_match(pred->op, str, pred->value))
+        && (pred->op2 == FILTER_NONE || scan_str_match(pred->op2, str, pred->value2));
+}
+
+/// Whether any row of a chunk with [zone] can satisfy [pred]. NULL strings never
+/// do, so neither can a chunk holding nothing else.
+static bool izone_may_match_pred(const Zone *zone, const StrPredicate *pred)
+{
+    return !zone->empty
+        && izone_may_match_str(zone, pred->op, pred->value)
+        && izone_may_match_str(zone, pred->op2, pred->value2);
+}
 
-    TABLE_ID++;
+/// A scan of the first [size] rows of [column] into [sel], split into morsels of
+/// a chunk each: they fill disjoint runs of bitmap words, so the parallel_for
+/// workers need no merging and the result is in row order right away
+typedef struct ChunkScan {
+    Column *column;
+    size_t size;
+    Selection *sel;
+    const uint64_t *within;   // the bitmap of candidate rows, NULL if all rows are
+    const StrPredicate *pred; // string scans
+    const bool *hits;         // dictionary scans, per code
+    int64_t lo, hi;           // integer scans
+    bool negate;
+} ChunkScan;
 
-    return new;
+/// The candidate rows of [chunk] in [scan], as bitmap words, NULL if all rows are candidates
+static const uint64_t *iscan_chunk_within(const ChunkScan *scan, size_t chunk)
+{
+    if (!scan->within)
+        return NULL;
+    return scan->within + (chunk << BAZA_CHUNK_SHIFT) / SELECTION_WORD_BITS;
 }
 
-/// Free [table]. As with column_free, we assume exclusive ownership 
-/// of all the data pointed to from inside the structure
-void itable_free(Table *table)
+/// Whether none of the first [count] bits of [words] is set
+static bool iwords_empty(const uint64_t *words, size_t count)
 {
-    Column *cur = table->columns, *nxt;
-    while(cur) {
-        nxt = cur->next;
-        icolumn_free(cur, table->meta.row_count);
-        cur = nxt;
+    for (size_t i = 0; i < SELECTION_WORD_COUNT(count); i++) {
+        if (words[i])
+            return false;
     }
-    free(table->meta.name);
-    free(table);
+    return true;
 }
 
-void itable_realloc(Table *table, uint64_t size)
+/// Does row [row] match the predicate of [scan]
+static bool iscan_row_matches(const ChunkScan *scan, uint64_t row)
 {
-    Column *col = table->columns;
-    while (col) {
-        icolumn_realloc_data(col, size);
-        col = col->next;
-    }
-    table->row_capacity = size;
+    void *cell = icolumn_cell(scan->column, row);
+
+    if (scan->hits)
+        return scan->hits[*(DictCode_t*)cell];
+    if (scan->pred)
+        return istr_predicate_eval(scan->pred, *(char**)cell);
+
+    int64_t value = scan->column->meta.type == BTYPE_INT32 ? *(int32_t*)cell : *(int64_t*)cell;
+    return (value >= scan->lo && value <= scan->hi) != scan->negate;
 }
 
-Column *itable_column_byid(Table *table, ColumnID_t cid)
+/// Check the sorted-array [within] one row at a time: too few candidates for a scan
+/// to pay off, the matches are a sorted array too
+static TableFindResult iscan_rows(const ChunkScan *scan, const Selection *within)
 {
-    Column *column = table->columns;
-    while (column) {
-        if (column->meta.id == cid)
-            return column;
-        column = column->next;
+    Selection *sel = selection_rows_new(scan->size);
+    if (!sel)
+        return (TableFindResult) { .res = RESULT_ALLOC };
+
+    for (size_t i = 0; i < within->count && within->rows[i] < scan->size; i++) {
+        if (iscan_row_matches(scan, within->rows[i]) && selection_push(sel, within->rows[i]) != RESULT_OK) {
+            selection_free(sel);
+            return (TableFindResult) { .res = RESULT_ALLOC };
+        }
     }
-    return NULL;
+
+    return (TableFindResult) { .res = RESULT_OK, .matches = sel };
 }
 
-Column *itable_column_find(Table *table, const char *name)
+static void iscan_dict_chunk(void *arg, size_t chunk)
 {
-    Column *cur = table->columns;
-    while (cur) {
-        if (!strcmp(cur->meta.name, name))
-            return cur;
-        cur = cur->next;
+    ChunkScan *scan = arg;
+    size_t count = ichunk_rows(chunk, scan->size);
+    const uint64_t *within = iscan_chunk_within(scan, chunk);
+    if (within && iwords_empty(within, count))
+        return;
+    if (!izone_may_match_pred(icolumn_zone(scan->column, chunk, count), scan->pred))
+        return;
+
+    const DictCode_t *codes = scan->column->chunks[chunk];
+    uint64_t *words = scan->sel->words + (chunk << BAZA_CHUNK_SHIFT) / SELECTION_WORD_BITS;
+
+    for (size_t base = 0; base < count; base += SELECTION_WORD_BITS) {
+        size_t end = base + SELECTION_WORD_BITS < count ? base + SELECTION_WORD_BITS : count;
+        uint64_t word = 0;
+
+        for (size_t i = base; i < end; i++)
+            word |= (uint64_t)scan->hits[codes[i]] << (i - base);
+
+        // looking the codes up costs less than skipping the non-candidates
+        if (within)
+            word &= within[base / SELECTION_WORD_BITS];
+
+        words[base / SELECTION_WORD_BITS] = word;
     }
-    return NULL;
 }
 
-/// Add a new column [name] with [type] to [table] (internal)
-BazaResult itable_column_new(Table *table, BaseType type, const char *name)
+/// Evaluate [pred] once per dictionary value, then match the rows by their codes
+static TableFindResult icolumn_find_dict(Column *column, size_t size, const StrPredicate *pred,
+                                         const Selection *within)
 {
-    // Since we do not allow for null values yet, disallow adding a new column 
-    // if there is already data inside the table
-    if (table->meta.row_count > 0)
-        return RESULT_TABLE_NOT_EMPTY;
+    StringDict *dict = column->dict;
 
-    if (itable_column_find(table, name))
-        return RESULT_DUPLICATE_COLUMN_NAME;
+    bool *hits = malloc(dict->count * sizeof(bool));
+    if (!hits)
+        return (TableFindResult) { .res = RESULT_ALLOC };
 
-    Column *new = icolumn_new(name, type);
-    if (!new)
-        return RESULT_ALLOC;
+    for (DictCode_t code = 0; code < dict->count; code++)
+        hits[code] = istr_predicate_eval(pred, dict->values[code]);
 
-    ENSURE(icolumn_realloc_data(new, table->row_capacity));
+    if (within && within->kind == SELECTION_ROWS) {
+        ChunkScan scan = { .column = column, .size = size, .hits = hits };
+        TableFindResult res = iscan_rows(&scan, within);
+        free(hits);
+        return res;
+    }
 
-    if (!table->columns) {
-        table->columns = new;
-    } else {
-        Column *cursor = table->columns;
-        while(cursor->next)
-            cursor = cursor->next;
-        cursor->next = new;
+    Selection *sel = selection_bitmap_new(size);
+    if (!sel) {
+        free(hits);
+        return (TableFindResult) { .res = RESULT_ALLOC };
     }
 
-    return RESULT_OK; 
+    ChunkScan scan = {
+        .column = column, .size = size, .sel = sel, .within = within ? within->words : NULL,
+        .pred = pred, .hits = hits,
+    };
+    parallel_for(BAZA_CHUNK_COUNT(size), iscan_dict_chunk, &scan);
+
+    free(hits);
+
+    return (TableFindResult) { .res = RESULT_OK, .matches = sel };
 }
 
-BazaResult itable_row_delete(Table *table, size_t index)
+static void iscan_str_chunk(void *arg, size_t chunk)
 {
-    if (index >= table->meta.row_count)
-        return RESULT_INDEX_OUT_OF_BOUNDS;
+    ChunkScan *scan = arg;
+    size_t count = ichunk_rows(chunk, scan->size);
+    const uint64_t *within = iscan_chunk_within(scan, chunk);
+    if (within && iwords_empty(within, count))
+        return;
+    if (!izone_may_match_pred(icolumn_zone(scan->column, chunk, count), scan->pred))
+        return;
+
+    char **strdata = scan->column->chunks[chunk];
+    uint64_t *words = scan->sel->words + (chunk << BAZA_CHUNK_SHIFT) / SELECTION_WORD_BITS;
+
+    // build each bitmap word in a register and store it once
+    for (size_t base = 0; base < count; base += SELECTION_WORD_BITS) {
+        size_t end = base + SELECTION_WORD_BITS < count ? base + SELECTION_WORD_BITS : count;
+        uint64_t word = 0;
+
+        if (within) {
+            // only the candidates are compared, string comparisons being the costly part
+            uint64_t candidates = within[base / SELECTION_WORD_BITS];
+            if (end - base < SELECTION_WORD_BITS)
+                candidates &= (1ULL << (end - base)) - 1;
+            while (candidates) {
+                int bit = __builtin_ctzll(candidates);
+                word |= (uint64_t)istr_predicate_eval(scan->pred, strdata[base + bit]) << bit;
+                candidates &= candidates - 1;
+            }
+        } else {
+            for (size_t i = base; i < end; i++)
+                word |= (uint64_t)istr_predicate_eval(scan->pred, strdata[i]) << (i - base);
+        }
 
-    Column *cur = table->columns;
-    while(cur) {
-        icolumn_row_delete(cur, index, table->meta.row_count);
-        cur = cur->next;
+        words[base / SELECTION_WORD_BITS] = word;
     }
+}
 
-    table->meta.row_count--;
-    return RESULT_OK;
+static TableFindResult icolumn_find_str(Column *column, size_t size, const StrPredicate *pred,
+                                        const Selection *within)
+{
+    if (column->dict)
+        return icolumn_find_dict(column, size, pred, within);
+
+    ChunkScan scan = { .column = column, .size = size, .pred = pred };
+    if (within && within->kind == SELECTION_ROWS)
+        return iscan_rows(&scan, within);
+
+    Selection *sel = selection_bitmap_new(size);
+    if (!sel)
+        return (TableFindResult) { .res = RESULT_ALLOC };
+
+    scan.sel = sel;
+    scan.within = within ? within->words : NULL;
+    parallel_for(BAZA_CHUNK_COUNT(size), iscan_str_chunk, &scan);
+
+    return (TableFindResult) { .res = RESULT_OK, .matches = sel };
 }
 
-void itable_row_print(Table *table, IntList *ColumnIDs, uint64_t row)
+/// Turn [range] into inclusive bounds within the domain of the integer [type].
+/// Returns false if no value can be in the range.
+static bool irange_bounds(BaseType type, ValueRange range, int64_t *lo, int64_t *hi)
 {
-    if (row > table->meta.row_count)
-        return;
+    int64_t min = type == BTYPE_INT32 ? INT32_MIN : INT64_MIN;
+    int64_t max = type == BTYPE_INT32 ? INT32_MAX : INT64_MAX;
 
-    Column *col = table->columns; 
-    while (col) {
-        if (ColumnIDs && !intlist_contains(ColumnIDs, col->meta.id)) {
-            col = col->next;
-            continue;
+    *lo = min;
+    *hi = max;
+
+    if (range.lower) {
+        int64_t value = ikey_from_value(type, range.lower).i;
+        if (!range.lower_inclusive) {
+            if (value == max)
+                return false;
+            value++;
         }
+        *lo = value;
+    }
 
-        void *value = icolumn_row_get(col, row);
+    if (range.upper) {
+        int64_t value = ikey_from_value(type, range.upper).i;
+        if (!range.upper_inclusive) {
+            if (value == min)
+                return false;
+            value--;
+        }
+        *hi = value;
+    }
 
-        #define PRINT_ROW_PADDING 20
+    return *lo <= *hi;
+}
 
-        char *as_str = basetype_value_to_str(col->meta.type, value);
-        fputs(as_str, stdout);
+/// Chunks entirely inside or outside of the range are decided by their zone alone,
+/// the others take one kernel call, each filling its own run of bitmap words
+static void iscan_int_chunk(void *arg, size_t chunk)
+{
+    ChunkScan *scan = arg;
+    Column *column = scan->column;
+    size_t count = ichunk_rows(chunk, scan->size);
+    uint64_t *words = scan->sel->words + (chunk << BAZA_CHUNK_SHIFT) / SELECTION_WORD_BITS;
+    const uint64_t *within = iscan_chunk_within(scan, chunk);
+    if (within && iwords_empty(within, count))
+        return;
 
-        int slen = str_count_utf8_glyphs(as_str);
-        printf("%*s", PRINT_ROW_PADDING-slen, " ");
+    ZoneMatch match = izone_match_int(icolumn_zone(column, chunk, count), scan->lo, scan->hi);
+    if (match != ZONE_MATCH_SOME) {
+        if ((match == ZONE_MATCH_ALL) != scan->negate)
+            iwords_fill(words, count);
+    } else if (column->meta.type == BTYPE_INT32) {
+        scan_i32_between(column->chunks[chunk], count, scan->lo, scan->hi, scan->negate, words);
+    } else {
+        scan_i64_between(column->chunks[chunk], count, scan->lo, scan->hi, scan->negate, words);
+    }
 
-        free(as_str);
-        col = col->next;
+    // the kernels compare whole blocks faster than they could skip rows
+    if (within) {
+        for (size_t i = 0; i < SELECTION_WORD_COUNT(count); i++)
+            words[i] &= within[i];
     }
 }
 
-/// Return a list of all row ids matching value in column 
-TableFindResult itable_find(Table *table, Column *column,
-                            findfunc_t func, void *value)
+/// Match the rows of an integer column lying within [range] (outside of it if [negate])
+static TableFindResult icolumn_find_int(Column *column, size_t size, ValueRange range, bool negate,
+                                        const Selection *within)
 {
-    return icolumn_find(column, table->meta.row_count, func, value);
+    int64_t lo, hi;
+    bool empty = !irange_bounds(column->meta.type, range, &lo, &hi);
+    if (empty && negate) {
+        // nothing lies in the range, so every row lies outside of it
+        irange_bounds(column->meta.type, (ValueRange) { 0 }, &lo, &hi);
+        negate = false;
+        empty = false;
+    }
+
+    ChunkScan scan = { .column = column, .size = size, .lo = lo, .hi = hi, .negate = negate };
+    if (!empty && within && within->kind == SELECTION_ROWS)
+        return iscan_rows(&scan, within);
+
+    Selection *sel = selection_bitmap_new(size);
+    if (!sel)
+        return (TableFindResult) { .res = RESULT_ALLOC };
+
+    // no row matches, the bitmap is already all zero
+    if (empty)
+        return (TableFindResult) { .res = RESULT_OK, .matches = sel };
+
+    scan.sel = sel;
+    scan.within = within ? within->words : NULL;
+    parallel_for(BAZA_CHUNK_COUNT(size), iscan_int_chunk, &scan);
+
+    return (TableFindResult) { .res = RESULT_OK, .matches = sel };
 }
 
-// global database object
-struct DataBase {
-    Table *tables; 
-} DB;
+/// Find all matching rows i.e. ones for which column[i] [op] [value] holds
+/// The values [op] [value] accepts, as a range: [value, value] for equality (and for
+/// inequality, negated) and half-open ranges for the rest. False for LIKE.
+static bool ifilter_range(FilterOp op, const void *value, ValueRange *range)
+{
+    switch (op) {
+        case FILTER_EQUAL:
+        case FILTER_NOT_EQUAL:
+            *range = (ValueRange) { value, true, value, true };
+            return true;
+        case FILTER_GREATER:
+        case FILTER_GREATER_EQUAL:
+            *range = (ValueRange) { .lower = value, .lower_inclusive = op == FILTER_GREATER_EQUAL };
+            return true;
+        case FILTER_LESSER:
+        case FILTER_LESSER_EQUAL:
+            *range = (ValueRange) { .upper = value, .upper_inclusive = op == FILTER_LESSER_EQUAL };
+            return true;
+        default:
+            return false;
+    }
+}
 
-TableResult idb_table_new(const char *table_name)
+TableFindResult icolumn_find(Column *column, size_t size, FilterOp op, const void *value,
+                             const Selection *within)
 {
-    if (!DB.tables) {
-        DB.tables = itable_new(table_name);
-        
-        if (DB.tables) {
-            return (TableResult) {
-                .result = RESULT_OK,
-                .meta = DB.tables->meta,
-            };
-        }
+    // rows past the candidates can not match
+    if (within && within->universe < size)
+        size = within->universe;
 
-        return (TableResult) {
-            .result = RESULT_SERVER_ERROR,
-        };
+    switch (column->meta.type) {
+        case BTYPE_INT32:
+        case BTYPE_INT64: {
+            // every comparison is a range check, LIKE on an integer is equality
+            ValueRange range;
+            if (!ifilter_range(op == FILTER_LIKE ? FILTER_EQUAL : op, value, &range))
+                return (TableFindResult) { .res = RESULT_INVALID_QUERY };
+
+            return icolumn_find_int(column, size, range, op == FILTER_NOT_EQUAL, within);
+        }
+        case BTYPE_STRING: {
+            StrPredicate pred = { .op = op, .value = value, .op2 = FILTER_NONE };
+            return icolumn_find_str(column, size, &pred, within);
+        }
+        case BTYPE_INVALID:
+            break;
     }
 
-    Table *tcur = DB.tables;
-    while (tcur->next)
-        tcur = tcur->next;
+    return (TableFindResult) { .res = RESULT_VALUE_TYPE };
+}
 
-    tcur->next = itable_new(table_name);
+/// Find all rows of [column] within [range]
+TableFindResult icolumn_find_range(Column *column, size_t size, ValueRange range,
+                                   const Selection *within)
+{
+    if (within && within->universe < size)
+        size = within->universe;
 
-    if (tcur->next) {
-        return (TableResult) {
-            .result = RESULT_OK,
-            .meta = tcur->next->meta,
-        };
+    switch (column->meta.type) {
+        case BTYPE_INT32:
+        case BTYPE_INT64:
+            return icolumn_find_int(column, size, range, false, within);
+        case BTYPE_STRING: {
+            StrPredicate pred = {
+                .op = !range.lower ? FILTER_NONE 
+                    : range.lower_inclusive ? FILTER_GREATER_EQUAL : FILTER_GREATER,
+                .value = range.lower,
+                .op2 = !range.upper ? FILTER_NONE 
+                     : range.upper_inclusive ? FILTER_LESSER_EQUAL : FILTER_LESSER,
+                .value2 = range.upper,
+            };
+            return icolumn_find_str(column, size, &pred, within);
+        }
+        case BTYPE_INVALID:
+            break;
     }
 
-    return (TableResult) { .result = RESULT_SERVER_ERROR };
+    return (TableFindResult) { .res = RESULT_VALUE_TYPE };
 }
 
-Table *idb_table_get(const char *table_name)
+static bool istats_match_pred(const void *pred, const char *str)
+{
+    return istr_predicate_eval(pred, str);
+}
+
+/// Shares of the rows assumed to satisfy a predicate where the zones cannot tell
+#define ESTIMATE_EQUAL 0.005 // unless the number of distinct values is known
+#define ESTIMATE_LIKE 0.05
+#define ESTIMATE_BOUND 0.33  // per bound of a range
+
+ColumnEstimate icolumn_estimate(Column *column, size_t size, FilterOp op, const void *value,
+                                ValueRange range)
 {
-    Table *cur = DB.tables; 
-    while (cur) {
-        if (!strcmp(cur->meta.name, table_name))
-            return cur;
-        cur = cur->next;
+    BaseType type = column->meta.type;
+    bool like = op == FILTER_LIKE && type == BTYPE_STRING;
+    bool equality = op == FILTER_EQUAL || op == FILTER_NOT_EQUAL || op == FILTER_LIKE;
+    bool negate = op == FILTER_NOT_EQUAL;
+
+    if (op != FILTER_NONE && !like && !ifilter_range(equality ? FILTER_EQUAL : op, value, &range))
+        return (ColumnEstimate) { .res = RESULT_INVALID_QUERY };
+
+    ColumnEstimate est = {
+        .res = RESULT_OK,
+        .chunks = BAZA_CHUNK_COUNT(size),
+        .distinct = column->dict ? column->dict->count - 1 : 0,
+        .index = INDEX_INVALID,
+    };
+
+    // the share of the rows of a chunk its zone can not decide
+    double guess = like ? ESTIMATE_LIKE
+                 : equality ? (est.distinct ? 1.0 / est.distinct : ESTIMATE_EQUAL)
+                 : (range.lower ? ESTIMATE_BOUND : 1) * (range.upper ? ESTIMATE_BOUND : 1);
+
+    int64_t lo = 0, hi = 0;
+    bool empty = type != BTYPE_STRING && !irange_bounds(type, range, &lo, &hi);
+
+    StrPredicate pred = {
+        .op = !range.lower ? FILTER_NONE 
+            : range.lower_inclusive ? FILTER_GREATER_EQUAL : FILTER_GREATER,
+        .value = range.lower,
+        .op2 = !range.upper ? FILTER_NONE 
+             : range.upper_inclusive ? FILTER_LESSER_EQUAL : FILTER_LESSER,
+        .value2 = range.upper,
+    };
+
+    for (size_t chunk = 0; chunk < est.chunks; chunk++) {
+        size_t count = ichunk_rows(chunk, size);
+        const Zone *zone = &column->zones[chunk];
+        double share = guess;
+
+        if (empty) {
+            share = 0;
+        } else if (like || __atomic_load_n(&zone->stale, __ATOMIC_ACQUIRE)) {
+            // refreshing stale zones is left to the scans
+        } else if (type == BTYPE_STRING) {
+            if (!izone_may_match_pred(zone, &pred)) {
+                share = 0;
+                // inequality is still checked row by row
+                est.chunks_skipped += !negate;
+            }
+        } else {
+            switch (izone_match_int(zone, lo, hi)) {
+                case ZONE_MATCH_NONE:
+                    share = 0;
+                    est.chunks_skipped++;
+                    break;
+                case ZONE_MATCH_ALL:
+                    share = 1;
+                    est.chunks_skipped++;
+                    break;
+                case ZONE_MATCH_SOME: {
+                    // assuming the values are spread evenly between the bounds of the zone
+                    double from = lo > zone->min.i ? lo : zone->min.i;
+                    double to = hi < zone->max.i ? hi : zone->max.i;
+                    share = (to - from + 1) / ((double)zone->max.i - zone->min.i + 1);
+                } break;
+            }
+        }
+
+        est.matches += (negate ? 1 - share : share) * count;
+    }
+
+    // the statistics describe the live rows as a whole, unlike the zones which
+    // know nothing of deletions, so they are trusted with the matches instead
+    const ColumnStats *stats = column->stats;
+    if (stats && !empty) {
+        StrPredicate like_pred = { .op = FILTER_LIKE, .value = value, .op2 = FILTER_NONE };
+        IndexKey key = type == BTYPE_STRING ? (IndexKey) { .s = value } : (IndexKey) { .i = lo };
+
+        double share = like ? istats_share_str(stats, istats_match_pred, &like_pred)
+                     : equality ? istats_share_equal(stats, type, key)
+                     : type == BTYPE_STRING ? istats_share_str(stats, istats_match_pred, &pred)
+                     : istats_share_int(stats, lo, hi);
+
+        // NULL strings satisfy no predicate, not even an inequality
+        if (negate) {
+            double nulls = stats->rows ? (double)stats->nulls / stats->rows : 0;
+            share = share + nulls < 1 ? 1 - share - nulls : 0;
+        }
+
+        est.matches = share * size;
     }
-    return NULL;
+
+    return est;
 }
 
-Table *idb_table_get_byid(TableID_t tid)
+/// Storage a writer replaced while a live snapshot could still see it
+typedef enum RetiredKind { RETIRED_CHUNK, RETIRED_ARENA, RETIRED_STATS } RetiredKind;
+
+typedef struct Retired {
+    void *ptr;
+    RetiredKind kind;
+    uint64_t version; // of the table when retired, only older snapshots see it
+    struct Retired *next;
+} Retired;
+
+static void iretired_free(void *ptr, RetiredKind kind)
 {
-    Table *cur = DB.tables; 
-    while (cur) {
-        if (cur->meta.id == tid)
-            return cur;
-        cur = cur->next;
+    switch (kind) {
+        case RETIRED_CHUNK: free(ptr); break;
+        case RETIRED_ARENA: arena_free(ptr); break;
+        case RETIRED_STATS: istats_free(ptr); break;
     }
-    return NULL;
 }
 
-void storage_init()
+/// Free what was retired from [table] at or before [oldest], the version of its
+/// oldest live snapshot. The caller holds the table's snapshots_lock.
+static void iretired_collect(Table *table, uint64_t oldest)
 {
+    Retired **link = &table->retired;
+
+    while (*link) {
+        Retired *item = *link;
+        if (item->version > oldest) {
+            link = &item->next;
+            continue;
+        }
 
+        *link = item->next;
+        iretired_free(item->ptr, item->kind);
+        free(item);
+    }
 }
 
-void storage_deinit()
+/// Free [ptr] once no live snapshot of [table] can see it anymore
+static void itable_retire(Table *table, RetiredKind kind, void *ptr)
 {
-    Table *tab = DB.tables, *next;
-    while (tab) {
-        next = tab->next; 
-        itable_free(tab);
-        tab = next;
-    }
+    if (!ptr)
+        return;
+
+    pthread_mutex_lock(&table->snapshots_lock);
+
+    if (!table->snapshots) {
+        iretired_free(ptr, kind);
+    } else {
+        // out of memory, rather leak [ptr] than pull it from under a reader
+        Retired *item = malloc(sizeof(Retired));
+        if (item) {
+            *item = (Retired) { .ptr = ptr, .kind = kind, .version = table->version, .next = table->retired };
+            table->retired = item;
+        }
+    }
+
+    pthread_mutex_unlock(&table->snapshots_lock);
+}
+
+/// Release the chunks of [column] past the first [count], which snapshots may still see
+static void itable_column_chunks_retire(Table *table, Column *column, size_t count)
+{
+    while (column->chunk_count > count) {
+        column->chunk_count--;
+        if (column->born[column->chunk_count] != CHUNK_BORN_MAPPED)
+            itable_retire(table, RETIRED_CHUNK, column->chunks[column->chunk_count]);
+    }
+}
+
+/// Return an empty table with the [name]. No chunks are allocated until the first row is added.
+Table *itable_new(TableID_t id, const char *name)
+{
+    Table *new = malloc(sizeof(Table));
+    if (!new)
+        return NULL;
+
+    *new = (Table) {
+        .meta.name = strdup(name),
+        .meta.row_count = 0,
+        .meta.id = id,
+        .row_capacity = 0,
+        .deleted = NULL,
+        .dead_count = 0,
+        .columns = NULL,
+        .column_count = 0,
+        .column_capacity = 0,
+        .column_names = strmap_new(),
+        .mapping = NULL,
+        .mapping_size = 0,
+        .wal_lsn = 0,
+        .modifications = 0,
+        .version = 1,
+        .shared_version = 0,
+        .shared_rows = 0,
+        .snapshots = NULL,
+        .retired = NULL,
+    };
+
+    if (!new->meta.name || !new->column_names || pthread_rwlock_init(&new->lock, NULL) != 0) {
+        strmap_free(new->column_names);
+        free(new->meta.name);
+        free(new);
+        return NULL;
+    }
+
+    if (pthread_mutex_init(&new->snapshots_lock, NULL) != 0) {
+        pthread_rwlock_destroy(&new->lock);
+        strmap_free(new->column_names);
+        free(new->meta.name);
+        free(new);
+        return NULL;
+    }
+
+    return new;
+}
+
+/// Free [table]. As with column_free, we assume exclusive ownership 
+/// of all the data pointed to from inside the structure
+void itable_free(Table *table)
+{
+    for (size_t i = 0; i < table->column_count; i++)
+        icolumn_deinit(&table->columns[i]);
+
+    free(table->columns);
+    strmap_free(table->column_names);
+    free(table->deleted);
+    free(table->meta.name);
+    // no snapshots are left by now
+    iretired_collect(table, UINT64_MAX);
+
+    if (table->mapping)
+        munmap(table->mapping, table->mapping_size);
+    pthread_rwlock_destroy(&table->lock);
+    pthread_mutex_destroy(&table->snapshots_lock);
+    free(table);
+}
+
+/// The table locks held by the calling thread, which make itable_lock re-entrant
+#define TABLE_LOCKS_HELD_MAX 8
+
+static _Thread_local struct HeldLock {
+    Table *table; // NULL if the slot is free
+    TableLockMode mode;
+    unsigned depth;
+} HELD_LOCKS[TABLE_LOCKS_HELD_MAX];
+
+void itable_lock(Table *table, TableLockMode mode)
+{
+    struct HeldLock *slot = NULL;
+
+    for (size_t i = 0; i < TABLE_LOCKS_HELD_MAX; i++) {
+        struct HeldLock *held = &HELD_LOCKS[i];
+
+        if (held->table == table) {
+            if (mode == TABLE_LOCK_WRITE && held->mode == TABLE_LOCK_READ)
+                FATAL("modifying %s while holding its read lock, this is a bug", table->meta.name);
+            held->depth++;
+            return;
+        }
+
+        if (!held->table && !slot)
+            slot = held;
+    }
+
+    if (!slot)
+        FATAL("a thread can hold at most %d table locks", TABLE_LOCKS_HELD_MAX);
+
+    if (mode == TABLE_LOCK_READ) {
+        pthread_rwlock_rdlock(&table->lock);
+    } else {
+        pthread_rwlock_wrlock(&table->lock);
+        table->modifications++;
+    }
+
+    *slot = (struct HeldLock) { .table = table, .mode = mode, .depth = 1 };
+}
+
+void itable_unlock(Table *table)
+{
+    for (size_t i = 0; i < TABLE_LOCKS_HELD_MAX; i++) {
+        struct HeldLock *held = &HELD_LOCKS[i];
+        if (held->table != table)
+            continue;
+
+        if (--held->depth == 0) {
+            held->table = NULL;
+            pthread_rwlock_unlock(&table->lock);
+        }
+        return;
+    }
+
+    FATAL("unlocking %s, which is not locked by this thread, this is a bug", table->meta.name);
+}
+
+/// Initialize [copy] (zeroed) as a view of [column] sharing its chunks
+static BazaResult icolumn_snapshot(Column *copy, Column *column)
+{
+    size_t count = column->chunk_count;
+
+    copy->meta = column->meta;
+    copy->chunk_count = count;
+    if (count) {
+        copy->chunks = malloc(count * sizeof(void*));
+        copy->zones = malloc(count * sizeof(Zone));
+        copy->born = malloc(count * sizeof(uint64_t));
+        if (!copy->chunks || !copy->zones || !copy->born)
+            return RESULT_ALLOC;
+
+        memcpy(copy->chunks, column->chunks, count * sizeof(void*));
+        memcpy(copy->born, column->born, count * sizeof(uint64_t));
+    }
+
+    // other readers may be refreshing stale zones meanwhile, only fresh ones are copied
+    for (size_t i = 0; i < count; i++) {
+        Zone *zone = &column->zones[i];
+        if (__atomic_load_n(&zone->stale, __ATOMIC_ACQUIRE))
+            copy->zones[i] = (Zone) { .empty = true, .stale = true };
+        else
+            copy->zones[i] = *zone;
+    }
+
+    // statistics are replaced rather than changed, the old ones are retired
+    copy->stats = column->stats;
+
+    // new codes are only ever appended, the strings of the old ones stay put
+    if (column->dict) {
+        StringDict *dict = calloc(1, sizeof(StringDict));
+        if (!dict)
+            return RESULT_ALLOC;
+        copy->dict = dict;
+
+        dict->values = malloc(column->dict->count * sizeof(char*));
+        if (!dict->values)
+            return RESULT_ALLOC;
+        memcpy(dict->values, column->dict->values, column->dict->count * sizeof(char*));
+        dict->count = dict->capacity = column->dict->count;
+    }
+
+    return RESULT_OK;
+}
+
+/// Free the copies [snapshot] made, leaving what it shares with its table alone
+static void itable_snapshot_free(TableSnapshot *snapshot)
+{
+    Table *view = &snapshot->view;
+
+    for (size_t i = 0; view->columns && i < view->column_count; i++) {
+        Column *col = &view->columns[i];
+        free(col->chunks);
+        free(col->zones);
+        free(col->born);
+        if (col->dict)
+            free(col->dict->values);
+        free(col->dict);
+    }
+
+    free(view->columns);
+    free(view->deleted);
+    strmap_free(view->column_names);
+    free(snapshot);
+}
+
+TableSnapshot *itable_snapshot_open(Table *table)
+{
+    TableSnapshot *snapshot = calloc(1, sizeof(TableSnapshot));
+    if (!snapshot)
+        return NULL;
+
+    Table *view = &snapshot->view;
+    view->meta = table->meta;
+    view->row_capacity = table->row_capacity;
+    view->dead_count = table->dead_count;
+    view->column_count = table->column_count;
+    view->column_capacity = table->column_count;
+    view->wal_lsn = table->wal_lsn;
+
+    size_t words = TABLE_BITMAP_WORDS(table->row_capacity);
+    view->deleted = words ? malloc(words * sizeof(uint64_t)) : NULL;
+    view->columns = table->column_count ? calloc(table->column_count, sizeof(Column)) : NULL;
+    view->column_names = strmap_new();
+    if ((words && !view->deleted) || (table->column_count && !view->columns) || !view->column_names) {
+        itable_snapshot_free(snapshot);
+        return NULL;
+    }
+    if (words)
+        memcpy(view->deleted, table->deleted, words * sizeof(uint64_t));
+
+    for (size_t i = 0; i < table->column_count; i++) {
+        if (icolumn_snapshot(&view->columns[i], &table->columns[i]) != RESULT_OK
+            || strmap_put(view->column_names, view->columns[i].meta.name, i) != RESULT_OK) {
+            itable_snapshot_free(snapshot);
+            return NULL;
+        }
+    }
+
+    snapshot->table = table;
+    snapshot->modifications = table->modifications;
+
+    // other readers may be taking snapshots of [table] at the same time
+    pthread_mutex_lock(&table->snapshots_lock);
+
+    snapshot->version = table->version++;
+    snapshot->next = table->snapshots;
+    table->snapshots = snapshot;
+
+    __atomic_store_n(&table->shared_version, snapshot->version, __ATOMIC_RELEASE);
+    if (table->meta.row_count > table->shared_rows)
+        __atomic_store_n(&table->shared_rows, table->meta.row_count, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&table->snapshots_lock);
+
+    return snapshot;
+}
+
+void itable_snapshot_close(TableSnapshot *snapshot)
+{
+    Table *table = snapshot->table;
+
+    pthread_mutex_lock(&table->snapshots_lock);
+
+    TableSnapshot **link = &table->snapshots;
+    while (*link != snapshot)
+        link = &(*link)->next;
+    *link = snapshot->next;
+
+    // the newest snapshot is the first one, the oldest the last
+    uint64_t newest = 0, oldest = UINT64_MAX, rows = 0;
+    for (TableSnapshot *live = table->snapshots; live; live = live->next) {
+        if (!newest)
+            newest = live->version;
+        oldest = live->version;
+        if (live->view.meta.row_count > rows)
+            rows = live->view.meta.row_count;
+    }
+
+    __atomic_store_n(&table->shared_version, newest, __ATOMIC_RELEASE);
+    __atomic_store_n(&table->shared_rows, rows, __ATOMIC_RELEASE);
+    iretired_collect(table, oldest);
+
+    pthread_mutex_unlock(&table->snapshots_lock);
+
+    itable_snapshot_free(snapshot);
+}
+
+BazaResult itable_chunk_own(Table *table, Column *column, uint64_t row)
+{
+    size_t chunk = row >> BAZA_CHUNK_SHIFT;
+    uint64_t shared = __atomic_load_n(&table->shared_version, __ATOMIC_ACQUIRE);
+
+    // chunks born after the newest snapshot and rows past the ones any snapshot
+    // sees are private already
+    if (!shared || shared < column->born[chunk]
+        || row >= __atomic_load_n(&table->shared_rows, __ATOMIC_ACQUIRE))
+        return RESULT_OK;
+
+    size_t size = ichunk_rows(chunk, table->meta.row_count) * icolumn_cell_size(column);
+    void *copy = malloc(BAZA_CHUNK_ROWS * icolumn_cell_size(column));
+    if (!copy)
+        return RESULT_ALLOC;
+    memcpy(copy, column->chunks[chunk], size);
+
+    if (column->born[chunk] != CHUNK_BORN_MAPPED)
+        itable_retire(table, RETIRED_CHUNK, column->chunks[chunk]);
+
+    column->chunks[chunk] = copy;
+    column->born[chunk] = table->version;
+
+    return RESULT_OK;
+}
+
+BazaResult itable_strings_compact(Table *table, Column *column, bool force)
+{
+    if (column->meta.type != BTYPE_STRING || column->dict)
+        return RESULT_OK;
+
+    if (!force && (column->strings_dead < BAZA_STRING_COMPACT_MIN_DEAD
+                   || column->strings_dead * 2 < column->strings->used))
+        return RESULT_OK;
+
+    size_t size = table->meta.row_count;
+    Arena *fresh = arena_new(BAZA_STRING_ARENA_BLOCK);
+    if (!fresh)
+        return RESULT_ALLOC;
+
+    // copy into the new arena first, so that a failure leaves the column untouched
+    char **moved = malloc(size * sizeof(char*));
+    if (!moved && size) {
+        arena_free(fresh);
+        return RESULT_ALLOC;
+    }
+
+    for (size_t i = 0; i < size; i++) {
+        const char *str = *(char**)icolumn_cell(column, i);
+        moved[i] = NULL;
+        if (str && !(moved[i] = arena_strdup(fresh, str))) {
+            free(moved);
+            arena_free(fresh);
+            return RESULT_ALLOC;
+        }
+    }
+
+    // every cell gets rewritten
+    for (size_t row = 0; row < size; row += BAZA_CHUNK_ROWS) {
+        BazaResult res = itable_chunk_own(table, column, row);
+        if (res != RESULT_OK) {
+            free(moved);
+            arena_free(fresh);
+            return res;
+        }
+    }
+
+    for (size_t i = 0; i < size; i++)
+        *(char**)icolumn_cell(column, i) = moved[i];
+    free(moved);
+
+    // the zones borrow their bounds from the old arena
+    icolumn_zones_invalidate(column);
+
+    itable_retire(table, RETIRED_ARENA, column->strings);
+    column->strings = fresh;
+    column->strings_dead = 0;
+
+    return RESULT_OK;
+}
+
+BazaResult itable_chunk_add(Table *table)
+{
+    size_t count = table->row_capacity / BAZA_CHUNK_ROWS + 1;
+
+    // columns that got their chunk before an earlier attempt failed keep it
+    for (size_t i = 0; i < table->column_count; i++) {
+        Column *col = &table->columns[i];
+        if (col->chunk_count < count)
+            ENSURE(icolumn_chunk_add(col, table->version));
+    }
+
+    size_t old_words = TABLE_BITMAP_WORDS(table->row_capacity);
+    size_t new_words = TABLE_BITMAP_WORDS(table->row_capacity + BAZA_CHUNK_ROWS);
+    uint64_t *deleted = realloc(table->deleted, new_words * sizeof(uint64_t));
+    if (!deleted)
+        return RESULT_ALLOC;
+    memset(deleted + old_words, 0, (new_words - old_words) * sizeof(uint64_t));
+
+    table->deleted = deleted;
+    table->row_capacity += BAZA_CHUNK_ROWS;
+
+    return RESULT_OK;
+}
+
+/// Release the chunks left empty after [table] shrunk
+static void itable_chunks_trim(Table *table)
+{
+    size_t count = BAZA_CHUNK_COUNT(table->meta.row_count);
+
+    for (size_t i = 0; i < table->column_count; i++)
+        itable_column_chunks_retire(table, &table->columns[i], count);
+
+    size_t capacity = count << BAZA_CHUNK_SHIFT;
+    if (!capacity) {
+        free(table->deleted);
+        table->deleted = NULL;
+    } else {
+        // shrinking can only fail by keeping the bigger bitmap, which is still usable
+        uint64_t *deleted = realloc(table->deleted, TABLE_BITMAP_WORDS(capacity) * sizeof(uint64_t));
+        if (deleted)
+            table->deleted = deleted;
+    }
+
+    table->row_capacity = capacity;
+}
+
+bool itable_row_is_deleted(Table *table, uint64_t row)
+{
+    return table->deleted[row / 64] >> (row % 64) & 1;
+}
+
+Column *itable_column_byid(Table *table, ColumnID_t cid)
+{
+    if (cid >= table->column_count)
+        return NULL;
+
+    return &table->columns[cid];
+}
+
+Column *itable_column_find(Table *table, const char *name)
+{
+    uint64_t cid;
+    if (!strmap_get(table->column_names, name, &cid))
+        return NULL;
+
+    return &table->columns[cid];
+}
+
+/// Add a new column [name] with [type] to [table] (internal)
+BazaResult itable_column_new(Table *table, BaseType type, const char *name)
+{
+    // Since we do not allow for null values yet, disallow adding a new column 
+    // if there is already data inside the table
+    if (table->meta.row_count > 0)
+        return RESULT_TABLE_NOT_EMPTY;
+
+    if (itable_column_find(table, name))
+        return RESULT_DUPLICATE_COLUMN_NAME;
+
+    if (table->column_count == table->column_capacity) {
+        size_t capacity = table->column_capacity ? table->column_capacity * 2 : BAZA_DEFAULT_COLUMN_CAPACITY;
+        Column *columns = realloc(table->columns, capacity * sizeof(Column));
+        if (!columns)
+            return RESULT_ALLOC;
+
+        table->columns = columns;
+        table->column_capacity = capacity;
+    }
+
+    ColumnID_t cid = table->column_count;
+    Column *new = &table->columns[cid];
+
+    ENSURE(icolumn_init(new, cid, name, type));
+
+    BazaResult res = RESULT_OK;
+    while (res == RESULT_OK && new->chunk_count < table->row_capacity / BAZA_CHUNK_ROWS)
+        res = icolumn_chunk_add(new, table->version);
+    if (res == RESULT_OK)
+        res = strmap_put(table->column_names, new->meta.name, cid);
+
+    if (res != RESULT_OK) {
+        icolumn_deinit(new);
+        return res;
+    }
+
+    table->column_count++;
+    iwal_create_column(table, new);
+
+    return RESULT_OK; 
+}
+
+/// Add the value at [row] to every index over [column]
+BazaResult icolumn_index_insert(Column *column, uint64_t row)
+{
+    IndexKey key = ikey_from_cell(column->meta.type, icolumn_row_get(column, row));
+
+    if (column->hash_index)
+        ENSURE(ihash_insert(column->hash_index, key, row));
+    if (column->btree_index)
+        ENSURE(ibtree_insert(column->btree_index, key, row));
+
+    return RESULT_OK;
+}
+
+/// Remove the value at [row] from every index over [column]
+void icolumn_index_remove(Column *column, uint64_t row)
+{
+    IndexKey key = ikey_from_cell(column->meta.type, icolumn_row_get(column, row));
+
+    if (column->hash_index)
+        ihash_remove(column->hash_index, key, row);
+    if (column->btree_index)
+        ibtree_remove(column->btree_index, key, row);
+}
+
+BazaResult itable_row_delete(Table *table, size_t index)
+{
+    if (index >= table->meta.row_count)
+        return RESULT_INDEX_OUT_OF_BOUNDS;
+
+    if (itable_row_is_deleted(table, index))
+        return RESULT_OK;
+
+    // the row stays in place (and keeps its data) until the table is compacted,
+    // but it has to disappear from the indexes right away
+    for (size_t i = 0; i < table->column_count; i++) {
+        icolumn_index_remove(&table->columns[i], index);
+        table->columns[i].stats_changes++;
+    }
+
+    table->deleted[index / 64] |= 1ULL << (index % 64);
+    table->dead_count++;
+    iwal_row_delete(table, index);
+
+    return RESULT_OK;
+}
+
+typedef struct ColumnCompaction {
+    Table *table;
+    const RowRemap *remap;
+} ColumnCompaction;
+
+static void icolumn_compact_morsel(void *arg, size_t cid)
+{
+    ColumnCompaction *compaction = arg;
+    Table *table = compaction->table;
+    Column *col = &table->columns[cid];
+
+    icolumn_compact(col, table->deleted, table->meta.row_count);
+
+    if (col->hash_index)
+        ihash_remap_rows(col->hash_index, compaction->remap);
+    if (col->btree_index)
+        ibtree_remap_rows(col->btree_index, compaction->remap);
+}
+
+static BazaResult itable_compact_rows(Table *table)
+{
+    size_t words = TABLE_BITMAP_WORDS(table->meta.row_count);
+    uint64_t *dead_before = malloc(words * sizeof(uint64_t));
+    if (!dead_before)
+        return RESULT_ALLOC;
+
+    uint64_t dead = 0;
+    for (size_t i = 0; i < words; i++) {
+        dead_before[i] = dead;
+        dead += __builtin_popcountll(table->deleted[i]);
+    }
+
+    RowRemap remap = { .deleted = table->deleted, .dead_before = dead_before };
+
+    // rows move down in place, in every chunk
+    for (size_t i = 0; i < table->column_count; i++) {
+        Column *col = &table->columns[i];
+
+        for (uint64_t row = 0; row < table->meta.row_count; row += BAZA_CHUNK_ROWS) {
+            BazaResult res = itable_chunk_own(table, col, row);
+            if (res != RESULT_OK) {
+                free(dead_before);
+                return res;
+            }
+        }
+    }
+
+    // the columns are independent of each other, each is a morsel of its own
+    ColumnCompaction compaction = { .table = table, .remap = &remap };
+    parallel_for(table->column_count, icolumn_compact_morsel, &compaction);
+
+    free(dead_before);
+
+    memset(table->deleted, 0, TABLE_BITMAP_WORDS(table->row_capacity) * sizeof(uint64_t));
+    table->meta.row_count -= table->dead_count;
+    table->dead_count = 0;
+
+    itable_chunks_trim(table);
+
+    return RESULT_OK;
+}
+
+BazaResult itable_compact(Table *table, bool force)
+{
+    if (table->dead_count)
+        ENSURE(itable_compact_rows(table));
+    else if (!force)
+        return RESULT_OK;
+
+    for (size_t i = 0; i < table->column_count; i++)
+        ENSURE(itable_strings_compact(table, &table->columns[i], force));
+
+    // the row numbers of later records depend on it, so it is replayed as well
+    iwal_compact(table, force);
+
+    return RESULT_OK;
+}
+
+BazaResult itable_save(Table *table)
+{
+    // the file holds no tombstones
+    if (table->dead_count)
+        ENSURE(itable_compact(table, false));
+
+    char *path = ifile_path(BAZA_DATA_DIR, table->meta.name, TABLE_FILE_EXT);
+    if (!path)
+        return RESULT_ALLOC;
+
+    BazaResult res = ifile_table_save(table, path, iwal_next_lsn());
+    free(path);
+
+    return res;
+}
+
+bool itable_should_compact(Table *table)
+{
+    return table->dead_count >= BAZA_COMPACT_MIN_DEAD_ROWS
+        && table->dead_count * 100 >= table->meta.row_count * BAZA_COMPACT_DEAD_PERCENT;
+}
+
+/// An analysis of a column, split into morsels of a chunk each. Every [step]th row
+/// is sampled: the samples of a chunk go to a run of [sample] of its own, starting
+/// at the position of the chunk's first row to sample, and are moved together later.
+typedef struct ColumnAnalysis {
+    Table *table;
+    Column *column;
+    size_t size;
+    uint64_t step;
+    IndexKey *sample;
+    struct ChunkAnalysis {
+        uint64_t rows;  // live ones
+        uint64_t nulls;
+        size_t sampled;
+        HyperLogLog hll;
+    } *chunks;
+} ColumnAnalysis;
+
+static void icolumn_analyze_chunk(void *arg, size_t chunk)
+{
+    ColumnAnalysis *analysis = arg;
+    Column *column = analysis->column;
+    BaseType type = column->meta.type;
+    struct ChunkAnalysis *result = &analysis->chunks[chunk];
+
+    size_t count = ichunk_rows(chunk, analysis->size);
+    uint64_t first = chunk << BAZA_CHUNK_SHIFT;
+    IndexKey *sample = analysis->sample + (first + analysis->step - 1) / analysis->step;
+
+    // SELECTs only refresh the zones of their snapshots, the live ones are done here
+    icolumn_zone(column, chunk, count);
+
+    for (uint64_t row = first; row < first + count; row++) {
+        if (itable_row_is_deleted(analysis->table, row))
+            continue;
+
+        IndexKey key = ikey_from_cell(type, icolumn_row_get(column, row));
+        result->rows++;
+        if (type == BTYPE_STRING && !key.s) {
+            result->nulls++;
+            continue;
+        }
+
+        ihll_add(&result->hll, type == BTYPE_STRING ? hash_u64(hash_str(key.s)) : hash_u64(key.i));
+        if (row % analysis->step == 0)
+            sample[result->sampled++] = key;
+    }
+}
+
+/// Collect the statistics of [column] anew, retiring the old ones
+static BazaResult icolumn_analyze(Table *table, Column *column)
+{
+    size_t size = table->meta.row_count;
+    size_t chunks = BAZA_CHUNK_COUNT(size);
+    uint64_t step = (size + BAZA_STATS_SAMPLE_ROWS - 1) / BAZA_STATS_SAMPLE_ROWS;
+    if (!step)
+        step = 1;
+
+    ColumnAnalysis analysis = {
+        .table = table,
+        .column = column,
+        .size = size,
+        .step = step,
+        .sample = size ? malloc((size + step - 1) / step * sizeof(IndexKey)) : NULL,
+        .chunks = chunks ? calloc(chunks, sizeof(struct ChunkAnalysis)) : NULL,
+    };
+
+    if ((size && !analysis.sample) || (chunks && !analysis.chunks)) {
+        free(analysis.sample);
+        free(analysis.chunks);
+        return RESULT_ALLOC;
+    }
+
+    parallel_for(chunks, icolumn_analyze_chunk, &analysis);
+
+    uint64_t rows = 0, nulls = 0;
+    size_t count = 0;
+    HyperLogLog hll = { 0 };
+
+    for (size_t chunk = 0; chunk < chunks; chunk++) {
+        struct ChunkAnalysis *result = &analysis.chunks[chunk];
+        size_t start = ((chunk << BAZA_CHUNK_SHIFT) + step - 1) / step;
+
+        rows += result->rows;
+        nulls += result->nulls;
+        ihll_merge(&hll, &result->hll);
+        memmove(analysis.sample + count, analysis.sample + start, result->sampled * sizeof(IndexKey));
+        count += result->sampled;
+    }
+
+    // with every row sampled the values are counted exactly
+    ColumnStats *stats = istats_build(column->meta.type, analysis.sample, count, step == 1,
+                                      rows, nulls, ihll_estimate(&hll));
+    free(analysis.sample);
+    free(analysis.chunks);
+    if (!stats)
+        return RESULT_ALLOC;
+
+    itable_retire(table, RETIRED_STATS, column->stats);
+    column->stats = stats;
+    column->stats_changes = 0;
+
+    return RESULT_OK;
+}
+
+/// Whether enough of [column] has changed since it was analyzed to analyze it again
+static bool icolumn_should_analyze(Column *column)
+{
+    return column->stats
+        && column->stats_changes >= BAZA_STATS_REFRESH_MIN_ROWS
+        && column->stats_changes * 100 >= column->stats->rows * BAZA_STATS_REFRESH_PERCENT;
+}
+
+BazaResult itable_analyze(Table *table, bool force)
+{
+    for (size_t i = 0; i < table->column_count; i++) {
+        Column *column = &table->columns[i];
+        if (force || icolumn_should_analyze(column))
+            ENSURE(icolumn_analyze(table, column));
+    }
+
+    return RESULT_OK;
+}
+
+Selection *itable_live_rows(Table *table)
+{
+    Selection *sel = selection_bitmap_new(table->meta.row_count);
+    if (!sel)
+        return NULL;
+
+    size_t words = TABLE_BITMAP_WORDS(table->meta.row_count);
+    for (size_t i = 0; i < words; i++)
+        sel->words[i] = ~table->deleted[i];
+
+    // clear the bits past the last row
+    if (table->meta.row_count % 64)
+        sel->words[words - 1] &= (1ULL << (table->meta.row_count % 64)) - 1;
+
+    return sel;
+}
+
+BazaResult itable_column_dict_encode(Table *table, Column *column, uint64_t max_values)
+{
+    if (column->meta.type != BTYPE_STRING)
+        return RESULT_VALUE_TYPE;
+
+    if (column->dict)
+        return RESULT_OK;
+
+    StringDict *dict = idict_new();
+    if (!dict)
+        return RESULT_ALLOC;
+
+    // the codes are built in a column of their own, swapped in once complete
+    Column encoded = { .meta = column->meta, .dict = dict };
+
+    BazaResult res = RESULT_OK;
+    while (res == RESULT_OK && encoded.chunk_count < column->chunk_count)
+        res = icolumn_chunk_add(&encoded, table->version);
+
+    // deleted rows keep their values until compaction, so encode them as well
+    for (uint64_t row = 0; res == RESULT_OK && row < table->meta.row_count; row++) {
+        DictCode_t *code = icolumn_cell(&encoded, row);
+        *code = idict_intern(dict, *(char**)icolumn_cell(column, row));
+
+        if (*code == DICT_CODE_NONE)
+            res = RESULT_ALLOC;
+        else if (dict->count - 1 > max_values)
+            break;
+    }
+
+    if (res != RESULT_OK || dict->count - 1 > max_values) {
+        icolumn_chunks_trim(&encoded, 0);
+        free(encoded.chunks);
+        free(encoded.zones);
+        free(encoded.born);
+        idict_free(dict);
+        return res;
+    }
+
+    // the indexes own copies of their keys, so they are not affected
+    // the fresh (stale) zones of [encoded] replace the ones borrowing from the arena
+    itable_column_chunks_retire(table, column, 0);
+    free(column->chunks);
+    free(column->zones);
+    free(column->born);
+    itable_retire(table, RETIRED_ARENA, column->strings);
+
+    column->chunks = encoded.chunks;
+    column->zones = encoded.zones;
+    column->born = encoded.born;
+    column->chunk_count = encoded.chunk_count;
+    column->strings = NULL;
+    column->strings_dead = 0;
+    column->dict = dict;
+
+    iwal_dict_encode(table, column);
+
+    return RESULT_OK;
+}
+
+BazaResult itable_row_add(Table *table)
+{
+    uint64_t row = table->meta.row_count;
+
+    if (row == table->row_capacity)
+        ENSURE(itable_chunk_add(table));
+
+    table->meta.row_count++;
+
+    for (size_t i = 0; i < table->column_count; i++) {
+        Column *col = &table->columns[i];
+
+        // only after a compaction can a snapshot see the slot of a new row
+        ENSURE(itable_chunk_own(table, col, row));
+        memset(icolumn_cell(col, row), 0, icolumn_cell_size(col));
+        col->zones[row >> BAZA_CHUNK_SHIFT].stale = true;
+        ENSURE(icolumn_index_insert(col, row));
+    }
+
+    iwal_row_add(table);
+
+    return RESULT_OK;
+}
+
+BazaResult itable_row_set(Table *table, Column *column, uint64_t row, const void *value)
+{
+    if (row >= table->meta.row_count)
+        return RESULT_INDEX_OUT_OF_BOUNDS;
+
+    ENSURE(itable_chunk_own(table, column, row));
+
+    icolumn_index_remove(column, row);
+    icolumn_string_release(column, row);
+    icolumn_row_set(column, row, value);
+    ENSURE(icolumn_index_insert(column, row));
+    column->stats_changes++;
+    iwal_row_set(table, column, row, value);
+
+    return itable_strings_compact(table, column, false);
+}
+
+BazaResult itable_index_new(Table *table, Column *column, const char *name, IndexKind kind)
+{
+    if ((kind == INDEX_HASH && column->hash_index) || (kind == INDEX_BTREE && column->btree_index))
+        return RESULT_DUPLICATE_INDEX;
+
+    for (size_t i = 0; i < table->column_count; i++) {
+        Column *col = &table->columns[i];
+        if (col->hash_index && !strcmp(col->hash_index->name, name))
+            return RESULT_DUPLICATE_INDEX;
+        if (col->btree_index && !strcmp(col->btree_index->name, name))
+            return RESULT_DUPLICATE_INDEX;
+    }
+
+    switch (kind) {
+        case INDEX_HASH: {
+            HashIndex *index = ihash_new(name, column->meta.type);
+            if (!index)
+                return RESULT_ALLOC;
+
+            for (uint64_t row = 0; row < table->meta.row_count; row++) {
+                IndexKey key = ikey_from_cell(column->meta.type, icolumn_row_get(column, row));
+                BazaResult res = ihash_insert(index, key, row);
+                if (res != RESULT_OK) {
+                    ihash_free(index);
+                    return res;
+                }
+            }
+
+            column->hash_index = index;
+        } break;
+        case INDEX_BTREE: {
+            BTreeIndex *index = ibtree_new(name, column->meta.type);
+            BTreeEntry *entries = malloc((table->meta.row_count ? table->meta.row_count : 1) * sizeof(BTreeEntry));
+            if (!index || !entries) {
+                ibtree_free(index);
+                free(entries);
+                return RESULT_ALLOC;
+            }
+
+            // NULL strings are not indexed
+            size_t count = 0;
+            for (uint64_t row = 0; row < table->meta.row_count; row++) {
+                IndexKey key = ikey_from_cell(column->meta.type, icolumn_row_get(column, row));
+                if (column->meta.type != BTYPE_STRING || key.s)
+                    entries[count++] = (BTreeEntry) { .key = key, .row = row };
+            }
+
+            BazaResult res = ibtree_build(index, entries, count);
+            free(entries);
+            if (res != RESULT_OK) {
+                ibtree_free(index);
+                return res;
+            }
+
+            column->btree_index = index;
+        } break;
+        case INDEX_INVALID:
+            return RESULT_INVALID_QUERY;
+    }
+
+    iwal_create_index(table, column, name, kind);
+
+    return RESULT_OK;
+}
+
+static int cmp_u64(const void *left, const void *right)
+{
+    uint64_t l = *(const uint64_t*)left, r = *(const uint64_t*)right;
+    return (l > r) - (l < r);
+}
+
+/// Run a range scan over [index] and return the matching rows out of [universe]
+TableFindResult ibtree_find(BTreeIndex *index, BTreeRange range, uint64_t universe)
+{
+    uint64_t *rows = NULL;
+    size_t capacity = 0;
+
+    int64_t count = ibtree_scan(index, range, &rows, &capacity);
+    if (count < 0) {
+        free(rows);
+        return (TableFindResult) { .res = RESULT_ALLOC };
+    }
+
+    if (count)
+        qsort(rows, count, sizeof(uint64_t), cmp_u64);
+
+    Selection *matches = selection_from_array(universe, rows, count);
+    free(rows);
+
+    if (!matches)
+        return (TableFindResult) { .res = RESULT_ALLOC };
+
+    return (TableFindResult) { .res = RESULT_OK, .matches = matches };
+}
+
+TableFindResult itable_lookup_equal(Table *table, Column *column, const void *value)
+{
+    IndexKey key = ikey_from_value(column->meta.type, value);
+
+    if (column->hash_index) {
+        const HashIndexEntry *entry = ihash_lookup(column->hash_index, key);
+
+        Selection *matches = entry ? selection_from_array(table->meta.row_count, entry->rows, entry->row_count)
+                                   : selection_rows_new(table->meta.row_count);
+        if (!matches)
+            return (TableFindResult) { .res = RESULT_ALLOC };
+
+        return (TableFindResult) { .res = RESULT_OK, .matches = matches };
+    }
+
+    if (column->btree_index) {
+        BTreeRange range = { 
+            .lower = &key, .lower_inclusive = true,
+            .upper = &key, .upper_inclusive = true,
+        };
+        return ibtree_find(column->btree_index, range, table->meta.row_count);
+    }
+
+    return (TableFindResult) { .res = RESULT_INDEX_NOT_FOUND };
+}
+
+/// The bounds of [range] as keys of [type], stored in [lower] and [upper]
+static BTreeRange ibtree_range(BaseType type, ValueRange range, IndexKey *lower, IndexKey *upper)
+{
+    BTreeRange brange = {
+        .lower_inclusive = range.lower_inclusive,
+        .upper_inclusive = range.upper_inclusive,
+    };
+
+    if (range.lower) {
+        *lower = ikey_from_value(type, range.lower);
+        brange.lower = lower;
+    }
+    if (range.upper) {
+        *upper = ikey_from_value(type, range.upper);
+        brange.upper = upper;
+    }
+
+    return brange;
+}
+
+TableFindResult itable_lookup_range(Table *table, Column *column, ValueRange range)
+{
+    if (!column->btree_index)
+        return (TableFindResult) { .res = RESULT_INDEX_NOT_FOUND };
+
+    IndexKey lower, upper;
+    BTreeRange brange = ibtree_range(column->meta.type, range, &lower, &upper);
+
+    return ibtree_find(column->btree_index, brange, table->meta.row_count);
+}
+
+static void irows_reverse(uint64_t *rows, size_t count)
+{
+    for (size_t i = 0; i < count / 2; i++) {
+        uint64_t tmp = rows[i];
+        rows[i] = rows[count - 1 - i];
+        rows[count - 1 - i] = tmp;
+    }
+}
+
+TableOrderResult itable_lookup_ordered(Table *table, Column *column, SortDirection direction)
+{
+    (void)table;
+
+    if (!column->btree_index)
+        return (TableOrderResult) { .res = RESULT_INDEX_NOT_FOUND };
+
+    uint64_t *rows = NULL;
+    size_t capacity = 0;
+
+    int64_t count = ibtree_scan(column->btree_index, (BTreeRange) { 0 }, &rows, &capacity);
+    if (count < 0) {
+        free(rows);
+        return (TableOrderResult) { .res = RESULT_ALLOC };
+    }
+
+    if (direction == SORT_DESCENDING) {
+        irows_reverse(rows, count);
+
+        // rows with equal keys stay in ascending order, as table_sort leaves them
+        BaseType type = column->meta.type;
+        for (int64_t start = 0, end; start < count; start = end) {
+            IndexKey key = ikey_from_cell(type, icolumn_row_get(column, rows[start]));
+            for (end = start + 1; end < count; end++) {
+                if (ikey_cmp(type, key, ikey_from_cell(type, icolumn_row_get(column, rows[end]))))
+                    break;
+            }
+            irows_reverse(rows + start, end - start);
+        }
+    }
+
+    return (TableOrderResult) { .res = RESULT_OK, .rows = rows, .count = count };
+}
+
+void icell_print(FILE *out, BaseType type, void *cell)
+{
+    #define PRINT_ROW_PADDING 20
+
+    char *as_str = basetype_value_to_str(type, cell);
+    fputs(as_str, out);
+
+    int slen = str_count_utf8_glyphs(as_str);
+    fprintf(out, "%*s", PRINT_ROW_PADDING-slen, " ");
+
+    free(as_str);
+}
+
+void itable_row_print(Table *table, IntList *ColumnIDs, uint64_t row)
+{
+    if (row >= table->meta.row_count || itable_row_is_deleted(table, row))
+        return;
+
+    for (size_t i = 0; i < table->column_count; i++) {
+        Column *col = &table->columns[i];
+        if (ColumnIDs && !intlist_contains(ColumnIDs, col->meta.id))
+            continue;
+
+        icell_print(stdout, col->meta.type, icolumn_row_get(col, row));
+    }
+}
+
+/// Return a list of all row ids matching value in column 
+/// Clear the deleted rows from a selection returned by icolumn_find*
+static TableFindResult itable_mask_deleted(Table *table, TableFindResult res)
+{
+    if (res.res != RESULT_OK || !table->dead_count)
+        return res;
+
+    // deleted rows still hold their old values, mask them out
+    Selection *sel = res.matches;
+    if (sel->kind == SELECTION_BITMAP) {
+        for (size_t i = 0; i < SELECTION_WORD_COUNT(sel->universe); i++)
+            sel->words[i] &= ~table->deleted[i];
+    } else {
+        size_t kept = 0;
+        for (size_t i = 0; i < sel->count; i++) {
+            if (!itable_row_is_deleted(table, sel->rows[i]))
+                sel->rows[kept++] = sel->rows[i];
+        }
+        sel->count = kept;
+    }
+
+    return res;
+}
+
+TableFindResult itable_find(Table *table, Column *column, FilterOp op, const void *value,
+                            const Selection *within)
+{
+    return itable_mask_deleted(table, icolumn_find(column, table->meta.row_count, op, value, within));
+}
+
+TableFindResult itable_find_range(Table *table, Column *column, ValueRange range,
+                                  const Selection *within)
+{
+    return itable_mask_deleted(table, icolumn_find_range(column, table->meta.row_count, range, within));
+}
+
+ColumnEstimate itable_estimate(Table *table, Column *column, FilterOp op, const void *value,
+                               ValueRange range)
+{
+    uint64_t size = table->meta.row_count;
+    ColumnEstimate est = icolumn_estimate(column, size, op, value, range);
+
+    // deleted rows are assumed to be spread evenly as well
+    est.rows = size - table->dead_count;
+    if (size)
+        est.matches = est.matches * est.rows / size;
+
+    return est;
+}
+
+/// The btree counts the matches of a range exactly, as long as there are fewer than
+/// 1/ESTIMATE_BTREE_SHARE of the rows: a lookup would not pay off for many more
+#define ESTIMATE_BTREE_SHARE 16
+
+void itable_estimate_index(Column *column, FilterOp op, const void *value, ValueRange range,
+                           ColumnEstimate *est)
+{
+    BaseType type = column->meta.type;
+
+    if (op == FILTER_EQUAL && column->hash_index) {
+        const HashIndexEntry *entry = ihash_lookup(column->hash_index, ikey_from_value(type, value));
+
+        est->index = INDEX_HASH;
+        est->matches = entry ? entry->row_count : 0;
+        return;
+    }
+
+    if (!column->btree_index)
+        return;
+    if (op != FILTER_NONE && (op == FILTER_NOT_EQUAL || !ifilter_range(op, value, &range)))
+        return;
+
+    IndexKey lower, upper;
+    BTreeRange brange = ibtree_range(type, range, &lower, &upper);
+
+    size_t limit = est->rows / ESTIMATE_BTREE_SHARE + 1;
+    size_t count = ibtree_count(column->btree_index, brange, limit);
+
+    est->index = INDEX_BTREE;
+    // past the limit the zones may know better
+    if (count < limit || count > est->matches)
+        est->matches = count;
+}
+
+// global database object. A table's id is its position in [tables].
+struct DataBase {
+    Table **tables;
+    size_t table_count;  // also the next TableID, allocated with [lock] held for writing
+    size_t table_capacity;
+    StrMap *table_names; // table name -> TableID
+    pthread_rwlock_t lock; // the catalog above, not the tables themselves
+} DB;
+
+/// Add [table], created with the next free TableID (DB.table_count), to the database.
+/// The caller holds DB.lock for writing (or runs before any other thread).
+static BazaResult idb_table_add(Table *table)
+{
+    uint64_t tid;
+    if (strmap_get(DB.table_names, table->meta.name, &tid))
+        return RESULT_DUPLICATE_TABLE_NAME;
+
+    if (DB.table_count == DB.table_capacity) {
+        size_t capacity = DB.table_capacity ? DB.table_capacity * 2 : BAZA_DEFAULT_TABLE_CAPACITY;
+        Table **tables = realloc(DB.tables, capacity * sizeof(Table*));
+        if (!tables)
+            return RESULT_ALLOC;
+
+        DB.tables = tables;
+        DB.table_capacity = capacity;
+    }
+
+    ENSURE(strmap_put(DB.table_names, table->meta.name, table->meta.id));
+
+    DB.tables[DB.table_count++] = table;
+
+    return RESULT_OK;
+}
+
+TableResult idb_table_new(const char *table_name)
+{
+    pthread_rwlock_wrlock(&DB.lock);
+
+    // the name check, the ID and publishing the table all happen under one lock
+    Table *table = itable_new(DB.table_count, table_name);
+    if (!table) {
+        pthread_rwlock_unlock(&DB.lock);
+        return (TableResult) { .result = RESULT_SERVER_ERROR };
+    }
+
+    BazaResult res = idb_table_add(table);
+    if (res != RESULT_OK) {
+        pthread_rwlock_unlock(&DB.lock);
+        itable_free(table);
+        return (TableResult) { .result = res };
+    }
+
+    iwal_create_table(table);
+    TableMeta meta = table->meta;
+
+    pthread_rwlock_unlock(&DB.lock);
+
+    return (TableResult) {
+        .result = RESULT_OK,
+        .meta = meta,
+    };
+}
+
+BazaResult idb_checkpoint(void)
+{
+    size_t count;
+
+    // nothing may be logged between saving the tables and resetting the log. Tables
+    // are locked before the catalog, as everywhere else (in TableID order, directly:
+    // the caller must hold none), then the catalog keeps new tables out until the
+    // log is reset. Tables created while waiting for the locks mean starting over.
+    for (;;) {
+        pthread_rwlock_rdlock(&DB.lock);
+        count = DB.table_count;
+        pthread_rwlock_unlock(&DB.lock);
+
+        for (size_t i = 0; i < count; i++) {
+            Table *table = idb_table_get_byid(i);
+            pthread_rwlock_wrlock(&table->lock);
+            table->modifications++;
+        }
+
+        pthread_rwlock_rdlock(&DB.lock);
+        if (DB.table_count == count)
+            break;
+        pthread_rwlock_unlock(&DB.lock);
+
+        for (size_t i = 0; i < count; i++)
+            pthread_rwlock_unlock(&idb_table_get_byid(i)->lock);
+    }
+
+    BazaResult res = RESULT_OK;
+    for (size_t i = 0; res == RESULT_OK && i < count; i++)
+        res = itable_save(DB.tables[i]);
+
+    // every change logged so far is in the table files now
+    if (res == RESULT_OK)
+        iwal_reset();
+
+    for (size_t i = 0; i < count; i++)
+        pthread_rwlock_unlock(&DB.tables[i]->lock);
+
+    pthread_rwlock_unlock(&DB.lock);
+
+    return res;
+}
+
+static int idb_is_table_file(const struct dirent *entry)
+{
+    return ifile_is_table_file(entry->d_name);
+}
+
+/// Map every table file in [dir] (in name order, so that TableIDs are stable)
+static void idb_load(const char *dir)
+{
+    struct dirent **entries;
+    int count = scandir(dir, &entries, idb_is_table_file, alphasort);
+    if (count < 0)
+        return; // no data directory, nothing saved yet
+
+    for (int i = 0; i < count; i++) {
+        char *path = ifile_path(dir, entries[i]->d_name, "");
+        if (!path)
+            FATAL("failed to allocate the path of %s", entries[i]->d_name);
+
+        Table *table;
+        BazaResult res = ifile_table_load(path, DB.table_count, &table);
+        if (res == RESULT_OK && (res = idb_table_add(table)) != RESULT_OK)
+            itable_free(table);
+        if (res != RESULT_OK)
+            FATAL("failed to load %s: %s", path, result_str(res));
+
+        free(path);
+        free(entries[i]);
+    }
+
+    free(entries);
+}
+
+Table *idb_table_get(const char *table_name)
+{
+    Table *table = NULL;
+    uint64_t tid;
+
+    // tables are never freed before storage_deinit, the pointer outlives the lock
+    pthread_rwlock_rdlock(&DB.lock);
+    if (strmap_get(DB.table_names, table_name, &tid))
+        table = DB.tables[tid];
+    pthread_rwlock_unlock(&DB.lock);
+
+    return table;
+}
+
+Table *idb_table_get_byid(TableID_t tid)
+{
+    Table *table = NULL;
+
+    pthread_rwlock_rdlock(&DB.lock);
+    if (tid < DB.table_count)
+        table = DB.tables[tid];
+    pthread_rwlock_unlock(&DB.lock);
+
+    return table;
+}
+
+void storage_init()
+{
+    scan_init();
+
+    DB.table_names = strmap_new();
+    if (!DB.table_names || pthread_rwlock_init(&DB.lock, NULL) != 0)
+        FATAL("failed to allocate the table catalog");
+
+    idb_load(BAZA_DATA_DIR);
+
+    // a first start may have no data directory yet, the log and SAVE need one
+    if (mkdir(BAZA_DATA_DIR, 0755) != 0 && errno != EEXIST)
+        FATAL("failed to create the data directory %s: %m", BAZA_DATA_DIR);
+
+    uint64_t next_lsn = 0;
+    for (size_t i = 0; i < DB.table_count; i++)
+        if (DB.tables[i]->wal_lsn > next_lsn)
+            next_lsn = DB.tables[i]->wal_lsn;
+
+    char *wal_path = ifile_path(BAZA_DATA_DIR, WAL_FILE_NAME, "");
+    if (!wal_path)
+        FATAL("failed to allocate the path of the write-ahead log");
+
+    iwal_open(wal_path, next_lsn);
+    free(wal_path);
+}
+
+void storage_deinit()
+{
+    iwal_close();
+
+    for (size_t i = 0; i < DB.table_count; i++)
+        itable_free(DB.tables[i]);
+
+    free(DB.tables);
+    strmap_free(DB.table_names);
+    pthread_rwlock_destroy(&DB.lock);
+
+    DB = (struct DataBase) { 0 };
 }
@@ -3,54 +3,228 @@
 #define _STORAGE_INTERNAL_H
 
 #include "storage.h"
+#include "storage_index.h"
+#include "storage_dict.h"
+#include "storage_stats.h"
+#include "util/arena.h"
+#include "util/strmap.h"
 
-/// A linked list of columns belonging to the same table
+#include <pthread.h>
+
+/// Rows are stored in fixed size chunks of BAZA_CHUNK_ROWS, so that growing a table
+/// never moves the rows already in it. A multiple of 64, so that every chunk
+/// starts on a word of a selection bitmap.
+#define BAZA_CHUNK_SHIFT 16
+#define BAZA_CHUNK_ROWS (1ULL << BAZA_CHUNK_SHIFT)
+#define BAZA_CHUNK_MASK (BAZA_CHUNK_ROWS - 1)
+
+/// Number of chunks needed to hold [rows]
+#define BAZA_CHUNK_COUNT(rows) (((rows) + BAZA_CHUNK_ROWS - 1) >> BAZA_CHUNK_SHIFT)
+
+/// Bounds of the values in a chunk of a column, letting scans skip (or take
+/// as a whole) chunks that cannot match. Any write to the chunk marks its zone
+/// stale and the next scan recomputes it, so a fresh zone is always exact.
+typedef struct Zone {
+    IndexKey min, max; // strings are borrowed from the column's arena or dictionary
+    bool empty;        // no rows, or only NULL strings
+    bool stale;
+} Zone;
+
+/// A single column, stored inline in its table's column array
 typedef struct Column {
     ColumnMeta meta;
-    void *data; // an array of row values interpreted based on column type
-    struct Column *next;
+    void **chunks;      // BAZA_CHUNK_ROWS row values each, interpreted based on column type
+    Zone *zones;        // one per chunk
+    uint64_t *born;     // per chunk, the table version it was allocated at (see TableSnapshot)
+    size_t chunk_count;
+    Arena *strings;        // backing storage of BTYPE_STRING cells, NULL for other types
+    uint64_t strings_dead; // bytes in [strings] no longer referenced by any row
+    StringDict *dict;      // non-NULL if the column is dictionary encoded, [chunks] then hold codes
+    HashIndex *hash_index;   // NULL if the column has no hash index
+    BTreeIndex *btree_index; // NULL if the column has no ordered index
+    ColumnStats *stats;      // NULL until the column is analyzed
+    uint64_t stats_changes;  // rows written or deleted since [stats] were collected
 } Column;
 
-/// Creates a new column [name] with [type], !without! allocating any backing storage.
-Column *icolumn_new(const char *name, BaseType type);
+/// Initialize [column] as [name] with [type] and [id], !without! allocating any backing storage.
+BazaResult icolumn_init(Column *column, ColumnID_t id, const char *name, BaseType type);
+
+/// Release everything owned by [column], but not the Column itself
+void icolumn_deinit(Column *column);
+
+/// Size of a single element of the column's chunks
+size_t icolumn_cell_size(Column *column);
 
-void icolumn_free(Column *column, uint64_t row_count);
+/// Chunks living in the table's file mapping are born at version 0, they are not
+/// owned by the column (heap chunks are born at 1 or later)
+#define CHUNK_BORN_MAPPED 0
 
-/// (Re)allocated data for a given column to fit the supplied capacity.
-BazaResult icolumn_realloc_data(Column *column, uint64_t capacity);
+/// Append an uninitialized chunk to [column], allocated at table version [born].
+/// Existing chunks are left where they are.
+BazaResult icolumn_chunk_add(Column *column, uint64_t born);
 
-/// Get the value at [index] inside [column].
+/// Append [chunk], which is not owned by [column] (it lives in a file mapping),
+/// to [column]. All the chunks before it must be mapped as well.
+BazaResult icolumn_chunk_map(Column *column, void *chunk);
+
+/// Free the chunks of [column] past the first [count]. Only for chunks no snapshot
+/// can see, itable_column_chunks_retire is for the others.
+void icolumn_chunks_trim(Column *column, size_t count);
+
+/// The raw cell at [index] inside [column] (a DictCode_t for dictionary encoded
+/// columns). No bounds checks performed.
+void *icolumn_cell(Column *column, uint64_t index);
+
+/// Mark the zones of all chunks of [column] stale, after its rows have moved
+void icolumn_zones_invalidate(Column *column);
+
+/// Get the value at [index] inside [column]. For dictionary encoded columns this
+/// points into the dictionary, so it must not be written through.
 void *icolumn_row_get(Column *column, uint64_t index);
 
-/// Delete row data at [index], shifting all the other rows up to [size] one slot down
-void icolumn_row_delete(Column *column, uint64_t index, size_t size);
+/// Set the value at [index] inside [column], copying types that need to be owned
+/// (i.e. strings, into the column's arena). No bounds checks performed and the
+/// previous value is not released.
+void icolumn_row_set(Column *column, uint64_t index, const void *data);
+
+/// Account for the string at [index] no longer being referenced (about to be
+/// overwritten or dropped), so that its bytes can be reclaimed later
+void icolumn_string_release(Column *column, uint64_t index);
+
+/// Drop the rows marked in the [deleted] bitmap from the first [size] rows of
+/// [column], moving the remaining ones down in a single pass
+void icolumn_compact(Column *column, const uint64_t *deleted, size_t size);
 
-/// Find all matching rows i.e. ones for which func(value, column[i]) returns true.
-TableFindResult icolumn_find(Column *column, size_t size, findfunc_t func, void *value);
+/// Print a [cell] (as returned by icolumn_row_get) to [out], padded to the width of a result column
+void icell_print(FILE *out, BaseType type, void *cell);
+
+/// Find all matching rows i.e. ones for which column[i] [op] [value] holds, using the
+/// scan kernels for integer columns. The matches are returned as a bitmap selection.
+/// Chunks whose zone rules the predicate in or out are not scanned at all. Dictionary
+/// encoded columns evaluate [op] once per distinct value instead of once per row.
+/// If [within] is not NULL only its rows are candidates: chunks without any are
+/// skipped, and a sorted-array [within] is probed row by row, giving a sorted-array
+/// result.
+TableFindResult icolumn_find(Column *column, size_t size, FilterOp op, const void *value,
+                             const Selection *within);
+
+/// Like icolumn_find, but matching the rows within [range]
+TableFindResult icolumn_find_range(Column *column, size_t size, ValueRange range,
+                                   const Selection *within);
+
+/// Estimate how many of the first [size] rows of [column] satisfy [op] [value], or lie
+/// within [range] if [op] is FILTER_NONE, from the column's statistics if it has any,
+/// from its zones and dictionary otherwise. The zones count deleted rows too, while the
+/// statistics only know the share of the live rows matching, which is applied to all
+/// [size] of them. The indexes are not consulted.
+ColumnEstimate icolumn_estimate(Column *column, size_t size, FilterOp op, const void *value,
+                                ValueRange range);
 
 
 
 /// The main structure describing a single table
 typedef struct Table {
     TableMeta meta;
-    size_t row_capacity;  // the max number of rows that this table can currently store (i.e. are allocated)
-    Column *columns;      // linked list of columns
-    struct Table *next;
+    size_t row_capacity;  // the max number of rows that this table can currently store, a whole number of chunks
+    uint64_t *deleted;    // bitmap of deleted rows (tombstones), sized for row_capacity
+    uint64_t dead_count;  // number of set bits in [deleted]
+    Column *columns;      // indexed by ColumnID, i.e. the column's position in the table
+    size_t column_count;
+    size_t column_capacity;
+    StrMap *column_names; // column name -> ColumnID
+    void *mapping;        // the table file the table was loaded from, NULL if none
+    size_t mapping_size;
+    uint64_t wal_lsn;     // write-ahead log records before this LSN are in the table file already
+    pthread_rwlock_t lock; // see the locking protocol in storage.h, taken by storage.c
+    uint64_t modifications; // write locks taken so far, the indexes are as a snapshot saw them while unchanged
+    uint64_t version;       // the version of the next snapshot, chunks allocated now are born at it
+    uint64_t shared_version; // newest version a live snapshot has, 0 if none (atomic)
+    uint64_t shared_rows;    // most rows a live snapshot sees (atomic)
+    pthread_mutex_t snapshots_lock; // [snapshots] and [retired]
+    struct TableSnapshot *snapshots; // live snapshots, newest first
+    struct Retired *retired; // storage replaced while live snapshots could still see it
 } Table;
 
-#define BAZA_DEFAULT_ROW_CAPACITY 64
+/// A consistent, read-only view of a table as of the moment it was taken (MVCC).
+/// [view] is a Table of its own with private copies of everything small (chunk
+/// arrays, zones, the deleted bitmap, dictionary values) sharing the row chunks
+/// and strings of the live table. Writers copy a chunk before changing rows a live
+/// snapshot sees (copy-on-write) and retire the chunks and string arenas they
+/// replace instead of freeing them, until no snapshot old enough is left.
+/// Taking a snapshot needs the table's lock for a moment, reading it none at all.
+typedef struct TableSnapshot {
+    Table view;             // its columns have no indexes
+    Table *table;           // the live table
+    uint64_t version;       // sees the chunks born at or before it
+    uint64_t modifications; // of [table] when taken
+    struct TableSnapshot *next;
+} TableSnapshot;
+
+/// Where table files (see storage_file.h) are saved to and loaded from on startup
+#define BAZA_DATA_DIR "./tables"
+
+#define BAZA_DEFAULT_COLUMN_CAPACITY 8
+#define BAZA_DEFAULT_TABLE_CAPACITY 16
+
+#define TABLE_BITMAP_WORDS(rows) (((rows) + 63) / 64)
+
+/// A table is compacted once at least BAZA_COMPACT_DEAD_PERCENT of its rows
+/// are deleted, but never for fewer than BAZA_COMPACT_MIN_DEAD_ROWS rows
+#define BAZA_COMPACT_DEAD_PERCENT 25
+#define BAZA_COMPACT_MIN_DEAD_ROWS 1024
+
+/// Size of the blocks string arenas are carved out of
+#define BAZA_STRING_ARENA_BLOCK (64 * 1024)
+
+/// A string arena is rewritten once at least half of it is dead, but never
+/// for fewer than BAZA_STRING_COMPACT_MIN_DEAD bytes
+#define BAZA_STRING_COMPACT_MIN_DEAD (64 * 1024)
+
+/// Bulk loaded string columns are dictionary encoded when their number of distinct
+/// values is at most BAZA_DICT_AUTO_MAX_PERCENT of their rows
+#define BAZA_DICT_AUTO_MAX_PERCENT 25
+
+/// Columns are analyzed from a sample of at most BAZA_STATS_SAMPLE_ROWS rows (the
+/// number of distinct values is estimated from all of them), and analyzed again once
+/// BAZA_STATS_REFRESH_PERCENT of their rows have changed, but never for fewer than
+/// BAZA_STATS_REFRESH_MIN_ROWS rows
+#define BAZA_STATS_SAMPLE_ROWS 30000
+#define BAZA_STATS_REFRESH_PERCENT 10
+#define BAZA_STATS_REFRESH_MIN_ROWS 1000
 
-/// Return an empty table with the [name] and row capacity of {BAZA_DEFAULT_CAPACITY}
-Table *itable_new(const char *name);
+/// Return an empty table with the [name]. No chunks are allocated until the first row is added.
+Table *itable_new(TableID_t id, const char *name);
 
 /// Free [table]. As with column_free, we assume exclusive ownership 
 /// of all the data pointed to from inside the structure
 void itable_free(Table *table);
 
-/// Realloc all columns in a table to fit the new_size
-void itable_realloc(Table *table, uint64_t new_size);
+/// Take [table]'s lock for the calling thread. Re-entrant: if the thread already holds
+/// it (in write mode, or in any mode for a read) this only counts the nesting.
+/// The itable_* functions themselves never lock, their callers do.
+void itable_lock(Table *table, TableLockMode mode);
 
-/// Get a struct Column* from a ColumnID
+void itable_unlock(Table *table);
+
+/// Take a snapshot of [table], whose lock the caller holds (in either mode).
+/// NULL if out of memory.
+TableSnapshot *itable_snapshot_open(Table *table);
+
+/// Release [snapshot], freeing whatever only it could still see. Needs no lock.
+void itable_snapshot_close(TableSnapshot *snapshot);
+
+/// Make the chunk of [column] holding [row] private to the live table, copying it
+/// if a live snapshot sees that row, before the row is written in place
+BazaResult itable_chunk_own(Table *table, Column *column, uint64_t row);
+
+/// Copy the strings of [column] into a fresh arena if enough of the current one
+/// is dead (or unconditionally if [force]), retiring the old one
+BazaResult itable_strings_compact(Table *table, Column *column, bool force);
+
+/// Grow [table] by a chunk of rows in every column
+BazaResult itable_chunk_add(Table *table);
+
+/// Get a struct Column* from a ColumnID. The pointer is invalidated by adding columns.
 Column *itable_column_byid(Table *table, ColumnID_t cid);
 
 /// Get a struct Column* by its string name
@@ -59,14 +233,72 @@ Column *itable_column_find(Table *table, const char *name);
 /// Add a new column [name] with [type] to [table]
 BazaResult itable_column_new(Table *table, BaseType type, const char *name);
 
-/// Delete table row at [index], with bounds checking
+/// Switch the string [column] of [table] to dictionary encoding, unless it holds
+/// more than [max_values] distinct values (then it is left as it is)
+BazaResult itable_column_dict_encode(Table *table, Column *column, uint64_t max_values);
+
+/// Append a zeroed row (empty strings are NULL) to [table], growing it if necessary
+BazaResult itable_row_add(Table *table);
+
+/// Replace the value of [column] at [row], keeping the column's indexes up to date
+BazaResult itable_row_set(Table *table, Column *column, uint64_t row, const void *value);
+
+/// Mark table row at [index] as deleted, with bounds checking. The row keeps its
+/// slot (and id) until the table is compacted.
 BazaResult itable_row_delete(Table *table, size_t index);
 
-/// Return a list of all row ids matching value in column 
-TableFindResult itable_find(Table *table, Column *column,
-                            findfunc_t func, void *value);
+bool itable_row_is_deleted(Table *table, uint64_t row);
+
+/// Write [table] to its file in BAZA_DATA_DIR, compacting it first
+BazaResult itable_save(Table *table);
+
+/// Drop all deleted rows from [table] in one linear pass over each column, 
+/// renumbering the remaining rows (and their index entries). Afterwards the
+/// string arenas are rewritten if enough of them is dead, or always if [force].
+BazaResult itable_compact(Table *table, bool force);
+
+/// Whether enough of [table] is deleted for a compaction to pay off
+bool itable_should_compact(Table *table);
 
-/// print a row to stdout
+/// Collect the statistics of the columns of [table] anew, refreshing their stale zones
+/// on the way. Unless [force] is set, only the columns which were analyzed before and
+/// have changed enough since are. Snapshots keep the statistics they were taken with.
+BazaResult itable_analyze(Table *table, bool force);
+
+/// Return a bitmap of all rows that are not deleted
+Selection *itable_live_rows(Table *table);
+
+/// Build an index of [kind] called [name] over [column]
+BazaResult itable_index_new(Table *table, Column *column, const char *name, IndexKind kind);
+
+/// Return the rows of [column] equal to [value] using one of the column's indexes
+TableFindResult itable_lookup_equal(Table *table, Column *column, const void *value);
+
+/// Return the rows of [column] within [range] using the column's ordered index
+TableFindResult itable_lookup_range(Table *table, Column *column, ValueRange range);
+
+/// Return all rows of [table] ordered by [column] using the column's ordered index
+TableOrderResult itable_lookup_ordered(Table *table, Column *column, SortDirection direction);
+
+/// Return the set of live rows (of [within], unless NULL) for which column[i] [op] [value] holds
+TableFindResult itable_find(Table *table, Column *column, FilterOp op, const void *value,
+                            const Selection *within);
+
+/// Return the set of live rows (of [within], unless NULL) whose value in [column] is within [range]
+TableFindResult itable_find_range(Table *table, Column *column, ValueRange range,
+                                  const Selection *within);
+
+/// Estimate the live rows of [column] satisfying [op] [value] (within [range] if [op]
+/// is FILTER_NONE), see table_estimate. The indexes are left to itable_estimate_index.
+ColumnEstimate itable_estimate(Table *table, Column *column, FilterOp op, const void *value,
+                               ValueRange range);
+
+/// Fill in the index of [column] able to answer the predicate of [est], and let it
+/// count the matches if it can do so cheaply
+void itable_estimate_index(Column *column, FilterOp op, const void *value, ValueRange range,
+                           ColumnEstimate *est);
+
+/// print a row to stdout, nothing if it is out of range or deleted
 void itable_row_print(Table *table, IntList *ColumnIDs, uint64_t row);
 
 // Get table from database by table_name
@@ -77,4 +309,7 @@ Table *idb_table_get_byid(TableID_t tid);
 
 TableResult idb_table_new(const char *table_name);
 
+/// Save every table in the database, with all of them locked, then reset the write-ahead log
+BazaResult idb_checkpoint(void);
+
 #endif
@@ -0,0 +1,281 @@
+#include "storage_scan.h"
+#include "util/selection.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+// Every kernel tests lo <= x <= hi with a single unsigned comparison:
+// (x - lo) <= (hi - lo), computed with wrapping arithmetic. SIMD only has
+// signed comparisons, so both sides get their sign bit flipped first.
+
+typedef void (scan_i32_fn)(const int32_t *data, size_t count, int32_t lo, int32_t hi, uint64_t *words);
+typedef void (scan_i64_fn)(const int64_t *data, size_t count, int64_t lo, int64_t hi, uint64_t *words);
+
+static void scan_i32_scalar(const int32_t *data, size_t count, int32_t lo, int32_t hi, uint64_t *words)
+{
+    uint32_t range = (uint32_t)hi - (uint32_t)lo;
+
+    for (size_t base = 0; base < count; base += SELECTION_WORD_BITS) {
+        size_t end = base + SELECTION_WORD_BITS < count ? base + SELECTION_WORD_BITS : count;
+        uint64_t word = 0;
+
+        for (size_t i = base; i < end; i++)
+            word |= (uint64_t)((uint32_t)data[i] - (uint32_t)lo <= range) << (i - base);
+
+        words[base / SELECTION_WORD_BITS] = word;
+    }
+}
+
+static void scan_i64_scalar(const int64_t *data, size_t count, int64_t lo, int64_t hi, uint64_t *words)
+{
+    uint64_t range = (uint64_t)hi - (uint64_t)lo;
+
+    for (size_t base = 0; base < count; base += SELECTION_WORD_BITS) {
+        size_t end = base + SELECTION_WORD_BITS < count ? base + SELECTION_WORD_BITS : count;
+        uint64_t word = 0;
+
+        for (size_t i = base; i < end; i++)
+            word |= (uint64_t)((uint64_t)data[i] - (uint64_t)lo <= range) << (i - base);
+
+        words[base / SELECTION_WORD_BITS] = word;
+    }
+}
+
+#ifdef SCAN_X86
+
+__attribute__((target("avx2")))
+static void scan_i32_avx2(const int32_t *data, size_t count, int32_t lo, int32_t hi, uint64_t *words)
+{
+    const __m256i vlo = _mm256_set1_epi32(lo);
+    const __m256i sign = _mm256_set1_epi32(INT32_MIN);
+    const __m256i vrange = _mm256_set1_epi32((int32_t)(((uint32_t)hi - (uint32_t)lo) ^ 0x80000000u));
+
+    size_t full = count / SELECTION_WORD_BITS;
+    for (size_t w = 0; w < full; w++) {
+        const int32_t *block = data + w * SELECTION_WORD_BITS;
+        uint64_t word = 0;
+
+        for (int k = 0; k < 8; k++) {
+            __m256i x = _mm256_loadu_si256((const __m256i*)(block + k * 8));
+            __m256i diff = _mm256_xor_si256(_mm256_sub_epi32(x, vlo), sign);
+            __m256i outside = _mm256_cmpgt_epi32(diff, vrange);
+            uint64_t bits = ~_mm256_movemask_ps(_mm256_castsi256_ps(outside)) & 0xff;
+            word |= bits << (k * 8);
+        }
+
+        words[w] = word;
+    }
+
+    size_t done = full * SELECTION_WORD_BITS;
+    scan_i32_scalar(data + done, count - done, lo, hi, words + full);
+}
+
+__attribute__((target("avx2")))
+static void scan_i64_avx2(const int64_t *data, size_t count, int64_t lo, int64_t hi, uint64_t *words)
+{
+    const __m256i vlo = _mm256_set1_epi64x(lo);
+    const __m256i sign = _mm256_set1_epi64x(INT64_MIN);
+    const __m256i vrange = _mm256_set1_epi64x((int64_t)(((uint64_t)hi - (uint64_t)lo) ^ (1ULL << 63)));
+
+    size_t full = count / SELECTION_WORD_BITS;
+    for (size_t w = 0; w < full; w++) {
+        const int64_t *block = data + w * SELECTION_WORD_BITS;
+        uint64_t word = 0;
+
+        for (int k = 0; k < 16; k++) {
+            __m256i x = _mm256_loadu_si256((const __m256i*)(block + k * 4));
+            __m256i diff = _mm256_xor_si256(_mm256_sub_epi64(x, vlo), sign);
+            __m256i outside = _mm256_cmpgt_epi64(diff, vrange);
+            uint64_t bits = ~_mm256_movemask_pd(_mm256_castsi256_pd(outside)) & 0xf;
+            word |= bits << (k * 4);
+        }
+
+        words[w] = word;
+    }
+
+    size_t done = full * SELECTION_WORD_BITS;
+    scan_i64_scalar(data + done, count - done, lo, hi, words + full);
+}
+
+__attribute__((target("sse4.2")))
+static void scan_i32_sse42(const int32_t *data, size_t count, int32_t lo, int32_t hi, uint64_t *words)
+{
+    const __m128i vlo = _mm_set1_epi32(lo);
+    const __m128i sign = _mm_set1_epi32(INT32_MIN);
+    const __m128i vrange = _mm_set1_epi32((int32_t)(((uint32_t)hi - (uint32_t)lo) ^ 0x80000000u));
+
+    size_t full = count / SELECTION_WORD_BITS;
+    for (size_t w = 0; w < full; w++) {
+        const int32_t *block = data + w * SELECTION_WORD_BITS;
+        uint64_t word = 0;
+
+        for (int k = 0; k < 16; k++) {
+            __m128i x = _mm_loadu_si128((const __m128i*)(block + k * 4));
+            __m128i diff = _mm_xor_si128(_mm_sub_epi32(x, vlo), sign);
+            __m128i outside = _mm_cmpgt_epi32(diff, vrange);
+            uint64_t bits = ~_mm_movemask_ps(_mm_castsi128_ps(outside)) & 0xf;
+            word |= bits << (k * 4);
+        }
+
+        words[w] = word;
+    }
+
+    size_t done = full * SELECTION_WORD_BITS;
+    scan_i32_scalar(data + done, count - done, lo, hi, words + full);
+}
+
+__attribute__((target("sse4.2")))
+static void scan_i64_sse42(const int64_t *data, size_t count, int64_t lo, int64_t hi, uint64_t *words)
+{
+    const __m128i vlo = _mm_set1_epi64x(lo);
+    const __m128i sign = _mm_set1_epi64x(INT64_MIN);
+    const __m128i vrange = _mm_set1_epi64x((int64_t)(((uint64_t)hi - (uint64_t)lo) ^ (1ULL << 63)));
+
+    size_t full = count / SELECTION_WORD_BITS;
+    for (size_t w = 0; w < full; w++) {
+        const int64_t *block = data + w * SELECTION_WORD_BITS;
+        uint64_t word = 0;
+
+        for (int k = 0; k < 32; k++) {
+            __m128i x = _mm_loadu_si128((const __m128i*)(block + k * 2));
+            __m128i diff = _mm_xor_si128(_mm_sub_epi64(x, vlo), sign);
+            __m128i outside = _mm_cmpgt_epi64(diff, vrange);
+            uint64_t bits = ~_mm_movemask_pd(_mm_castsi128_pd(outside)) & 0x3;
+            word |= bits << (k * 2);
+        }
+
+        words[w] = word;
+    }
+
+    size_t done = full * SELECTION_WORD_BITS;
+    scan_i64_scalar(data + done, count - done, lo, hi, words + full);
+}
+
+#endif /* SCAN_X86 */
+
+static struct {
+    scan_i32_fn *i32;
+    scan_i64_fn *i64;
+} SCAN_KERNELS = { scan_i32_scalar, scan_i64_scalar };
+
+void scan_init(void)
+{
+#ifdef SCAN_X86
+    const char *forced = getenv("BAZA_SCAN_KERNEL");
+    bool allow_avx2 = !forced || !strcmp(forced, "avx2");
+    bool allow_sse42 = !forced || !strcmp(forced, "sse4.2");
+
+    __builtin_cpu_init();
+
+    if (allow_avx2 && __builtin_cpu_supports("avx2")) {
+        SCAN_KERNELS.i32 = scan_i32_avx2;
+        SCAN_KERNELS.i64 = scan_i64_avx2;
+        return;
+    }
+
+    if (allow_sse42 && __builtin_cpu_supports("sse4.2")) {
+        SCAN_KERNELS.i32 = scan_i32_sse42;
+        SCAN_KERNELS.i64 = scan_i64_sse42;
+        return;
+    }
+#endif
+
+    SCAN_KERNELS.i32 = scan_i32_scalar;
+    SCAN_KERNELS.i64 = scan_i64_scalar;
+}
+
+/// Invert the first [count] bits of [words], keeping the rest cleared
+static void scan_negate(uint64_t *words, size_t count)
+{
+    size_t nwords = SELECTION_WORD_COUNT(count);
+    for (size_t i = 0; i < nwords; i++)
+        words[i] = ~words[i];
+
+    if (count % SELECTION_WORD_BITS)
+        words[nwords - 1] &= (1ULL << (count % SELECTION_WORD_BITS)) - 1;
+}
+
+void scan_i32_between(const int32_t *data, size_t count, int32_t lo, int32_t hi,
+                      bool negate, uint64_t *words)
+{
+    SCAN_KERNELS.i32(data, count, lo, hi, words);
+    if (negate)
+        scan_negate(words, count);
+}
+
+void scan_i64_between(const int64_t *data, size_t count, int64_t lo, int64_t hi,
+                      bool negate, uint64_t *words)
+{
+    SCAN_KERNELS.i64(data, count, lo, hi, words);
+    if (negate)
+        scan_negate(words, count);
+}
+
+static bool scan_str_like(const char *str, const char *pattern)
+{
+    while (*str && *pattern) {
+        // %: zero or more characters
+        if (*pattern == '%') {
+            pattern++;
+            
+            // pattern ending with a %, since we are already here
+            // this must match
+            if (!*pattern)
+                return true;
+
+            while (*str && *str != *pattern)
+                str++;
+
+            // no match
+            if (!*str)
+                return false;
+        }
+
+        // _: exactly one character
+        if (*pattern == '_') {
+            pattern++;
+            if (!pattern)
+                return true;
+            str++;
+            continue;
+        }
+
+        if (*str != *pattern)
+            return false;
+    
+        str++;
+        pattern++;
+    }
+
+    // one of the strings ends prematurely
+    if (*str + *pattern > 0 && *pattern != '%')
+        return false;
+
+    return true;
+}
+
+bool scan_str_match(FilterOp op, const char *str, const char *value)
+{
+    switch (op) {
+        case FILTER_EQUAL:
+            return !strcmp(str, value);
+        case FILTER_NOT_EQUAL:
+            return strcmp(str, value) != 0;
+        case FILTER_GREATER:
+            return strcmp(str, value) > 0;
+        case FILTER_GREATER_EQUAL:
+            return strcmp(str, value) >= 0;
+        case FILTER_LESSER:
+            return strcmp(str, value) < 0;
+        case FILTER_LESSER_EQUAL:
+            return strcmp(str, value) <= 0;
+        case FILTER_LIKE:
+            return scan_str_like(str, value);
+        default:
+            return false;
+    }
+}
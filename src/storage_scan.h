@@ -0,0 +1,25 @@
+/// Scan kernels: evaluate a predicate over a whole column array at once, producing
+/// a bitmap with one bit per row. The integer kernels come in AVX2, SSE4.2 and
+/// scalar variants, picked at runtime (see scan_init).
+#ifndef _STORAGE_SCAN_H
+#define _STORAGE_SCAN_H
+
+#include "storage.h"
+
+/// Pick the fastest kernels supported by the CPU. Setting BAZA_SCAN_KERNEL to
+/// "scalar", "sse4.2" or "avx2" forces a variant (if supported), for testing.
+void scan_init(void);
+
+/// Set bit i of [words] iff lo <= data[i] <= hi, or the opposite if [negate].
+/// [words] has to hold SELECTION_WORD_COUNT(count) words, all of which are
+/// overwritten; the bits past [count] are left cleared. Requires lo <= hi.
+void scan_i32_between(const int32_t *data, size_t count, int32_t lo, int32_t hi,
+                      bool negate, uint64_t *words);
+void scan_i64_between(const int64_t *data, size_t count, int64_t lo, int64_t hi,
+                      bool negate, uint64_t *words);
+
+/// Evaluate [str] [op] [value] for a string stored in a column. LIKE supports
+/// the % (any number of characters) and _ (one character) wildcards.
+bool scan_str_match(FilterOp op, const char *str, const char *value);
+
+#endif
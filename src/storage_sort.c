@@ -0,0 +1,285 @@
+#include "storage_sort.h"
+#include "util/parallel.h"
+
+#include <string.h>
+
+/// Runs shorter than this are insertion sorted, the radix passes do not pay off
+#define SORT_INSERTION_MAX 64
+#define SORT_RADIX_BITS 8
+#define SORT_RADIX_BUCKETS (1 << SORT_RADIX_BITS)
+#define SORT_RADIX_PASSES (64 / SORT_RADIX_BITS)
+
+/// A row and the unsigned key ordering it by one column: ascending keys give the
+/// requested order, descending ones are complemented
+typedef struct SortEntry {
+    uint64_t key;
+    uint64_t row;
+} SortEntry;
+
+/// A key of the sort, resolved against the table
+typedef struct SortColumn {
+    Column *column;
+    bool descending;
+    uint32_t *ranks; // dictionary code -> position of its string among all of them
+} SortColumn;
+
+/// Stable sort of [entries] by key
+static void isort_insertion(SortEntry *entries, size_t count)
+{
+    for (size_t i = 1; i < count; i++) {
+        SortEntry entry = entries[i];
+        size_t j = i;
+        for (; j > 0 && entries[j - 1].key > entry.key; j--)
+            entries[j] = entries[j - 1];
+        entries[j] = entry;
+    }
+}
+
+/// Stable LSD radix sort of [entries] by key, with [tmp] as scratch space of the same size
+static void isort_radix(SortEntry *entries, SortEntry *tmp, size_t count)
+{
+    if (count < SORT_INSERTION_MAX) {
+        isort_insertion(entries, count);
+        return;
+    }
+
+    // the histograms of every digit at once, a single pass over the keys
+    size_t counts[SORT_RADIX_PASSES][SORT_RADIX_BUCKETS] = { { 0 } };
+    for (size_t i = 0; i < count; i++) {
+        uint64_t key = entries[i].key;
+        for (size_t pass = 0; pass < SORT_RADIX_PASSES; pass++)
+            counts[pass][(key >> (pass * SORT_RADIX_BITS)) & (SORT_RADIX_BUCKETS - 1)]++;
+    }
+
+    SortEntry *from = entries, *to = tmp;
+    for (size_t pass = 0; pass < SORT_RADIX_PASSES; pass++) {
+        size_t shift = pass * SORT_RADIX_BITS;
+
+        // a digit shared by all the keys (the high ones of small integers) moves nothing
+        if (counts[pass][(from[0].key >> shift) & (SORT_RADIX_BUCKETS - 1)] == count)
+            continue;
+
+        size_t offsets[SORT_RADIX_BUCKETS];
+        size_t offset = 0;
+        for (size_t digit = 0; digit < SORT_RADIX_BUCKETS; digit++) {
+            offsets[digit] = offset;
+            offset += counts[pass][digit];
+        }
+
+        for (size_t i = 0; i < count; i++)
+            to[offsets[(from[i].key >> shift) & (SORT_RADIX_BUCKETS - 1)]++] = from[i];
+
+        SortEntry *swap = from;
+        from = to;
+        to = swap;
+    }
+
+    if (from != entries)
+        memcpy(entries, from, count * sizeof(SortEntry));
+}
+
+/// The first 8 bytes of [str], big-endian so that they compare like the strings
+static uint64_t isort_prefix(const char *str)
+{
+    uint64_t prefix = 0;
+    for (size_t i = 0; i < 8 && str[i]; i++)
+        prefix |= (uint64_t)(unsigned char)str[i] << (56 - 8 * i);
+
+    return prefix;
+}
+
+/// Whether strings with the same [prefix] can still differ: both of them at least
+/// 8 bytes long, or one NULL and the other empty
+static bool isort_prefix_ambiguous(uint64_t prefix)
+{
+    return !prefix || (prefix & 0xff);
+}
+
+/// strcmp, with NULL before any string
+static int isort_str_cmp(const char *left, const char *right)
+{
+    if (!left || !right)
+        return (left != NULL) - (right != NULL);
+
+    return strcmp(left, right);
+}
+
+static const char *isort_str(const SortColumn *key, uint64_t row)
+{
+    return *(char**)icolumn_cell(key->column, row);
+}
+
+static uint64_t isort_key(const SortColumn *key, uint64_t row)
+{
+    void *cell = icolumn_cell(key->column, row);
+    uint64_t value = 0;
+
+    if (key->ranks)
+        value = key->ranks[*(DictCode_t*)cell];
+    else if (key->column->meta.type == BTYPE_STRING)
+        value = *(char**)cell ? isort_prefix(*(char**)cell) : 0;
+    else
+        value = (uint64_t)ikey_from_cell(key->column->meta.type, cell).i ^ (1ULL << 63);
+
+    return key->descending ? ~value : value;
+}
+
+/// Whether the rows of two entries sorted by [key] are equal in it
+static bool isort_equal(const SortColumn *key, const SortEntry *left, const SortEntry *right)
+{
+    if (left->key != right->key)
+        return false;
+
+    if (key->ranks || key->column->meta.type != BTYPE_STRING)
+        return true;
+
+    uint64_t prefix = key->descending ? ~left->key : left->key;
+    return !isort_prefix_ambiguous(prefix)
+           || !isort_str_cmp(isort_str(key, left->row), isort_str(key, right->row));
+}
+
+static int isort_run_cmp(const void *left, const void *right, void *ctx)
+{
+    const SortColumn *key = ctx;
+    const SortEntry *l = left, *r = right;
+
+    int cmp = isort_str_cmp(isort_str(key, l->row), isort_str(key, r->row));
+    if (key->descending)
+        cmp = -cmp;
+    if (cmp)
+        return cmp;
+
+    // the keys hold the positions in the run meanwhile, keeping the sort stable
+    return (l->key > r->key) - (l->key < r->key);
+}
+
+/// Order the runs of strings sharing an ambiguous prefix by the whole strings
+static bool isort_strings_fix(const SortColumn *key, SortEntry *entries, size_t count)
+{
+    for (size_t start = 0, end; start < count; start = end) {
+        uint64_t run_key = entries[start].key;
+        for (end = start + 1; end < count && entries[end].key == run_key; end++)
+            ;
+
+        uint64_t prefix = key->descending ? ~run_key : run_key;
+        if (end - start < 2 || !isort_prefix_ambiguous(prefix))
+            continue;
+
+        for (size_t i = start; i < end; i++)
+            entries[i].key = i;
+
+        bool sorted = parallel_sort(entries + start, end - start, sizeof(SortEntry),
+                                    isort_run_cmp, (void*)key);
+
+        for (size_t i = start; i < end; i++)
+            entries[i].key = run_key;
+
+        if (!sorted)
+            return false;
+    }
+
+    return true;
+}
+
+/// Sort [rows] by [keys], then the runs equal in the first key by the rest of them.
+/// [entries] and [tmp] are scratch space for [count] entries.
+static bool isort_level(const SortColumn *keys, size_t key_count, uint64_t *rows, size_t count,
+                        SortEntry *entries, SortEntry *tmp)
+{
+    const SortColumn *key = &keys[0];
+
+    for (size_t i = 0; i < count; i++)
+        entries[i] = (SortEntry) { .key = isort_key(key, rows[i]), .row = rows[i] };
+
+    isort_radix(entries, tmp, count);
+
+    if (!key->ranks && key->column->meta.type == BTYPE_STRING && !isort_strings_fix(key, entries, count))
+        return false;
+
+    for (size_t i = 0; i < count; i++)
+        rows[i] = entries[i].row;
+
+    if (key_count == 1)
+        return true;
+
+    // the run reuses its own part of the scratch space, past which nothing is read again
+    for (size_t start = 0, end; start < count; start = end) {
+        for (end = start + 1; end < count && isort_equal(key, &entries[start], &entries[end]); end++)
+            ;
+
+        if (end - start > 1
+            && !isort_level(keys + 1, key_count - 1, rows + start, end - start, entries + start, tmp + start))
+            return false;
+    }
+
+    return true;
+}
+
+static int isort_dict_cmp(const void *left, const void *right, void *ctx)
+{
+    char **values = ctx;
+    return isort_str_cmp(values[*(const uint32_t*)left], values[*(const uint32_t*)right]);
+}
+
+/// Rank the codes of the dictionary of [column] by their strings, so that sorting
+/// by the ranks sorts by the strings. NULL if out of memory.
+static uint32_t *isort_dict_ranks(Column *column)
+{
+    StringDict *dict = column->dict;
+    uint32_t *codes = malloc(dict->count * sizeof(uint32_t));
+    uint32_t *ranks = malloc(dict->count * sizeof(uint32_t));
+    if (!codes || !ranks) {
+        free(codes);
+        free(ranks);
+        return NULL;
+    }
+
+    for (uint32_t code = 0; code < dict->count; code++)
+        codes[code] = code;
+
+    // distinct strings, so the ranks do not depend on the sort being stable
+    if (!parallel_sort(codes, dict->count, sizeof(uint32_t), isort_dict_cmp, dict->values)) {
+        free(codes);
+        free(ranks);
+        return NULL;
+    }
+
+    for (uint32_t rank = 0; rank < dict->count; rank++)
+        ranks[codes[rank]] = rank;
+
+    free(codes);
+    return ranks;
+}
+
+BazaResult isort_rows(Table *table, const TableSortKey *keys, size_t key_count,
+                      uint64_t *rows, size_t count)
+{
+    if (!key_count || count < 2)
+        return RESULT_OK;
+
+    SortColumn *columns = calloc(key_count, sizeof(SortColumn));
+    SortEntry *entries = malloc(count * sizeof(SortEntry));
+    SortEntry *tmp = malloc(count * sizeof(SortEntry));
+    BazaResult res = columns && entries && tmp ? RESULT_OK : RESULT_ALLOC;
+
+    for (size_t i = 0; res == RESULT_OK && i < key_count; i++) {
+        columns[i].column = itable_column_byid(table, keys[i].column);
+        columns[i].descending = keys[i].direction == SORT_DESCENDING;
+
+        if (!columns[i].column)
+            res = RESULT_COLUMN_NOT_FOUND;
+        else if (columns[i].column->dict && !(columns[i].ranks = isort_dict_ranks(columns[i].column)))
+            res = RESULT_ALLOC;
+    }
+
+    if (res == RESULT_OK && !isort_level(columns, key_count, rows, count, entries, tmp))
+        res = RESULT_ALLOC;
+
+    for (size_t i = 0; columns && i < key_count; i++)
+        free(columns[i].ranks);
+    free(columns);
+    free(entries);
+    free(tmp);
+
+    return res;
+}
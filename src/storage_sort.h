@@ -0,0 +1,14 @@
+/// Sorting rows by the values of their columns (ORDER BY). Integer keys, and the
+/// codes of dictionary encoded columns ranked by their strings, are radix sorted.
+/// Other strings are radix sorted by their first 8 bytes, and only the rows whose
+/// prefixes tie are compared in full.
+#ifndef _STORAGE_SORT_H
+#define _STORAGE_SORT_H
+
+#include "storage_internal.h"
+
+/// Sort the [count] row IDs at [rows] of [table] by [keys], see table_sort
+BazaResult isort_rows(Table *table, const TableSortKey *keys, size_t key_count,
+                      uint64_t *rows, size_t count);
+
+#endif
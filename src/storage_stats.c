@@ -0,0 +1,254 @@
+#include "storage_stats.h"
+#include "util/parallel.h"
+
+#include <string.h>
+
+#define STATS_ARENA_BLOCK (4 * 1024)
+
+void ihll_add(HyperLogLog *hll, uint64_t hash)
+{
+    // the first bits pick the register, the position of the first set bit among
+    // the rest is how rare the value looks
+    size_t reg = hash >> (64 - STATS_HLL_BITS);
+    uint64_t rest = hash << STATS_HLL_BITS;
+    uint8_t rank = rest ? __builtin_clzll(rest) + 1 : 64 - STATS_HLL_BITS + 1;
+
+    if (rank > hll->registers[reg])
+        hll->registers[reg] = rank;
+}
+
+void ihll_merge(HyperLogLog *hll, const HyperLogLog *other)
+{
+    for (size_t i = 0; i < STATS_HLL_REGISTERS; i++) {
+        if (other->registers[i] > hll->registers[i])
+            hll->registers[i] = other->registers[i];
+    }
+}
+
+/// Natural logarithm of [x] > 0, to spare linking the math library for a single call
+static double istats_log(double x)
+{
+    int exponent = 0;
+    while (x >= 2) {
+        x /= 2;
+        exponent++;
+    }
+    while (x < 1) {
+        x *= 2;
+        exponent--;
+    }
+
+    // ln x = 2 atanh((x - 1) / (x + 1)), which converges quickly for x in [1, 2)
+    double t = (x - 1) / (x + 1), power = t, sum = 0;
+    for (int k = 1; k < 40; k += 2) {
+        sum += power / k;
+        power *= t * t;
+    }
+
+    return 2 * sum + exponent * 0.6931471805599453;
+}
+
+uint64_t ihll_estimate(const HyperLogLog *hll)
+{
+    double m = STATS_HLL_REGISTERS;
+    double sum = 0;
+    size_t zeros = 0;
+
+    for (size_t i = 0; i < STATS_HLL_REGISTERS; i++) {
+        sum += 1.0 / (1ULL << hll->registers[i]);
+        zeros += hll->registers[i] == 0;
+    }
+
+    double estimate = 0.7213 / (1 + 1.079 / m) * m * m / sum;
+
+    // few values leave many registers empty, counting those is more accurate then
+    if (estimate <= 2.5 * m && zeros)
+        estimate = m * istats_log(m / zeros);
+
+    return (uint64_t)(estimate + 0.5);
+}
+
+static int istats_key_cmp(const void *left, const void *right, void *ctx)
+{
+    return ikey_cmp(*(BaseType*)ctx, *(const IndexKey*)left, *(const IndexKey*)right);
+}
+
+/// A run of equal values in the sorted sample
+typedef struct SampleRun {
+    IndexKey key;
+    uint64_t count;
+    bool common; // picked as one of the most common values
+} SampleRun;
+
+/// Copy [key] into the arena of [stats] if it is a string
+static bool istats_key_copy(ColumnStats *stats, BaseType type, IndexKey *key)
+{
+    if (type != BTYPE_STRING)
+        return true;
+
+    key->s = arena_strdup(stats->strings, key->s);
+    return key->s != NULL;
+}
+
+ColumnStats *istats_build(BaseType type, IndexKey *sample, size_t count, bool complete,
+                          uint64_t rows, uint64_t nulls, uint64_t distinct)
+{
+    ColumnStats *stats = calloc(1, sizeof(ColumnStats));
+    SampleRun *runs = count ? malloc(count * sizeof(SampleRun)) : NULL;
+    if (!stats || (count && !runs)
+        || (type == BTYPE_STRING && !(stats->strings = arena_new(STATS_ARENA_BLOCK)))
+        || !parallel_sort(sample, count, sizeof(IndexKey), istats_key_cmp, &type)) {
+        free(runs);
+        istats_free(stats);
+        return NULL;
+    }
+
+    size_t run_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (run_count && !ikey_cmp(type, runs[run_count - 1].key, sample[i]))
+            runs[run_count - 1].count++;
+        else
+            runs[run_count++] = (SampleRun) { .key = sample[i], .count = 1 };
+    }
+
+    stats->rows = rows;
+    stats->nulls = nulls;
+    stats->sampled = count;
+    // the sketch can fall short of what the sample alone shows
+    stats->distinct = complete || distinct < run_count ? run_count : distinct;
+
+    // values noticeably more common than the average one, the most common first,
+    // or every value if there are few enough to list them all
+    bool all = stats->distinct <= STATS_MCV_MAX;
+    while (stats->mcv_count < STATS_MCV_MAX) {
+        SampleRun *best = NULL;
+        for (size_t i = 0; i < run_count; i++) {
+            if (!runs[i].common && (!best || runs[i].count > best->count))
+                best = &runs[i];
+        }
+
+        if (!best || (!all && (best->count < 2 || best->count * stats->distinct * 4 <= count * 5)))
+            break;
+
+        best->common = true;
+        stats->mcv[stats->mcv_count] = best->key;
+        stats->mcv_counts[stats->mcv_count++] = best->count;
+        stats->mcv_rows += best->count;
+    }
+
+    // the histogram describes the rest of the sample, left in order at its start
+    size_t rest = 0;
+    for (size_t i = 0; i < run_count; i++) {
+        for (uint64_t j = 0; !runs[i].common && j < runs[i].count; j++)
+            sample[rest++] = runs[i].key;
+    }
+
+    if (rest >= 2) {
+        stats->bound_count = rest < STATS_BUCKETS + 1 ? rest : STATS_BUCKETS + 1;
+        for (size_t i = 0; i < stats->bound_count; i++)
+            stats->bounds[i] = sample[i * (rest - 1) / (stats->bound_count - 1)];
+    }
+
+    free(runs);
+
+    bool copied = true;
+    for (size_t i = 0; i < stats->mcv_count; i++)
+        copied &= istats_key_copy(stats, type, &stats->mcv[i]);
+    for (size_t i = 0; i < stats->bound_count; i++)
+        copied &= istats_key_copy(stats, type, &stats->bounds[i]);
+
+    if (!copied) {
+        istats_free(stats);
+        return NULL;
+    }
+
+    return stats;
+}
+
+void istats_free(ColumnStats *stats)
+{
+    if (!stats)
+        return;
+
+    arena_free(stats->strings);
+    free(stats);
+}
+
+/// The share of all the rows a single sampled one stands for
+static double istats_row_share(const ColumnStats *stats)
+{
+    if (!stats->rows || !stats->sampled)
+        return 0;
+
+    return (double)(stats->rows - stats->nulls) / stats->rows / stats->sampled;
+}
+
+double istats_share_equal(const ColumnStats *stats, BaseType type, IndexKey key)
+{
+    for (size_t i = 0; i < stats->mcv_count; i++) {
+        if (!ikey_cmp(type, stats->mcv[i], key))
+            return stats->mcv_counts[i] * istats_row_share(stats);
+    }
+
+    // any other value is assumed to be as common as the rest of them
+    uint64_t others = stats->sampled - stats->mcv_rows;
+    if (!others || stats->distinct <= stats->mcv_count)
+        return 0;
+
+    return others * istats_row_share(stats) / (stats->distinct - stats->mcv_count);
+}
+
+/// The share of the values in the histogram of an integer column below [x],
+/// assuming they are spread evenly within each bucket
+static double istats_histogram_below(const ColumnStats *stats, double x)
+{
+    double below = 0;
+
+    for (size_t i = 0; i + 1 < stats->bound_count; i++) {
+        double first = stats->bounds[i].i, last = stats->bounds[i + 1].i;
+        if (x > last)
+            below += 1;
+        else if (x > first)
+            below += (x - first) / (last - first + 1);
+    }
+
+    return below / (stats->bound_count - 1);
+}
+
+double istats_share_int(const ColumnStats *stats, int64_t lo, int64_t hi)
+{
+    double matches = 0;
+
+    for (size_t i = 0; i < stats->mcv_count; i++) {
+        if (stats->mcv[i].i >= lo && stats->mcv[i].i <= hi)
+            matches += stats->mcv_counts[i];
+    }
+
+    if (stats->bound_count) {
+        double share = istats_histogram_below(stats, (double)hi + 1) - istats_histogram_below(stats, lo);
+        matches += share * (stats->sampled - stats->mcv_rows);
+    }
+
+    return matches * istats_row_share(stats);
+}
+
+double istats_share_str(const ColumnStats *stats, StatsMatchFn *match, const void *arg)
+{
+    double matches = 0;
+
+    for (size_t i = 0; i < stats->mcv_count; i++) {
+        if (match(arg, stats->mcv[i].s))
+            matches += stats->mcv_counts[i];
+    }
+
+    // strings do not interpolate, so the share of the bounds matching has to do
+    if (stats->bound_count) {
+        size_t bounds = 0;
+        for (size_t i = 0; i < stats->bound_count; i++)
+            bounds += match(arg, stats->bounds[i].s);
+
+        matches += (double)bounds / stats->bound_count * (stats->sampled - stats->mcv_rows);
+    }
+
+    return matches * istats_row_share(stats);
+}
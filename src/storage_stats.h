@@ -0,0 +1,73 @@
+/// Column statistics collected by ANALYZE for the planner's estimates. Owned by the
+/// column they describe, nothing outside of the storage backend should touch them.
+#ifndef _STORAGE_STATS_H
+#define _STORAGE_STATS_H
+
+#include "storage_index.h"
+#include "util/arena.h"
+
+/// A HyperLogLog sketch, estimating the number of distinct values added to it
+/// within a few percent in a fixed amount of memory: 2^STATS_HLL_BITS registers
+#define STATS_HLL_BITS 12
+#define STATS_HLL_REGISTERS (1 << STATS_HLL_BITS)
+
+typedef struct HyperLogLog {
+    uint8_t registers[STATS_HLL_REGISTERS];
+} HyperLogLog;
+
+/// Add a value with the (well mixed) [hash] to [hll]
+void ihll_add(HyperLogLog *hll, uint64_t hash);
+
+/// Merge [other] into [hll], as if its values had been added to [hll] as well
+void ihll_merge(HyperLogLog *hll, const HyperLogLog *other);
+
+/// Estimated number of distinct values added to [hll]
+uint64_t ihll_estimate(const HyperLogLog *hll);
+
+#define STATS_MCV_MAX 16
+#define STATS_BUCKETS 64
+
+/// What a column held when it was last analyzed. Never modified once built: a
+/// refresh builds new statistics, and snapshots keep seeing the ones they took.
+typedef struct ColumnStats {
+    uint64_t rows;     // live rows
+    uint64_t nulls;    // NULL strings among them
+    uint64_t distinct; // non-NULL values, estimated unless every row was sampled
+    uint64_t sampled;  // non-NULL rows the values below were taken from
+
+    // the most common values, most common first, with their occurrences in the sample
+    IndexKey mcv[STATS_MCV_MAX];
+    uint64_t mcv_counts[STATS_MCV_MAX];
+    size_t mcv_count;
+    uint64_t mcv_rows; // sum of [mcv_counts]
+
+    // equi-depth histogram of the other sampled values: each bucket, between two
+    // consecutive bounds (inclusive), holds about the same number of them
+    IndexKey bounds[STATS_BUCKETS + 1];
+    size_t bound_count; // 0 if fewer than two values are left for it
+
+    Arena *strings; // of [mcv] and [bounds]
+} ColumnStats;
+
+/// Build the statistics of a column of [type] from [sample], [count] non-NULL keys
+/// picked evenly among its [rows] live rows (sorted in place). [nulls] of the rows
+/// are NULL and the column holds about [distinct] values, unless [complete] is set:
+/// then the sample is every non-NULL row and they are counted exactly. Strings
+/// are copied. NULL if out of memory.
+ColumnStats *istats_build(BaseType type, IndexKey *sample, size_t count, bool complete,
+                          uint64_t rows, uint64_t nulls, uint64_t distinct);
+
+void istats_free(ColumnStats *stats);
+
+/// Estimated share of the rows equal to [key]
+double istats_share_equal(const ColumnStats *stats, BaseType type, IndexKey key);
+
+/// Estimated share of the rows of an integer column between [lo] and [hi] (inclusive)
+double istats_share_int(const ColumnStats *stats, int64_t lo, int64_t hi);
+
+typedef bool (StatsMatchFn)(const void *arg, const char *str);
+
+/// Estimated share of the rows of a string column for which [match]([arg], value) holds
+double istats_share_str(const ColumnStats *stats, StatsMatchFn *match, const void *arg);
+
+#endif
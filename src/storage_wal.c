@@ -0,0 +1,647 @@
+#include "storage_wal.h"
+#include "storage_file.h"
+#include "util/hash.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <string.h>
+
+#define WAL_BUFFER_INITIAL_CAPACITY 4096
+#define WAL_STR_NULL UINT32_MAX
+
+/// The records of the statement a thread has in progress, written out on commit
+typedef struct WalBuffer {
+    byte *data;
+    size_t length;
+    size_t capacity;
+} WalBuffer;
+
+static struct WriteAheadLog {
+    bool open;          // only changed by iwal_open and iwal_close, with no other threads around
+    bool replaying;     // the changes made by the replay are not logged again
+    pthread_key_t buffer; // WalBuffer of the calling thread
+    uint64_t next_lsn;  // atomic, records get their LSN when they are made
+    uint64_t pending;   // atomic, threads with records not yet written out
+    WalSync sync;
+    uint64_t group_ns;
+    pthread_mutex_t lock; // the rest, and writing to the file
+    pthread_cond_t synced_cond; // signalled when an fsync completes
+    int fd;
+    char *path;
+    uint64_t written;   // size of the file
+    uint64_t synced;    // how much of it is known to be on disk
+    bool syncing;       // a thread is in fdatasync, with [lock] released
+    uint64_t synced_at; // when the last fsync completed (CLOCK_MONOTONIC, in ns)
+} WAL = { .fd = -1 };
+
+static uint64_t iwal_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static bool iwal_active(void)
+{
+    return WAL.open && !WAL.replaying;
+}
+
+static void iwal_buffer_free(void *buffer)
+{
+    free(((WalBuffer*)buffer)->data);
+    free(buffer);
+}
+
+static WalBuffer *iwal_buffer(void)
+{
+    WalBuffer *buffer = pthread_getspecific(WAL.buffer);
+    if (buffer)
+        return buffer;
+
+    if (!(buffer = calloc(1, sizeof(WalBuffer))) || pthread_setspecific(WAL.buffer, buffer) != 0)
+        FATAL("failed to allocate a write-ahead log buffer");
+
+    return buffer;
+}
+
+static uint64_t iwal_checksum(const WalRecordHeader *header, const byte *payload)
+{
+    return hash_u64(hash_bytes(payload, header->size) ^ header->lsn
+                    ^ ((uint64_t)header->type << 32 | header->size));
+}
+
+static void iwal_put(const void *data, size_t size)
+{
+    WalBuffer *buffer = iwal_buffer();
+
+    if (buffer->length + size > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : WAL_BUFFER_INITIAL_CAPACITY;
+        while (buffer->length + size > capacity)
+            capacity *= 2;
+
+        byte *grown = realloc(buffer->data, capacity);
+        if (!grown)
+            FATAL("failed to grow the write-ahead log buffer");
+
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+
+    memcpy(buffer->data + buffer->length, data, size);
+    buffer->length += size;
+}
+
+static void iwal_put_u8(uint8_t value)   { iwal_put(&value, sizeof(value)); }
+static void iwal_put_u32(uint32_t value) { iwal_put(&value, sizeof(value)); }
+static void iwal_put_u64(uint64_t value) { iwal_put(&value, sizeof(value)); }
+
+/// Strings are stored with their length and a NUL, so that the replay can use them in place
+static void iwal_put_str(const char *str)
+{
+    if (!str) {
+        iwal_put_u32(WAL_STR_NULL);
+        return;
+    }
+
+    uint32_t len = strlen(str);
+    iwal_put_u32(len);
+    iwal_put(str, len + 1);
+}
+
+/// Start a record of [type] about [table], returning its offset in the buffer
+static size_t iwal_begin(WalRecordType type, Table *table)
+{
+    size_t start = iwal_buffer()->length;
+    if (!start)
+        __atomic_fetch_add(&WAL.pending, 1, __ATOMIC_RELAXED);
+
+    WalRecordHeader header = { .type = type };
+    iwal_put(&header, sizeof(header));
+
+    if (table)
+        iwal_put_str(table->meta.name);
+
+    return start;
+}
+
+/// Finish the record started at [start], giving it the next LSN
+static void iwal_end(size_t start)
+{
+    WalBuffer *buffer = iwal_buffer();
+
+    WalRecordHeader header;
+    memcpy(&header, buffer->data + start, sizeof(header));
+
+    header.lsn = __atomic_fetch_add(&WAL.next_lsn, 1, __ATOMIC_RELAXED);
+    header.size = buffer->length - start - sizeof(header);
+    header.checksum = iwal_checksum(&header, buffer->data + start + sizeof(header));
+
+    memcpy(buffer->data + start, &header, sizeof(header));
+}
+
+static void iwal_write(int fd, const void *data, size_t size)
+{
+    const byte *bytes = data;
+
+    while (size) {
+        ssize_t written = write(fd, bytes, size);
+        if (written < 0)
+            FATAL("failed to write to the write-ahead log: %m");
+
+        bytes += written;
+        size -= written;
+    }
+}
+
+/// Wait until the log is on disk up to [end], with WAL.lock held. One thread at a
+/// time calls fdatasync, without the lock so that others keep appending meanwhile;
+/// whoever finds their records still not covered afterwards syncs for all of them.
+static void iwal_sync(uint64_t end)
+{
+    while (WAL.synced < end) {
+        if (WAL.syncing) {
+            pthread_cond_wait(&WAL.synced_cond, &WAL.lock);
+            continue;
+        }
+
+        uint64_t target = WAL.written;
+        WAL.syncing = true;
+        pthread_mutex_unlock(&WAL.lock);
+
+        int err = fdatasync(WAL.fd);
+
+        pthread_mutex_lock(&WAL.lock);
+        if (err != 0)
+            FATAL("failed to sync the write-ahead log: %m");
+
+        WAL.synced = target;
+        WAL.syncing = false;
+        WAL.synced_at = iwal_now();
+        pthread_cond_broadcast(&WAL.synced_cond);
+    }
+}
+
+/// Wait until the log is on disk up to [end] under the GROUP policy, with WAL.lock held.
+/// While other statements are in progress, committers wait for them until [group_ns]
+/// has passed since the last fsync, then the first of them to wake (or the last of
+/// the statements to commit) syncs for all of them. A lone committer syncs at once.
+static void iwal_sync_group(uint64_t end)
+{
+    while (WAL.synced < end) {
+        uint64_t deadline = WAL.synced_at + WAL.group_ns;
+        if (WAL.syncing || !__atomic_load_n(&WAL.pending, __ATOMIC_RELAXED) || iwal_now() >= deadline) {
+            iwal_sync(end);
+            return;
+        }
+
+        struct timespec ts = { .tv_sec = deadline / 1000000000ULL, .tv_nsec = deadline % 1000000000ULL };
+        pthread_cond_timedwait(&WAL.synced_cond, &WAL.lock, &ts);
+    }
+}
+
+void iwal_commit(void)
+{
+    WalBuffer *buffer = iwal_active() ? pthread_getspecific(WAL.buffer) : NULL;
+    if (!buffer || !buffer->length)
+        return;
+
+    iwal_end(iwal_begin(WAL_COMMIT, NULL));
+
+    pthread_mutex_lock(&WAL.lock);
+
+    iwal_write(WAL.fd, buffer->data, buffer->length);
+    WAL.written += buffer->length;
+    buffer->length = 0;
+    __atomic_fetch_sub(&WAL.pending, 1, __ATOMIC_RELAXED);
+
+    // group commit: ALWAYS shares each fsync between the statements committed while the
+    // previous one ran, GROUP also waits up to a window for the statements in progress
+    if (WAL.sync == WAL_SYNC_ALWAYS)
+        iwal_sync(WAL.written);
+    else if (WAL.sync == WAL_SYNC_GROUP)
+        iwal_sync_group(WAL.written);
+
+    pthread_mutex_unlock(&WAL.lock);
+}
+
+void iwal_create_table(Table *table)
+{
+    if (iwal_active())
+        iwal_end(iwal_begin(WAL_CREATE_TABLE, table));
+}
+
+void iwal_create_column(Table *table, Column *column)
+{
+    if (!iwal_active())
+        return;
+
+    size_t start = iwal_begin(WAL_CREATE_COLUMN, table);
+    iwal_put_u32(column->meta.type);
+    iwal_put_str(column->meta.name);
+    iwal_end(start);
+}
+
+void iwal_row_add(Table *table)
+{
+    if (iwal_active())
+        iwal_end(iwal_begin(WAL_ROW_ADD, table));
+}
+
+void iwal_row_set(Table *table, Column *column, uint64_t row, const void *value)
+{
+    if (!iwal_active())
+        return;
+
+    size_t start = iwal_begin(WAL_ROW_SET, table);
+    iwal_put_u32(column->meta.id);
+    iwal_put_u64(row);
+
+    switch (column->meta.type) {
+        case BTYPE_INT32:
+            iwal_put_u32(*(const uint32_t*)value);
+            break;
+        case BTYPE_INT64:
+            iwal_put_u64(*(const uint64_t*)value);
+            break;
+        case BTYPE_STRING:
+            iwal_put_str(*(char *const*)value);
+            break;
+        case BTYPE_INVALID:
+            break;
+    }
+
+    iwal_end(start);
+}
+
+void iwal_row_delete(Table *table, uint64_t row)
+{
+    if (!iwal_active())
+        return;
+
+    size_t start = iwal_begin(WAL_ROW_DELETE, table);
+    iwal_put_u64(row);
+    iwal_end(start);
+}
+
+void iwal_compact(Table *table, bool force)
+{
+    if (!iwal_active())
+        return;
+
+    size_t start = iwal_begin(WAL_COMPACT, table);
+    iwal_put_u8(force);
+    iwal_end(start);
+}
+
+void iwal_dict_encode(Table *table, Column *column)
+{
+    if (!iwal_active())
+        return;
+
+    size_t start = iwal_begin(WAL_DICT_ENCODE, table);
+    iwal_put_u32(column->meta.id);
+    iwal_end(start);
+}
+
+void iwal_create_index(Table *table, Column *column, const char *name, IndexKind kind)
+{
+    if (!iwal_active())
+        return;
+
+    size_t start = iwal_begin(WAL_CREATE_INDEX, table);
+    iwal_put_u32(column->meta.id);
+    iwal_put_str(name);
+    iwal_put_u8(kind);
+    iwal_end(start);
+}
+
+uint64_t iwal_next_lsn(void)
+{
+    return __atomic_load_n(&WAL.next_lsn, __ATOMIC_RELAXED);
+}
+
+/// The payload of a record being replayed
+typedef struct WalReader {
+    const byte *data;
+    size_t size;
+    size_t pos;
+    bool failed; // read past the end of the payload
+} WalReader;
+
+static void iwal_read(WalReader *reader, void *out, size_t size)
+{
+    if (reader->size - reader->pos < size) {
+        reader->failed = true;
+        memset(out, 0, size);
+        return;
+    }
+
+    memcpy(out, reader->data + reader->pos, size);
+    reader->pos += size;
+}
+
+static uint8_t iwal_read_u8(WalReader *reader)   { uint8_t v;  iwal_read(reader, &v, sizeof(v)); return v; }
+static uint32_t iwal_read_u32(WalReader *reader) { uint32_t v; iwal_read(reader, &v, sizeof(v)); return v; }
+static uint64_t iwal_read_u64(WalReader *reader) { uint64_t v; iwal_read(reader, &v, sizeof(v)); return v; }
+
+/// Read a string in place. NULL is either a NULL string or a failed read.
+static const char *iwal_read_str(WalReader *reader)
+{
+    uint32_t len = iwal_read_u32(reader);
+    if (reader->failed || len == WAL_STR_NULL)
+        return NULL;
+
+    if (reader->size - reader->pos <= len || reader->data[reader->pos + len] != '\0') {
+        reader->failed = true;
+        return NULL;
+    }
+
+    const char *str = (const char*)reader->data + reader->pos;
+    reader->pos += len + 1;
+
+    return str;
+}
+
+static BazaResult iwal_apply_row_set(Table *table, WalReader *reader)
+{
+    Column *column = itable_column_byid(table, iwal_read_u32(reader));
+    uint64_t row = iwal_read_u64(reader);
+    if (!column)
+        return RESULT_INVALID_WAL;
+
+    switch (column->meta.type) {
+        case BTYPE_INT32: {
+            uint32_t value = iwal_read_u32(reader);
+            return reader->failed ? RESULT_INVALID_WAL : itable_row_set(table, column, row, &value);
+        }
+        case BTYPE_INT64: {
+            uint64_t value = iwal_read_u64(reader);
+            return reader->failed ? RESULT_INVALID_WAL : itable_row_set(table, column, row, &value);
+        }
+        case BTYPE_STRING: {
+            const char *value = iwal_read_str(reader);
+            return reader->failed ? RESULT_INVALID_WAL : itable_row_set(table, column, row, &value);
+        }
+        case BTYPE_INVALID:
+            break;
+    }
+
+    return RESULT_INVALID_WAL;
+}
+
+/// Redo the change described by a record
+static BazaResult iwal_apply(const WalRecordHeader *header, WalReader *reader)
+{
+    if (header->type == WAL_COMMIT)
+        return RESULT_OK;
+
+    const char *name = iwal_read_str(reader);
+    if (!name)
+        return RESULT_INVALID_WAL;
+
+    Table *table = idb_table_get(name);
+
+    // changes from before a table was saved are already in its file
+    if (table && header->lsn < table->wal_lsn)
+        return RESULT_OK;
+
+    if (header->type == WAL_CREATE_TABLE)
+        return table ? RESULT_INVALID_WAL : idb_table_new(name).result;
+
+    if (!table)
+        return RESULT_INVALID_WAL;
+
+    switch ((WalRecordType)header->type) {
+        case WAL_CREATE_COLUMN: {
+            BaseType type = iwal_read_u32(reader);
+            const char *column = iwal_read_str(reader);
+            return column ? itable_column_new(table, type, column) : RESULT_INVALID_WAL;
+        }
+        case WAL_ROW_ADD:
+            return itable_row_add(table);
+        case WAL_ROW_SET:
+            return iwal_apply_row_set(table, reader);
+        case WAL_ROW_DELETE: {
+            uint64_t row = iwal_read_u64(reader);
+            return reader->failed ? RESULT_INVALID_WAL : itable_row_delete(table, row);
+        }
+        case WAL_COMPACT: {
+            bool force = iwal_read_u8(reader);
+            return reader->failed ? RESULT_INVALID_WAL : itable_compact(table, force);
+        }
+        case WAL_DICT_ENCODE: {
+            // the column was encoded when it was logged, whatever its number of values
+            Column *column = itable_column_byid(table, iwal_read_u32(reader));
+            return column ? itable_column_dict_encode(table, column, UINT64_MAX) : RESULT_INVALID_WAL;
+        }
+        case WAL_CREATE_INDEX: {
+            Column *column = itable_column_byid(table, iwal_read_u32(reader));
+            const char *index = iwal_read_str(reader);
+            IndexKind kind = iwal_read_u8(reader);
+            if (!column || !index || reader->failed)
+                return RESULT_INVALID_WAL;
+            return itable_index_new(table, column, index, kind);
+        }
+        case WAL_CREATE_TABLE:
+        case WAL_COMMIT:
+            break;
+    }
+
+    return RESULT_INVALID_WAL;
+}
+
+/// Replay the committed records of the log mapped at [data], returning the size of
+/// the log up to the end of the last committed statement (anything after it was torn
+/// by a crash, or never committed)
+static size_t iwal_replay(const byte *data, size_t size)
+{
+    WalFileHeader file_header;
+    if (size < sizeof(file_header))
+        FATAL("invalid write-ahead log %s: missing header", WAL.path);
+
+    memcpy(&file_header, data, sizeof(file_header));
+    if (memcmp(file_header.magic, WAL_FILE_MAGIC, sizeof(file_header.magic))
+        || file_header.version != WAL_FILE_VERSION)
+        FATAL("invalid write-ahead log %s: bad header", WAL.path);
+
+    // find the end of the last statement whose records are all intact
+    size_t pos = sizeof(file_header), committed = pos;
+    while (size - pos >= sizeof(WalRecordHeader)) {
+        WalRecordHeader header;
+        memcpy(&header, data + pos, sizeof(header));
+
+        const byte *payload = data + pos + sizeof(header);
+        if (header.size > size - pos - sizeof(header) || header.checksum != iwal_checksum(&header, payload))
+            break;
+
+        pos += sizeof(header) + header.size;
+        if (header.type == WAL_COMMIT)
+            committed = pos;
+    }
+
+    WAL.replaying = true;
+
+    for (pos = sizeof(file_header); pos < committed; ) {
+        WalRecordHeader header;
+        memcpy(&header, data + pos, sizeof(header));
+
+        WalReader reader = { .data = data + pos + sizeof(header), .size = header.size };
+        BazaResult res = iwal_apply(&header, &reader);
+        if (res != RESULT_OK)
+            FATAL("failed to replay the write-ahead log at LSN %lu: %s", header.lsn, result_str(res));
+
+        if (header.lsn >= WAL.next_lsn)
+            WAL.next_lsn = header.lsn + 1;
+
+        pos += sizeof(header) + header.size;
+    }
+
+    WAL.replaying = false;
+
+    return committed;
+}
+
+/// Create an empty log at [path], replacing whatever is there
+static void iwal_create(const char *path)
+{
+    size_t len = strlen(path) + sizeof(".tmp");
+    char *tmp_path = malloc(len);
+    if (!tmp_path)
+        FATAL("failed to allocate the path of the write-ahead log");
+    snprintf(tmp_path, len, "%s.tmp", path);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        FATAL("failed to create the write-ahead log %s: %m", tmp_path);
+
+    WalFileHeader header = { .version = WAL_FILE_VERSION };
+    memcpy(header.magic, WAL_FILE_MAGIC, sizeof(header.magic));
+    iwal_write(fd, &header, sizeof(header));
+
+    if (fsync(fd) != 0 || close(fd) != 0 || rename(tmp_path, path) != 0)
+        FATAL("failed to create the write-ahead log %s: %m", path);
+
+    ifile_sync_dir(path);
+    free(tmp_path);
+}
+
+static WalSync iwal_sync_from_env(void)
+{
+    const char *sync = getenv("BAZA_WAL_SYNC");
+
+    if (!sync || !strcmp(sync, "group"))
+        return WAL_SYNC_GROUP;
+    if (!strcmp(sync, "always"))
+        return WAL_SYNC_ALWAYS;
+    if (!strcmp(sync, "off"))
+        return WAL_SYNC_OFF;
+
+    FATAL("BAZA_WAL_SYNC must be one of \"off\", \"group\" or \"always\", not \"%s\"", sync);
+}
+
+void iwal_open(const char *path, uint64_t next_lsn)
+{
+    const char *group_ms = getenv("BAZA_WAL_GROUP_MS");
+
+    WAL.sync = iwal_sync_from_env();
+    WAL.group_ns = (group_ms ? strtoull(group_ms, NULL, 10) : WAL_DEFAULT_GROUP_MS) * 1000000ULL;
+    WAL.next_lsn = next_lsn;
+    WAL.path = strdup(path);
+    if (!WAL.path)
+        FATAL("failed to allocate the path of the write-ahead log");
+
+    if (access(path, F_OK) != 0)
+        iwal_create(path);
+
+    int fd = open(path, O_RDWR | O_APPEND);
+    struct stat statbuf;
+    if (fd < 0 || fstat(fd, &statbuf) != 0)
+        FATAL("failed to open the write-ahead log %s: %m", path);
+
+    size_t size = statbuf.st_size;
+    const byte *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        FATAL("failed to map the write-ahead log %s: %m", path);
+
+    size_t committed = iwal_replay(data, size);
+    munmap((void*)data, size);
+
+    // new records go right after the last committed statement
+    if (committed < size && ftruncate(fd, committed) != 0)
+        FATAL("failed to truncate the write-ahead log %s: %m", path);
+
+    // the group commit deadlines are CLOCK_MONOTONIC, like iwal_now
+    pthread_condattr_t cond_attr;
+    if (pthread_key_create(&WAL.buffer, iwal_buffer_free) != 0
+        || pthread_mutex_init(&WAL.lock, NULL) != 0
+        || pthread_condattr_init(&cond_attr) != 0
+        || pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC) != 0
+        || pthread_cond_init(&WAL.synced_cond, &cond_attr) != 0)
+        FATAL("failed to initialize the write-ahead log");
+    pthread_condattr_destroy(&cond_attr);
+
+    WAL.fd = fd;
+    WAL.written = WAL.synced = committed;
+    WAL.synced_at = iwal_now();
+    WAL.open = true;
+}
+
+void iwal_reset(void)
+{
+    if (!WAL.open)
+        return;
+
+    // whatever is pending is part of the saved tables already
+    WalBuffer *buffer = pthread_getspecific(WAL.buffer);
+    if (buffer && buffer->length) {
+        buffer->length = 0;
+        __atomic_fetch_sub(&WAL.pending, 1, __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_lock(&WAL.lock);
+    while (WAL.syncing)
+        pthread_cond_wait(&WAL.synced_cond, &WAL.lock);
+
+    close(WAL.fd);
+    iwal_create(WAL.path);
+
+    WAL.fd = open(WAL.path, O_WRONLY | O_APPEND);
+    if (WAL.fd < 0)
+        FATAL("failed to open the write-ahead log %s: %m", WAL.path);
+
+    WAL.written = WAL.synced = sizeof(WalFileHeader);
+    WAL.synced_at = iwal_now();
+
+    pthread_mutex_unlock(&WAL.lock);
+}
+
+void iwal_close(void)
+{
+    if (!WAL.open)
+        return;
+
+    iwal_commit();
+
+    pthread_mutex_lock(&WAL.lock);
+    iwal_sync(WAL.written);
+    pthread_mutex_unlock(&WAL.lock);
+
+    close(WAL.fd);
+
+    // the buffers of other threads are freed as they exit
+    WalBuffer *buffer = pthread_getspecific(WAL.buffer);
+    if (buffer)
+        iwal_buffer_free(buffer);
+
+    pthread_key_delete(WAL.buffer);
+    pthread_mutex_destroy(&WAL.lock);
+    pthread_cond_destroy(&WAL.synced_cond);
+    free(WAL.path);
+
+    WAL = (struct WriteAheadLog) { .fd = -1 };
+}
@@ -0,0 +1,85 @@
+/// The write-ahead log. Every change to the tables is appended to it as it is made
+/// and the log is written out (and fsync'ed, as the sync policy dictates) at the end
+/// of each statement, with db_commit. On startup the committed statements are
+/// replayed on top of the table files. Owned by storage_internal, nothing outside
+/// of the storage backend should touch it.
+#ifndef _STORAGE_WAL_H
+#define _STORAGE_WAL_H
+
+#include "storage_internal.h"
+
+/// Layout of the log: a WalFileHeader followed by records, each a WalRecordHeader
+/// and [size] bytes of payload. Records carry a log sequence number (LSN), which
+/// keeps growing across checkpoints: a table file saved at LSN n already contains
+/// the changes of all the records before n.
+#define WAL_FILE_MAGIC "BAZAWAL"
+#define WAL_FILE_VERSION 1
+#define WAL_FILE_NAME "baza.wal"
+
+typedef struct WalFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+} WalFileHeader;
+
+typedef enum WalRecordType {
+    WAL_CREATE_TABLE = 1, // name
+    WAL_CREATE_COLUMN,    // table, type, name
+    WAL_ROW_ADD,          // table
+    WAL_ROW_SET,          // table, column, row, value
+    WAL_ROW_DELETE,       // table, row
+    WAL_COMPACT,          // table, force
+    WAL_DICT_ENCODE,      // table, column
+    WAL_CREATE_INDEX,     // table, column, name, kind
+    WAL_COMMIT,           // end of a statement, only committed records are replayed
+} WalRecordType;
+
+typedef struct WalRecordHeader {
+    uint64_t lsn;
+    uint64_t checksum; // of the rest of the header and the payload, catches torn writes
+    uint32_t size;     // of the payload
+    uint32_t type;     // WalRecordType
+} WalRecordHeader;
+
+/// How often the log is fsync'ed, set with the BAZA_WAL_SYNC environment variable
+typedef enum WalSync {
+    WAL_SYNC_OFF,    // "off": never, the OS writes the log back whenever it wants
+    WAL_SYNC_GROUP,  // "group" (default): like "always", but while other statements are
+                     // in progress a commit waits for them, up to BAZA_WAL_GROUP_MS
+                     // after the previous fsync, so that one fsync covers them all
+    WAL_SYNC_ALWAYS, // "always": once per statement
+} WalSync;
+
+#define WAL_DEFAULT_GROUP_MS 10
+
+/// Open (or create) the log at [path], replaying its committed records on top of
+/// the tables already loaded from their files. [next_lsn] is the first LSN after
+/// all of those files, new records get at least it.
+void iwal_open(const char *path, uint64_t next_lsn);
+
+/// Write out and fsync everything committed, then close the log
+void iwal_close(void);
+
+/// The LSN the next record will get. A table file saved now contains everything before it.
+uint64_t iwal_next_lsn(void);
+
+/// Replace the log with an empty one, once every table has been saved at iwal_next_lsn
+void iwal_reset(void);
+
+/// End the calling thread's current statement: write its records out, and fsync them
+/// as the policy says. Records are buffered per thread until then, so a thread must
+/// hold the locks of the tables it changed until it commits, for the log to keep
+/// the order in which the changes were made.
+void iwal_commit(void);
+
+void iwal_create_table(Table *table);
+void iwal_create_column(Table *table, Column *column);
+void iwal_row_add(Table *table);
+/// [value] as passed to itable_row_set (i.e. char** for strings)
+void iwal_row_set(Table *table, Column *column, uint64_t row, const void *value);
+void iwal_row_delete(Table *table, uint64_t row);
+void iwal_compact(Table *table, bool force);
+void iwal_dict_encode(Table *table, Column *column);
+void iwal_create_index(Table *table, Column *column, const char *name, IndexKind kind);
+
+#endif
@@ -0,0 +1,150 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN 8
+
+static ArenaBlock *arena_block_new(size_t size)
+{
+    ArenaBlock *block = malloc(sizeof(ArenaBlock) + size);
+    if (!block)
+        return NULL;
+
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+
+    return block;
+}
+
+Arena *arena_new(size_t block_size)
+{
+    Arena *arena = malloc(sizeof(Arena));
+    if (!arena)
+        return NULL;
+
+    *arena = (Arena) {
+        .blocks = NULL,
+        .block_size = block_size,
+        .used = 0,
+    };
+
+    return arena;
+}
+
+void arena_free(Arena *arena)
+{
+    if (!arena)
+        return;
+
+    ArenaBlock *cur = arena->blocks, *nxt;
+    while (cur) {
+        nxt = cur->next;
+        free(cur);
+        cur = nxt;
+    }
+    free(arena);
+}
+
+static void *arena_bump(Arena *arena, size_t size, size_t align)
+{
+    ArenaBlock *head = arena->blocks;
+
+    if (head) {
+        size_t offset = (head->used + align - 1) & ~(align - 1);
+        if (offset + size <= head->size) {
+            head->used = offset + size;
+            arena->used += size;
+            return head->data + offset;
+        }
+    }
+
+    if (size > arena->block_size) {
+        // oversized allocation: give it a dedicated block, placed behind the
+        // head so that the remaining space in the head can still be used
+        ArenaBlock *block = arena_block_new(size);
+        if (!block)
+            return NULL;
+
+        block->used = size;
+        if (head) {
+            block->next = head->next;
+            head->next = block;
+        } else {
+            arena->blocks = block;
+        }
+
+        arena->used += size;
+        return block->data;
+    }
+
+    ArenaBlock *block = arena_block_new(arena->block_size);
+    if (!block)
+        return NULL;
+
+    block->next = head;
+    block->used = size;
+    arena->blocks = block;
+    arena->used += size;
+
+    return block->data;
+}
+
+void *arena_alloc(Arena *arena, size_t size)
+{
+    return arena_bump(arena, size, ARENA_ALIGN);
+}
+
+void *arena_alloc_unaligned(Arena *arena, size_t size)
+{
+    return arena_bump(arena, size, 1);
+}
+
+char *arena_strdup(Arena *arena, const char *str)
+{
+    size_t len = strlen(str) + 1;
+    char *copy = arena_alloc_unaligned(arena, len);
+    if (!copy)
+        return NULL;
+
+    memcpy(copy, str, len);
+    return copy;
+}
+
+char *arena_strndup(Arena *arena, const char *str, size_t length)
+{
+    char *copy = arena_alloc_unaligned(arena, length + 1);
+    if (!copy)
+        return NULL;
+
+    memcpy(copy, str, length);
+    copy[length] = 0;
+    return copy;
+}
+
+void arena_reset(Arena *arena)
+{
+    ArenaBlock *cur = arena->blocks;
+    if (!cur)
+        return;
+
+    // keep the last block in the list (the oldest one), which is a regular sized
+    // block unless the very first allocation was an oversized one
+    ArenaBlock *nxt;
+    while (cur->next) {
+        nxt = cur->next;
+        free(cur);
+        cur = nxt;
+    }
+
+    if (cur->size != arena->block_size) {
+        free(cur);
+        arena->blocks = NULL;
+    } else {
+        cur->used = 0;
+        arena->blocks = cur;
+    }
+
+    arena->used = 0;
+}
@@ -0,0 +1,41 @@
+// append-only region allocator: many small allocations, freed all at once
+#ifndef _UTIL_ARENA_H
+#define _UTIL_ARENA_H
+
+#include "includes.h"
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;  // usable bytes in [data]
+    size_t used;
+    _Alignas(8) unsigned char data[];
+} ArenaBlock;
+
+/// Memory handed out by an arena never moves and stays valid until the arena
+/// is reset or freed. Allocations larger than [block_size] get a block of their own.
+typedef struct Arena {
+    ArenaBlock *blocks; // the block currently being filled comes first
+    size_t block_size;
+    size_t used;        // total bytes handed out
+} Arena;
+
+Arena *arena_new(size_t block_size);
+
+void arena_free(Arena *arena);
+
+/// Allocate [size] bytes aligned to 8 bytes. Returns NULL on allocation failure.
+void *arena_alloc(Arena *arena, size_t size);
+
+/// Allocate [size] bytes without any alignment padding (e.g. for string data)
+void *arena_alloc_unaligned(Arena *arena, size_t size);
+
+/// Copy a NUL terminated string into [arena]
+char *arena_strdup(Arena *arena, const char *str);
+
+/// Copy the [length] bytes at [str] into [arena], adding a NUL terminator
+char *arena_strndup(Arena *arena, const char *str, size_t length);
+
+/// Drop all allocations, keeping the first block around for reuse
+void arena_reset(Arena *arena);
+
+#endif /* _UTIL_ARENA_H */
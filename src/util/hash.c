@@ -0,0 +1,40 @@
+#include "hash.h"
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+uint64_t hash_u64(uint64_t value)
+{
+    value ^= value >> 30;
+    value *= 0xbf58476d1ce4e5b9ULL;
+    value ^= value >> 27;
+    value *= 0x94d049bb133111ebULL;
+    value ^= value >> 31;
+    return value;
+}
+
+uint64_t hash_str(const char *str)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+    const unsigned char *s = (const unsigned char *)str;
+
+    while (*s) {
+        hash ^= *s++;
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+uint64_t hash_bytes(const void *data, size_t len)
+{
+    uint64_t hash = FNV_OFFSET_BASIS;
+    const unsigned char *s = data;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= s[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
@@ -0,0 +1,16 @@
+// general purpose (non-cryptographic) hash functions
+#ifndef _UTIL_HASH_H
+#define _UTIL_HASH_H
+
+#include "includes.h"
+
+/// Mix the bits of a 64 bit integer (splitmix64 finalizer)
+uint64_t hash_u64(uint64_t value);
+
+/// Hash a NUL terminated string (FNV-1a)
+uint64_t hash_str(const char *str);
+
+/// Hash [len] bytes starting at [data] (FNV-1a)
+uint64_t hash_bytes(const void *data, size_t len);
+
+#endif /* _UTIL_HASH_H */
@@ -91,46 +91,3 @@ bool intlist_contains(IntList *list, int64_t value)
     }
     return false;
 }
-
-// yes, this is slooooow. We should be using a hashset or whatever for this kind of thing
-IntList *intlist_union(IntList *left, IntList *right)
-{
-    if (left == right)
-        return NULL;
-
-    IntList *new = intlist_empty();
-
-    // push all the elements from the first list first
-    while (left && left->value != INTLIST_NULL)  {
-        if (!intlist_contains(new, left->value)) // filter duplicates
-            intlist_push(new, left->value);
-        left = left->next;
-    }
-
-    // ..and push all the elements of the second list, if they
-    // are not already present in the first one
-    while (right && right->value != INTLIST_NULL)  {
-        if (!intlist_contains(new, right->value))
-            intlist_push(new, right->value);
-        right = right->next;
-    }
-
-    return new;
-}
-
-IntList *intlist_intersection(IntList *left, IntList *right)
-{
-    if (left == right)
-        return NULL;
-
-    IntList *new = intlist_empty();
-
-    // push all the elements from the left that are also in the right + filter duplicates
-    while (left && left->value != INTLIST_NULL)  {
-        if (intlist_contains(right, left->value) && !intlist_contains(new, left->value)) 
-            intlist_push(new, left->value);
-        left = left->next;
-    }
-    
-    return new;
-}
@@ -21,10 +21,4 @@ void intlist_free(IntList *list);
 void intlist_print(IntList *list);
 bool intlist_contains(IntList *list, int64_t value);
 
-// intlist_{union,intersection} perform the respective set operation,
-// returning a new list (to be freed separately) containing the appropriate
-// elements.
-IntList *intlist_union(IntList *left, IntList *right);
-IntList *intlist_intersection(IntList *left, IntList *right);
-
 #endif  /* _UTIL_INTLIST_H */
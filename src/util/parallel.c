@@ -0,0 +1,353 @@
+#define _GNU_SOURCE // qsort_r
+#include "parallel.h"
+#include "defs.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PARALLEL_MAX_THREADS 256
+#define TASK_DEQUE_INITIAL 64
+
+typedef struct Task {
+    TaskFn *fn;
+    void *arg;
+    TaskGroup *group;
+} Task;
+
+/// A growable ring buffer of tasks. The owner works at the back, thieves at the front.
+typedef struct TaskDeque {
+    pthread_mutex_t lock;
+    Task *tasks;
+    size_t capacity; // always a power of two
+    size_t front;    // index of the oldest task, wrapping
+    size_t count;
+} TaskDeque;
+
+static struct {
+    pthread_once_t once;
+    size_t threads;
+    TaskDeque *deques; // one per worker, followed by the shared queue of the other threads
+    size_t deque_count;
+    size_t queued;     // tasks in all the deques (atomic)
+    pthread_mutex_t lock;
+    pthread_cond_t wake;  // tasks were queued, or a group finished
+    size_t sleepers;      // threads waiting on [wake] (atomic)
+} POOL = {
+    .once = PTHREAD_ONCE_INIT,
+    .threads = 1,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+};
+
+/// Index of the calling thread's deque, the shared queue for threads outside the pool
+static _Thread_local size_t WORKER = SIZE_MAX;
+
+static size_t task_deque_self(void)
+{
+    return WORKER != SIZE_MAX ? WORKER : POOL.deque_count - 1;
+}
+
+static bool task_deque_push(TaskDeque *deque, Task task)
+{
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->count == deque->capacity) {
+        size_t capacity = deque->capacity ? deque->capacity * 2 : TASK_DEQUE_INITIAL;
+        Task *tasks = malloc(capacity * sizeof(Task));
+        if (!tasks) {
+            pthread_mutex_unlock(&deque->lock);
+            return false;
+        }
+
+        // unwrap the old ring at the start of the new one
+        for (size_t i = 0; i < deque->count; i++)
+            tasks[i] = deque->tasks[(deque->front + i) & (deque->capacity - 1)];
+
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->capacity = capacity;
+        deque->front = 0;
+    }
+
+    deque->tasks[(deque->front + deque->count) & (deque->capacity - 1)] = task;
+    deque->count++;
+
+    pthread_mutex_unlock(&deque->lock);
+
+    return true;
+}
+
+/// Take the newest task of [deque] if [back], its oldest otherwise
+static bool task_deque_take(TaskDeque *deque, bool back, Task *task)
+{
+    pthread_mutex_lock(&deque->lock);
+
+    bool found = deque->count > 0;
+    if (found) {
+        if (back) {
+            *task = deque->tasks[(deque->front + deque->count - 1) & (deque->capacity - 1)];
+        } else {
+            *task = deque->tasks[deque->front];
+            deque->front = (deque->front + 1) & (deque->capacity - 1);
+        }
+        deque->count--;
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+
+    return found;
+}
+
+/// Find a task to run: the newest one of the calling thread's own deque, or else
+/// the oldest one of any other
+static bool task_find(Task *task)
+{
+    if (!__atomic_load_n(&POOL.queued, __ATOMIC_SEQ_CST))
+        return false;
+
+    size_t self = task_deque_self();
+    bool found = task_deque_take(&POOL.deques[self], WORKER != SIZE_MAX, task);
+
+    // start with the victim after ourselves, so that thieves spread out
+    for (size_t i = 1; !found && i < POOL.deque_count; i++)
+        found = task_deque_take(&POOL.deques[(self + i) % POOL.deque_count], false, task);
+
+    if (found)
+        __atomic_sub_fetch(&POOL.queued, 1, __ATOMIC_SEQ_CST);
+
+    return found;
+}
+
+static void task_wake_all(void)
+{
+    pthread_mutex_lock(&POOL.lock);
+    pthread_cond_broadcast(&POOL.wake);
+    pthread_mutex_unlock(&POOL.lock);
+}
+
+static void task_run(Task task)
+{
+    task.fn(task.arg);
+
+    // [group] may be gone as soon as its count drops to zero
+    if (__atomic_sub_fetch(&task.group->pending, 1, __ATOMIC_ACQ_REL) == 0)
+        task_wake_all();
+}
+
+/// Sleep until there is a task to run or, with a [group], until it is finished
+static void task_sleep(TaskGroup *group)
+{
+    pthread_mutex_lock(&POOL.lock);
+
+    // pairs with task_spawn: either it sees us sleeping or we see its task
+    __atomic_add_fetch(&POOL.sleepers, 1, __ATOMIC_SEQ_CST);
+    while (!__atomic_load_n(&POOL.queued, __ATOMIC_SEQ_CST)
+           && (!group || __atomic_load_n(&group->pending, __ATOMIC_ACQUIRE)))
+        pthread_cond_wait(&POOL.wake, &POOL.lock);
+    __atomic_sub_fetch(&POOL.sleepers, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_unlock(&POOL.lock);
+}
+
+static void *task_worker(void *arg)
+{
+    WORKER = (size_t)arg;
+
+    for (;;) {
+        Task task;
+        if (task_find(&task))
+            task_run(task);
+        else
+            task_sleep(NULL);
+    }
+
+    return NULL;
+}
+
+static void parallel_init(void)
+{
+    const char *env = getenv("BAZA_THREADS");
+    long threads = env ? atol(env) : sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (threads < 1)
+        threads = 1;
+    if (threads > PARALLEL_MAX_THREADS)
+        threads = PARALLEL_MAX_THREADS;
+    if (threads == 1)
+        return;
+
+    POOL.deques = calloc(threads, sizeof(TaskDeque));
+    if (!POOL.deques)
+        return;
+
+    // a deque per worker, the last one is the shared queue
+    POOL.deque_count = threads;
+    for (size_t i = 0; i < POOL.deque_count; i++)
+        pthread_mutex_init(&POOL.deques[i].lock, NULL);
+
+    // the pool runs until the process exits. Threads which fail to start leave
+    // their deque empty, the others steal anything pushed to it.
+    for (long i = 0; i < threads - 1; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, task_worker, (void*)i) != 0)
+            break;
+        pthread_detach(thread);
+        POOL.threads++;
+    }
+}
+
+size_t parallel_threads(void)
+{
+    pthread_once(&POOL.once, parallel_init);
+
+    return POOL.threads;
+}
+
+void task_spawn(TaskGroup *group, TaskFn *fn, void *arg)
+{
+    Task task = { .fn = fn, .arg = arg, .group = group };
+    __atomic_add_fetch(&group->pending, 1, __ATOMIC_RELAXED);
+
+    if (parallel_threads() < 2) {
+        task_run(task);
+        return;
+    }
+
+    // counted before it can be taken, so that [queued] never drops below zero
+    __atomic_add_fetch(&POOL.queued, 1, __ATOMIC_SEQ_CST);
+    if (!task_deque_push(&POOL.deques[task_deque_self()], task)) {
+        __atomic_sub_fetch(&POOL.queued, 1, __ATOMIC_SEQ_CST);
+        task_run(task);
+        return;
+    }
+
+    if (__atomic_load_n(&POOL.sleepers, __ATOMIC_SEQ_CST))
+        task_wake_all();
+}
+
+void task_group_wait(TaskGroup *group)
+{
+    while (__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE)) {
+        Task task;
+        if (task_find(&task))
+            task_run(task);
+        else
+            task_sleep(group);
+    }
+}
+
+typedef struct ParallelLoop {
+    ParallelFn *fn;
+    void *arg;
+    size_t count;
+    size_t next; // the next morsel to hand out (atomic), may overshoot [count]
+} ParallelLoop;
+
+static void parallel_loop_run(void *arg)
+{
+    ParallelLoop *loop = arg;
+    size_t morsel;
+
+    while ((morsel = __atomic_fetch_add(&loop->next, 1, __ATOMIC_RELAXED)) < loop->count)
+        loop->fn(loop->arg, morsel);
+}
+
+void parallel_for(size_t count, ParallelFn *fn, void *arg)
+{
+    size_t threads = parallel_threads();
+
+    if (count < 2 || threads < 2) {
+        for (size_t i = 0; i < count; i++)
+            fn(arg, i);
+        return;
+    }
+
+    ParallelLoop loop = { .fn = fn, .arg = arg, .count = count, .next = 0 };
+    TaskGroup group = TASK_GROUP_INIT;
+
+    // helpers arriving after the last morsel was handed out return right away
+    for (size_t i = 1; i < threads && i < count; i++)
+        task_spawn(&group, parallel_loop_run, &loop);
+
+    parallel_loop_run(&loop);
+    task_group_wait(&group);
+}
+
+/// Runs shorter than this are left to qsort_r
+#define PARALLEL_SORT_RUN 16384
+
+typedef struct SortJob {
+    byte *base;
+    byte *scratch; // as big as [base]
+    size_t count;
+    size_t size;
+    SortCmpFn *cmp;
+    void *ctx;
+} SortJob;
+
+static void parallel_sort_run(void *arg)
+{
+    SortJob *job = arg;
+
+    if (job->count <= PARALLEL_SORT_RUN) {
+        qsort_r(job->base, job->count, job->size, job->cmp, job->ctx);
+        return;
+    }
+
+    size_t half = job->count / 2;
+    SortJob left = *job, right = *job;
+    left.count = half;
+    right.base += half * job->size;
+    right.scratch += half * job->size;
+    right.count -= half;
+
+    // the left half may be stolen while this thread sorts the right one
+    TaskGroup group = TASK_GROUP_INIT;
+    task_spawn(&group, parallel_sort_run, &left);
+    parallel_sort_run(&right);
+    task_group_wait(&group);
+
+    // merge both halves into the scratch space, then move them back
+    byte *l = left.base, *l_end = right.base;
+    byte *r = right.base, *r_end = job->base + job->count * job->size;
+    byte *out = job->scratch;
+
+    while (l < l_end && r < r_end) {
+        byte **from = job->cmp(r, l, job->ctx) < 0 ? &r : &l;
+        memcpy(out, *from, job->size);
+        *from += job->size;
+        out += job->size;
+    }
+
+    memcpy(out, l, l_end - l);
+    out += l_end - l;
+    memcpy(out, r, r_end - r);
+
+    memcpy(job->base, job->scratch, job->count * job->size);
+}
+
+bool parallel_sort(void *base, size_t count, size_t size, SortCmpFn *cmp, void *ctx)
+{
+    if (count <= PARALLEL_SORT_RUN || parallel_threads() < 2) {
+        qsort_r(base, count, size, cmp, ctx);
+        return true;
+    }
+
+    SortJob job = {
+        .base = base,
+        .scratch = malloc(count * size),
+        .count = count,
+        .size = size,
+        .cmp = cmp,
+        .ctx = ctx,
+    };
+    if (!job.scratch)
+        return false;
+
+    parallel_sort_run(&job);
+    free(job.scratch);
+
+    return true;
+}
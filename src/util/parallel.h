@@ -0,0 +1,52 @@
+// the thread pool running every parallel piece of work: a work-stealing task
+// scheduler, with morsel-driven loops and a parallel sort built on top of it
+#ifndef _UTIL_PARALLEL_H
+#define _UTIL_PARALLEL_H
+
+#include "includes.h"
+
+/// Threads running tasks, the calling one included (it works on its own tasks while
+/// waiting for them). Set with the BAZA_THREADS environment variable, the number of
+/// online CPUs by default; 1 runs everything serially on the calling thread.
+size_t parallel_threads(void);
+
+typedef void (TaskFn)(void *arg);
+
+/// Tasks spawned together, to be waited for together (fork-join). Lives wherever
+/// the spawning code likes (usually its stack) until task_group_wait returns.
+typedef struct TaskGroup {
+    size_t pending; // spawned tasks not finished yet (atomic)
+} TaskGroup;
+
+#define TASK_GROUP_INIT ((TaskGroup) { .pending = 0 })
+
+/// Run [fn]([arg]) as part of [group] on whichever thread gets to it first. Every
+/// pool thread has a deque of its own: it pushes and pops its tasks at the back,
+/// running the newest (cache-warm) ones first, while idle threads steal the oldest
+/// (biggest, for divide-and-conquer work) from the front of the others. Tasks spawned
+/// by other threads go to a shared queue. If the task cannot be queued, it is run
+/// right away.
+void task_spawn(TaskGroup *group, TaskFn *fn, void *arg);
+
+/// Return once every task of [group] has finished, running queued tasks (of any
+/// group) in the meantime, so tasks can spawn and wait for tasks of their own
+void task_group_wait(TaskGroup *group);
+
+/// Called once per morsel (a slice of the work, e.g. a chunk of rows) with its index
+typedef void (ParallelFn)(void *arg, size_t morsel);
+
+/// Call [fn]([arg], i) for every i < [count], in no particular order and spread
+/// over the pool: a task per thread, each taking the next morsel not started yet
+/// until none are left. Returns once every call has returned. Fewer than two
+/// morsels run serially.
+void parallel_for(size_t count, ParallelFn *fn, void *arg);
+
+/// qsort_r compatible comparison
+typedef int (SortCmpFn)(const void *left, const void *right, void *ctx);
+
+/// Sort [count] elements of [size] bytes at [base], like qsort_r: a merge sort whose
+/// halves are sorted as separate tasks, down to runs small enough for qsort_r. Not
+/// stable. Returns false (leaving [base] unsorted) if out of memory.
+bool parallel_sort(void *base, size_t count, size_t size, SortCmpFn *cmp, void *ctx);
+
+#endif /* _UTIL_PARALLEL_H */
@@ -13,14 +13,21 @@ const char *result_str(BazaResult result)
         case RESULT_TABLE_NOT_EMPTY: return "table not empty";
         case RESULT_TABLE_NOT_FOUND: return "table not found";
         case RESULT_DUPLICATE_COLUMN_NAME: return "duplicate column name";
+        case RESULT_DUPLICATE_TABLE_NAME: return "duplicate table name";
         case RESULT_ERR_SQL_PARSE: return "SQL parse error";
         case RESULT_SERVER_ERROR: return "server error";
         case RESULT_FILE_NOT_FOUND: return "file not found";
         case RESULT_IO_ERROR: return "io error";
         case RESULT_INVALID_CSV: return "io error";
+        case RESULT_INVALID_TABLE_FILE: return "invalid table file";
+        case RESULT_INVALID_WAL: return "invalid write-ahead log";
         case RESULT_VALUE_TYPE: return "value type error";
         case RESULT_FILTER_VALUE_TYPE: return "filter value type error";
         case RESULT_INVALID_QUERY: return "invalid query";
+        case RESULT_INDEX_NOT_FOUND: return "index not found";
+        case RESULT_DUPLICATE_INDEX: return "duplicate index";
+        case RESULT_STATEMENT_NOT_FOUND: return "prepared statement not found";
+        case RESULT_DUPLICATE_STATEMENT: return "duplicate prepared statement name";
     }
     return NULL; 
 }
@@ -12,13 +12,20 @@ typedef enum {
     RESULT_TABLE_NOT_EMPTY,
     RESULT_TABLE_NOT_FOUND,
     RESULT_DUPLICATE_COLUMN_NAME,
+    RESULT_DUPLICATE_TABLE_NAME,
     RESULT_INVALID_QUERY,
     RESULT_FILE_NOT_FOUND,
     RESULT_IO_ERROR,
     RESULT_INVALID_CSV,
+    RESULT_INVALID_TABLE_FILE,
+    RESULT_INVALID_WAL,
     RESULT_VALUE_TYPE,
     RESULT_FILTER_VALUE_TYPE,
+    RESULT_INDEX_NOT_FOUND,
+    RESULT_DUPLICATE_INDEX,
     RESULT_SERVER_ERROR,
+    RESULT_STATEMENT_NOT_FOUND,
+    RESULT_DUPLICATE_STATEMENT,
 } BazaResult;
 
 const char *result_str(BazaResult result);
@@ -0,0 +1,309 @@
+#include "selection.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SELECTION_INITIAL_CAPACITY 16
+
+Selection *selection_rows_new(uint64_t universe)
+{
+    Selection *sel = malloc(sizeof(Selection));
+    if (!sel)
+        return NULL;
+
+    *sel = (Selection) {
+        .kind = SELECTION_ROWS,
+        .universe = universe,
+        .rows = NULL,
+        .count = 0,
+        .capacity = 0,
+    };
+
+    return sel;
+}
+
+Selection *selection_bitmap_new(uint64_t universe)
+{
+    Selection *sel = malloc(sizeof(Selection));
+    if (!sel)
+        return NULL;
+
+    *sel = (Selection) {
+        .kind = SELECTION_BITMAP,
+        .universe = universe,
+        .words = calloc(SELECTION_WORD_COUNT(universe) + 1, sizeof(uint64_t)),
+    };
+
+    if (!sel->words) {
+        free(sel);
+        return NULL;
+    }
+
+    return sel;
+}
+
+Selection *selection_from_array(uint64_t universe, const uint64_t *rows, size_t count)
+{
+    Selection *sel = selection_rows_new(universe);
+    if (!sel || !count)
+        return sel;
+
+    sel->rows = malloc(count * sizeof(uint64_t));
+    if (!sel->rows) {
+        free(sel);
+        return NULL;
+    }
+
+    memcpy(sel->rows, rows, count * sizeof(uint64_t));
+    sel->count = count;
+    sel->capacity = count;
+
+    return sel;
+}
+
+void selection_free(Selection *sel)
+{
+    if (!sel)
+        return;
+
+    if (sel->kind == SELECTION_ROWS)
+        free(sel->rows);
+    else
+        free(sel->words);
+
+    free(sel);
+}
+
+BazaResult selection_push(Selection *sel, uint64_t row)
+{
+    if (sel->count == sel->capacity) {
+        size_t capacity = sel->capacity ? sel->capacity * 2 : SELECTION_INITIAL_CAPACITY;
+        uint64_t *rows = realloc(sel->rows, capacity * sizeof(uint64_t));
+        if (!rows)
+            return RESULT_ALLOC;
+        sel->rows = rows;
+        sel->capacity = capacity;
+    }
+
+    sel->rows[sel->count++] = row;
+    return RESULT_OK;
+}
+
+void selection_set(Selection *sel, uint64_t row)
+{
+    sel->words[row / SELECTION_WORD_BITS] |= 1ULL << (row % SELECTION_WORD_BITS);
+}
+
+bool selection_contains(const Selection *sel, uint64_t row)
+{
+    if (row >= sel->universe)
+        return false;
+
+    if (sel->kind == SELECTION_BITMAP)
+        return sel->words[row / SELECTION_WORD_BITS] >> (row % SELECTION_WORD_BITS) & 1;
+
+    size_t lo = 0, hi = sel->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (sel->rows[mid] < row)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo < sel->count && sel->rows[lo] == row;
+}
+
+size_t selection_count(const Selection *sel)
+{
+    if (sel->kind == SELECTION_ROWS)
+        return sel->count;
+
+    size_t count = 0;
+    for (size_t i = 0; i < SELECTION_WORD_COUNT(sel->universe); i++)
+        count += __builtin_popcountll(sel->words[i]);
+
+    return count;
+}
+
+static uint64_t selection_universe(const Selection *left, const Selection *right)
+{
+    return left->universe > right->universe ? left->universe : right->universe;
+}
+
+Selection *selection_and(const Selection *left, const Selection *right)
+{
+    uint64_t universe = selection_universe(left, right);
+
+    if (left->kind == SELECTION_BITMAP && right->kind == SELECTION_BITMAP) {
+        Selection *new = selection_bitmap_new(universe);
+        if (!new)
+            return NULL;
+
+        size_t words = SELECTION_WORD_COUNT(left->universe < right->universe 
+                                            ? left->universe : right->universe);
+        for (size_t i = 0; i < words; i++)
+            new->words[i] = left->words[i] & right->words[i];
+
+        return new;
+    }
+
+    // at least one side is an array, so the result can not be larger than it
+    if (left->kind == SELECTION_BITMAP) {
+        const Selection *tmp = left;
+        left = right;
+        right = tmp;
+    }
+
+    Selection *new = selection_rows_new(universe);
+    if (!new)
+        return NULL;
+
+    if (right->kind == SELECTION_BITMAP) {
+        for (size_t i = 0; i < left->count; i++) {
+            if (selection_contains(right, left->rows[i]) && selection_push(new, left->rows[i]) != RESULT_OK)
+                goto fail;
+        }
+        return new;
+    }
+
+    size_t l = 0, r = 0;
+    while (l < left->count && r < right->count) {
+        if (left->rows[l] < right->rows[r]) {
+            l++;
+        } else if (left->rows[l] > right->rows[r]) {
+            r++;
+        } else {
+            if (selection_push(new, left->rows[l]) != RESULT_OK)
+                goto fail;
+            l++;
+            r++;
+        }
+    }
+
+    return new;
+
+fail:
+    selection_free(new);
+    return NULL;
+}
+
+Selection *selection_or(const Selection *left, const Selection *right)
+{
+    uint64_t universe = selection_universe(left, right);
+
+    if (left->kind == SELECTION_BITMAP || right->kind == SELECTION_BITMAP) {
+        Selection *new = selection_bitmap_new(universe);
+        if (!new)
+            return NULL;
+
+        const Selection *sides[] = { left, right };
+        for (int s = 0; s < 2; s++) {
+            const Selection *side = sides[s];
+            if (side->kind == SELECTION_BITMAP) {
+                for (size_t i = 0; i < SELECTION_WORD_COUNT(side->universe); i++)
+                    new->words[i] |= side->words[i];
+            } else {
+                for (size_t i = 0; i < side->count; i++)
+                    selection_set(new, side->rows[i]);
+            }
+        }
+
+        return new;
+    }
+
+    Selection *new = selection_rows_new(universe);
+    if (!new)
+        return NULL;
+
+    size_t l = 0, r = 0;
+    while (l < left->count || r < right->count) {
+        uint64_t row;
+        if (r == right->count || (l < left->count && left->rows[l] < right->rows[r])) {
+            row = left->rows[l++];
+        } else if (l == left->count || right->rows[r] < left->rows[l]) {
+            row = right->rows[r++];
+        } else {
+            row = left->rows[l++];
+            r++;
+        }
+
+        if (selection_push(new, row) != RESULT_OK) {
+            selection_free(new);
+            return NULL;
+        }
+    }
+
+    return new;
+}
+
+Selection *selection_andnot(const Selection *left, const Selection *right)
+{
+    if (left->kind == SELECTION_BITMAP) {
+        Selection *new = selection_bitmap_new(left->universe);
+        if (!new)
+            return NULL;
+
+        size_t words = SELECTION_WORD_COUNT(left->universe);
+        memcpy(new->words, left->words, words * sizeof(uint64_t));
+
+        if (right->kind == SELECTION_BITMAP) {
+            size_t common = SELECTION_WORD_COUNT(right->universe) < words
+                ? SELECTION_WORD_COUNT(right->universe) : words;
+            for (size_t i = 0; i < common; i++)
+                new->words[i] &= ~right->words[i];
+        } else {
+            for (size_t i = 0; i < right->count && right->rows[i] < left->universe; i++)
+                new->words[right->rows[i] / SELECTION_WORD_BITS] &= ~(1ULL << (right->rows[i] % SELECTION_WORD_BITS));
+        }
+
+        return new;
+    }
+
+    Selection *new = selection_rows_new(left->universe);
+    if (!new)
+        return NULL;
+
+    for (size_t i = 0; i < left->count; i++) {
+        if (!selection_contains(right, left->rows[i]) && selection_push(new, left->rows[i]) != RESULT_OK) {
+            selection_free(new);
+            return NULL;
+        }
+    }
+
+    return new;
+}
+
+SelectionIter selection_iter(const Selection *sel)
+{
+    SelectionIter it = { .sel = sel, .pos = 0, .word = 0 };
+
+    if (sel->kind == SELECTION_BITMAP && sel->universe)
+        it.word = sel->words[0];
+
+    return it;
+}
+
+bool selection_next(SelectionIter *it, uint64_t *row)
+{
+    const Selection *sel = it->sel;
+
+    if (sel->kind == SELECTION_ROWS) {
+        if (it->pos >= sel->count)
+            return false;
+        *row = sel->rows[it->pos++];
+        return true;
+    }
+
+    size_t words = SELECTION_WORD_COUNT(sel->universe);
+    while (!it->word) {
+        if (++it->pos >= words)
+            return false;
+        it->word = sel->words[it->pos];
+    }
+
+    *row = it->pos * SELECTION_WORD_BITS + __builtin_ctzll(it->word);
+    it->word &= it->word - 1;  // clear the lowest set bit
+
+    return true;
+}
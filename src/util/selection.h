@@ -0,0 +1,73 @@
+// a set of row ids produced by filtering a table
+#ifndef _UTIL_SELECTION_H
+#define _UTIL_SELECTION_H
+
+#include "includes.h"
+#include "result.h"
+
+typedef enum SelectionKind {
+    SELECTION_ROWS,   // sorted array of row ids, for sparse results (e.g. index lookups)
+    SELECTION_BITMAP, // one bit per row of the table, for dense results (e.g. scans)
+} SelectionKind;
+
+/// A set of row ids in the range [0, universe). Both representations iterate
+/// in ascending row order and can be combined with each other in linear time.
+typedef struct Selection {
+    SelectionKind kind;
+    uint64_t universe;
+    union {
+        struct { // SELECTION_ROWS
+            uint64_t *rows;
+            size_t count;
+            size_t capacity;
+        };
+        struct { // SELECTION_BITMAP
+            uint64_t *words;
+        };
+    };
+} Selection;
+
+#define SELECTION_WORD_BITS 64
+#define SELECTION_WORD_COUNT(universe) (((universe) + SELECTION_WORD_BITS - 1) / SELECTION_WORD_BITS)
+
+/// An empty sorted-array selection
+Selection *selection_rows_new(uint64_t universe);
+
+/// An empty (all zero) bitmap selection
+Selection *selection_bitmap_new(uint64_t universe);
+
+/// A sorted-array selection holding a copy of [rows], which must be sorted
+Selection *selection_from_array(uint64_t universe, const uint64_t *rows, size_t count);
+
+void selection_free(Selection *sel);
+
+/// Append [row] to a SELECTION_ROWS selection. Rows must be pushed in ascending order.
+BazaResult selection_push(Selection *sel, uint64_t row);
+
+/// Add [row] to a SELECTION_BITMAP selection
+void selection_set(Selection *sel, uint64_t row);
+
+bool selection_contains(const Selection *sel, uint64_t row);
+size_t selection_count(const Selection *sel);
+
+/// selection_{and,or} perform the respective set operation, returning a new
+/// selection (to be freed separately). Two bitmaps are combined a word at a
+/// time, an array with a bitmap by probing the bitmap and two arrays by merging.
+Selection *selection_and(const Selection *left, const Selection *right);
+Selection *selection_or(const Selection *left, const Selection *right);
+
+/// The rows of [left] which are not in [right], as a new selection of the same kind as [left]
+Selection *selection_andnot(const Selection *left, const Selection *right);
+
+typedef struct SelectionIter {
+    const Selection *sel;
+    size_t pos;      // array index or bitmap word index
+    uint64_t word;   // remaining bits of the current bitmap word
+} SelectionIter;
+
+SelectionIter selection_iter(const Selection *sel);
+
+/// Store the next row in ascending order into [row]. Returns false once exhausted.
+bool selection_next(SelectionIter *it, uint64_t *row);
+
+#endif /* _UTIL_SELECTION_H */
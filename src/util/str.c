@@ -57,12 +57,13 @@ size_t str_count_utf8_glyphs(const char *str)
     return count;
 }
 
-IntConvResult str_to_int(const char *str)
+IntConvResult str_to_int(const char *str, int64_t min, int64_t max)
 {
+    char *end;
     errno = 0;
-    uint64_t conv = strtoll(str, NULL, 10);
-    if (errno == EINVAL)
-        return (IntConvResult) { .result = RESULT_ERR };
+    long long conv = strtoll(str, &end, 10);
+    if (end == str || *end || errno == ERANGE || conv < min || conv > max)
+        return (IntConvResult) { .result = RESULT_VALUE_TYPE };
 
     return (IntConvResult) { 
         .result = RESULT_OK,
@@ -80,6 +81,7 @@ StrList *strlist_empty()
     *empty = (StrList) {
         .str = NULL,
         .strlen = 0,
+        .placeholder = false,
         .next = NULL
     };
 
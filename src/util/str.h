@@ -18,13 +18,16 @@ typedef struct IntConvResult {
     uint64_t value;
 } IntConvResult;
 
-IntConvResult str_to_int(const char *str);
+/// Convert all of [str] to an integer in [min, max]. RESULT_VALUE_TYPE if it is
+/// not a number, has anything after it, or does not fit.
+IntConvResult str_to_int(const char *str, int64_t min, int64_t max);
 bool str_contains(const char *str, char c);
 size_t str_count_utf8_glyphs(const char *str);
 
 typedef struct StrList {
     char *str;
     size_t strlen;
+    bool placeholder; // [str] is an unquoted ?, a parameter of a prepared statement
     struct StrList *next;
 } StrList;
 
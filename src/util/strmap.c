@@ -0,0 +1,134 @@
+#include "strmap.h"
+#include "hash.h"
+#include "defs.h"
+
+#include <string.h>
+
+#define STRMAP_INITIAL_CAPACITY 16
+#define STRMAP_MAX_LOAD_PERCENT 70
+
+StrMap *strmap_new(void)
+{
+    StrMap *map = malloc(sizeof(StrMap));
+    if (!map)
+        return NULL;
+
+    *map = (StrMap) {
+        .slots = calloc(STRMAP_INITIAL_CAPACITY, sizeof(StrMapEntry)),
+        .capacity = STRMAP_INITIAL_CAPACITY,
+        .count = 0,
+    };
+
+    if (!map->slots) {
+        free(map);
+        return NULL;
+    }
+
+    return map;
+}
+
+void strmap_free(StrMap *map)
+{
+    if (!map)
+        return;
+
+    free(map->slots);
+    free(map);
+}
+
+/// Find the slot holding [key], or the empty slot where it should be inserted
+static StrMapEntry *strmap_probe(const StrMap *map, uint64_t hash, const char *key)
+{
+    size_t mask = map->capacity - 1;
+    size_t i = hash & mask;
+
+    for (;;) {
+        StrMapEntry *slot = &map->slots[i];
+        if (!slot->key)
+            return slot;
+        if (slot->hash == hash && !strcmp(slot->key, key))
+            return slot;
+        i = (i + 1) & mask;
+    }
+}
+
+static BazaResult strmap_grow(StrMap *map)
+{
+    size_t new_capacity = map->capacity * 2;
+    StrMapEntry *new_slots = calloc(new_capacity, sizeof(StrMapEntry));
+    if (!new_slots)
+        return RESULT_ALLOC;
+
+    // keys are unique, so we only need to find the first free slot
+    size_t mask = new_capacity - 1;
+    for (size_t i = 0; i < map->capacity; i++) {
+        StrMapEntry *slot = &map->slots[i];
+        if (!slot->key)
+            continue;
+
+        size_t j = slot->hash & mask;
+        while (new_slots[j].key)
+            j = (j + 1) & mask;
+        new_slots[j] = *slot;
+    }
+
+    free(map->slots);
+    map->slots = new_slots;
+    map->capacity = new_capacity;
+
+    return RESULT_OK;
+}
+
+BazaResult strmap_put(StrMap *map, const char *key, uint64_t value)
+{
+    if ((map->count + 1) * 100 > map->capacity * STRMAP_MAX_LOAD_PERCENT)
+        ENSURE(strmap_grow(map));
+
+    uint64_t hash = hash_str(key);
+    StrMapEntry *slot = strmap_probe(map, hash, key);
+
+    if (!slot->key) {
+        slot->hash = hash;
+        slot->key = key;
+        map->count++;
+    }
+    slot->value = value;
+
+    return RESULT_OK;
+}
+
+bool strmap_get(const StrMap *map, const char *key, uint64_t *value)
+{
+    StrMapEntry *slot = strmap_probe(map, hash_str(key), key);
+    if (!slot->key)
+        return false;
+
+    *value = slot->value;
+    return true;
+}
+
+bool strmap_remove(StrMap *map, const char *key)
+{
+    StrMapEntry *slot = strmap_probe(map, hash_str(key), key);
+    if (!slot->key)
+        return false;
+
+    // shift back the entries after the hole which could not be found across it anymore
+    size_t mask = map->capacity - 1;
+    size_t hole = slot - map->slots;
+
+    for (size_t i = (hole + 1) & mask; map->slots[i].key; i = (i + 1) & mask) {
+        size_t home = map->slots[i].hash & mask;
+
+        // the hole lies between the entry's home slot and where it is now
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            map->slots[hole] = map->slots[i];
+            hole = i;
+        }
+    }
+
+    map->slots[hole].key = NULL;
+    map->count--;
+
+    return true;
+}
@@ -0,0 +1,34 @@
+// hash map from strings to 64 bit values, used for name lookups
+#ifndef _UTIL_STRMAP_H
+#define _UTIL_STRMAP_H
+
+#include "includes.h"
+#include "result.h"
+
+typedef struct StrMapEntry {
+    uint64_t hash;
+    const char *key; // NULL marks an empty slot
+    uint64_t value;
+} StrMapEntry;
+
+/// Open-addressing (linear probing) map. Keys are borrowed, not copied: they
+/// have to stay alive and unchanged for as long as they are in the map.
+typedef struct StrMap {
+    StrMapEntry *slots;
+    size_t capacity; // always a power of two
+    size_t count;
+} StrMap;
+
+StrMap *strmap_new(void);
+void strmap_free(StrMap *map);
+
+/// Insert [key] or overwrite its value
+BazaResult strmap_put(StrMap *map, const char *key, uint64_t value);
+
+/// Look [key] up, storing its value in [value]. Returns false if it is not present.
+bool strmap_get(const StrMap *map, const char *key, uint64_t *value);
+
+/// Remove [key]. Returns false if it is not present.
+bool strmap_remove(StrMap *map, const char *key);
+
+#endif /* _UTIL_STRMAP_H */